@@ -34,3 +34,20 @@ function(add_unit_test TEST_NAME TEST_DIR EXTRA_INCLUDES IS_GTEST EXPAND_GTEST)
         add_test(${TEST_NAME} ${TEST_NAME})
     endif()
 endfunction()
+
+if(NOT TARGET benches)
+    add_custom_target(benches)
+endif(NOT TARGET benches)
+
+# Benchmarks are gtest executables which are built only by the `benches` target and are not run by `ctest`
+function(add_bench BENCH_NAME TEST_DIR EXTRA_INCLUDES)
+    add_executable(${BENCH_NAME} EXCLUDE_FROM_ALL ${TEST_DIR}/${BENCH_NAME}.cpp)
+    foreach(INC ${EXTRA_INCLUDES})
+        target_include_directories(${BENCH_NAME} PRIVATE ${INC})
+    endforeach()
+
+    add_dependencies(benches ${BENCH_NAME})
+
+    find_package(GTest REQUIRED)
+    target_link_libraries(${BENCH_NAME} PRIVATE gtest::gtest)
+endfunction()
@@ -14,6 +14,7 @@
 #include <event2/event.h>
 
 #include "common/defs.h"
+#include "vpn/timer_wheel.h"
 
 namespace ag {
 
@@ -37,6 +38,22 @@ struct VpnEventLoopTask {
     void (*finalize)(void *arg);
 };
 
+/**
+ * A timer run by an event loop.
+ * Unlike the scheduled tasks, timers are owned by the user and re-arming a timer allocates nothing,
+ * which makes them suitable for per-connection timeouts.
+ * Must be zero-initialized before the first use. Must be started and stopped on the event loop thread
+ * (or while the loop is not running).
+ */
+struct VpnEventLoopTimer {
+    /** The function to be executed on the event loop once the timer expires */
+    void (*callback)(void *arg);
+    /** User-provided argument which will be passed in the callback */
+    void *arg;
+    /** Internal state, must not be touched by the user */
+    TimerWheelEntry entry;
+};
+
 /**
  * Event loop settings struct.
  * For now only holds QoS class and relative priority for threads/queues on iOS.
@@ -104,6 +121,28 @@ TaskId vpn_event_loop_submit(VpnEventLoop *loop, VpnEventLoopTask task);
  */
 TaskId vpn_event_loop_schedule(VpnEventLoop *loop, VpnEventLoopTask task, Millis defer);
 
+/**
+ * Start a timer. If the timer is pending, it is re-armed with the new timeout.
+ * The expiry time is rounded up to the granularity of the timer wheel, so the longer the timeout
+ * the later the timer may fire (by at most ~1/8 of the timeout).
+ * @param loop the event loop
+ * @param timer the timer
+ * @param timeout the amount of time after which the timer's callback is called
+ */
+void vpn_event_loop_timer_start(VpnEventLoop *loop, VpnEventLoopTimer *timer, Millis timeout);
+
+/**
+ * Stop a timer. Does nothing if the timer is not pending.
+ * @param loop the event loop
+ * @param timer the timer
+ */
+void vpn_event_loop_timer_stop(VpnEventLoop *loop, VpnEventLoopTimer *timer);
+
+/**
+ * Check if a timer is started and has not expired yet
+ */
+bool vpn_event_loop_timer_is_pending(const VpnEventLoopTimer *timer);
+
 /**
  * Submit a task that runs `action` to the event loop and block until it is finalized.
  * Note that the task may not be executed in some circumstances (e.g. if the event
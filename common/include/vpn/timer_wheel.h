@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace ag {
+
+/**
+ * Timer entry of `TimerWheel`.
+ * Trivial to be embeddable in C-style structures: a zero-initialized entry is not pending.
+ */
+struct TimerWheelEntry {
+    TimerWheelEntry *next;   /**< Next entry in the same slot */
+    TimerWheelEntry **pprev; /**< Pointer to the pointer to this entry, null if the entry is not pending */
+    uint64_t deadline;       /**< The tick at which the entry expires */
+    uint32_t slot;           /**< The slot the entry is linked in */
+};
+
+/**
+ * Hierarchical timing wheel.
+ *
+ * The wheel consists of `DEPTH` levels of `LEVEL_SIZE` slots each. A slot of level `n` covers `8^n` ticks,
+ * so an entry is placed on the level whose granularity matches the time left until the deadline and is never
+ * moved between the levels (no cascading). The price is that the entries on the upper levels expire
+ * a bit late: the deadline is rounded up to the level granularity, which is at most ~1/8 of the timeout.
+ * Adding, removing and expiring an entry is O(1), finding the next expiry is O(DEPTH).
+ *
+ * The wheel is not thread-safe.
+ */
+class TimerWheel {
+public:
+    static constexpr size_t LEVEL_BITS = 6;
+    static constexpr size_t LEVEL_SIZE = 1 << LEVEL_BITS;
+    static constexpr size_t LEVEL_CLK_SHIFT = 3;
+    static constexpr size_t DEPTH = 9;
+    /** Entries with longer timeouts are kept on the last level and re-added on expiry */
+    static constexpr uint64_t MAX_TIMEOUT = ((LEVEL_SIZE - 1) << ((DEPTH - 1) * LEVEL_CLK_SHIFT)) - 1;
+
+    /**
+     * @param now the current tick
+     */
+    explicit TimerWheel(uint64_t now);
+
+    ~TimerWheel() = default;
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+    TimerWheel(TimerWheel &&) = delete;
+    TimerWheel &operator=(TimerWheel &&) = delete;
+
+    /**
+     * Add an entry to the wheel. If the entry is pending, it is re-added with the new deadline.
+     * @param entry the entry
+     * @param deadline the tick at which the entry expires
+     */
+    void add(TimerWheelEntry *entry, uint64_t deadline);
+
+    /**
+     * Remove an entry from the wheel or from an expired list. Does nothing if the entry is not pending.
+     */
+    void remove(TimerWheelEntry *entry);
+
+    /**
+     * Get the tick at which the earliest entry expires, not earlier than the current tick
+     */
+    [[nodiscard]] std::optional<uint64_t> next_expiry() const;
+
+    /**
+     * Advance the wheel to the specified tick
+     * @param now the current tick
+     * @param expired the head of the list which the expired entries are moved to. The entries stay pending
+     *                until they are popped with `pop_expired` or removed with `remove`.
+     */
+    void advance(uint64_t now, TimerWheelEntry **expired);
+
+    /**
+     * Pop an entry from a list filled by `advance`
+     * @return null if the list is empty
+     */
+    static TimerWheelEntry *pop_expired(TimerWheelEntry **expired);
+
+    /**
+     * Check if an entry is in the wheel or in an expired list
+     */
+    static bool is_pending(const TimerWheelEntry *entry) {
+        return entry->pprev != nullptr;
+    }
+
+private:
+    static constexpr size_t SLOTS_NUM = LEVEL_SIZE * DEPTH;
+    static constexpr uint32_t SLOT_EXPIRED = UINT32_MAX;
+
+    TimerWheelEntry *m_slots[SLOTS_NUM] = {};
+    uint64_t m_pending[DEPTH] = {}; // bitmap of non-empty slots per level
+    uint64_t m_clk;                 // the next tick to be processed
+
+    void link(TimerWheelEntry **head, TimerWheelEntry *entry);
+    void collect(TimerWheelEntry **expired);
+};
+
+} // namespace ag
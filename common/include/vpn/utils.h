@@ -37,8 +37,51 @@ typedef enum {
 struct VpnConnectionStats {
     uint32_t rtt_us;          // RTT in microseconds
     double packet_loss_ratio; // the ratio of the number of lost packets to the total number of sent packets
+    uint32_t pacing_delay_us; // the average time a packet held by the pacer waited to be sent (QUIC only)
+    uint32_t max_burst;       // the largest number of packets sent back-to-back (QUIC only)
 };
 
+/**
+ * QUIC congestion control algorithms
+ */
+typedef enum {
+    VPN_QUIC_CC_DEFAULT, // Use the library default (CUBIC)
+    VPN_QUIC_CC_CUBIC,
+    VPN_QUIC_CC_RENO,
+    VPN_QUIC_CC_BBR,
+    VPN_QUIC_CC_BBR2,
+} VpnQuicCongestionControl;
+
+/**
+ * QUIC transport tuning. A zero-initialized structure means the library defaults.
+ */
+typedef struct {
+    /** Congestion control algorithm */
+    VpnQuicCongestionControl congestion_control;
+    /** Disable HyStart++ (the slow start exit heuristic of CUBIC and Reno) */
+    bool disable_hystart;
+    /** Initial connection-level flow control window. If 0, `QUIC_CONNECTION_WINDOW_SIZE` is used. */
+    uint64_t initial_max_data;
+    /** Initial stream-level flow control window. If 0, `QUIC_STREAM_WINDOW_SIZE` is used. */
+    uint64_t initial_max_stream_data;
+    /**
+     * The limit the connection-level window may be auto-tuned up to.
+     * If 0, the initial connection window is used (so the window is not grown).
+     */
+    uint64_t max_connection_window;
+    /**
+     * The limit the stream-level window may be auto-tuned up to.
+     * If 0, the initial stream window is used (so the window is not grown).
+     */
+    uint64_t max_stream_window;
+    /**
+     * The maximum UDP payload size advertised to the peer.
+     * If 0, `QUIC_MAX_UDP_PAYLOAD_SIZE` is used. Clamped to
+     * [`QUIC_MIN_UDP_PAYLOAD_SIZE`, `QUIC_MAX_RECV_UDP_PAYLOAD_SIZE`].
+     */
+    uint32_t max_recv_udp_payload_size;
+} VpnQuicTransportConfig;
+
 // The longest ipv6 address len (45) + brackets (2) + port delimiter (1) + maximum port length (5) + null (1)
 #define SOCKADDR_STR_BUF_SIZE (INET6_ADDRSTRLEN + 8)
 
@@ -68,6 +111,11 @@ static constexpr uint64_t QUIC_CONNECTION_WINDOW_SIZE = 100ul * 1024 * 1024;
 static constexpr uint64_t QUIC_STREAM_WINDOW_SIZE = 1ul * 1024 * 1024;
 static constexpr uint64_t QUIC_MAX_STREAMS_NUM = 4ul * 1024;
 static constexpr size_t QUIC_MAX_UDP_PAYLOAD_SIZE = 1350;
+// RFC 9000: the smallest allowed value of the `max_udp_payload_size` transport parameter
+static constexpr size_t QUIC_MIN_UDP_PAYLOAD_SIZE = 1200;
+// The largest UDP payload a receive buffer must fit: an Ethernet MTU without the IPv4 and UDP headers
+static constexpr size_t QUIC_MAX_RECV_UDP_PAYLOAD_SIZE = 1500 - 20 - 8;
+static constexpr size_t QUIC_DGRAM_QUEUE_LEN = 1024;
 static constexpr uint8_t QUIC_H3_ALPN_PROTOS[] = {2, 'h', '3'};
 
 // TCP defaults
@@ -131,6 +179,19 @@ typedef struct {
 
 typedef AG_ARRAY_OF(VpnPacket) VpnPackets;
 
+/**
+ * Shared ownership of a buffer holding some data passed to a callee. Lets the callee keep the data
+ * after the call returns without copying it: it takes a reference with `ref` and drops it with `unref`
+ * once the data is not needed anymore. `unref` has the signature of the libevent's reference cleanup
+ * callback, so it may be passed to `evbuffer_add_reference` as is. The references must be taken and
+ * dropped on the thread the data came from.
+ */
+typedef struct {
+    void (*ref)(void *arg);
+    void (*unref)(const void *data, size_t length, void *arg);
+    void *arg;
+} VpnBufferRef;
+
 class VpnPacketsHolder {
 public:
     VpnPacketsHolder() = default;
@@ -1,11 +1,16 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
-#include <list>
+#include <cstddef>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 
 #include <event2/bufferevent.h>
 #include <event2/event.h>
@@ -28,41 +33,123 @@
 namespace ag {
 
 static constexpr size_t TASK_QUEUE_BUDGET = 64;
+// Max number of task nodes kept for reuse by a loop
+static constexpr size_t TASK_NODE_POOL_SIZE = 1024;
 
 std::atomic<TaskId> g_next_task_id = 0;
 std::atomic_int g_next_loop_id = 0;
+// The loop running on the current thread, if any
+thread_local VpnEventLoop *g_running_loop = nullptr;
 
 static event_base *make_event_base();
 static void run_task_queue(evutil_socket_t, short, void *arg);
-static void run_deferred_task(evutil_socket_t, short, void *arg);
-static void vpn_timer_event_free_finalize(event *ev);
+static void run_expired_timers(evutil_socket_t, short, void *arg);
+static void run_deferred_task(void *arg);
 
 struct TaskInfo {
     TaskId id;
     VpnEventLoopTask task;
 };
 
-struct DeferredTaskCtx {
-    VpnEventLoop *parent_loop;
-    TaskId id;
-};
-
-struct DeferredTaskInfo {
-    TaskInfo basic;
-    DeclPtr<event, &vpn_timer_event_free_finalize> timer_event;
+/**
+ * A node of the immediate task queue.
+ * Nodes are pushed into the lock-free inbox by any thread. The inbox is drained into the ready list
+ * by the thread holding `VpnEventLoop::guard`, so that the pending tasks can be cancelled.
+ * The loop takes the nodes off the ready list in batches, a node of the batch being run is either run
+ * or cancelled by the one who claims it first.
+ */
+struct TaskNode {
+    std::atomic<TaskNode *> next{nullptr};
+    TaskInfo info = {};
+    std::function<void()> func;       // owned by the node if the task was submitted as `std::function`
+    std::atomic_bool claimed = false; // the node of the running batch has been run or cancelled
 };
 
 /**
- * timer_event is required to be finalized because it is created with EV_FINALIZE flag.
- * If it is created without this flag, event_del may block while the event's callback is running.
- * This can lead to deadlocks in multithreaded applications, so we use EV_FINALIZE
+ * Intrusive multi-producer single-consumer queue (Dmitry Vyukov's algorithm).
+ * Push is wait-free. Pop must be serialized by the caller.
  */
-static void vpn_timer_event_free_finalize(event *ev) {
-    if (ev) {
-        event_free_finalize(0, ev, [](event *, void *arg) {
-            delete (DeferredTaskCtx *) arg;
-        });
+class TaskInbox {
+public:
+    TaskInbox() = default;
+    ~TaskInbox() = default;
+
+    TaskInbox(const TaskInbox &) = delete;
+    TaskInbox &operator=(const TaskInbox &) = delete;
+    TaskInbox(TaskInbox &&) = delete;
+    TaskInbox &operator=(TaskInbox &&) = delete;
+
+    void push(TaskNode *node) {
+        m_size.fetch_add(1);
+        node->next.store(nullptr, std::memory_order_relaxed);
+        TaskNode *prev = m_tail.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * Pop the oldest node
+     * @return null if the inbox is empty or the next node is being pushed at the moment,
+     *         in the latter case the nodes pushed after it are not reachable until the push completes
+     */
+    TaskNode *pop() {
+        TaskNode *head = m_head;
+        TaskNode *next = head->next.load(std::memory_order_acquire);
+        if (head == &m_stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            m_head = next;
+            head = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            m_head = next;
+            m_size.fetch_sub(1);
+            return head;
+        }
+        if (head != m_tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        push_stub();
+        next = head->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            m_head = next;
+            m_size.fetch_sub(1);
+            return head;
+        }
+        return nullptr;
     }
+
+    /** Number of nodes pushed, but not popped yet */
+    [[nodiscard]] size_t size() const {
+        return m_size.load();
+    }
+
+private:
+    void push_stub() {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+        TaskNode *prev = m_tail.exchange(&m_stub, std::memory_order_acq_rel);
+        prev->next.store(&m_stub, std::memory_order_release);
+    }
+
+    TaskNode m_stub;
+    TaskNode *m_head = &m_stub;
+    std::atomic<TaskNode *> m_tail{&m_stub};
+    std::atomic<size_t> m_size{0};
+};
+
+static void drain_task_inbox(VpnEventLoop *loop);
+static void release_task_node(VpnEventLoop *loop, TaskNode *node);
+
+struct DeferredTask {
+    VpnEventLoop *parent_loop;
+    TaskInfo info;
+    VpnEventLoopTimer timer;
+};
+
+// Timer wheel ticks are milliseconds of the monotonic clock
+static uint64_t current_tick() {
+    return std::chrono::duration_cast<Millis>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 enum EventLoopState {
@@ -75,10 +162,30 @@ struct VpnEventLoop {
     DeclPtr<event_base, &event_base_free> ev_base{make_event_base()};
     mutable std::mutex guard;
     std::condition_variable stop_barrier;
-    bool task_queue_scheduled = false;
-    std::list<TaskInfo> task_queue;
-    std::list<DeferredTaskInfo> deferred_task_queue;
-    EventLoopState state = ELS_STOPPED;
+    std::atomic_bool task_queue_scheduled = false;
+    TaskInbox task_inbox;
+    // Tasks taken from the inbox, but not run yet. Guarded by `guard`.
+    TaskNode *ready_head = nullptr;
+    TaskNode *ready_tail = nullptr;
+    // The batch being run by `run_task_queue`. Its nodes are released once it is done. Guarded by `guard`.
+    TaskNode *running_head = nullptr;
+    // Nodes of the completed tasks. Accessed only on the loop thread.
+    TaskNode *node_pool = nullptr;
+    size_t node_pool_size = 0;
+    // Timers and deferred tasks. Guarded by `guard`.
+    TimerWheel timer_wheel{current_tick()};
+    // Fires when the earliest timer in the wheel expires. Only re-armed to an earlier deadline
+    // outside the loop thread, as `event_del` might block while the event's callback is running.
+    DeclPtr<event, &event_free> timer_event;
+    uint64_t timer_event_deadline = UINT64_MAX;
+    std::unordered_map<TaskId, DeferredTask> deferred_tasks;
+    std::atomic<EventLoopState> state = ELS_STOPPED;
+    // Number of `submit_task_node` calls past the state check. The final drain waits for them,
+    // so that a node pushed by a submitter which has seen the loop running is not missed.
+    std::atomic<size_t> submitters_num = 0;
+    // Signalled when the last submitter leaves after the inbox has been sealed
+    std::mutex submitters_guard;
+    std::condition_variable submitters_done;
     bool stopping_externally = false;
     ag::Logger log{"EVLOOP"};
     int id = g_next_loop_id++;
@@ -139,12 +246,24 @@ VpnEventLoop *vpn_event_loop_create() {
         log_loop(loop, err, "Failed to create event base");
         return nullptr;
     }
+    loop->timer_event.reset(event_new(loop->ev_base.get(), -1, 0, &run_expired_timers, loop.get()));
+    if (loop->timer_event == nullptr) {
+        log_loop(loop, err, "Failed to create timer event");
+        return nullptr;
+    }
     return loop.release();
 }
 
 void vpn_event_loop_destroy(VpnEventLoop *loop) {
-    assert(loop == nullptr || loop->task_queue.empty());
-    assert(loop == nullptr || loop->deferred_task_queue.empty());
+    if (loop == nullptr) {
+        return;
+    }
+    assert(loop->ready_head == nullptr && loop->running_head == nullptr && loop->task_inbox.size() == 0);
+    assert(loop->deferred_tasks.empty());
+    while (TaskNode *node = loop->node_pool) {
+        loop->node_pool = node->next.load(std::memory_order_relaxed);
+        delete node;
+    }
     delete loop;
 }
 
@@ -178,7 +297,9 @@ int vpn_event_loop_run(VpnEventLoop *loop, VpnEventLoopSettings settings [[maybe
     loop->guard.unlock();
 
     log_loop(loop, dbg, "Running event base...");
+    VpnEventLoop *prev_running_loop = std::exchange(g_running_loop, loop);
     int r = event_base_loop(loop->ev_base.get(), EVLOOP_NO_EXIT_ON_EMPTY);
+    g_running_loop = prev_running_loop;
     log_loop(loop, dbg, "Exited from event base ({})", r);
     if (r == -1) {
         log_loop(loop, err, "Error in event base: {}", evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
@@ -215,28 +336,41 @@ void vpn_event_loop_finalize_exit(VpnEventLoop *loop) {
     log_loop(loop, dbg, "...");
 
     std::unique_lock l(loop->guard);
-    log_loop(loop, dbg, "Waiting until run finished (current state={})", magic_enum::enum_name(loop->state));
+    log_loop(loop, dbg, "Waiting until run finished (current state={})", magic_enum::enum_name(loop->state.load()));
     loop->stopping_externally = true;
     loop->stop_barrier.wait(l, [loop]() -> bool {
         return loop->state != ELS_RUNNING;
     });
     log_loop(loop, dbg, "Run finish waited");
 
-    for (TaskInfo &info : loop->task_queue) {
-        if (info.task.finalize != nullptr) {
-            log_task(loop, info.id, trace, "Finalizing");
-            info.task.finalize(info.task.arg);
+    // The loop might have exited on its own, seal the inbox for the submitters coming from now on
+    loop->state = ELS_BASE_EXITED;
+    {
+        std::unique_lock submitters_lock(loop->submitters_guard);
+        loop->submitters_done.wait(submitters_lock, [loop]() -> bool {
+            return loop->submitters_num.load() == 0;
+        });
+    }
+
+    drain_task_inbox(loop);
+    while (TaskNode *node = loop->ready_head) {
+        loop->ready_head = node->next.load(std::memory_order_relaxed);
+        if (node->info.task.finalize != nullptr) {
+            log_task(loop, node->info.id, trace, "Finalizing");
+            node->info.task.finalize(node->info.task.arg);
         }
+        release_task_node(loop, node);
     }
-    loop->task_queue.clear();
+    loop->ready_tail = nullptr;
 
-    for (DeferredTaskInfo &info : loop->deferred_task_queue) {
-        if (info.basic.task.finalize != nullptr) {
-            log_task(loop, info.basic.id, trace, "Finalizing");
-            info.basic.task.finalize(info.basic.task.arg);
+    for (auto &[id, deferred] : loop->deferred_tasks) {
+        loop->timer_wheel.remove(&deferred.timer.entry);
+        if (deferred.info.task.finalize != nullptr) {
+            log_task(loop, id, trace, "Finalizing");
+            deferred.info.task.finalize(deferred.info.task.arg);
         }
     }
-    loop->deferred_task_queue.clear();
+    loop->deferred_tasks.clear();
 
     loop->state = ELS_STOPPED;
     loop->stopping_externally = false;
@@ -244,46 +378,140 @@ void vpn_event_loop_finalize_exit(VpnEventLoop *loop) {
     log_loop(loop, dbg, "Done");
 }
 
-TaskId vpn_event_loop_submit(VpnEventLoop *loop, VpnEventLoopTask task) {
-    loop->guard.lock();
+static TaskNode *acquire_task_node(VpnEventLoop *loop) {
+    // The pool is touched only on the loop thread, so the tasks submitted from the loop itself
+    // (the most frequent case) don't hit the allocator
+    if (g_running_loop == loop && loop->node_pool != nullptr) {
+        TaskNode *node = loop->node_pool;
+        loop->node_pool = node->next.load(std::memory_order_relaxed);
+        --loop->node_pool_size;
+        node->claimed.store(false, std::memory_order_relaxed);
+        return node;
+    }
+    return new TaskNode{};
+}
 
-    TaskId task_id = g_next_task_id++;
+static void release_task_node(VpnEventLoop *loop, TaskNode *node) {
+    node->func = nullptr;
+    if (g_running_loop == loop && loop->node_pool_size < TASK_NODE_POOL_SIZE) {
+        node->next.store(loop->node_pool, std::memory_order_relaxed);
+        loop->node_pool = node;
+        ++loop->node_pool_size;
+        return;
+    }
+    delete node;
+}
 
-    switch (loop->state) {
-    case ELS_BASE_EXITED:
-        loop->guard.unlock();
-        if (task.finalize != nullptr) {
-            log_task(loop, task_id, trace, "Finalizing immediately as loop is exited");
-            task.finalize(task.arg);
+/**
+ * Move the nodes from the inbox to the ready list. Must be called with `guard` held.
+ * All the nodes counted by the inbox are moved, including the ones behind a push in progress,
+ * so a task whose submission has completed is on the ready list after this.
+ */
+static void drain_task_inbox(VpnEventLoop *loop) {
+    for (size_t left = loop->task_inbox.size(); left > 0;) {
+        TaskNode *node = loop->task_inbox.pop();
+        if (node == nullptr) {
+            // A producer is between counting its node and linking it, which takes a few instructions
+            std::this_thread::yield();
+            continue;
         }
+        --left;
+        node->next.store(nullptr, std::memory_order_relaxed);
+        if (loop->ready_tail == nullptr) {
+            loop->ready_head = node;
+        } else {
+            loop->ready_tail->next.store(node, std::memory_order_relaxed);
+        }
+        loop->ready_tail = node;
+    }
+}
+
+static void finalize_task_node(VpnEventLoop *loop, TaskNode *node) {
+    if (node->info.task.finalize != nullptr) {
+        log_task(loop, node->info.id, trace, "Finalizing");
+        node->info.task.finalize(node->info.task.arg);
+    }
+    release_task_node(loop, node);
+}
+
+static void leave_submitters(VpnEventLoop *loop) {
+    if (loop->submitters_num.fetch_sub(1) == 1 && loop->state.load() == ELS_BASE_EXITED) {
+        // `vpn_event_loop_finalize_exit` may be waiting for the last submitter
+        std::scoped_lock l(loop->submitters_guard);
+        loop->submitters_done.notify_all();
+    }
+}
+
+static TaskId submit_task_node(VpnEventLoop *loop, TaskNode *node) {
+    TaskId task_id = node->info.id;
+
+    loop->submitters_num.fetch_add(1);
+    if (loop->state.load() == ELS_BASE_EXITED) {
+        leave_submitters(loop);
+        log_task(loop, task_id, trace, "Finalizing immediately as loop is exited");
+        finalize_task_node(loop, node);
         return -1;
-    case ELS_STOPPED:
-    case ELS_RUNNING:
-        // handled below
-        break;
     }
 
-    loop->task_queue.push_back({task_id, task});
+    // The node may be run and released by the loop right after the push
+    loop->task_inbox.push(node);
     log_task(loop, task_id, trace, "Queued");
 
-    if (!loop->task_queue_scheduled) {
-        loop->task_queue_scheduled = true;
-        loop->guard.unlock();
-
+    if (!loop->task_queue_scheduled.exchange(true)) {
         event_base_once(loop->ev_base.get(), -1, EV_TIMEOUT, &run_task_queue, loop, nullptr);
-    } else {
-        loop->guard.unlock();
     }
+    leave_submitters(loop);
 
     return task_id;
 }
 
+TaskId vpn_event_loop_submit(VpnEventLoop *loop, VpnEventLoopTask task) {
+    TaskNode *node = acquire_task_node(loop);
+    node->info = {g_next_task_id++, task};
+    return submit_task_node(loop, node);
+}
+
+/**
+ * Re-arm the timer event if the earliest timer expires before it fires. Must be called with `guard` held.
+ */
+static void arm_timer_event(VpnEventLoop *loop) {
+    std::optional<uint64_t> next = loop->timer_wheel.next_expiry();
+    if (!next.has_value() || next.value() >= loop->timer_event_deadline) {
+        return;
+    }
+    loop->timer_event_deadline = next.value();
+    uint64_t now = current_tick();
+    const timeval tv = ms_to_timeval(uint32_t(std::min<uint64_t>(
+            (next.value() > now) ? next.value() - now : 0, TimerWheel::MAX_TIMEOUT)));
+    event_add(loop->timer_event.get(), &tv);
+}
+
+static void start_timer(VpnEventLoop *loop, VpnEventLoopTimer *timer, Millis timeout) {
+    loop->timer_wheel.add(&timer->entry, current_tick() + uint64_t(std::max<Millis::rep>(timeout.count(), 0)));
+    arm_timer_event(loop);
+}
+
+void vpn_event_loop_timer_start(VpnEventLoop *loop, VpnEventLoopTimer *timer, Millis timeout) {
+    std::scoped_lock l(loop->guard);
+    start_timer(loop, timer, timeout);
+}
+
+void vpn_event_loop_timer_stop(VpnEventLoop *loop, VpnEventLoopTimer *timer) {
+    // The timer event is left armed, if it fires for nothing it is just re-armed for the next timer
+    std::scoped_lock l(loop->guard);
+    loop->timer_wheel.remove(&timer->entry);
+}
+
+bool vpn_event_loop_timer_is_pending(const VpnEventLoopTimer *timer) {
+    return TimerWheel::is_pending(&timer->entry);
+}
+
 TaskId vpn_event_loop_schedule(VpnEventLoop *loop, VpnEventLoopTask task, Millis defer) {
     TaskId task_id = g_next_task_id++;
 
     loop->guard.lock();
 
-    switch (loop->state) {
+    switch (loop->state.load()) {
     case ELS_BASE_EXITED:
         loop->guard.unlock();
         log_task(loop, task_id, trace, "Finalizing immediately as loop is exited");
@@ -295,14 +523,9 @@ TaskId vpn_event_loop_schedule(VpnEventLoop *loop, VpnEventLoopTask task, Millis
         break;
     }
 
-    DeferredTaskInfo &info = loop->deferred_task_queue.emplace_back(DeferredTaskInfo{{task_id, task}});
-
-    // Will be freed by `vpn_timer_event_free_finalize`
-    auto *task_ctx = new DeferredTaskCtx{loop, task_id};
-
-    info.timer_event.reset(event_new(loop->ev_base.get(), -1, EV_FINALIZE, &run_deferred_task, task_ctx));
-    const struct timeval tv = ms_to_timeval(uint32_t(defer.count()));
-    event_add(info.timer_event.get(), &tv);
+    DeferredTask &deferred = loop->deferred_tasks[task_id];
+    deferred = {loop, {task_id, task}, {&run_deferred_task, &deferred}};
+    start_timer(loop, &deferred.timer, defer);
 
     log_task(loop, task_id, trace, "Scheduled");
 
@@ -353,31 +576,57 @@ bool vpn_event_loop_dispatch_sync(VpnEventLoop *loop, void (*action)(void *), vo
 void vpn_event_loop_cancel(VpnEventLoop *loop, TaskId task_id) {
     log_task(loop, task_id, trace, "...");
 
+    TaskNode *node = nullptr;
     std::optional<TaskInfo> info;
 
     loop->guard.lock();
 
-    for (auto i = loop->task_queue.begin(); i != loop->task_queue.end(); ++i) {
-        if (i->id == task_id) {
-            info = *i;
-            loop->task_queue.erase(i);
-            break;
+    drain_task_inbox(loop);
+    for (TaskNode *prev = nullptr, *i = loop->ready_head; i != nullptr;
+            prev = i, i = i->next.load(std::memory_order_relaxed)) {
+        if (i->info.id != task_id) {
+            continue;
         }
+        TaskNode *next = i->next.load(std::memory_order_relaxed);
+        if (prev == nullptr) {
+            loop->ready_head = next;
+        } else {
+            prev->next.store(next, std::memory_order_relaxed);
+        }
+        if (loop->ready_tail == i) {
+            loop->ready_tail = prev;
+        }
+        node = i;
+        break;
     }
 
-    if (!info.has_value()) {
-        for (auto i = loop->deferred_task_queue.begin(); i != loop->deferred_task_queue.end(); ++i) {
-            if (i->basic.id == task_id) {
-                info = i->basic;
-                loop->deferred_task_queue.erase(i);
+    if (node == nullptr) {
+        // A task of the batch being run is cancelled in place unless the loop has got to it
+        for (TaskNode *i = loop->running_head; i != nullptr; i = i->next.load(std::memory_order_relaxed)) {
+            if (i->info.id == task_id) {
+                if (!i->claimed.exchange(true)) {
+                    info = i->info;
+                }
                 break;
             }
         }
     }
 
+    if (node == nullptr && !info.has_value()) {
+        // A deferred task which is not pending has expired and is being run at the moment
+        auto i = loop->deferred_tasks.find(task_id);
+        if (i != loop->deferred_tasks.end() && TimerWheel::is_pending(&i->second.timer.entry)) {
+            loop->timer_wheel.remove(&i->second.timer.entry);
+            info = i->second.info;
+            loop->deferred_tasks.erase(i);
+        }
+    }
+
     loop->guard.unlock();
 
-    if (!info.has_value()) {
+    if (node != nullptr) {
+        finalize_task_node(loop, node);
+    } else if (!info.has_value()) {
         log_task(loop, task_id, trace, "Not found");
     } else if (info->task.finalize != nullptr) {
         log_task(loop, task_id, trace, "Finalizing");
@@ -407,7 +656,7 @@ void vpn_event_loop_hijack(VpnEventLoop *loop) {
     vpn_event_loop_exit(loop, {});
 
     std::unique_lock l(loop->guard);
-    log_loop(loop, dbg, "Waiting until run finished (current state={})", magic_enum::enum_name(loop->state));
+    log_loop(loop, dbg, "Waiting until run finished (current state={})", magic_enum::enum_name(loop->state.load()));
     loop->stopping_externally = true;
     loop->stop_barrier.wait(l, [loop]() -> bool {
         return loop->state != ELS_RUNNING;
@@ -430,6 +679,11 @@ AutoTaskId submit(VpnEventLoop *loop, VpnEventLoopTask task) {
     return {loop, loop->shutdown_guard, vpn_event_loop_submit(loop, task)};
 }
 
+static void run_function_task(void *arg, TaskId) {
+    auto *func = (std::function<void()> *) arg;
+    (*func)();
+}
+
 static VpnEventLoopTask func_to_task(std::function<void()> &&func) {
     return VpnEventLoopTask{
             new std::function(std::move(func)),
@@ -444,7 +698,11 @@ static VpnEventLoopTask func_to_task(std::function<void()> &&func) {
 }
 
 AutoTaskId submit(VpnEventLoop *loop, std::function<void()> func) {
-    return {loop, loop->shutdown_guard, vpn_event_loop_submit(loop, func_to_task(std::move(func)))};
+    // The function lives in the node and is destroyed when the node is released
+    TaskNode *node = acquire_task_node(loop);
+    node->func = std::move(func);
+    node->info = {g_next_task_id++, {&node->func, &run_function_task, nullptr}};
+    return {loop, loop->shutdown_guard, submit_task_node(loop, node)};
 }
 
 AutoTaskId schedule(VpnEventLoop *loop, VpnEventLoopTask task, Millis defer) {
@@ -517,77 +775,101 @@ static void run_task_queue(evutil_socket_t, short, void *arg) {
     auto *loop = (VpnEventLoop *) arg;
     log_loop(loop, trace, "...");
 
-    TaskId task_queue_last_id = -1;
-    if (std::scoped_lock l(loop->guard); !loop->task_queue.empty()) {
-        if (loop->task_queue.front().id <= loop->task_queue.back().id) {
-            task_queue_last_id = loop->task_queue.back().id;
-        } else {
-            log_loop(loop, err, "Event loop inconsistency: front task id={} is larger than last task id={}",
-                    loop->task_queue.front().id, loop->task_queue.back().id);
-            task_queue_last_id = std::numeric_limits<TaskId>::max();
-            // FIXME: we need to investigate this but at this time just execute whole queue.
-            assert(0);
+    // Take a batch of the queued tasks under a single lock, the ones queued while it runs are left for the next pass
+    TaskNode *batch = nullptr;
+    {
+        std::scoped_lock l(loop->guard);
+        drain_task_inbox(loop);
+        batch = loop->ready_head;
+        TaskNode *last = nullptr;
+        for (size_t i = 0; i < TASK_QUEUE_BUDGET && loop->ready_head != nullptr; ++i) {
+            last = loop->ready_head;
+            loop->ready_head = last->next.load(std::memory_order_relaxed);
         }
-    }
-    TaskInfo info = {};
-    for (size_t i = 0;; ++i) {
-        {
-            std::scoped_lock l(loop->guard);
-            if (loop->task_queue.empty()) {
-                loop->task_queue_scheduled = false;
-                break;
-            }
-            if (loop->task_queue.front().id > task_queue_last_id || i == TASK_QUEUE_BUDGET) {
+        if (last != nullptr) {
+            last->next.store(nullptr, std::memory_order_relaxed);
+        }
+        if (loop->ready_head != nullptr) {
+            event_base_once(loop->ev_base.get(), -1, EV_TIMEOUT, &run_task_queue, loop, nullptr);
+        } else {
+            loop->ready_tail = nullptr;
+            loop->task_queue_scheduled.store(false);
+            // A producer may have pushed a task after the inbox was drained and seen the flag still set
+            if (loop->task_inbox.size() > 0 && !loop->task_queue_scheduled.exchange(true)) {
                 event_base_once(loop->ev_base.get(), -1, EV_TIMEOUT, &run_task_queue, loop, nullptr);
-                break;
             }
-            info = loop->task_queue.front();
-            loop->task_queue.pop_front();
         }
+        loop->running_head = batch;
+    }
 
-        log_task(loop, info.id, trace, "Running");
-        info.task.action(info.task.arg, info.id);
-        if (info.task.finalize != nullptr) {
-            log_task(loop, info.id, trace, "Finalizing");
-            info.task.finalize(info.task.arg);
+    for (TaskNode *node = batch; node != nullptr; node = node->next.load(std::memory_order_relaxed)) {
+        // The task has been cancelled after the batch was taken
+        if (node->claimed.exchange(true)) {
+            continue;
+        }
+        log_task(loop, node->info.id, trace, "Running");
+        node->info.task.action(node->info.task.arg, node->info.id);
+        if (node->info.task.finalize != nullptr) {
+            log_task(loop, node->info.id, trace, "Finalizing");
+            node->info.task.finalize(node->info.task.arg);
         }
     }
 
+    // `vpn_event_loop_cancel` may be walking the batch
+    {
+        std::scoped_lock l(loop->guard);
+        loop->running_head = nullptr;
+    }
+    while (TaskNode *node = batch) {
+        batch = node->next.load(std::memory_order_relaxed);
+        release_task_node(loop, node);
+    }
+
     log_loop(loop, trace, "Done");
 }
 
-static void run_deferred_task(evutil_socket_t, short, void *arg) {
-    auto *ctx = (DeferredTaskCtx *) arg;
-    VpnEventLoop *loop = ctx->parent_loop;
-    std::optional<DeferredTaskInfo> info;
+static void run_expired_timers(evutil_socket_t, short, void *arg) {
+    auto *loop = (VpnEventLoop *) arg;
+    log_loop(loop, trace, "...");
 
-    TaskId task_id = ctx->id;
-    log_task(loop, task_id, trace, "...");
+    std::unique_lock l(loop->guard);
+    loop->timer_event_deadline = UINT64_MAX;
+    // The list lives until all the expired timers are run, so stopping any of them unlinks it from the list
+    TimerWheelEntry *expired = nullptr;
+    loop->timer_wheel.advance(current_tick(), &expired);
+    while (TimerWheelEntry *entry = TimerWheel::pop_expired(&expired)) {
+        auto *timer = (VpnEventLoopTimer *) ((uint8_t *) entry - offsetof(VpnEventLoopTimer, entry));
+        void (*callback)(void *) = timer->callback;
+        void *callback_arg = timer->arg;
+        l.unlock();
+        callback(callback_arg);
+        l.lock();
+    }
+    arm_timer_event(loop);
+    l.unlock();
+
+    log_loop(loop, trace, "Done");
+}
+
+static void run_deferred_task(void *arg) {
+    auto *deferred = (DeferredTask *) arg;
+    VpnEventLoop *loop = deferred->parent_loop;
+    TaskInfo info = deferred->info;
+    log_task(loop, info.id, trace, "...");
 
     {
         std::scoped_lock l(loop->guard);
-        auto it = std::find_if(loop->deferred_task_queue.begin(), loop->deferred_task_queue.end(),
-                [task_id](const DeferredTaskInfo &info) -> bool {
-                    return info.basic.id == task_id;
-                });
-        if (it != loop->deferred_task_queue.end()) {
-            info = std::move(*it);
-            loop->deferred_task_queue.erase(it);
-        }
+        loop->deferred_tasks.erase(info.id);
     }
 
-    if (info.has_value()) {
-        log_task(loop, task_id, trace, "Running");
-        info->basic.task.action(info->basic.task.arg, info->basic.id);
-        if (info->basic.task.finalize != nullptr) {
-            log_task(loop, task_id, trace, "Finalizing");
-            info->basic.task.finalize(info->basic.task.arg);
-        }
-    } else {
-        log_task(loop, task_id, trace, "Not found");
+    log_task(loop, info.id, trace, "Running");
+    info.task.action(info.task.arg, info.id);
+    if (info.task.finalize != nullptr) {
+        log_task(loop, info.id, trace, "Finalizing");
+        info.task.finalize(info.task.arg);
     }
 
-    log_task(loop, task_id, trace, "Done");
+    log_task(loop, info.id, trace, "Done");
 }
 
 } // namespace ag
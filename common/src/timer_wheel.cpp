@@ -0,0 +1,133 @@
+#include "vpn/timer_wheel.h"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+namespace ag {
+
+static constexpr uint64_t level_granularity(size_t level) {
+    return uint64_t(1) << (level * TimerWheel::LEVEL_CLK_SHIFT);
+}
+
+// The minimum time left until the deadline for an entry to be placed on the level
+static constexpr uint64_t level_start(size_t level) {
+    return (level == 0) ? 0 : (TimerWheel::LEVEL_SIZE - 1) << ((level - 1) * TimerWheel::LEVEL_CLK_SHIFT);
+}
+
+static uint32_t calc_slot(uint64_t deadline, uint64_t clk) {
+    deadline = std::clamp(deadline, clk, clk + TimerWheel::MAX_TIMEOUT);
+    uint64_t delta = deadline - clk;
+    size_t level = 0;
+    while (level + 1 < TimerWheel::DEPTH && delta >= level_start(level + 1)) {
+        ++level;
+    }
+    // Round up, so that the entry never expires early
+    uint64_t bucket = (deadline + level_granularity(level) - 1) >> (level * TimerWheel::LEVEL_CLK_SHIFT);
+    return uint32_t(level * TimerWheel::LEVEL_SIZE + (bucket & (TimerWheel::LEVEL_SIZE - 1)));
+}
+
+TimerWheel::TimerWheel(uint64_t now)
+        : m_clk(now) {
+}
+
+void TimerWheel::link(TimerWheelEntry **head, TimerWheelEntry *entry) {
+    entry->next = *head;
+    if (entry->next != nullptr) {
+        entry->next->pprev = &entry->next;
+    }
+    *head = entry;
+    entry->pprev = head;
+}
+
+void TimerWheel::add(TimerWheelEntry *entry, uint64_t deadline) {
+    remove(entry);
+    entry->deadline = deadline;
+    entry->slot = calc_slot(deadline, m_clk);
+    link(&m_slots[entry->slot], entry);
+    m_pending[entry->slot / LEVEL_SIZE] |= uint64_t(1) << (entry->slot % LEVEL_SIZE);
+}
+
+void TimerWheel::remove(TimerWheelEntry *entry) {
+    if (!is_pending(entry)) {
+        return;
+    }
+    *entry->pprev = entry->next;
+    if (entry->next != nullptr) {
+        entry->next->pprev = entry->pprev;
+    }
+    if (entry->slot != SLOT_EXPIRED && m_slots[entry->slot] == nullptr) {
+        m_pending[entry->slot / LEVEL_SIZE] &= ~(uint64_t(1) << (entry->slot % LEVEL_SIZE));
+    }
+    entry->next = nullptr;
+    entry->pprev = nullptr;
+}
+
+std::optional<uint64_t> TimerWheel::next_expiry() const {
+    std::optional<uint64_t> next;
+    for (size_t level = 0; level < DEPTH; ++level) {
+        if (m_pending[level] == 0) {
+            continue;
+        }
+        size_t shift = level * LEVEL_CLK_SHIFT;
+        // The first bucket of the level to be processed at or after the current tick
+        uint64_t bucket = (m_clk + level_granularity(level) - 1) >> shift;
+        uint64_t rotated = std::rotr(m_pending[level], int(bucket % LEVEL_SIZE));
+        uint64_t expiry = (bucket + std::countr_zero(rotated)) << shift;
+        next = std::min(next.value_or(UINT64_MAX), expiry);
+    }
+    return next;
+}
+
+void TimerWheel::collect(TimerWheelEntry **expired) {
+    for (size_t level = 0; level < DEPTH; ++level) {
+        size_t shift = level * LEVEL_CLK_SHIFT;
+        // The slots of the upper levels are processed only at their granularity boundaries
+        if ((m_clk & (level_granularity(level) - 1)) != 0) {
+            break;
+        }
+        size_t idx = (m_clk >> shift) % LEVEL_SIZE;
+        TimerWheelEntry *list = std::exchange(m_slots[level * LEVEL_SIZE + idx], nullptr);
+        m_pending[level] &= ~(uint64_t(1) << idx);
+        while (list != nullptr) {
+            TimerWheelEntry *entry = list;
+            list = entry->next;
+            if (entry->deadline > m_clk) {
+                // The timeout exceeded the wheel range, so the entry was parked on the last level
+                entry->pprev = nullptr;
+                add(entry, entry->deadline);
+            } else {
+                entry->slot = SLOT_EXPIRED;
+                link(expired, entry);
+            }
+        }
+    }
+}
+
+void TimerWheel::advance(uint64_t now, TimerWheelEntry **expired) {
+    while (m_clk <= now) {
+        std::optional<uint64_t> next = next_expiry();
+        if (!next.has_value() || next.value() > now) {
+            m_clk = now + 1;
+            break;
+        }
+        m_clk = next.value();
+        collect(expired);
+        ++m_clk;
+    }
+}
+
+TimerWheelEntry *TimerWheel::pop_expired(TimerWheelEntry **expired) {
+    TimerWheelEntry *entry = *expired;
+    if (entry != nullptr) {
+        *expired = entry->next;
+        if (entry->next != nullptr) {
+            entry->next->pprev = expired;
+        }
+        entry->next = nullptr;
+        entry->pprev = nullptr;
+    }
+    return entry;
+}
+
+} // namespace ag
@@ -1,6 +1,9 @@
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -276,3 +279,147 @@ TEST_F(EventLoopTest, StopSubmitRun) {
     ASSERT_TRUE(ctx.ran);
     ASSERT_TRUE(ctx.finalized);
 }
+
+TEST_F(EventLoopTest, Timer) {
+    struct Ctx {
+        std::mutex guard;
+        std::condition_variable cond_var;
+        int fired = 0;
+    };
+    Ctx ctx;
+    VpnEventLoopTimer timer{};
+    timer.arg = &ctx;
+    timer.callback = [](void *arg) {
+        auto *ctx = (Ctx *) arg;
+        std::unique_lock l(ctx->guard);
+        ++ctx->fired;
+        ctx->cond_var.notify_one();
+    };
+    VpnEventLoopTimer stopped = timer;
+
+    run_event_loop();
+    event_loop::dispatch_sync(m_ev_loop.get(), [&] {
+        vpn_event_loop_timer_start(m_ev_loop.get(), &timer, Millis{5000});
+        vpn_event_loop_timer_start(m_ev_loop.get(), &stopped, Millis{100});
+        // Re-arming moves the timer
+        vpn_event_loop_timer_start(m_ev_loop.get(), &timer, Millis{200});
+        vpn_event_loop_timer_stop(m_ev_loop.get(), &stopped);
+    });
+
+    std::unique_lock l(ctx.guard);
+    ASSERT_TRUE(ctx.cond_var.wait_for(l, std::chrono::seconds(2), [&] {
+        return ctx.fired > 0;
+    }));
+    ASSERT_FALSE(ctx.cond_var.wait_for(l, std::chrono::milliseconds(300), [&] {
+        return ctx.fired > 1;
+    }));
+    ASSERT_FALSE(vpn_event_loop_timer_is_pending(&timer));
+    ASSERT_FALSE(vpn_event_loop_timer_is_pending(&stopped));
+}
+
+// The tasks submitted while the loop is being stopped are either run, finalized by the stop or left queued
+TEST_F(EventLoopTest, SubmitWhileStopping) {
+    static constexpr size_t ROUNDS_NUM = 20;
+    static constexpr size_t SUBMITTERS_NUM = 4;
+    static constexpr size_t TASKS_NUM = 500;
+    ag::Logger::set_log_level(ag::LOG_LEVEL_INFO);
+
+    std::atomic<size_t> finalized_num = 0;
+    VpnEventLoopTask task = {
+            .arg = &finalized_num,
+            .action = [](void *, TaskId) {},
+            .finalize =
+                    [](void *arg) {
+                        ++*(std::atomic<size_t> *) arg;
+                    },
+    };
+    for (size_t round = 0; round < ROUNDS_NUM; ++round) {
+        run_event_loop();
+        event_loop::dispatch_sync(m_ev_loop.get(), [] {});
+
+        std::atomic<size_t> started_num = 0;
+        std::vector<event_loop::AutoTaskId> ids[SUBMITTERS_NUM];
+        std::vector<std::thread> submitters;
+        for (std::vector<event_loop::AutoTaskId> &submitter_ids : ids) {
+            submitters.emplace_back([&, loop = m_ev_loop.get()] {
+                ++started_num;
+                for (size_t i = 0; i < TASKS_NUM; ++i) {
+                    submitter_ids.emplace_back(event_loop::submit(loop, task));
+                }
+            });
+        }
+
+        while (started_num < SUBMITTERS_NUM) {
+            std::this_thread::yield();
+        }
+        vpn_event_loop_stop(m_ev_loop.get());
+        for (std::thread &t : submitters) {
+            t.join();
+        }
+        m_loop_thread.join();
+
+        // The ones queued after the stop are finalized on cancellation
+        for (std::vector<event_loop::AutoTaskId> &submitter_ids : ids) {
+            submitter_ids.clear();
+        }
+        m_ev_loop.reset(vpn_event_loop_create());
+        ASSERT_EQ(finalized_num, SUBMITTERS_NUM * TASKS_NUM) << "round=" << round;
+        finalized_num = 0;
+    }
+}
+
+// A task whose submission has completed is either run before the cancellation returns or not run at all,
+// even if it sits behind a task being pushed by another thread
+TEST_F(EventLoopTest, CancelWhileOthersSubmit) {
+    static constexpr size_t SUBMITTERS_NUM = 4;
+    static constexpr size_t TASKS_NUM = 5000;
+    ag::Logger::set_log_level(ag::LOG_LEVEL_INFO);
+
+    struct CancelledTask {
+        std::atomic_bool cancelled = false;
+        std::atomic_bool finalized = false;
+        std::atomic<size_t> *late_runs_num = nullptr;
+    };
+    std::atomic<size_t> late_runs_num = 0;
+    VpnEventLoopTask task = {
+            .action =
+                    [](void *arg, TaskId) {
+                        auto *task = (CancelledTask *) arg;
+                        if (task->cancelled) {
+                            ++*task->late_runs_num;
+                        }
+                    },
+            .finalize =
+                    [](void *arg) {
+                        ((CancelledTask *) arg)->finalized = true;
+                    },
+    };
+    run_event_loop();
+
+    std::vector<std::unique_ptr<CancelledTask[]>> tasks;
+    std::vector<std::thread> submitters;
+    for (size_t i = 0; i < SUBMITTERS_NUM; ++i) {
+        CancelledTask *submitter_tasks = tasks.emplace_back(new CancelledTask[TASKS_NUM]).get();
+        submitters.emplace_back([&, submitter_tasks, loop = m_ev_loop.get()] {
+            for (size_t i = 0; i < TASKS_NUM; ++i) {
+                CancelledTask *cancelled_task = &submitter_tasks[i];
+                cancelled_task->late_runs_num = &late_runs_num;
+                VpnEventLoopTask submitted = task;
+                submitted.arg = cancelled_task;
+                vpn_event_loop_cancel(loop, vpn_event_loop_submit(loop, submitted));
+                cancelled_task->cancelled = true;
+            }
+        });
+    }
+    for (std::thread &t : submitters) {
+        t.join();
+    }
+    event_loop::dispatch_sync(m_ev_loop.get(), [] {});
+
+    ASSERT_EQ(late_runs_num, 0);
+    for (const std::unique_ptr<CancelledTask[]> &submitter_tasks : tasks) {
+        for (size_t i = 0; i < TASKS_NUM; ++i) {
+            ASSERT_TRUE(submitter_tasks[i].finalized) << "i=" << i;
+        }
+    }
+}
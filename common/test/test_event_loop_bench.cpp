@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "vpn/event_loop.h"
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t TASKS_NUM = 200000;
+
+struct BenchSlot {
+    Clock::time_point submitted;
+    Clock::duration latency;
+};
+
+struct BenchCtx {
+    std::vector<BenchSlot> slots{TASKS_NUM};
+    size_t completed = 0;
+    std::promise<void> done;
+};
+
+struct BenchTaskArg {
+    BenchCtx *ctx;
+    BenchSlot *slot;
+};
+
+/**
+ * Measures the submit-to-run latency and the throughput of the immediate task queue
+ * with several threads submitting tasks simultaneously
+ */
+class EventLoopBench : public testing::TestWithParam<size_t> {
+protected:
+    DeclPtr<VpnEventLoop, &vpn_event_loop_destroy> m_ev_loop{vpn_event_loop_create()};
+    std::thread m_loop_thread;
+
+    void SetUp() override {
+        m_loop_thread = std::thread([loop = m_ev_loop.get()]() {
+            vpn_event_loop_run(loop);
+        });
+        event_loop::dispatch_sync(m_ev_loop.get(), [] {});
+    }
+
+    void TearDown() override {
+        vpn_event_loop_stop(m_ev_loop.get());
+        m_loop_thread.join();
+    }
+};
+
+TEST_P(EventLoopBench, SubmitToRun) {
+    size_t producers_num = GetParam();
+    BenchCtx ctx;
+    std::vector<BenchTaskArg> args(TASKS_NUM);
+    for (size_t i = 0; i < TASKS_NUM; ++i) {
+        args[i] = {&ctx, &ctx.slots[i]};
+    }
+    std::future<void> done = ctx.done.get_future();
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < producers_num; ++p) {
+        producers.emplace_back([&, p] {
+            for (size_t i = p; i < TASKS_NUM; i += producers_num) {
+                args[i].slot->submitted = Clock::now();
+                vpn_event_loop_submit(m_ev_loop.get(),
+                        {
+                                .arg = &args[i],
+                                .action =
+                                        [](void *arg, TaskId) {
+                                            auto *a = (BenchTaskArg *) arg;
+                                            a->slot->latency = Clock::now() - a->slot->submitted;
+                                            if (++a->ctx->completed == TASKS_NUM) {
+                                                a->ctx->done.set_value();
+                                            }
+                                        },
+                        });
+            }
+        });
+    }
+    for (std::thread &t : producers) {
+        t.join();
+    }
+    ASSERT_EQ(std::future_status::ready, done.wait_for(std::chrono::seconds(30)));
+    Clock::duration elapsed = Clock::now() - start;
+
+    std::vector<Clock::duration> latencies;
+    latencies.reserve(TASKS_NUM);
+    for (const BenchSlot &slot : ctx.slots) {
+        latencies.push_back(slot.latency);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto us = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(d).count();
+    };
+    double seconds = std::chrono::duration<double>(elapsed).count();
+
+    printf("producers=%zu tasks=%zu throughput=%.0f tasks/s latency p50=%.1fus p99=%.1fus max=%.1fus\n",
+            producers_num, TASKS_NUM, double(TASKS_NUM) / seconds, us(latencies[TASKS_NUM / 2]),
+            us(latencies[TASKS_NUM * 99 / 100]), us(latencies.back()));
+}
+
+INSTANTIATE_TEST_SUITE_P(Producers, EventLoopBench, testing::Values(1, 2, 4, 8));
@@ -0,0 +1,113 @@
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "vpn/timer_wheel.h"
+
+using namespace ag;
+
+struct TestEntry {
+    TimerWheelEntry entry;
+    uint64_t deadline;
+    uint64_t fired_at;
+};
+
+static std::vector<TimerWheelEntry *> advance(TimerWheel &wheel, uint64_t now) {
+    std::vector<TimerWheelEntry *> out;
+    TimerWheelEntry *expired = nullptr;
+    wheel.advance(now, &expired);
+    while (TimerWheelEntry *entry = TimerWheel::pop_expired(&expired)) {
+        out.push_back(entry);
+    }
+    return out;
+}
+
+TEST(TimerWheel, ExpiresInTime) {
+    static constexpr uint64_t START = 123456;
+    static constexpr size_t ENTRIES_NUM = 5000;
+    TimerWheel wheel(START);
+    std::vector<TestEntry> entries(ENTRIES_NUM);
+    std::mt19937_64 rng(42); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+    std::uniform_int_distribution<uint64_t> timeouts(0, 600000);
+    for (TestEntry &e : entries) {
+        e = {};
+        e.deadline = START + timeouts(rng);
+        wheel.add(&e.entry, e.deadline);
+    }
+
+    size_t fired = 0;
+    for (uint64_t now = START; fired < ENTRIES_NUM; now += 7) {
+        for (TimerWheelEntry *entry : advance(wheel, now)) {
+            auto *e = (TestEntry *) entry;
+            ASSERT_FALSE(TimerWheel::is_pending(entry));
+            ASSERT_EQ(e->fired_at, 0);
+            e->fired_at = now;
+            ++fired;
+        }
+        ASSERT_LT(now, START + 700000);
+    }
+
+    for (const TestEntry &e : entries) {
+        ASSERT_GE(e.fired_at, e.deadline);
+        // Rounding to the level granularity plus the advance step
+        uint64_t timeout = e.deadline - START;
+        ASSERT_LE(e.fired_at - e.deadline, timeout * 8 / 63 + 7) << "timeout=" << timeout;
+    }
+    ASSERT_FALSE(wheel.next_expiry().has_value());
+}
+
+TEST(TimerWheel, NextExpiry) {
+    TimerWheel wheel(1000);
+    ASSERT_FALSE(wheel.next_expiry().has_value());
+
+    TimerWheelEntry near{};
+    TimerWheelEntry far{};
+    wheel.add(&far, 1000 + 10000);
+    wheel.add(&near, 1000 + 10);
+    ASSERT_EQ(wheel.next_expiry(), 1010);
+
+    wheel.remove(&near);
+    ASSERT_FALSE(TimerWheel::is_pending(&near));
+    std::optional<uint64_t> next = wheel.next_expiry();
+    ASSERT_TRUE(next.has_value());
+    ASSERT_GE(next.value(), 11000);
+    ASSERT_LE(next.value(), 11000 + 10000 / 8);
+
+    ASSERT_TRUE(advance(wheel, next.value() - 1).empty());
+    ASSERT_EQ(advance(wheel, next.value()), std::vector<TimerWheelEntry *>{&far});
+}
+
+TEST(TimerWheel, ReAddAndRemove) {
+    TimerWheel wheel(0);
+    TimerWheelEntry a{};
+    TimerWheelEntry b{};
+    wheel.add(&a, 100);
+    wheel.add(&b, 100);
+    // Re-adding moves the entry
+    wheel.add(&a, 5000);
+    ASSERT_EQ(advance(wheel, 200), std::vector<TimerWheelEntry *>{&b});
+    ASSERT_TRUE(TimerWheel::is_pending(&a));
+
+    // Removing an entry from the expired list
+    wheel.add(&b, 5000);
+    TimerWheelEntry *expired = nullptr;
+    wheel.advance(10000, &expired);
+    ASSERT_TRUE(TimerWheel::is_pending(&a));
+    ASSERT_TRUE(TimerWheel::is_pending(&b));
+    wheel.remove(&a);
+    ASSERT_EQ(TimerWheel::pop_expired(&expired), &b);
+    ASSERT_EQ(TimerWheel::pop_expired(&expired), nullptr);
+}
+
+TEST(TimerWheel, TimeoutBeyondRange) {
+    TimerWheel wheel(0);
+    TimerWheelEntry e{};
+    uint64_t deadline = 3 * TimerWheel::MAX_TIMEOUT;
+    wheel.add(&e, deadline);
+    ASSERT_TRUE(advance(wheel, deadline - 1).empty());
+    ASSERT_TRUE(TimerWheel::is_pending(&e));
+    std::optional<uint64_t> next = wheel.next_expiry();
+    ASSERT_TRUE(next.has_value());
+    ASSERT_EQ(advance(wheel, next.value()), std::vector<TimerWheelEntry *>{&e});
+}
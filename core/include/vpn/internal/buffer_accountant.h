@@ -0,0 +1,137 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ag {
+
+/** Kinds of the buffered data the memory budget is shared by */
+enum BufferSubsystem {
+    BS_CONNECTION_BUFFERS, // data waiting for a peer of a connection to read it
+    BS_SPILL_EXTENTS,      // extents of the spill file which are held in memory
+    BS_TUNNEL_PACKETS,     // packets held by the tunnel while a connection is being set up or migrated
+    BS_DNS_PENDING,        // DNS messages waiting for the connection to a resolver
+    BS_COUNT,
+};
+
+/**
+ * Process-wide accounting of the memory held by the buffers against a budget. The buffers charge what
+ * they allocate and discharge what they free, from any thread.
+ *
+ * Once the usage passes `PRESSURE_PERCENT` of the budget the buffers are under pressure: the spilling buffers
+ * stop taking memory, and the flow control windows shrink. Once the budget is exhausted, the reads stop
+ * after each send, the idle buffers larger than the average get spilled, and the UDP packets get dropped
+ * instead of being queued.
+ */
+class BufferAccountant {
+public:
+    static constexpr size_t PRESSURE_PERCENT = 75;
+    /** The smallest flow control window under pressure, so that the connections keep going */
+    static constexpr size_t MIN_WINDOW = 64 * 1024;
+
+    static BufferAccountant &instance();
+
+    /** Set the budget in bytes, 0 means unlimited */
+    void set_budget(size_t budget) {
+        m_budget.store(budget, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] size_t budget() const {
+        return m_budget.load(std::memory_order_relaxed);
+    }
+
+    void charge(BufferSubsystem subsystem, size_t size) {
+        m_usage[subsystem].fetch_add(size, std::memory_order_relaxed);
+        m_total.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void discharge(BufferSubsystem subsystem, size_t size) {
+        m_usage[subsystem].fetch_sub(size, std::memory_order_relaxed);
+        m_total.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    /** Count a buffer which has started holding memory */
+    void add_holder(BufferSubsystem subsystem) {
+        m_holders[subsystem].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /** Count a buffer which has stopped holding memory */
+    void remove_holder(BufferSubsystem subsystem) {
+        m_holders[subsystem].fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] size_t usage(BufferSubsystem subsystem) const {
+        return m_usage[subsystem].load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] size_t total() const {
+        return m_total.load(std::memory_order_relaxed);
+    }
+
+    /** Average memory held by a buffer of the subsystem, among the ones which hold any */
+    [[nodiscard]] size_t average_usage(BufferSubsystem subsystem) const;
+
+    /** Check if the usage approaches the budget */
+    [[nodiscard]] bool under_pressure() const;
+
+    /** Check if the usage reached the budget */
+    [[nodiscard]] bool exhausted() const;
+
+    /**
+     * Shrink a flow control window in proportion to the budget left above the pressure level,
+     * down to `MIN_WINDOW`
+     */
+    [[nodiscard]] size_t limit_window(size_t window) const;
+
+private:
+    std::array<std::atomic<size_t>, BS_COUNT> m_usage{};
+    std::array<std::atomic<size_t>, BS_COUNT> m_holders{};
+    std::atomic<size_t> m_total = 0;
+    std::atomic<size_t> m_budget = 0;
+};
+
+/**
+ * Allocator which charges the allocated memory to a subsystem
+ */
+template <typename T, BufferSubsystem S>
+class AccountedAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AccountedAllocator<U, S>;
+    };
+
+    AccountedAllocator() noexcept = default;
+
+    template <typename U>
+    AccountedAllocator(const AccountedAllocator<U, S> &) noexcept { // NOLINT(*-explicit-constructor)
+    }
+
+    T *allocate(size_t n) {
+        T *p = std::allocator<T>{}.allocate(n);
+        BufferAccountant::instance().charge(S, n * sizeof(T));
+        return p;
+    }
+
+    void deallocate(T *p, size_t n) noexcept {
+        BufferAccountant::instance().discharge(S, n * sizeof(T));
+        std::allocator<T>{}.deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const AccountedAllocator<U, S> &) const noexcept {
+        return true;
+    }
+};
+
+/** Byte vector charged to a subsystem */
+template <BufferSubsystem S>
+using AccountedBytes = std::vector<uint8_t, AccountedAllocator<uint8_t, S>>;
+
+} // namespace ag
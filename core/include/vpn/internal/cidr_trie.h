@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "common/cidr_range.h"
+#include "common/utils.h"
+#include "vpn/internal/flat_buffer.h"
+
+namespace ag {
+
+/**
+ * Immutable set of CIDR ranges compiled into a multibit trie with 8-bit strides, one for each address family.
+ * A node keeps two 256-bit maps indexed by the next address byte: the bytes which complete a range
+ * and the bytes which have a child node. The children of a node are contiguous, so a child is found
+ * by counting the set bits below the byte (as in poptrie). Thus a lookup visits at most one node
+ * per address byte and does not allocate.
+ *
+ * The trie does not own the nodes: it is a view of the ones written by `build`, which may be in memory
+ * or in a mapped file.
+ */
+class CidrTrie {
+public:
+    /** An empty trie */
+    CidrTrie() = default;
+
+    /**
+     * Compile the ranges, the invalid ones are ignored
+     * @param out receives the compiled trie
+     */
+    static void build(std::span<const CidrRange> ranges, FlatBufferWriter &out);
+
+    /**
+     * Make a trie over the data written by `build`. The data must outlive the trie. Only the layout
+     * is checked here, the lookups in a damaged trie stay within the data but may give wrong results.
+     * @return nullopt if the data is truncated
+     */
+    static std::optional<CidrTrie> view(FlatBufferReader &in);
+
+    /**
+     * Check if an address belongs to any of the ranges
+     * @param address an IPv4 or IPv6 address in network byte order
+     */
+    [[nodiscard]] bool includes(Uint8View address) const;
+
+    /** Number of the ranges */
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+
+private:
+    struct Node {
+        std::array<uint64_t, 4> leaves;   // Bytes which complete a range
+        std::array<uint64_t, 4> children; // Bytes which continue to a child node
+        uint32_t first_child;
+        uint32_t reserved; // Makes the padding explicit, so that the compiled data is deterministic
+    };
+
+    struct Prefix {
+        std::array<uint8_t, 16> address; // The bits past the prefix length are zeroed
+        size_t length;
+    };
+
+    struct Tree {
+        std::span<const Node> nodes; // The first one is the root, empty if there are no ranges
+        bool includes_all = false;
+    };
+
+    Tree m_ipv4;
+    Tree m_ipv6;
+    size_t m_size = 0;
+
+    static void build_tree(std::vector<Prefix> &prefixes, FlatBufferWriter &out);
+    static void build_node(std::vector<Node> &nodes, uint32_t node, size_t depth, std::span<const Prefix> prefixes);
+    static std::optional<Tree> view_tree(FlatBufferReader &in);
+    static bool includes(const Tree &tree, Uint8View address);
+};
+
+} // namespace ag
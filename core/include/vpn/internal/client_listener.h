@@ -55,6 +55,8 @@ struct ClientRead {
      * may retry later or drop the packet.
      */
     int result;
+    /** Owner of the data buffer, may be referenced to keep the data after the event (null if may not) */
+    const VpnBufferRef *buffer = nullptr;
 };
 
 struct ClientDataSentEvent {
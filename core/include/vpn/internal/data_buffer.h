@@ -2,6 +2,7 @@
 
 #include <cstdlib>
 #include <optional>
+#include <span>
 #include <string>
 
 #include "vpn/internal/utils.h"
@@ -13,6 +14,14 @@ struct BufferPeekResult {
     U8View data;                    // peeked data chunk
 };
 
+struct BufferPeekIovResult {
+    std::optional<std::string> err; // nullopt if successful, some error description otherwise
+    size_t count;                   // number of filled segments
+};
+
+/** Number of segments enough for `DataBuffer::peek_iov` to return a typical pending data amount at once */
+static constexpr size_t DATA_BUFFER_PEEK_SEGMENTS = 16;
+
 class DataBuffer {
 public:
     DataBuffer() = default;
@@ -42,6 +51,13 @@ public:
      */
     virtual BufferPeekResult peek() = 0;
 
+    /**
+     * Peek several consecutive data chunks from buffer (may be less than the buffer size).
+     * Like `peek`, does not advance the buffer.
+     * @param segments receives the chunks, the first one is the chunk `peek` would return
+     */
+    virtual BufferPeekIovResult peek_iov(std::span<U8View> segments) = 0;
+
     /**
      * Remove data from buffer
      * @param length data length to remove
@@ -2,6 +2,8 @@
 
 #include <bitset>
 #include <chrono>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <string_view>
@@ -51,16 +53,63 @@ public:
     DomainFilter(DomainFilter &&) = delete;
     DomainFilter &operator=(DomainFilter &&) = delete;
 
+    /**
+     * Immutable snapshot of the parsed and compiled exclusions. The filter matches against the installed
+     * snapshot, so a new one may be built on any thread while the current one is in use.
+     */
+    struct Exclusions;
+
     static DomainFilterValidationStatus validate_entry(std::string_view entry);
 
     /**
-     * Update current filtering settings
-     * @param vpn VPN client
+     * Update current filtering settings. Same as `set_exclusions(build_exclusions(mode, exclusions))`.
      * @param mode the VPN mode
      * @return true if updated successfully, false otherwise
      */
     bool update_exclusions(VpnMode mode, std::string_view exclusions);
 
+    /**
+     * Parse and compile the exclusions into a new snapshot. May be called from any thread.
+     * @param mode the VPN mode
+     * @param exclusions the exclusions list (see `VpnSettings.exclusions`)
+     */
+    std::shared_ptr<const Exclusions> build_exclusions(VpnMode mode, std::string_view exclusions);
+
+    /**
+     * Make a new snapshot from the latest built one with some entries added and some removed,
+     * without parsing the rest of the entries again. May be called from any thread.
+     * Removing a domain entry removes only its kind of matching, e.g. removing `*.example.com`
+     * keeps `example.com` if it has been added.
+     * @param added the entries to add in the `VpnSettings.exclusions` syntax
+     * @param removed the entries to remove in the `VpnSettings.exclusions` syntax
+     */
+    std::shared_ptr<const Exclusions> build_exclusions_update(std::string_view added, std::string_view removed);
+
+    /**
+     * Map a file written by `save_exclusions` as a new snapshot instead of parsing the list. The matching
+     * runs over the mapped data, so neither the load time nor the memory use depend on the list size.
+     * May be called from any thread.
+     * @param mode the VPN mode
+     * @param path the file path
+     * @return null if the file can't be mapped or is not a valid exclusions file
+     */
+    std::shared_ptr<const Exclusions> load_exclusions(VpnMode mode, const std::string &path);
+
+    /**
+     * Write a snapshot to a file for `load_exclusions`. The data goes to a temporary file which then
+     * replaces the target, so a partially written file is never loaded. May be called from any thread.
+     * @return true if written successfully, false otherwise
+     */
+    bool save_exclusions(const Exclusions &exclusions, const std::string &path) const;
+
+    /**
+     * Install a snapshot. Must be called from the thread which does the matching.
+     * The previous snapshot is released once the last holder drops it. The snapshots built concurrently
+     * may arrive out of order, so a snapshot older than the installed one is dropped.
+     * @return true if installed, false if the snapshot is stale
+     */
+    bool set_exclusions(std::shared_ptr<const Exclusions> exclusions);
+
     /**
      * Match domain name against exclusion list. Logic of matching is explained in
      * `VpnSettings.exclusions` description.
@@ -92,7 +141,7 @@ public:
     void add_exclusion_suspect(const SocketAddress &addr, std::chrono::seconds ttl);
 
     /**
-     * Get list of the DNS-resolvable exclusions
+     * Get list of the DNS-resolvable exclusions. The names are valid until another snapshot is installed.
      */
     [[nodiscard]] std::vector<std::string_view> get_resolvable_exclusions() const;
 
@@ -111,15 +160,22 @@ private:
     struct DomainEntryMalformed {};
     using ParseResult = std::variant<SocketAddress, CidrRange, DomainEntryInfo, DomainEntryMalformed>;
 
-    VpnMode m_mode = VPN_MODE_GENERAL;
-    std::unordered_map<std::string, MatchFlagsSet> m_domains; // key - domain name / value - set of `MatchFlags`
-    std::unordered_set<SocketAddress> m_addresses;
-    ag::CidrRangeSet m_cidr_ranges;
+    std::shared_ptr<const Exclusions> m_exclusions;
+    std::mutex m_build_guard;
+    // The latest built snapshot which the incremental updates are based on, guarded by `m_build_guard`
+    std::shared_ptr<const Exclusions> m_latest_exclusions;
+    uint64_t m_last_generation = 0; // guarded by `m_build_guard`
     ag::LruTimeoutCache<ag::SockAddrTag, std::string> m_resolved_tags{DEFAULT_CACHE_SIZE, DEFAULT_TAG_TTL};
     ag::LruTimeoutCache<SocketAddress, uint8_t> m_exclusion_suspects{DEFAULT_CACHE_SIZE, DEFAULT_TAG_TTL};
     ag::Logger m_log{"DOMAIN_FILTER"};
 
     static ParseResult parse_entry(std::string_view entry);
+    // Call `f(const std::string &entry)` for each whitespace-separated entry
+    template <typename F>
+    static void for_each_entry(std::string_view exclusions, F &&f);
+    void add_entry(Exclusions &exclusions, std::string_view entry);
+    void remove_entry(Exclusions &exclusions, std::string_view entry);
+    static void compile(Exclusions &exclusions);
 };
 
 } // namespace ag
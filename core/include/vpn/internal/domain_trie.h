@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "vpn/internal/flat_buffer.h"
+
+namespace ag {
+
+/**
+ * Immutable set of domain names with a set of flags per name, compiled into a trie of the labels
+ * in the reversed order (`com` -> `example` -> `www`). The nodes and the label bytes live in flat arrays,
+ * and the children of all the nodes are found through a single open-addressing table keyed on
+ * the parent node and the label hash. So matching a name walks it once from the end, costs a table probe
+ * per label and does not allocate.
+ *
+ * The trie does not own the arrays: it is a view of the ones written by `build`, which may be in memory
+ * or in a mapped file.
+ */
+class DomainTrie {
+public:
+    using Flags = uint32_t;
+
+    /** An empty trie */
+    DomainTrie() = default;
+
+    /**
+     * Compile the names
+     * @param domains the names with their flags, the names must be unique
+     * @param out receives the compiled trie
+     */
+    static void build(const std::vector<std::pair<std::string_view, Flags>> &domains, FlatBufferWriter &out);
+
+    /**
+     * Make a trie over the data written by `build`. The data must outlive the trie. Only the layout
+     * is checked here, the lookups in a damaged trie stay within the data but may give wrong results.
+     * @return nullopt if the data is truncated
+     */
+    static std::optional<DomainTrie> view(FlatBufferReader &in);
+
+    /**
+     * Call `f(size_t suffix_length, Flags flags)` for each suffix of `domain` which starts with a label
+     * and is present in the trie with non-empty flags, from the shortest to the longest.
+     * The walk stops if `f` returns true.
+     * @return true if stopped by `f`
+     */
+    template <typename F>
+    bool match_suffixes(std::string_view domain, F &&f) const {
+        uint32_t parent = ROOT;
+        size_t end = domain.size();
+        while (true) {
+            size_t dot = (end == 0) ? std::string_view::npos : domain.rfind('.', end - 1);
+            size_t begin = (dot == std::string_view::npos) ? 0 : dot + 1;
+            uint32_t node = find_child(parent, domain.substr(begin, end - begin));
+            if (node == ROOT) {
+                return false;
+            }
+            if (Flags flags = m_nodes[node].flags; flags != 0 && f(domain.size() - begin, flags)) {
+                return true;
+            }
+            if (dot == std::string_view::npos) {
+                return false;
+            }
+            parent = node;
+            end = dot;
+        }
+    }
+
+    /** Number of the names */
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return m_size == 0;
+    }
+
+private:
+    // The root node has no label, so its index doubles as "not found" and as an empty table slot
+    static constexpr uint32_t ROOT = 0;
+
+    struct Node {
+        uint32_t parent;
+        uint32_t label_hash;
+        uint32_t label_offset;
+        uint32_t label_length;
+        Flags flags;
+    };
+
+    std::span<const Node> m_nodes;
+    std::span<const uint32_t> m_table; // Node indices, the size is a power of two
+    std::string_view m_labels;
+    size_t m_size = 0;
+
+    [[nodiscard]] uint32_t find_child(uint32_t parent, std::string_view label) const;
+};
+
+} // namespace ag
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "vpn/utils.h"
+
+namespace ag {
+
+static constexpr size_t FLAT_BUFFER_ALIGNMENT = 8;
+
+/**
+ * Appends plain values and arrays to a buffer, each one aligned to `FLAT_BUFFER_ALIGNMENT`, so that
+ * `FlatBufferReader` can access the arrays in place. The values are in the host byte order.
+ */
+class FlatBufferWriter {
+public:
+    explicit FlatBufferWriter(std::vector<uint8_t> &buffer)
+            : m_buffer(buffer) {
+    }
+
+    template <typename T>
+    void write(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        append(&value, sizeof(value));
+    }
+
+    /** Write the number of the elements followed by the elements */
+    template <typename T>
+    void write_array(std::span<const T> array) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write(uint64_t(array.size()));
+        append(array.data(), array.size_bytes());
+    }
+
+private:
+    std::vector<uint8_t> &m_buffer;
+
+    void append(const void *data, size_t size) {
+        size_t padding = (FLAT_BUFFER_ALIGNMENT - size % FLAT_BUFFER_ALIGNMENT) % FLAT_BUFFER_ALIGNMENT;
+        m_buffer.insert(m_buffer.end(), (const uint8_t *) data, (const uint8_t *) data + size);
+        m_buffer.insert(m_buffer.end(), padding, 0);
+    }
+};
+
+/**
+ * Reads the values and the arrays written by `FlatBufferWriter`. The arrays are not copied,
+ * they point into the data. The data must be aligned to `FLAT_BUFFER_ALIGNMENT`.
+ */
+class FlatBufferReader {
+public:
+    explicit FlatBufferReader(U8View data)
+            : m_data(data) {
+    }
+
+    template <typename T>
+    std::optional<T> read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const uint8_t *data = take(sizeof(T));
+        if (data == nullptr) {
+            return std::nullopt;
+        }
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    std::optional<std::span<const T>> read_array() {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= FLAT_BUFFER_ALIGNMENT);
+        std::optional<uint64_t> size = read<uint64_t>();
+        if (!size.has_value() || *size > m_data.size() / sizeof(T)) {
+            return std::nullopt;
+        }
+        const uint8_t *data = take(*size * sizeof(T));
+        if (data == nullptr) {
+            return std::nullopt;
+        }
+        return std::span<const T>{(const T *) data, size_t(*size)};
+    }
+
+    /** The data left */
+    [[nodiscard]] U8View rest() const {
+        return m_data;
+    }
+
+private:
+    U8View m_data;
+
+    // Return nullptr if there is not enough data
+    const uint8_t *take(size_t size) {
+        size_t padding = (FLAT_BUFFER_ALIGNMENT - size % FLAT_BUFFER_ALIGNMENT) % FLAT_BUFFER_ALIGNMENT;
+        if (size + padding > m_data.size()) {
+            return nullptr;
+        }
+        const uint8_t *data = m_data.data();
+        m_data.remove_prefix(size + padding);
+        return data;
+    }
+};
+
+} // namespace ag
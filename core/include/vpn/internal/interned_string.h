@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace ag {
+
+/**
+ * Immutable string kept in a process-wide pool: the equal strings share the storage, and a copy costs
+ * a pointer. The pool never shrinks, so it is meant for small sets of values, like application names.
+ */
+class InternedString {
+public:
+    InternedString() = default;
+    InternedString(std::string_view str); // NOLINT(*-explicit-constructor)
+
+    InternedString &operator=(std::string_view str) {
+        *this = InternedString(str);
+        return *this;
+    }
+
+    [[nodiscard]] const std::string &str() const {
+        static const std::string EMPTY;
+        return (m_str != nullptr) ? *m_str : EMPTY;
+    }
+
+    [[nodiscard]] const char *c_str() const {
+        return str().c_str();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return m_str == nullptr;
+    }
+
+    operator std::string_view() const { // NOLINT(*-explicit-constructor)
+        return str();
+    }
+
+private:
+    const std::string *m_str = nullptr;
+};
+
+} // namespace ag
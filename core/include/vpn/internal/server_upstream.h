@@ -147,6 +147,20 @@ public:
      */
     virtual ssize_t send(uint64_t id, const uint8_t *data, size_t length) = 0;
 
+    /**
+     * Send data through connection. An upstream queueing the data keeps a reference to the buffer
+     * instead of copying it. Falls back to `send` by default.
+     * @param id connection id
+     * @param data data to send
+     * @param length data length
+     * @param buffer owner of the data
+     * @return number of consumed bytes (< 0 in case of error)
+     */
+    virtual ssize_t send_by_reference(uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef &buffer) {
+        (void) buffer;
+        return send(id, data, length);
+    }
+
     /**
      * Notify server of client sent some data
      * @param id connection id
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+
+namespace ag {
+
+/**
+ * Allocator of equally sized records. The records are carved out of the chunks of `CHUNK_SIZE` bytes,
+ * so that they lie close to each other in memory and carry no per-allocation overhead. A chunk is given
+ * back to the system once all its records are freed, unless it is the only one with free space left.
+ * Thread-safe.
+ */
+class SlabAllocator {
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    struct Stats {
+        size_t records_in_use; // number of the allocated records
+        size_t chunks_num;     // number of the chunks taken from the system
+    };
+
+    explicit SlabAllocator(size_t record_size);
+    ~SlabAllocator();
+
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    SlabAllocator(SlabAllocator &&) noexcept = delete;
+    SlabAllocator &operator=(SlabAllocator &&) noexcept = delete;
+
+    /** Size of a record including the alignment padding */
+    [[nodiscard]] size_t record_size() const {
+        return m_record_size;
+    }
+
+    [[nodiscard]] size_t records_per_chunk() const {
+        return m_records_per_chunk;
+    }
+
+    /**
+     * Allocate a record
+     * @return null if the system is out of memory
+     */
+    [[nodiscard]] void *allocate();
+
+    /** Free a record allocated by this allocator */
+    void deallocate(void *ptr);
+
+    [[nodiscard]] Stats stats() const;
+
+private:
+    struct Chunk;
+
+    size_t m_record_size = 0;
+    size_t m_records_per_chunk = 0;
+    mutable std::mutex m_mutex;
+    Chunk *m_partial = nullptr; // chunks which have free records
+    size_t m_records_in_use = 0;
+    size_t m_chunks_num = 0;
+
+    void link(Chunk *chunk);
+    void unlink(Chunk *chunk);
+};
+
+} // namespace ag
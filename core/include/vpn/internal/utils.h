@@ -152,9 +152,9 @@ static inline constexpr bool starts_with(std::string_view str, std::string_view
 }
 
 /**
- * Contruct full path for connection buffer file
+ * Contruct full path for buffer spill file
  * @param base_path directory path
- * @param id connection id
+ * @param id file id
  */
 std::string make_buffer_file_path(const char *base_path, uint64_t id);
 
@@ -86,6 +86,7 @@ struct EndpointConnectionConfig {
     std::string password;
     IpVersionSet ip_availability;
     bool anti_dpi = false;
+    VpnQuicTransportConfig quic_transport{};
 };
 
 static constexpr const char *LOG_NAME = "VPNCLIENT";
@@ -126,6 +127,12 @@ public:
 
     void update_exclusions(VpnMode mode, std::string_view exclusions);
 
+    /**
+     * Install the exclusions built by `domain_filter`
+     * @return false if the snapshot is older than the installed one and has been dropped
+     */
+    bool update_exclusions(std::shared_ptr<const DomainFilter::Exclusions> exclusions);
+
     void reset_connections(int uid);
 
     void reset_connection(uint64_t id);
@@ -142,7 +149,7 @@ public:
 
     VpnConnectionStats get_connection_stats() const;
 
-    [[nodiscard]] std::unique_ptr<DataBuffer> make_buffer(uint64_t id) const;
+    [[nodiscard]] std::unique_ptr<DataBuffer> make_buffer() const;
 
     [[nodiscard]] bool may_send_icmp_request() const;
 
@@ -5,11 +5,15 @@
 #include <cstdint>
 #include <list>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "vpn/event_loop.h"
+#include "vpn/internal/buffer_accountant.h"
 #include "vpn/internal/domain_extractor.h"
+#include "vpn/internal/interned_string.h"
+#include "vpn/internal/slab_allocator.h"
 #include "vpn/internal/utils.h"
 #include "vpn/utils.h"
 
@@ -61,20 +65,42 @@ enum VpnConnectionFlags {
 class ClientListener;
 class ServerUpstream;
 
+/**
+ * State of the domain name lookup, which lives only while `CONNF_LOOKINGUP_DOMAIN` is set
+ */
+struct VpnConnectionLookup {
+    DomainExtractor domain_extractor;
+    int attempts_num = 0;
+};
+
+/**
+ * Packets of a connection waiting to be sent to the server side, which exist only if the connection
+ * has buffered something (a split Client Hello, a migration to another upstream)
+ */
+struct VpnConnectionBuffered {
+    std::list<AccountedBytes<BS_TUNNEL_PACKETS>> packets;
+    event_loop::AutoTaskId send_task;
+};
+
+/**
+ * Connection record. The records are allocated from a slab (see `SlabAllocator`), and the members
+ * which are needed only for a part of a connection's lifetime are allocated on demand.
+ */
 struct VpnConnection {
     uint64_t client_id = NON_ID;
     uint64_t server_id = NON_ID;
     std::weak_ptr<ClientListener> listener;
     std::weak_ptr<ServerUpstream> upstream;
-    VpnConnectionState state = CONNS_WAITING_ACTION;
     TunnelAddressPair addr;
+    VpnConnectionState state = CONNS_WAITING_ACTION;
     int proto = 0;
-    std::bitset<width_of<VpnConnectionFlags>()> flags;
     int uid = 0;
-    DomainExtractor domain_extractor;
-    DomainExtractorResult domain_extractor_result;
+    std::optional<VpnConnectAction> action;
+    std::bitset<width_of<VpnConnectionFlags>()> flags;
+    std::unique_ptr<VpnConnectionLookup> lookup;
+    std::unique_ptr<DomainExtractorResult> domain_extractor_result; // null until the domain lookup gives a result
     uint64_t migrating_client_id = NON_ID;
-    std::string app_name;
+    InternedString app_name;
     event_loop::AutoTaskId complete_connect_request_task;
     // This pair of counters is used to make it visible in the logs whether
     // any traffic has passed through the connection.
@@ -82,14 +108,17 @@ struct VpnConnection {
     // on the connections that have been routed through an endpoint.
     size_t incoming_bytes = 0;
     size_t outgoing_bytes = 0;
-    std::list<std::vector<uint8_t>> buffered_packets;
-    event_loop::AutoTaskId send_buffered_task;
-    int lookup_attempts_num = 0;
-    std::optional<VpnConnectAction> action;
+    std::unique_ptr<VpnConnectionBuffered> buffered;
     std::chrono::high_resolution_clock::time_point requested_at{};
 
     static VpnConnection *make(uint64_t client_id, TunnelAddressPair addr, int proto);
 
+    /** Get the usage of the connection records slab */
+    static SlabAllocator::Stats records_stats();
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
+
     VpnConnection(const VpnConnection &) = delete;
     VpnConnection(VpnConnection &&) = delete;
     VpnConnection &operator=(const VpnConnection &) = delete;
@@ -99,6 +128,22 @@ struct VpnConnection {
     virtual ~VpnConnection() = default;
     [[nodiscard]] SockAddrTag make_tag() const;
 
+    /** Get the domain lookup state, allocating it if needed */
+    VpnConnectionLookup &lookup_state();
+
+    /** Clear `CONNF_LOOKINGUP_DOMAIN` and free the domain lookup state */
+    void finish_domain_lookup();
+
+    /** Get the domain found by the lookup, empty if none */
+    [[nodiscard]] const std::string &found_domain() const;
+
+    /** Get the buffered packets state, allocating it if needed */
+    VpnConnectionBuffered &buffered_state();
+
+    [[nodiscard]] bool has_buffered_packets() const {
+        return this->buffered != nullptr && !this->buffered->packets.empty();
+    }
+
 protected:
     explicit VpnConnection(TunnelAddressPair);
 };
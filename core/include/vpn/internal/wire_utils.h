@@ -1,5 +1,6 @@
 #pragma once
 
+#include <bit>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
@@ -16,6 +17,23 @@ static constexpr size_t IPV4_ADDR_SIZE = 4;
 static constexpr size_t IPV6_ADDR_SIZE = 16;
 static constexpr size_t PADDED_IP_SIZE = IPV6_ADDR_SIZE;
 static constexpr size_t IPV4_6_SIZE_DIFF = IPV6_ADDR_SIZE - IPV4_ADDR_SIZE;
+static constexpr uint64_t VARINT_MAX = (uint64_t(1) << 62) - 1;
+
+/**
+ * Get the length of a QUIC variable-length integer (RFC 9000, section 16)
+ */
+static constexpr size_t varint_size(uint64_t val) {
+    if (val <= 63) {
+        return 1;
+    }
+    if (val <= 16383) {
+        return 2;
+    }
+    if (val <= 1073741823) {
+        return 4;
+    }
+    return 8;
+}
 
 class Writer {
 public:
@@ -50,6 +68,19 @@ public:
         m_buffer.remove_prefix(sizeof(val));
     }
 
+    void put_varint(uint64_t val) {
+        assert(val <= VARINT_MAX);
+        size_t size = varint_size(val);
+        assert(m_buffer.size() >= size);
+        auto *p = (uint8_t *) m_buffer.data();
+        for (size_t i = size; i > 0; --i) {
+            p[i - 1] = uint8_t(val);
+            val >>= 8;
+        }
+        p[0] |= uint8_t(std::countr_zero(size) << 6);
+        m_buffer.remove_prefix(size);
+    }
+
     void put_data(U8View d) {
         assert(m_buffer.size() >= d.size());
         memcpy((void *) m_buffer.data(), d.data(), d.size());
@@ -114,6 +145,22 @@ public:
         return ntohl(val);
     }
 
+    std::optional<uint64_t> get_varint() {
+        if (m_buffer.empty()) {
+            return std::nullopt;
+        }
+        size_t size = size_t(1) << (m_buffer[0] >> 6);
+        if (m_buffer.size() < size) {
+            return std::nullopt;
+        }
+        uint64_t val = m_buffer[0] & 0x3f;
+        for (size_t i = 1; i < size; ++i) {
+            val = (val << 8) | m_buffer[i];
+        }
+        m_buffer.remove_prefix(size);
+        return val;
+    }
+
     std::optional<SocketAddress> get_ip(int family) {
         size_t ip_size = (family == AF_INET) ? IPV4_ADDR_SIZE : IPV6_ADDR_SIZE;
         if (m_buffer.size() < ip_size) {
@@ -87,6 +87,12 @@ typedef struct {
     uint32_t mtu_size;
     /** Pcap file name */
     const char *pcap_filename;
+    /**
+     * Linux only: packets on `fd` are prefixed with `struct virtio_net_hdr`, i.e. the device is opened
+     * with `IFF_VNET_HDR` (see `VpnOsTunnel::is_vnet_hdr_enabled()`). Allows the device to exchange
+     * TCP super-packets of up to 64 KiB with the listener.
+     */
+    bool vnet_hdr;
 } VpnTunListenerConfig;
 
 /**
@@ -137,7 +143,10 @@ typedef struct {
 } VpnListenerConfig;
 
 typedef struct {
-    /** Number of parallel HTTP2 sessions. If 0, default value will be assigned. */
+    /**
+     * Maximum number of parallel HTTP2 sessions. If 0, default value will be assigned.
+     * The sessions are opened as the load grows or the existing ones get congested, and closed once idle.
+     */
     uint32_t connections_num;
 } VpnHttp2UpstreamConfig;
 
@@ -234,6 +243,11 @@ typedef struct {
     VpnUpstreamSessionRecoverySettings recovery;
     /** Enable anti-dpi measures */
     bool anti_dpi;
+    /**
+     * QUIC transport tuning (congestion control, flow control windows, etc.) applied to HTTP/3 connections.
+     * Zero-initialize to use the defaults.
+     */
+    VpnQuicTransportConfig quic_transport;
 } VpnUpstreamConfig;
 
 /**
@@ -495,12 +509,13 @@ typedef struct {
     const char *tmp_files_base_path;
     /**
      * Connection in-memory buffer size exceeding which causes storing incoming data in a file.
+     * The connections share a single file in the directory, which is written and read off the event loop.
      * If `tmp_files_base_path` is null, takes no effect. Otherwise, if equals 0,
      * `VPN_DEFAULT_CONN_MEMORY_BUFFER_THRESHOLD` will be used.
      */
     int conn_memory_buffer_threshold;
     /**
-     * Maximum size of file of a connection data buffer.
+     * Maximum size of the data of a connection buffer stored in the file.
      * If `tmp_files_base_path` is null, takes no effect. Otherwise, if equals 0,
      * `VPN_DEFAULT_MAX_CONN_BUFFER_FILE_SIZE` will be used.
      */
@@ -527,6 +542,13 @@ typedef struct {
      */
     VpnQosSettings qos_settings;
 #endif // __APPLE__ && TARGET_OS_IPHONE
+    /**
+     * Path to a file with the compiled exclusions (see `vpn_compile_exclusions`).
+     * If not null, it is used instead of `exclusions`. The file is mapped into memory and is not parsed,
+     * so the start time and the memory use do not depend on the list size.
+     * If the file can't be loaded, `exclusions` are used.
+     */
+    const char *exclusions_file;
 } VpnSettings;
 
 /**
@@ -674,12 +696,43 @@ WIN_EXPORT void vpn_complete_connect_request(Vpn *vpn, const VpnConnectionInfo *
 
 /**
  * Update the VPN exclusion settings. This also resets all client connections without restarting vpn client.
+ * The list is parsed on a background thread, the function does not wait for it. The updates are applied
+ * in the order of the calls.
  * @param vpn VPN client
  * @param mode the VPN mode
  * @param exclusions the exclusions list (see `VpnSettings.exclusions`)
  */
 WIN_EXPORT void vpn_update_exclusions(Vpn *vpn, VpnMode mode, ag::VpnStr exclusions);
 
+/**
+ * Add and remove some exclusions without passing the whole list again. The VPN mode is kept.
+ * This also resets all client connections, like `vpn_update_exclusions`.
+ * @param vpn VPN client
+ * @param added the exclusions to add (see `VpnSettings.exclusions`)
+ * @param removed the exclusions to remove (see `VpnSettings.exclusions`). Removing a domain entry
+ *                removes only its kind of matching, e.g. removing `*.example.com` keeps `example.com`.
+ */
+WIN_EXPORT void vpn_change_exclusions(Vpn *vpn, ag::VpnStr added, ag::VpnStr removed);
+
+/**
+ * Compile the exclusions into a file which can be passed to `vpn_update_exclusions_from_file`
+ * or `VpnSettings.exclusions_file`. The file is specific to the library version and the host byte order.
+ * @param exclusions the exclusions list (see `VpnSettings.exclusions`)
+ * @param path the file path, an existing file is replaced
+ * @return true if compiled successfully, false otherwise
+ */
+WIN_EXPORT bool vpn_compile_exclusions(ag::VpnStr exclusions, const char *path);
+
+/**
+ * Update the VPN exclusion settings from a file made by `vpn_compile_exclusions`.
+ * The file is mapped into memory, not parsed. Otherwise, same as `vpn_update_exclusions`.
+ * @param vpn VPN client
+ * @param mode the VPN mode
+ * @param path the file path
+ * @return true if the file is loaded successfully, false otherwise (the exclusions are not changed then)
+ */
+WIN_EXPORT bool vpn_update_exclusions_from_file(Vpn *vpn, VpnMode mode, const char *path);
+
 /**
  * Reset all connection with given application UID
  * @param vpn VPN client
@@ -748,6 +801,32 @@ typedef enum {
  */
 WIN_EXPORT VpnDnsUpstreamValidationStatus vpn_validate_dns_upstream(const char *address);
 
+/**
+ * Memory held by the buffered data of all the instances in the process, in bytes
+ */
+typedef struct {
+    size_t connection_buffers; // data waiting for a peer of a connection to read it
+    size_t spill_extents;      // data being spilled to or read back from the temporary files
+    size_t tunnel_packets;     // packets held while a connection is being set up or migrated
+    size_t dns_pending;        // DNS messages waiting for the connection to a resolver
+    size_t total;              // sum of the above
+    size_t budget;             // see `vpn_set_buffers_memory_budget`
+} VpnBuffersMemoryUsage;
+
+/**
+ * Set the process-wide budget of the memory for the buffered data.
+ * Approaching the budget, the instances shrink the flow control windows and spill the connection buffers
+ * to the temporary files (see `VpnSettings#tmp_files_base_path`). Having reached it, they pause reading
+ * from the clients until the sent data are acknowledged, and drop the UDP packets they would queue.
+ * @param budget the budget in bytes, 0 means unlimited (default)
+ */
+WIN_EXPORT void vpn_set_buffers_memory_budget(size_t budget);
+
+/**
+ * Get the memory held by the buffered data of all the instances in the process
+ */
+WIN_EXPORT VpnBuffersMemoryUsage vpn_get_buffers_memory_usage();
+
 /**
  * Return the event loop that the VPN instance is running in.
  * If the event loop has not been started yet or has already been stopped, return NULL.
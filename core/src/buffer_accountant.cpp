@@ -0,0 +1,41 @@
+#include "vpn/internal/buffer_accountant.h"
+
+#include <algorithm>
+
+namespace ag {
+
+BufferAccountant &BufferAccountant::instance() {
+    static BufferAccountant accountant;
+    return accountant;
+}
+
+size_t BufferAccountant::average_usage(BufferSubsystem subsystem) const {
+    size_t holders = m_holders[subsystem].load(std::memory_order_relaxed);
+    return (holders != 0) ? usage(subsystem) / holders : 0;
+}
+
+bool BufferAccountant::under_pressure() const {
+    size_t budget = this->budget();
+    return budget != 0 && total() >= budget / 100 * PRESSURE_PERCENT;
+}
+
+bool BufferAccountant::exhausted() const {
+    size_t budget = this->budget();
+    return budget != 0 && total() >= budget;
+}
+
+size_t BufferAccountant::limit_window(size_t window) const {
+    size_t budget = this->budget();
+    size_t pressure = budget / 100 * PRESSURE_PERCENT;
+    size_t total = this->total();
+    if (budget == 0 || total < pressure) {
+        return window;
+    }
+    if (total >= budget) {
+        return std::min(window, MIN_WINDOW);
+    }
+    uint64_t limited = uint64_t(window) * (budget - total) / (budget - pressure);
+    return std::min(window, std::max(size_t(limited), MIN_WINDOW));
+}
+
+} // namespace ag
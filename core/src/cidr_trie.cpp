@@ -0,0 +1,179 @@
+#include "vpn/internal/cidr_trie.h"
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <tuple>
+
+#include "common/net_utils.h"
+
+namespace ag {
+
+static constexpr size_t STRIDE_BITS = 8;
+
+static bool test_bit(const std::array<uint64_t, 4> &bits, uint8_t byte) {
+    return bits[byte / 64] & (uint64_t(1) << (byte % 64));
+}
+
+static void set_bit(std::array<uint64_t, 4> &bits, uint8_t byte) {
+    bits[byte / 64] |= uint64_t(1) << (byte % 64);
+}
+
+void CidrTrie::build(std::span<const CidrRange> ranges, FlatBufferWriter &out) {
+    std::vector<Prefix> ipv4;
+    std::vector<Prefix> ipv6;
+    for (const CidrRange &range : ranges) {
+        const Uint8Vector &address = range.get_address();
+        size_t length = range.get_prefix_len();
+        if (!range.valid() || (address.size() != IPV4_ADDRESS_SIZE && address.size() != IPV6_ADDRESS_SIZE)
+                || length > address.size() * CHAR_BIT) {
+            continue;
+        }
+        Prefix prefix{.address = {}, .length = length};
+        for (size_t i = 0; i * CHAR_BIT < length; ++i) {
+            size_t bits = std::min<size_t>(length - i * CHAR_BIT, CHAR_BIT);
+            prefix.address[i] = address[i] & uint8_t(0xff << (CHAR_BIT - bits));
+        }
+        (address.size() == IPV4_ADDRESS_SIZE ? ipv4 : ipv6).push_back(prefix);
+    }
+    out.write(uint64_t(ipv4.size() + ipv6.size()));
+    build_tree(ipv4, out);
+    build_tree(ipv6, out);
+}
+
+void CidrTrie::build_tree(std::vector<Prefix> &prefixes, FlatBufferWriter &out) {
+    std::vector<Node> nodes;
+    if (!prefixes.empty()) {
+        // Sorted prefixes sharing some first bytes are contiguous, so are the ones going to a child node
+        std::sort(prefixes.begin(), prefixes.end(), [](const Prefix &lhs, const Prefix &rhs) {
+            return std::tie(lhs.address, lhs.length) < std::tie(rhs.address, rhs.length);
+        });
+        nodes.push_back({});
+        build_node(nodes, 0, 0, prefixes);
+    }
+    out.write(uint64_t(!prefixes.empty() && prefixes.front().length == 0));
+    out.write_array<Node>(nodes);
+}
+
+// The prefixes share the first `depth` bytes. The ones not longer than `depth` bytes are already
+// accounted for by the parent nodes.
+void CidrTrie::build_node(std::vector<Node> &nodes, uint32_t node, size_t depth, std::span<const Prefix> prefixes) {
+    size_t begin_bits = depth * STRIDE_BITS;
+    size_t end_bits = begin_bits + STRIDE_BITS;
+
+    std::array<uint64_t, 4> leaves{};
+    for (const Prefix &prefix : prefixes) {
+        if (prefix.length <= begin_bits || prefix.length > end_bits) {
+            continue;
+        }
+        size_t first = prefix.address[depth];
+        size_t last = first + (size_t(1) << (end_bits - prefix.length)) - 1;
+        for (size_t byte = first; byte <= last; ++byte) {
+            set_bit(leaves, uint8_t(byte));
+        }
+    }
+
+    // Call `f(byte, prefixes)` for each group of the prefixes continuing to a child node
+    auto for_each_child = [&](auto &&f) {
+        for (size_t i = 0; i < prefixes.size();) {
+            if (prefixes[i].length <= end_bits) {
+                ++i;
+                continue;
+            }
+            uint8_t byte = prefixes[i].address[depth];
+            size_t j = i + 1;
+            while (j < prefixes.size() && prefixes[j].address[depth] == byte) {
+                ++j;
+            }
+            // A completed range covers everything below it
+            if (!test_bit(leaves, byte)) {
+                f(byte, prefixes.subspan(i, j - i));
+            }
+            i = j;
+        }
+    };
+
+    std::array<uint64_t, 4> children{};
+    for_each_child([&](uint8_t byte, std::span<const Prefix>) {
+        set_bit(children, byte);
+    });
+    auto first_child = uint32_t(nodes.size());
+    size_t children_num = 0;
+    for (uint64_t word : children) {
+        children_num += std::popcount(word);
+    }
+    nodes[node] = {leaves, children, first_child, 0};
+    nodes.resize(nodes.size() + children_num);
+
+    uint32_t child = first_child;
+    for_each_child([&](uint8_t, std::span<const Prefix> group) {
+        build_node(nodes, child++, depth + 1, group);
+    });
+}
+
+std::optional<CidrTrie> CidrTrie::view(FlatBufferReader &in) {
+    std::optional size = in.read<uint64_t>();
+    std::optional ipv4 = view_tree(in);
+    std::optional ipv6 = view_tree(in);
+    if (!size.has_value() || !ipv4.has_value() || !ipv6.has_value()) {
+        return std::nullopt;
+    }
+    CidrTrie trie;
+    trie.m_size = *size;
+    trie.m_ipv4 = *ipv4;
+    trie.m_ipv6 = *ipv6;
+    return trie;
+}
+
+std::optional<CidrTrie::Tree> CidrTrie::view_tree(FlatBufferReader &in) {
+    std::optional includes_all = in.read<uint64_t>();
+    std::optional nodes = in.read_array<Node>();
+    if (!includes_all.has_value() || !nodes.has_value()) {
+        return std::nullopt;
+    }
+    // The nodes are checked by the lookups (see `includes`), so that viewing a mapped file
+    // does not read all of it
+    return Tree{.nodes = *nodes, .includes_all = *includes_all != 0};
+}
+
+bool CidrTrie::includes(Uint8View address) const {
+    switch (address.size()) {
+    case IPV4_ADDRESS_SIZE:
+        return includes(m_ipv4, address);
+    case IPV6_ADDRESS_SIZE:
+        return includes(m_ipv6, address);
+    default:
+        return false;
+    }
+}
+
+bool CidrTrie::includes(const Tree &tree, Uint8View address) {
+    if (tree.includes_all) {
+        return true;
+    }
+    if (tree.nodes.empty()) {
+        return false;
+    }
+    const Node *node = &tree.nodes[0];
+    for (uint8_t byte : address) {
+        if (test_bit(node->leaves, byte)) {
+            return true;
+        }
+        if (!test_bit(node->children, byte)) {
+            return false;
+        }
+        size_t word = byte / 64;
+        size_t rank = std::popcount(node->children[word] & ((uint64_t(1) << (byte % 64)) - 1));
+        for (size_t i = 0; i < word; ++i) {
+            rank += std::popcount(node->children[i]);
+        }
+        // A lookup must not go out of the array whatever the data is
+        if (node->first_child >= tree.nodes.size() || rank >= tree.nodes.size() - node->first_child) {
+            return false;
+        }
+        node = &tree.nodes[node->first_child + rank];
+    }
+    return false;
+}
+
+} // namespace ag
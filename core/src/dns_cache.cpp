@@ -0,0 +1,190 @@
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+
+#include "net/dns_utils.h"
+
+namespace ag {
+
+static constexpr size_t DNS_HEADER_SIZE = 12;
+static constexpr uint8_t DNS_FLAG_TC = 0x02; // in the 3rd header byte
+static constexpr uint8_t DNS_FLAG_CD = 0x10; // in the 4th header byte
+static constexpr uint32_t EDNS_FLAG_DO = 0x8000; // in the OPT record TTL
+/** The UDP payload size a requester without EDNS accepts (RFC 1035) */
+static constexpr size_t DNS_UDP_DEFAULT_SIZE = 512;
+
+/** The OPT record of a message, if any */
+static std::optional<dns_utils::RecordView> find_opt(const dns_utils::MessageReader &reader) {
+    std::optional<dns_utils::RecordView> opt;
+    reader.for_each_record([&](const dns_utils::RecordView &record) {
+        if (record.type == LDNS_RR_TYPE_OPT) {
+            opt = record;
+        }
+    });
+    return opt;
+}
+
+/**
+ * The key is the route, the resolver, the DNSSEC flags and the question. The DO and CD flags are echoed
+ * in the responses, and change what a resolver answers.
+ */
+static std::optional<std::string> make_key(
+        DnsRoute route, std::string_view resolver, U8View message, const dns_utils::MessageReader &reader) {
+    if (reader.opcode() != LDNS_PACKET_QUERY || !reader.has_question()) {
+        return std::nullopt;
+    }
+    dns_utils::NameText name; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    reader.question_name(name);
+    uint16_t type = reader.question_type();
+    uint16_t rr_class = reader.question_class();
+    std::optional<dns_utils::RecordView> opt = find_opt(reader);
+    bool dnssec_ok = opt.has_value() && (opt->ttl & EDNS_FLAG_DO) != 0;
+    bool checking_disabled = (message[3] & DNS_FLAG_CD) != 0;
+
+    std::string key;
+    key.reserve(7 + resolver.size() + name.size);
+    key.push_back(char(route));
+    key.push_back(char(dnssec_ok));
+    key.push_back(char(checking_disabled));
+    key.append((const char *) &type, sizeof(type));
+    key.append((const char *) &rr_class, sizeof(rr_class));
+    key.append(resolver);
+    key.push_back('\0');
+    std::transform(name.data, name.data + name.size, std::back_inserter(key), [](char c) {
+        return (char) std::tolower((unsigned char) c);
+    });
+    return key;
+}
+
+static void write_ttl(uint8_t *message, const dns_utils::RecordView &record, uint32_t ttl) {
+    ttl = htonl(ttl);
+    // TTL is followed by the 2-byte record data length
+    std::memcpy(&message[record.rdata - 2 - sizeof(ttl)], &ttl, sizeof(ttl));
+}
+
+DnsCache::DnsCache(size_t max_entries)
+        : m_max_entries(max_entries) {
+}
+
+void DnsCache::store(DnsRoute route, std::string_view resolver, U8View response, SteadyClock::time_point now) {
+    if (response.size() > MAX_MESSAGE_SIZE) {
+        return;
+    }
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse(response);
+    if (!reader.has_value() || !reader->is_response() || reader->is_truncated()
+            || (reader->rcode() != LDNS_RCODE_NOERROR && reader->rcode() != LDNS_RCODE_NXDOMAIN)) {
+        return;
+    }
+    std::optional<std::string> key = make_key(route, resolver, response, *reader);
+    if (!key.has_value()) {
+        return;
+    }
+
+    // A negative response is cached for the TTL of the SOA record in the authority section
+    std::optional<uint32_t> ttl;
+    reader->for_each_record([&](const dns_utils::RecordView &record) {
+        if (record.type != LDNS_RR_TYPE_OPT) {
+            ttl = std::min(ttl.value_or(UINT32_MAX), record.ttl);
+        }
+    });
+    if (ttl.value_or(0) == 0) {
+        return;
+    }
+
+    auto [it, inserted] = m_entries.try_emplace(std::move(*key));
+    Entry &entry = it->second;
+    if (inserted) {
+        m_lru.push_front(it->first);
+        entry.lru_it = m_lru.begin();
+    } else {
+        m_lru.splice(m_lru.begin(), m_lru, entry.lru_it);
+    }
+    entry.message.assign(response.begin(), response.end());
+    entry.stored = now;
+    entry.ttl = std::min(Secs{*ttl}, MAX_TTL);
+    entry.expires = now + entry.ttl;
+    entry.refresh_deadline.reset();
+
+    while (m_entries.size() > m_max_entries) {
+        erase(m_entries.find(m_lru.back()));
+    }
+}
+
+DnsCache::LookupResult DnsCache::lookup(DnsRoute route, std::string_view resolver, U8View request, bool tcp,
+        bool serve_stale, std::vector<uint8_t> &response, SteadyClock::time_point now) {
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse(request);
+    std::optional<std::string> key;
+    if (reader.has_value() && !reader->is_response()) {
+        key = make_key(route, resolver, request, *reader);
+    }
+    auto it = key.has_value() ? m_entries.find(*key) : m_entries.end();
+    if (it != m_entries.end() && now >= it->second.expires + STALE_WINDOW) {
+        erase(it);
+        it = m_entries.end();
+    }
+    bool stale = it != m_entries.end() && now >= it->second.expires;
+    if (it == m_entries.end() || (stale && !serve_stale)) {
+        ++m_stats.misses;
+        return {LS_MISS, false};
+    }
+
+    Entry &entry = it->second;
+    ++entry.hits;
+    m_lru.splice(m_lru.begin(), m_lru, entry.lru_it);
+
+    bool refresh = false;
+    if (serve_stale && (!entry.refresh_deadline.has_value() || now >= *entry.refresh_deadline)) {
+        auto left = std::chrono::duration_cast<Secs>(entry.expires - now);
+        refresh = stale
+                || (entry.hits >= PREFETCH_MIN_HITS && left.count() * 100 < entry.ttl.count() * PREFETCH_TTL_PERCENT);
+    }
+    if (refresh) {
+        entry.refresh_deadline = now + REFRESH_TIMEOUT;
+        ++m_stats.prefetches;
+    }
+
+    ++(stale ? m_stats.stale_hits : m_stats.hits);
+    LookupResult result = {stale ? LS_STALE_HIT : LS_HIT, refresh};
+
+    response.assign(entry.message.begin(), entry.message.end());
+    std::memcpy(response.data(), request.data(), sizeof(uint16_t)); // ID
+    dns_utils::MessageReader cached = *dns_utils::MessageReader::parse({response.data(), response.size()});
+    // Keep the question exactly as it is asked, the names may differ in case only
+    if (size_t end = reader->question_end(); end == cached.question_end()) {
+        std::memcpy(&response[DNS_HEADER_SIZE], &request[DNS_HEADER_SIZE], end - DNS_HEADER_SIZE);
+    }
+
+    // A response the requester can't take over UDP is truncated to the question, so that it retries over TCP
+    std::optional<dns_utils::RecordView> opt = find_opt(*reader);
+    size_t max_size = std::max(DNS_UDP_DEFAULT_SIZE, opt.has_value() ? size_t(opt->rr_class) : 0);
+    if (!tcp && response.size() > max_size) {
+        response.resize(cached.question_end());
+        response[2] |= DNS_FLAG_TC;
+        std::memset(&response[6], 0, 3 * sizeof(uint16_t)); // ANCOUNT, NSCOUNT, ARCOUNT
+        return result;
+    }
+
+    auto elapsed = uint32_t(std::chrono::duration_cast<Secs>(now - entry.stored).count());
+    cached.for_each_record([&](const dns_utils::RecordView &record) {
+        if (record.type != LDNS_RR_TYPE_OPT) {
+            write_ttl(response.data(), record,
+                    stale ? uint32_t(STALE_TTL.count()) : record.ttl - std::min(record.ttl, elapsed));
+        }
+    });
+    return result;
+}
+
+void DnsCache::clear() {
+    m_entries.clear();
+    m_lru.clear();
+}
+
+void DnsCache::erase(std::unordered_map<std::string, Entry>::iterator it) {
+    m_lru.erase(it->second.lru_it);
+    m_entries.erase(it);
+}
+
+} // namespace ag
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "common/clock.h"
+#include "common/defs.h"
+
+namespace ag {
+
+/** The way a DNS query is resolved, see `DnsHandler` */
+enum DnsRoute {
+    DNS_ROUTE_PROXY,        /**< Through the DNS proxy with the user-configured upstreams */
+    DNS_ROUTE_SYSTEM_PROXY, /**< Through the "system" DNS proxy */
+    DNS_ROUTE_TUNNEL,       /**< To the original destination through the endpoint */
+};
+
+struct DnsCacheStats {
+    uint64_t hits;       /**< Number of queries answered with fresh entries */
+    uint64_t stale_hits; /**< Number of queries answered with expired entries */
+    uint64_t misses;     /**< Number of queries not answered from the cache */
+    uint64_t prefetches; /**< Number of refreshes requested ahead of or after expiry */
+};
+
+/**
+ * Cache of DNS responses keyed on the question, the route and the resolver the query takes, and the DNSSEC
+ * flags (DO and CD) of the query. A response larger than a UDP requester accepts is served truncated.
+ * Entries are kept for their minimal TTL (or the SOA one for negative responses, RFC 2308),
+ * after that they may be served stale for a while (RFC 8767), while being refreshed.
+ * Popular entries are refreshed ahead of expiry.
+ */
+class DnsCache {
+public:
+    static constexpr size_t DEFAULT_MAX_ENTRIES = 1024;
+    /** Responses larger than this are not cached */
+    static constexpr size_t MAX_MESSAGE_SIZE = 4096;
+    static constexpr auto MAX_TTL = Secs{3600};
+    /** How long an expired entry may be served */
+    static constexpr auto STALE_WINDOW = Secs{300};
+    /** TTL of the records in a response served from an expired entry */
+    static constexpr auto STALE_TTL = Secs{30};
+    /** An entry is refreshed ahead of expiry if it has been hit this many times... */
+    static constexpr uint32_t PREFETCH_MIN_HITS = 2;
+    /** ...and less than this percentage of its TTL is left */
+    static constexpr uint32_t PREFETCH_TTL_PERCENT = 10;
+    /** A refresh which has not brought a response in this time is considered lost */
+    static constexpr auto REFRESH_TIMEOUT = Secs{5};
+
+    enum LookupStatus {
+        LS_MISS,
+        LS_HIT,
+        LS_STALE_HIT,
+    };
+
+    struct LookupResult {
+        LookupStatus status;
+        /** If true, the caller should send the query on its own to refresh the entry */
+        bool refresh;
+    };
+
+    explicit DnsCache(size_t max_entries = DEFAULT_MAX_ENTRIES);
+
+    /**
+     * Store a response. Truncated, erroneous (except NXDOMAIN) and malformed responses are ignored.
+     * @param route the route the query has taken
+     * @param resolver the resolver the query has been sent to, empty if the route determines it
+     */
+    void store(DnsRoute route, std::string_view resolver, U8View response,
+            SteadyClock::time_point now = SteadyClock::now());
+
+    /**
+     * Look up a response to a query
+     * @param route the route the query would take
+     * @param resolver the resolver the query would be sent to, empty if the route determines it
+     * @param request the query
+     * @param tcp whether the query has come over TCP, otherwise the response is limited to the UDP payload
+     *            size the query advertises
+     * @param serve_stale whether an expired entry may be served and the entries may be refreshed
+     * @param response receives the cached response with the ID and the question of the query
+     *                 and the TTLs decreased by the time spent in the cache, or only the question with
+     *                 the TC flag if the response does not fit the UDP payload size
+     */
+    LookupResult lookup(DnsRoute route, std::string_view resolver, U8View request, bool tcp, bool serve_stale,
+            std::vector<uint8_t> &response, SteadyClock::time_point now = SteadyClock::now());
+
+    /** Drop all the entries */
+    void clear();
+
+    [[nodiscard]] DnsCacheStats get_stats() const {
+        return m_stats;
+    }
+
+private:
+    struct Entry {
+        std::vector<uint8_t> message;
+        SteadyClock::time_point stored;
+        SteadyClock::time_point expires;
+        Secs ttl;
+        uint32_t hits = 0;
+        std::optional<SteadyClock::time_point> refresh_deadline;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    size_t m_max_entries;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::list<std::string> m_lru; // The most recently used entry is the first
+    DnsCacheStats m_stats = {};
+
+    void erase(std::unordered_map<std::string, Entry>::iterator it);
+};
+
+} // namespace ag
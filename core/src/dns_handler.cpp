@@ -47,6 +47,11 @@ static void write_dns_message_to(std::vector<uint8_t> &out, ag::U8View message)
     out.insert(out.end(), message.data(), message.data() + ntohs(size));
 }
 
+static bool is_address_record(const ag::dns_utils::RecordView &record) {
+    return (record.type == LDNS_RR_TYPE_A && record.rdata_length == 4)
+            || (record.type == LDNS_RR_TYPE_AAAA && record.rdata_length == 16);
+}
+
 void ag::DnsHandlerServerUpstreamBase::notify_vpn_resolver_connection(uint64_t upstream_conn_id) {
     auto it = m_connections.find(upstream_conn_id);
     if (it == m_connections.end()) {
@@ -74,6 +79,11 @@ ag::DnsHandlerServerUpstreamBase::~DnsHandlerServerUpstreamBase() = default;
 void ag::DnsHandlerServerUpstreamBase::deinit() {
 }
 
+const ag::TunnelAddressPair *ag::DnsHandlerServerUpstreamBase::find_connection_addrs(uint64_t upstream_conn_id) const {
+    auto it = m_connections.find(upstream_conn_id);
+    return (it != m_connections.end()) ? &it->second.addrs : nullptr;
+}
+
 void ag::DnsHandlerServerUpstreamBase::send_response(uint64_t upstream_conn_id, U8View message) {
     auto it = m_connections.find(upstream_conn_id);
     if (it == m_connections.end()) {
@@ -346,7 +356,7 @@ uint64_t ag::DnsHandlerClientListenerBase::send_as_listener(
                 log_upstream(this, info, "Failed to send UDP {} ({}) -> {}: handler returned {}", info.addrs->src,
                         info.app_name, tunnel_addr_to_str(&info.addrs->dst), event.result);
             }
-        } else if (it->second.udp_pending.size() < MAX_UDP_QUEUE_SIZE) {
+        } else if (it->second.udp_pending.size() < MAX_UDP_QUEUE_SIZE && !BufferAccountant::instance().exhausted()) {
             it->second.udp_pending.emplace_back(message.begin(), message.end());
         } else {
             log_upstream(this, info, "Failed to send UDP {} ({}) -> {}: read disabled", info.addrs->src, info.app_name,
@@ -591,6 +601,7 @@ bool ag::DnsHandler::update_parameters(DnsHandlerParameters parameters) {
     }
     log_handler(this, dbg, "Restarting DNS proxy with new parameters");
     m_parameters = std::move(parameters);
+    m_cache.clear();
     return start_dns_proxy();
 }
 
@@ -775,7 +786,8 @@ void ag::DnsHandler::client_handler(std::unordered_map<uint16_t, uint64_t> &map,
         auto node = map.extract(event->id);
         assert(!node.empty());
         if (!event->data.empty()) {
-            on_dns_response(node.mapped(), event->data);
+            handle_response((&map == &m_upstream_conn_id_by_client_id) ? DNS_ROUTE_PROXY : DNS_ROUTE_SYSTEM_PROXY,
+                    /*resolver*/ "", node.mapped(), event->data);
         } else {
             log_handler(this, info, "{}DNS proxy request id={} failed",
                     &map == &m_upstream_conn_id_by_system_client_id                ? "System "
@@ -795,6 +807,7 @@ void ag::DnsHandler::client_handler(std::unordered_map<uint16_t, uint64_t> &map,
 void ag::DnsHandler::on_dns_change(void *arg) {
     auto *self = (DnsHandler *) arg;
     log_handler(self, info, "Restarting system DNS proxy");
+    self->m_cache.clear();
     self->start_system_dns_proxy();
 }
 
@@ -802,6 +815,7 @@ void ag::DnsHandler::on_network_change() {
     // System proxy has to be restarted with a new `outbound_interface`.
     // Assume `vpn_network_manager_set_outbound_interface` has been called before `vpn_notify_network_change`.
     log_handler(this, info, "Restarting system DNS proxy");
+    m_cache.clear();
     start_system_dns_proxy();
 }
 
@@ -827,12 +841,75 @@ void ag::DnsHandler::send_request(bool system_proxy, bool ipv6, bool tcp, uint64
     assert_use(placed);
 }
 
+void ag::DnsHandler::route_request(DnsRoute route, const ConnectionInfo &info, U8View message) {
+    bool ipv6 = std::holds_alternative<SocketAddress>(info.addrs->dst)
+            && std::get<SocketAddress>(info.addrs->dst).is_ipv6();
+    bool tcp = (info.proto == IPPROTO_TCP);
+
+    // The connections through the endpoint are initiated by the clients only,
+    // so such entries are neither served stale nor refreshed
+    std::string resolver = (route == DNS_ROUTE_TUNNEL) ? tunnel_addr_to_str(&info.addrs->dst) : "";
+    std::vector<uint8_t> cached;
+    DnsCache::LookupResult result
+            = m_cache.lookup(route, resolver, message, tcp, /*serve_stale*/ route != DNS_ROUTE_TUNNEL, cached);
+    if (result.refresh) {
+        log_handler(this, dbg, "{} refreshing cached response", info);
+        send_request(route == DNS_ROUTE_SYSTEM_PROXY, ipv6, tcp, NON_ID, message);
+    }
+    if (result.status != DnsCache::LS_MISS) {
+        log_handler(this, dbg, "{} answered from cache{}", info,
+                (result.status == DnsCache::LS_STALE_HIT) ? " (stale)" : "");
+        // Answer asynchronously as the request may be being handled inside `send()`
+        m_cached_answers.emplace_back(info.upstream_conn_id, std::move(cached));
+        if (!m_cached_answers_task.has_value()) {
+            m_cached_answers_task = event_loop::submit(
+                    ServerUpstream::vpn->parameters.ev_loop, {this, on_cached_answers_task});
+        }
+        return;
+    }
+
+    switch (route) {
+    case DNS_ROUTE_PROXY:
+        send_request(/*system proxy*/ false, ipv6, tcp, info.upstream_conn_id, message);
+        break;
+    case DNS_ROUTE_SYSTEM_PROXY:
+        send_request(/*system proxy*/ true, ipv6, tcp, info.upstream_conn_id, message);
+        break;
+    case DNS_ROUTE_TUNNEL:
+        send_request_as_listener(info, message);
+        break;
+    }
+}
+
+void ag::DnsHandler::on_cached_answers_task(void *arg, TaskId /*task_id*/) {
+    auto *self = (DnsHandler *) arg;
+    self->m_cached_answers_task.release();
+
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> answers;
+    answers.swap(self->m_cached_answers);
+    for (auto &[upstream_conn_id, message] : answers) {
+        // Hits affect the exclusions exactly like the live responses
+        U8View response = self->filter_response(upstream_conn_id, {message.data(), message.size()});
+        self->send_response(upstream_conn_id, response);
+    }
+}
+
+ag::DnsCacheStats ag::DnsHandler::get_cache_stats() const {
+    return m_cache.get_stats();
+}
+
 void ag::DnsHandler::send_request_as_listener(const ConnectionInfo &info, U8View message) {
     uint64_t listener_conn_id = send_as_listener(info, message);
     log_handler(this, dbg, "[L:{}] {}", listener_conn_id, info);
 }
 
 void ag::DnsHandler::shutdown() {
+    DnsCacheStats stats = m_cache.get_stats();
+    log_handler(this, dbg, "DNS cache: hits={} stale hits={} misses={} prefetches={}", stats.hits, stats.stale_hits,
+            stats.misses, stats.prefetches);
+    m_cached_answers_task.reset();
+    m_cached_answers.clear();
+    m_cache.clear();
     if (m_dns_change_subscription_id.has_value()) {
         dns_manager_unsubscribe_servers_change(
                 ServerUpstream::vpn->parameters.network_manager->dns, *m_dns_change_subscription_id);
@@ -857,79 +934,121 @@ void ag::DnsHandler::shutdown() {
 }
 
 void ag::DnsHandler::on_dns_request(const ConnectionInfo &info, U8View message) {
-    auto decode_result = dns_utils::decode_packet(message);
-
-    if (auto *error = std::get_if<dns_utils::Error>(&decode_result)) {
-        log_handler(this, info, "{} dropping unparseable DNS request, error: {}", info, error->description);
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse(message);
+    if (!reader.has_value()) {
+        log_handler(this, info, "{} dropping unparseable DNS request", info);
         return;
     }
 
-    // Note: now obsolete inverse queries (RFC 1035) will result in `dns_utils::InapplicablePacket`.
+    // Note: now obsolete inverse queries (RFC 1035) have no question.
     // The DNS proxy doesn't support them.
-    if (!std::holds_alternative<dns_utils::DecodedRequest>(decode_result)) {
+    if (reader->is_response() || !reader->has_question()) {
         send_request_as_listener(info, message);
         return;
     }
 
-    auto &request = std::get<dns_utils::DecodedRequest>(decode_result);
-    bool ipv6 = std::holds_alternative<SocketAddress>(info.addrs->dst)
-            && std::get<SocketAddress>(info.addrs->dst).is_ipv6();
-    bool tcp = (info.proto == IPPROTO_TCP);
+    dns_utils::NameText name; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    reader->question_name(name);
 
     if (!ServerUpstream::vpn->tunnel->endpoint_upstream_connected) {
         if (!ServerUpstream::vpn->kill_switch_on) {
-            log_handler(this, dbg, "{} qname: {} -> system DNS proxy (not connected)", info, request.name);
-            send_request(/*system proxy*/ true, ipv6, tcp, info.upstream_conn_id, message);
+            log_handler(this, dbg, "{} qname: {} -> system DNS proxy (not connected)", info, name.view());
+            route_request(DNS_ROUTE_SYSTEM_PROXY, info, message);
             return;
         }
-        if (vpn_network_manager_check_app_request_domain(request.name.c_str())) {
-            log_handler(this, dbg, "{} qname: {} -> system DNS proxy (not connected, app request)", info, request.name);
-            send_request(/*system proxy*/ true, ipv6, tcp, info.upstream_conn_id, message);
+        if (vpn_network_manager_check_app_request_domain(name.c_str())) {
+            log_handler(this, dbg, "{} qname: {} -> system DNS proxy (not connected, app request)", info, name.view());
+            route_request(DNS_ROUTE_SYSTEM_PROXY, info, message);
             return;
         }
-        log_handler(this, dbg, "{} qname: {} dropped: not connected, kill switch enabled", info, request.name);
+        log_handler(this, dbg, "{} qname: {} dropped: not connected, kill switch enabled", info, name.view());
         return;
     }
 
-    DomainFilterMatchStatus status = ServerUpstream::vpn->domain_filter.match_domain(request.name);
+    DomainFilterMatchStatus status = ServerUpstream::vpn->domain_filter.match_domain(name.view());
     bool included = (ServerUpstream::vpn->exclusions_mode == VPN_MODE_GENERAL) ? (status == DFMS_DEFAULT)
                                                                                : (status == DFMS_EXCLUSION);
 
     if (included && m_client) {
-        log_handler(this, dbg, "{} qname: {} -> DNS proxy", info, request.name);
-        send_request(/*system proxy*/ false, ipv6, tcp, info.upstream_conn_id, message);
+        log_handler(this, dbg, "{} qname: {} -> DNS proxy", info, name.view());
+        route_request(DNS_ROUTE_PROXY, info, message);
     } else if (!included) {
-        log_handler(this, dbg, "{} qname: {} -> system DNS proxy", info, request.name);
-        send_request(/*system proxy*/ true, ipv6, tcp, info.upstream_conn_id, message);
+        log_handler(this, dbg, "{} qname: {} -> system DNS proxy", info, name.view());
+        route_request(DNS_ROUTE_SYSTEM_PROXY, info, message);
     } else {
-        log_handler(this, dbg, "{} qname: {} -> {}", info, request.name, tunnel_addr_to_str(&info.addrs->dst));
-        send_request_as_listener(info, message);
+        log_handler(this, dbg, "{} qname: {} -> {}", info, name.view(), tunnel_addr_to_str(&info.addrs->dst));
+        route_request(DNS_ROUTE_TUNNEL, info, message);
     }
 }
 
 void ag::DnsHandler::on_dns_response(uint64_t upstream_conn_id, U8View message) {
-    dns_utils::LdnsBufferPtr pkt_buffer;
-    auto decode_result = dns_utils::decode_packet(message);
-    if (auto *response = std::get_if<dns_utils::DecodedReply>(&decode_result)) {
-        if (std::ranges::any_of(response->names, [&](const std::string &name) {
-                return DFMS_EXCLUSION == ServerUpstream::vpn->domain_filter.match_domain(name);
-            })) {
-            // Add exclusion suspects.
-            for (const auto &addr : response->addresses) {
-                ServerUpstream::vpn->domain_filter.add_exclusion_suspect(
-                        SocketAddress({addr.ip.data(), addr.ip.size()}, 0),
-                        is_vpn_resolver_connection(upstream_conn_id)
-                                ? std::max(addr.ttl, Tunnel::EXCLUSIONS_RESOLVE_PERIOD)
-                                : addr.ttl);
+    // The resolver is the original destination of the query
+    const TunnelAddressPair *addrs = find_connection_addrs(upstream_conn_id);
+    if (addrs == nullptr) {
+        log_handler(this, dbg, "Dropping DNS response: connection R:{} does not exist", upstream_conn_id);
+        return;
+    }
+    handle_response(DNS_ROUTE_TUNNEL, tunnel_addr_to_str(&addrs->dst), upstream_conn_id, message);
+}
+
+void ag::DnsHandler::handle_response(
+        DnsRoute route, std::string_view resolver, uint64_t upstream_conn_id, U8View message) {
+    m_cache.store(route, resolver, message);
+    if (upstream_conn_id != NON_ID) {
+        send_response(upstream_conn_id, filter_response(upstream_conn_id, message));
+    }
+}
+
+ag::U8View ag::DnsHandler::filter_response(uint64_t upstream_conn_id, U8View message) {
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse(message);
+    if (reader.has_value() && reader->is_response() && reader->rcode() == LDNS_RCODE_NOERROR
+            && reader->has_question()) {
+        DomainFilter &filter = ServerUpstream::vpn->domain_filter;
+        dns_utils::NameText name; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        auto is_excluded = [&](size_t offset) {
+            reader->read_name(offset, name);
+            return DFMS_EXCLUSION == filter.match_domain(name.view());
+        };
+        bool excluded = false;
+        bool has_svcparams = false;
+        reader->for_each_answer([&](const dns_utils::RecordView &record) {
+            switch (record.type) {
+            case LDNS_RR_TYPE_A:
+            case LDNS_RR_TYPE_AAAA:
+                excluded = excluded || (is_address_record(record) && is_excluded(record.owner));
+                break;
+            case LDNS_RR_TYPE_CNAME:
+                // ignoring TTL of CNAMEs for simplicity
+                excluded = excluded
+                        || (record.rdata_length > 0 && (is_excluded(record.owner) || is_excluded(record.rdata)));
+                break;
+            case LDNS_RR_TYPE_HTTPS:
+            case LDNS_RR_TYPE_SVCB:
+                has_svcparams = true;
+                excluded = excluded || is_excluded(record.owner);
+                break;
+            default:
+                break;
             }
-            // Remove ECH parameters.
-            if (dns_utils::remove_svcparam_echconfig(response->pkt.get())) {
-                pkt_buffer = dns_utils::encode_pkt(response->pkt.get());
-                if (pkt_buffer) {
-                    message = {ldns_buffer_at(pkt_buffer.get(), 0), ldns_buffer_position(pkt_buffer.get())};
+        });
+
+        if (excluded) {
+            // Add exclusion suspects.
+            bool resolver = is_vpn_resolver_connection(upstream_conn_id);
+            reader->for_each_answer([&](const dns_utils::RecordView &record) {
+                if (is_address_record(record)) {
+                    auto ttl = std::chrono::seconds(record.ttl);
+                    filter.add_exclusion_suspect(SocketAddress(reader->rdata(record), 0),
+                            resolver ? std::max(ttl, Tunnel::EXCLUSIONS_RESOLVE_PERIOD) : ttl);
                 }
-            }
+            });
+        }
+        if (excluded && has_svcparams) {
+            // Remove ECH parameters.
+            m_response_buffer.assign(message.begin(), message.end());
+            size_t length = dns_utils::remove_svcparam_echconfig(std::span{m_response_buffer});
+            message = {m_response_buffer.data(), length};
         }
     }
-    send_response(upstream_conn_id, message);
+    return message;
 }
@@ -6,15 +6,18 @@
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "common/socket_address.h"
 #include "net/dns_manager.h"
 #include "vpn/event_loop.h"
+#include "vpn/internal/buffer_accountant.h"
 #include "vpn/internal/client_listener.h"
 #include "vpn/internal/dns_proxy_accessor.h"
 #include "vpn/internal/server_upstream.h"
 
+#include "dns_cache.h"
 #include "dns_client.h"
 
 /*
@@ -83,6 +86,10 @@
   DnsHandler is also responsible for parsing DNS responses and performing actions based on their content,
   such as adding exclusion suspects (see `DomainFilter::add_exclusion_suspect()`) or removing ECH parameters
   from HTTPS/SVCB RRs if the domain is in the domain exclusions list.
+
+  The responses are cached per question and route (see `DnsCache`). A query answered from the cache is not forwarded
+  anywhere, but the cached response is handled exactly like a live one. The entries for the queries sent through
+  the DNS proxies are served stale for a while after expiry and refreshed by DnsHandler itself.
 */
 
 namespace ag {
@@ -115,6 +122,8 @@ protected:
     virtual void on_dns_request(const ConnectionInfo &info, U8View message) = 0;
 
     void send_response(uint64_t upstream_conn_id, U8View message);
+    // Return the addresses of a connection, null if it does not exist.
+    [[nodiscard]] const TunnelAddressPair *find_connection_addrs(uint64_t upstream_conn_id) const;
 
 private:
     bool open_session(std::optional<Millis> timeout) final;
@@ -192,9 +201,10 @@ private:
         uint64_t upstream_conn_id;
         int proto;
         bool read_enabled;
-        std::vector<uint8_t> rcv_buf;                // TCP connections only.
-        std::vector<uint8_t> snd_buf;                // TCP connections only.
-        std::list<std::vector<uint8_t>> udp_pending; // UDP payloads waiting for connect request completion.
+        std::vector<uint8_t> rcv_buf; // TCP connections only.
+        std::vector<uint8_t> snd_buf; // TCP connections only.
+        // UDP payloads waiting for connect request completion.
+        std::list<AccountedBytes<BS_DNS_PENDING>> udp_pending;
 
         Connection(uint64_t listener_conn_id, uint64_t upstream_conn_id, int proto);
     };
@@ -238,6 +248,9 @@ public:
 
     void on_network_change();
 
+    /** Get the counters of the DNS response cache */
+    [[nodiscard]] DnsCacheStats get_cache_stats() const;
+
 private:
     DnsHandlerParameters m_parameters;
 
@@ -256,6 +269,12 @@ private:
     std::unordered_map<uint16_t, uint64_t> m_upstream_conn_id_by_system_client_id;
     std::unordered_map<uint16_t, uint64_t> m_upstream_conn_id_by_system_client_ipv6_id;
 
+    std::vector<uint8_t> m_response_buffer; // Reused for the responses modified before sending to client
+
+    DnsCache m_cache;
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> m_cached_answers; // Upstream connection ID, response.
+    event_loop::AutoTaskId m_cached_answers_task;
+
     bool start_dns_proxy();
     bool start_system_dns_proxy();
 
@@ -269,6 +288,9 @@ private:
 
     void on_upstream_connection_closed(uint64_t upstream_conn_id) override;
 
+    // Answer from the cache or send the request the way `route` says.
+    void route_request(DnsRoute route, const ConnectionInfo &info, U8View message);
+    // `upstream_conn_id` is `NON_ID` for the requests refreshing the cache.
     void send_request(bool system_proxy, bool ipv6, bool tcp, uint64_t upstream_conn_id, U8View message);
     void send_request_as_listener(const ConnectionInfo &info, U8View message);
 
@@ -276,6 +298,13 @@ private:
 
     void on_dns_request(const ConnectionInfo &info, U8View message) override;
     void on_dns_response(uint64_t upstream_conn_id, U8View message) override;
+
+    // Cache the response and send it to the client, if any. `resolver` is empty unless the route is the tunnel.
+    void handle_response(DnsRoute route, std::string_view resolver, uint64_t upstream_conn_id, U8View message);
+    // Update the exclusion suspects and strip ECH parameters as the response says. Return the message to send.
+    U8View filter_response(uint64_t upstream_conn_id, U8View message);
+
+    static void on_cached_answers_task(void *arg, TaskId task_id);
 };
 
 } // namespace ag
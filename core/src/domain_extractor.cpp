@@ -5,7 +5,7 @@
 #include <string_view>
 #include <vector>
 
-#include "net/quic_utils.h"
+#include "net/sni_extractor.h"
 #include "net/tls.h"
 #include "vpn/internal/utils.h"
 
@@ -13,39 +13,29 @@ namespace ag {
 
 struct Parser { // NOLINT(cppcoreguidelines-special-member-functions,hicpp-special-member-functions)
     virtual ~Parser() = default;
-    virtual DomainExtractorResult parse(DomainExtractorPacketDirection dir, std::vector<uint8_t> *buffer) = 0;
+    virtual DomainExtractorResult parse(DomainExtractorPacketDirection dir, U8View data) = 0;
 };
 
 struct QuicParser : public Parser {
-    TlsReader reader = {};
+    QuicSniExtractor extractor;
 
     ~QuicParser() override = default;
 
-    DomainExtractorResult parse(DomainExtractorPacketDirection dir, std::vector<uint8_t> *buffer) override {
+    DomainExtractorResult parse(DomainExtractorPacketDirection dir, U8View data) override {
         if (dir != DEPD_OUTGOING) {
             return {DES_NOTFOUND}; // not TLS
         }
 
-        auto reassembled_crypto = ag::quic_utils::reassemble_initial_crypto_frames({buffer->data(), buffer->size()});
-        if (!reassembled_crypto.has_value()) {
-            return {DES_NOTFOUND};
-        }
-        tls_input_hshake(&this->reader, reassembled_crypto->data(), reassembled_crypto->size());
-
-        for (;;) {
-            TlsParseResult r = tls_parse(&this->reader);
-            switch (r) {
-            case TLS_RCLIENT_HELLO_SNI:
-                return {DES_FOUND, {this->reader.tls_hostname.data(), this->reader.tls_hostname.size()}};
-            case TLS_RERR:
-            case TLS_RMORE:
-                return {DES_WANT_MORE};
-            case TLS_RDONE:
-                return {DES_NOTFOUND};
-            default:
-                continue;
-            }
+        switch (this->extractor.feed_initial_payload(data)) {
+        case SNI_RFOUND:
+            return {DES_FOUND, std::string(this->extractor.server_name())};
+        case SNI_RMORE:
+            return {DES_WANT_MORE};
+        case SNI_RNOTFOUND:
+        case SNI_RERR:
+            break;
         }
+        return {DES_NOTFOUND};
     }
 };
 
@@ -57,7 +47,10 @@ struct TlsParser : public Parser { // NOLINT(cppcoreguidelines-special-member-fu
     };
 
     State state = TPS_IDLE;
+    TlsSniExtractor extractor;
+    // Server Hello and Certificate are buffered only if the Client Hello has no server name
     TlsReader reader = {};
+    std::vector<uint8_t> buffer;
     size_t buffer_offset = 0;
 
     ~TlsParser() override = default;
@@ -75,31 +68,26 @@ struct TlsParser : public Parser { // NOLINT(cppcoreguidelines-special-member-fu
         }
     }
 
-    DomainExtractorResult parse(DomainExtractorPacketDirection dir, std::vector<uint8_t> *buffer) override {
+    DomainExtractorResult parse(DomainExtractorPacketDirection dir, U8View data) override {
+        if (this->state != TPS_IDLE && dir == DEPD_INCOMING) {
+            this->buffer.insert(this->buffer.end(), data.begin(), data.end());
+        }
+
         switch (this->state) {
         case TPS_IDLE: {
             if (dir != DEPD_OUTGOING) {
                 break; // not TLS
             }
 
-            tls_input(&this->reader, buffer->data(), buffer->size());
-            this->buffer_offset = 0;
-            TlsParseResult r = tls_parse(&this->reader);
-            switch (r) {
-            case TLS_RCLIENT_HELLO:
-                r = tls_parse(&this->reader);
-                if (r == TLS_RCLIENT_HELLO_SNI && !this->reader.tls_hostname.empty()) {
-                    DomainExtractorResult result = {
-                            DES_FOUND, {this->reader.tls_hostname.data(), this->reader.tls_hostname.size()}};
-                    buffer->clear();
-                    return result;
-                }
+            switch (this->extractor.feed_records(data)) {
+            case SNI_RFOUND:
+                return {DES_FOUND, std::string(this->extractor.server_name())};
+            case SNI_RNOTFOUND:
                 this->state = TPS_SERVER_HELLO;
-                buffer->clear();
                 return {DES_PASS};
-            case TLS_RMORE:
+            case SNI_RMORE:
                 return {DES_WANT_MORE};
-            default:
+            case SNI_RERR:
                 break;
             }
             break;
@@ -110,7 +98,7 @@ struct TlsParser : public Parser { // NOLINT(cppcoreguidelines-special-member-fu
             }
 
             this->reader = {};
-            tls_input(&this->reader, buffer->data(), buffer->size());
+            tls_input(&this->reader, this->buffer.data(), this->buffer.size());
 
             TlsParseResult r = tls_parse(&this->reader);
             switch (r) {
@@ -122,7 +110,7 @@ struct TlsParser : public Parser { // NOLINT(cppcoreguidelines-special-member-fu
                 return {DES_PASS};
             }
 
-            this->buffer_offset = this->reader.in.data() - buffer->data();
+            this->buffer_offset = this->reader.in.data() - this->buffer.data();
             r = tls_parse(&this->reader);
             if (r != TLS_RDONE) {
                 return parse_cert_to_lookuper_result(r);
@@ -134,7 +122,8 @@ struct TlsParser : public Parser { // NOLINT(cppcoreguidelines-special-member-fu
                 return {DES_PASS};
             }
 
-            tls_input(&this->reader, buffer->data() + this->buffer_offset, buffer->size() - this->buffer_offset);
+            tls_input(&this->reader, this->buffer.data() + this->buffer_offset,
+                    this->buffer.size() - this->buffer_offset);
             TlsParseResult r = tls_parse(&this->reader);
             return parse_cert_to_lookuper_result(r);
         }
@@ -147,14 +136,14 @@ struct TlsParser : public Parser { // NOLINT(cppcoreguidelines-special-member-fu
 struct HttpParser : public Parser {
     ~HttpParser() override = default;
 
-    DomainExtractorResult parse(DomainExtractorPacketDirection, std::vector<uint8_t> *buffer) override {
+    DomainExtractorResult parse(DomainExtractorPacketDirection, U8View data) override {
         static constexpr size_t MIN_METHOD_LENGTH = 3;
         static constexpr size_t MAX_METHOD_LENGTH = 32;
 
         // check method
         size_t i;
-        for (i = 0; i < buffer->size(); ++i) {
-            int ch = (*buffer)[i];
+        for (i = 0; i < data.size(); ++i) {
+            int ch = data[i];
             if (isspace((unsigned char) ch)) {
                 break;
             }
@@ -168,7 +157,7 @@ struct HttpParser : public Parser {
         }
 
         static constexpr std::string_view HOST_MARKER = "Host:";
-        std::string_view seek = {(char *) buffer->data() + i, buffer->size() - i};
+        std::string_view seek = {(char *) data.data() + i, data.size() - i};
         if (size_t host_header_pos, host_start, host_end; seek.npos != (host_header_pos = seek.find(HOST_MARKER))
                 && host_header_pos + HOST_MARKER.length() < seek.length()
                 && seek.npos != (host_start = seek.find_first_not_of(" \t", host_header_pos + HOST_MARKER.length()))
@@ -237,24 +226,26 @@ struct DomainExtractor::Context {
     int proto{};
     ParserFactory factory = {};
     std::unique_ptr<Parser> current_parser = factory.produce(proto);
-    std::vector<uint8_t> buffer;
+    bool parser_accepted = false; // the current parser has taken some data as its protocol
 
     DomainExtractorResult parse(DomainExtractorPacketDirection dir, const uint8_t *data, size_t length);
 };
 
 DomainExtractorResult DomainExtractor::Context::parse(
         DomainExtractorPacketDirection dir, const uint8_t *data, size_t length) {
-    this->buffer.insert(this->buffer.end(), data, data + length);
-
     while (this->current_parser != nullptr) {
-        DomainExtractorResult r = this->current_parser->parse(dir, &this->buffer);
+        DomainExtractorResult r = this->current_parser->parse(dir, {data, length});
         switch (r.status) {
         case DES_WANT_MORE:
-        case DES_FOUND:
         case DES_PASS:
+            this->parser_accepted = true;
+            return r;
+        case DES_FOUND:
             return r;
         case DES_NOTFOUND:
-            this->current_parser = this->factory.produce(proto);
+            // The parsers don't keep the data they have walked through, so the next one could only
+            // see the middle of the flow
+            this->current_parser = !this->parser_accepted ? this->factory.produce(proto) : nullptr;
             break;
         }
     }
@@ -1,6 +1,17 @@
 #include "vpn/internal/domain_filter.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+
 #include "common/defs.h"
+#include "common/file.h"
+#include "common/net_utils.h"
+#include "mapped_file.h"
+#include "vpn/internal/cidr_trie.h"
+#include "vpn/internal/domain_trie.h"
+#include "vpn/internal/flat_buffer.h"
 #include "vpn/internal/utils.h"
 #include "vpn/utils.h"
 
@@ -16,7 +27,90 @@ enum DomainFilter::MatchFlags : uint32_t {
     DFMM_SUBDOMAINS, // match only subdomains and www. + the domain, but not the domain itself
 };
 
-DomainFilter::DomainFilter() = default;
+struct DomainFilter::Exclusions {
+    VpnMode mode = VPN_MODE_GENERAL;
+    // Grows with each snapshot which becomes the latest built one, see `set_exclusions`
+    uint64_t generation = 0;
+
+    // The parsed entries, the incremental updates start from them. A snapshot loaded from a file
+    // has only `entries_text`, which is parsed by the first update.
+    bool parsed = true;
+    std::unordered_map<std::string, MatchFlagsSet> domain_entries; // key - domain name / value - set of `MatchFlags`
+    std::vector<CidrRange> cidr_entries;
+    std::unordered_set<SocketAddress> addresses;
+
+    // The compiled entries (see `compile`), owned by `image` or by `file`
+    std::vector<uint8_t> image;
+    std::unique_ptr<MappedFile> file;
+    U8View compiled;
+    DomainTrie domains; // `domain_entries` compiled
+    std::string_view resolvable_domains; // the names with `DFMM_EXACT`, each one is followed by '\0'
+    CidrTrie cidr_ranges; // `cidr_entries` compiled
+    std::string_view entries_text; // `domain_entries` and `cidr_entries` in the `VpnSettings.exclusions` syntax
+};
+
+/**
+ * The exclusions file is the header followed by the compiled entries, which are used in place.
+ * The values are in the host byte order, so a file made on a host with another byte order is rejected.
+ */
+static constexpr char EXCLUSIONS_FILE_MAGIC[8] = {'A', 'G', 'V', 'P', 'N', 'E', 'X', 'C'};
+static constexpr uint32_t EXCLUSIONS_FILE_VERSION = 2;
+static constexpr uint32_t EXCLUSIONS_FILE_BYTE_ORDER_MARK = 0x01020304;
+
+struct ExclusionsFileHeader {
+    char magic[sizeof(EXCLUSIONS_FILE_MAGIC)];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint64_t compiled_size;
+    uint64_t checksum; // Of the fields above, see `header_checksum`
+};
+
+static_assert(sizeof(ExclusionsFileHeader) % FLAT_BUFFER_ALIGNMENT == 0);
+
+struct CompiledAddress {
+    uint8_t size;
+    uint8_t reserved;
+    uint16_t port;
+    uint8_t address[IPV6_ADDRESS_SIZE];
+};
+
+// FNV-1a over the 64-bit words of the header. The compiled data is not checksummed, so that loading
+// does not read the whole file: the file is replaced atomically, a truncated one fails the size check,
+// and the tries check the bounds on each access, so the damaged data may only give wrong matches.
+static uint64_t header_checksum(const ExclusionsFileHeader &header) {
+    static_assert(offsetof(ExclusionsFileHeader, checksum) % sizeof(uint64_t) == 0);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < offsetof(ExclusionsFileHeader, checksum); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, (const uint8_t *) &header + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Point the snapshot to the compiled entries. Return the compiled addresses, or nullopt if the data is malformed.
+static std::optional<std::span<const CompiledAddress>> view_compiled(DomainFilter::Exclusions &exclusions) {
+    FlatBufferReader in{exclusions.compiled};
+    std::optional domains = DomainTrie::view(in);
+    std::optional resolvable_domains = in.read_array<char>();
+    std::optional cidr_ranges = CidrTrie::view(in);
+    std::optional addresses = in.read_array<CompiledAddress>();
+    std::optional entries_text = in.read_array<char>();
+    if (!domains.has_value() || !resolvable_domains.has_value() || !cidr_ranges.has_value()
+            || !addresses.has_value() || !entries_text.has_value()) {
+        return std::nullopt;
+    }
+    exclusions.domains = *domains;
+    exclusions.resolvable_domains = {resolvable_domains->data(), resolvable_domains->size()};
+    exclusions.cidr_ranges = *cidr_ranges;
+    exclusions.entries_text = {entries_text->data(), entries_text->size()};
+    return addresses;
+}
+
+DomainFilter::DomainFilter()
+        : m_exclusions(std::make_shared<Exclusions>())
+        , m_latest_exclusions(m_exclusions) {
+}
 
 DomainFilter::~DomainFilter() = default;
 
@@ -84,77 +178,271 @@ DomainFilter::ParseResult DomainFilter::parse_entry(std::string_view entry) {
     return DomainEntryInfo{std::string(entry), match_flags};
 }
 
-bool DomainFilter::update_exclusions(VpnMode mode_, std::string_view exclusions) {
-    m_mode = mode_;
-    m_domains.clear();
-    m_addresses.clear();
-    m_exclusion_suspects.clear();
-    m_cidr_ranges.clear();
-
-    auto add_entry = [this](const std::string &entry) {
-        ParseResult result = parse_entry(entry);
-        if (const auto *addr = std::get_if<SocketAddress>(&result); addr != nullptr) {
-            log_filter(this, trace, "Entry added in address table: {}", entry);
-            m_addresses.insert(*addr);
-        } else if (auto *domain_info = std::get_if<DomainEntryInfo>(&result); domain_info != nullptr) {
-            log_filter(this, trace, "Entry added in domain table: {}", domain_info->text);
-            m_domains[std::move(domain_info->text)] |= domain_info->flags;
-        } else if (auto *range = std::get_if<CidrRange>(&result); range != nullptr) {
-            log_filter(this, trace, "Entry added in CIDR ranges table: {}", range->to_string());
-            m_cidr_ranges.insert(*range);
-        } else {
-            auto status = std::get<DomainEntryMalformed>(result);
-            (void) status;
-            log_filter(this, warn, "Malformed entry detected in exceptions list: {}", entry);
-        }
-    };
-
+template <typename F>
+void DomainFilter::for_each_entry(std::string_view exclusions, F &&f) {
     std::string buffer;
 
     for (char ch : exclusions) {
         if (!isspace(ch)) {
             buffer.push_back(ch);
         } else if (!buffer.empty()) {
-            add_entry(buffer);
+            f(buffer);
             buffer.clear();
         }
     }
 
     if (!buffer.empty()) {
-        add_entry(buffer);
+        f(buffer);
     }
+}
 
-    return true;
+void DomainFilter::add_entry(Exclusions &exclusions, std::string_view entry) {
+    ParseResult result = parse_entry(entry);
+    if (const auto *addr = std::get_if<SocketAddress>(&result); addr != nullptr) {
+        log_filter(this, trace, "Entry added in address table: {}", entry);
+        exclusions.addresses.insert(*addr);
+    } else if (auto *domain_info = std::get_if<DomainEntryInfo>(&result); domain_info != nullptr) {
+        log_filter(this, trace, "Entry added in domain table: {}", domain_info->text);
+        exclusions.domain_entries[std::move(domain_info->text)] |= domain_info->flags;
+    } else if (auto *range = std::get_if<CidrRange>(&result); range != nullptr) {
+        log_filter(this, trace, "Entry added in CIDR ranges table: {}", range->to_string());
+        exclusions.cidr_entries.push_back(*range);
+    } else {
+        auto status = std::get<DomainEntryMalformed>(result);
+        (void) status;
+        log_filter(this, warn, "Malformed entry detected in exceptions list: {}", entry);
+    }
 }
 
-DomainFilterMatchStatus DomainFilter::match_domain(std::string_view domain) const {
-    bool www_prefixed = starts_with(domain, WWW_PREFIX);
-    std::string seek = !www_prefixed ? std::string(domain) : std::string(domain.substr(WWW_PREFIX.length()));
-
-    while (true) {
-        auto i = m_domains.find(seek);
-        if (i != m_domains.end()) {
-            MatchFlagsSet flags = i->second;
-
-            bool found = (flags.test(DFMM_EXACT)
-                                 && (seek.length() == domain.length()
-                                         || (www_prefixed && seek.length() + WWW_PREFIX.length() == domain.length())))
-                    || (flags.test(DFMM_SUBDOMAINS) && (seek.length() < domain.length()));
-            if (found) {
-                log_filter(this, dbg, "Matched domain: {}", seek);
-                return DFMS_EXCLUSION;
+void DomainFilter::remove_entry(Exclusions &exclusions, std::string_view entry) {
+    ParseResult result = parse_entry(entry);
+    if (const auto *addr = std::get_if<SocketAddress>(&result); addr != nullptr) {
+        log_filter(this, trace, "Entry removed from address table: {}", entry);
+        exclusions.addresses.erase(*addr);
+    } else if (auto *domain_info = std::get_if<DomainEntryInfo>(&result); domain_info != nullptr) {
+        if (auto it = exclusions.domain_entries.find(domain_info->text); it != exclusions.domain_entries.end()) {
+            log_filter(this, trace, "Entry removed from domain table: {}", entry);
+            it->second &= ~domain_info->flags;
+            if (it->second.none()) {
+                exclusions.domain_entries.erase(it);
             }
         }
+    } else if (auto *range = std::get_if<CidrRange>(&result); range != nullptr) {
+        log_filter(this, trace, "Entry removed from CIDR ranges table: {}", range->to_string());
+        std::erase_if(exclusions.cidr_entries, [range](const CidrRange &i) {
+            return i.get_prefix_len() == range->get_prefix_len() && i.get_address() == range->get_address();
+        });
+    } else {
+        log_filter(this, warn, "Malformed entry detected in exceptions list: {}", entry);
+    }
+}
 
-        size_t next_dot = seek.find('.');
-        if (next_dot == std::string::npos || next_dot + 1 == seek.length()) {
-            break;
+void DomainFilter::compile(Exclusions &exclusions) {
+    std::vector<std::pair<std::string_view, DomainTrie::Flags>> domains;
+    domains.reserve(exclusions.domain_entries.size());
+    std::string resolvable_domains;
+    std::string entries_text;
+    for (const auto &[name, flags] : exclusions.domain_entries) {
+        domains.emplace_back(name, DomainTrie::Flags(flags.to_ulong()));
+        if (flags.test(DFMM_EXACT)) {
+            resolvable_domains.append(name).push_back('\0');
+            entries_text.append(name).push_back(' ');
+        }
+        if (flags.test(DFMM_SUBDOMAINS)) {
+            entries_text.append(WILDCARD_PREFIX).append(name).push_back(' ');
         }
+    }
+    for (const CidrRange &range : exclusions.cidr_entries) {
+        entries_text.append(range.to_string()).push_back(' ');
+    }
+    std::vector<CompiledAddress> addresses;
+    addresses.reserve(exclusions.addresses.size());
+    for (const SocketAddress &addr : exclusions.addresses) {
+        CompiledAddress &compiled = addresses.emplace_back();
+        compiled.size = uint8_t(addr.addr().size());
+        compiled.port = addr.port();
+        std::copy(addr.addr().begin(), addr.addr().end(), compiled.address);
+    }
+
+    exclusions.image.clear();
+    FlatBufferWriter out{exclusions.image};
+    DomainTrie::build(domains, out);
+    out.write_array<char>(resolvable_domains);
+    CidrTrie::build(exclusions.cidr_entries, out);
+    out.write_array<CompiledAddress>(addresses);
+    out.write_array<char>(entries_text);
+    exclusions.compiled = {exclusions.image.data(), exclusions.image.size()};
+    view_compiled(exclusions);
+}
 
-        seek.erase(0, next_dot + 1);
+bool DomainFilter::update_exclusions(VpnMode mode, std::string_view exclusions) {
+    return set_exclusions(build_exclusions(mode, exclusions));
+}
+
+std::shared_ptr<const DomainFilter::Exclusions> DomainFilter::build_exclusions(
+        VpnMode mode, std::string_view exclusions) {
+    auto snapshot = std::make_shared<Exclusions>();
+    snapshot->mode = mode;
+    for_each_entry(exclusions, [&](const std::string &entry) {
+        add_entry(*snapshot, entry);
+    });
+    compile(*snapshot);
+
+    std::scoped_lock l(m_build_guard);
+    snapshot->generation = ++m_last_generation;
+    m_latest_exclusions = snapshot;
+    return snapshot;
+}
+
+std::shared_ptr<const DomainFilter::Exclusions> DomainFilter::build_exclusions_update(
+        std::string_view added, std::string_view removed) {
+    // Hold the lock for the whole build, so that concurrent updates do not lose each other's entries
+    std::scoped_lock l(m_build_guard);
+    const Exclusions &latest = *m_latest_exclusions;
+    auto snapshot = std::make_shared<Exclusions>();
+    snapshot->mode = latest.mode;
+    if (latest.parsed) {
+        snapshot->domain_entries = latest.domain_entries;
+        snapshot->cidr_entries = latest.cidr_entries;
+    } else {
+        for_each_entry(latest.entries_text, [&](const std::string &entry) {
+            add_entry(*snapshot, entry);
+        });
+    }
+    snapshot->addresses = latest.addresses;
+    for_each_entry(removed, [&](const std::string &entry) {
+        remove_entry(*snapshot, entry);
+    });
+    for_each_entry(added, [&](const std::string &entry) {
+        add_entry(*snapshot, entry);
+    });
+    compile(*snapshot);
+
+    snapshot->generation = ++m_last_generation;
+    m_latest_exclusions = snapshot;
+    return snapshot;
+}
+
+std::shared_ptr<const DomainFilter::Exclusions> DomainFilter::load_exclusions(
+        VpnMode mode, const std::string &path) {
+    std::string error;
+    std::unique_ptr<MappedFile> file = MappedFile::open(path, error);
+    if (file == nullptr) {
+        log_filter(this, warn, "Failed to load exclusions from {}: {}", path, error);
+        return nullptr;
     }
 
-    return DFMS_DEFAULT;
+    U8View data = file->data();
+    ExclusionsFileHeader header{};
+    if (data.size() >= sizeof(header)) {
+        std::memcpy(&header, data.data(), sizeof(header));
+        data.remove_prefix(sizeof(header));
+    }
+    if (0 != std::memcmp(header.magic, EXCLUSIONS_FILE_MAGIC, sizeof(header.magic))) {
+        log_filter(this, warn, "Failed to load exclusions from {}: not an exclusions file", path);
+        return nullptr;
+    }
+    if (header.version != EXCLUSIONS_FILE_VERSION || header.byte_order_mark != EXCLUSIONS_FILE_BYTE_ORDER_MARK) {
+        log_filter(this, warn, "Failed to load exclusions from {}: unsupported version or byte order", path);
+        return nullptr;
+    }
+    if (header.checksum != header_checksum(header) || header.compiled_size != data.size()) {
+        log_filter(this, warn, "Failed to load exclusions from {}: file is corrupted", path);
+        return nullptr;
+    }
+
+    auto snapshot = std::make_shared<Exclusions>();
+    snapshot->mode = mode;
+    snapshot->parsed = false;
+    snapshot->file = std::move(file);
+    snapshot->compiled = data;
+    std::optional addresses = view_compiled(*snapshot);
+    if (!addresses.has_value()) {
+        log_filter(this, warn, "Failed to load exclusions from {}: file is malformed", path);
+        return nullptr;
+    }
+    for (const CompiledAddress &addr : *addresses) {
+        if (addr.size != IPV4_ADDRESS_SIZE && addr.size != IPV6_ADDRESS_SIZE) {
+            log_filter(this, warn, "Failed to load exclusions from {}: file is malformed", path);
+            return nullptr;
+        }
+        snapshot->addresses.emplace(U8View{addr.address, addr.size}, addr.port);
+    }
+    log_filter(this, dbg, "Loaded exclusions from {}: domains={} ranges={} addresses={}", path,
+            snapshot->domains.size(), snapshot->cidr_ranges.size(), snapshot->addresses.size());
+
+    std::scoped_lock l(m_build_guard);
+    snapshot->generation = ++m_last_generation;
+    m_latest_exclusions = snapshot;
+    return snapshot;
+}
+
+bool DomainFilter::save_exclusions(const Exclusions &exclusions, const std::string &path) const {
+    ExclusionsFileHeader header{};
+    std::memcpy(header.magic, EXCLUSIONS_FILE_MAGIC, sizeof(header.magic));
+    header.version = EXCLUSIONS_FILE_VERSION;
+    header.byte_order_mark = EXCLUSIONS_FILE_BYTE_ORDER_MARK;
+    header.compiled_size = exclusions.compiled.size();
+    header.checksum = header_checksum(header);
+
+    // Write to a temporary file and replace the target, so that a mapped target is never modified
+    std::string tmp_path = path + ".tmp";
+    std::error_code fs_err;
+    fs::remove(tmp_path, fs_err);
+    file::Handle fd = file::open(tmp_path, file::CREAT | file::RDWR);
+    if (fd == file::INVALID_HANDLE) {
+        log_filter(this, warn, "Failed to open file: {}: {} ({})", tmp_path, sys::strerror(sys::last_error()),
+                sys::last_error());
+        return false;
+    }
+    bool written = ssize_t(sizeof(header)) == file::write(fd, &header, sizeof(header))
+            && ssize_t(exclusions.compiled.size())
+                    == file::write(fd, exclusions.compiled.data(), exclusions.compiled.size());
+    if (!written) {
+        log_filter(this, warn, "Failed to write file: {}: {} ({})", tmp_path, sys::strerror(sys::last_error()),
+                sys::last_error());
+    }
+    file::close(fd);
+    if (written) {
+        fs::rename(tmp_path, path, fs_err);
+        if (fs_err) {
+            log_filter(this, warn, "Failed to rename file: {} -> {}: {}", tmp_path, path, fs_err.message());
+            written = false;
+        }
+    }
+    if (!written) {
+        fs::remove(tmp_path, fs_err);
+    }
+    return written;
+}
+
+bool DomainFilter::set_exclusions(std::shared_ptr<const Exclusions> exclusions) {
+    if (exclusions->generation < m_exclusions->generation) {
+        log_filter(this, dbg, "Dropping stale exclusions: generation={} installed={}", exclusions->generation,
+                m_exclusions->generation);
+        return false;
+    }
+    m_exclusions = std::move(exclusions);
+    m_exclusion_suspects.clear();
+    return true;
+}
+
+DomainFilterMatchStatus DomainFilter::match_domain(std::string_view domain) const {
+    bool www_prefixed = starts_with(domain, WWW_PREFIX);
+    std::string_view base = !www_prefixed ? domain : domain.substr(WWW_PREFIX.length());
+
+    // The candidates are the domain without the `www.` prefix and each of its suffixes starting with a label
+    bool found = m_exclusions->domains.match_suffixes(base, [&](size_t length, DomainTrie::Flags bits) {
+        MatchFlagsSet flags{bits};
+        bool matched = (flags.test(DFMM_EXACT) && length == base.length())
+                || (flags.test(DFMM_SUBDOMAINS) && length < domain.length());
+        if (matched) {
+            log_filter(this, dbg, "Matched domain: {}", base.substr(base.length() - length));
+        }
+        return matched;
+    });
+
+    return found ? DFMS_EXCLUSION : DFMS_DEFAULT;
 }
 
 DomainFilterMatchResult DomainFilter::match_tag(const SockAddrTag &tag) const {
@@ -163,15 +451,14 @@ DomainFilterMatchResult DomainFilter::match_tag(const SockAddrTag &tag) const {
     SocketAddress addr_no_port = tag.addr;
     addr_no_port.set_port(0);
 
-    bool found = m_addresses.contains(tag.addr);
+    const Exclusions &exclusions = *m_exclusions;
+    bool found = exclusions.addresses.contains(tag.addr);
     if (!found) {
-        found = m_addresses.contains(addr_no_port);
+        found = exclusions.addresses.contains(addr_no_port);
     }
 
     if (!found) {
-        const Uint8View addr = tag.addr.addr();
-        ag::CidrRange addr_cidr(addr, addr.size() * 8);
-        found = m_cidr_ranges.includes(addr_cidr);
+        found = exclusions.cidr_ranges.includes(tag.addr.addr());
     }
 
     if (found) {
@@ -204,17 +491,17 @@ void DomainFilter::add_exclusion_suspect(const SocketAddress &addr_, std::chrono
 
 std::vector<std::string_view> DomainFilter::get_resolvable_exclusions() const {
     std::vector<std::string_view> names;
-    for (const auto &[name, flags] : m_domains) {
-        if (flags.test(DFMM_EXACT)) {
-            names.emplace_back(name);
-        }
+    std::string_view blob = m_exclusions->resolvable_domains;
+    for (size_t pos = 0; pos < blob.size();) {
+        size_t end = std::min(blob.find('\0', pos), blob.size());
+        names.push_back(blob.substr(pos, end - pos));
+        pos = end + 1;
     }
-
     return names;
 }
 
 VpnMode DomainFilter::get_mode() const {
-    return m_mode;
+    return m_exclusions->mode;
 }
 
 } // namespace ag
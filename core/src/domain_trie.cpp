@@ -0,0 +1,122 @@
+#include "vpn/internal/domain_trie.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace ag {
+
+static uint32_t hash_label(std::string_view label) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (char c : label) {
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t slot_hash(uint32_t parent, uint32_t label_hash) {
+    uint32_t hash = label_hash ^ (parent * 0x9e3779b1u);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+void DomainTrie::build(const std::vector<std::pair<std::string_view, Flags>> &domains, FlatBufferWriter &out) {
+    size_t labels_num = 0;
+    size_t labels_length = 0;
+    for (const auto &[name, flags] : domains) {
+        labels_num += std::count(name.begin(), name.end(), '.') + 1;
+        labels_length += name.size();
+    }
+    // Keep the table at most half full, so that the probe sequences are short
+    std::vector<uint32_t> table(std::bit_ceil(2 * labels_num + 1));
+    std::vector<Node> nodes;
+    nodes.reserve(labels_num + 1);
+    nodes.push_back({});
+    std::string labels;
+    labels.reserve(labels_length);
+
+    auto insert_child = [&](uint32_t parent, std::string_view label) {
+        uint32_t label_hash = hash_label(label);
+        size_t mask = table.size() - 1;
+        size_t i = slot_hash(parent, label_hash) & mask;
+        for (; table[i] != ROOT; i = (i + 1) & mask) {
+            const Node &node = nodes[table[i]];
+            if (node.parent == parent && node.label_hash == label_hash
+                    && label == std::string_view{labels}.substr(node.label_offset, node.label_length)) {
+                return table[i];
+            }
+        }
+
+        auto index = uint32_t(nodes.size());
+        nodes.push_back({parent, label_hash, uint32_t(labels.size()), uint32_t(label.size()), 0});
+        labels.append(label);
+        table[i] = index;
+        return index;
+    };
+
+    for (const auto &[name, flags] : domains) {
+        uint32_t node = ROOT;
+        size_t end = name.size();
+        while (true) {
+            size_t dot = (end == 0) ? std::string_view::npos : name.rfind('.', end - 1);
+            size_t begin = (dot == std::string_view::npos) ? 0 : dot + 1;
+            node = insert_child(node, name.substr(begin, end - begin));
+            if (dot == std::string_view::npos) {
+                break;
+            }
+            end = dot;
+        }
+        nodes[node].flags |= flags;
+    }
+
+    out.write(uint64_t(domains.size()));
+    out.write_array<Node>(nodes);
+    out.write_array<uint32_t>(table);
+    out.write_array<char>(labels);
+}
+
+std::optional<DomainTrie> DomainTrie::view(FlatBufferReader &in) {
+    std::optional size = in.read<uint64_t>();
+    std::optional nodes = in.read_array<Node>();
+    std::optional table = in.read_array<uint32_t>();
+    std::optional labels = in.read_array<char>();
+    if (!size.has_value() || !nodes.has_value() || !table.has_value() || !labels.has_value() || nodes->empty()
+            || !std::has_single_bit(table->size())) {
+        return std::nullopt;
+    }
+    // The contents are checked by the lookups (see `find_child`), so that viewing a mapped file
+    // does not read all of it
+    DomainTrie trie;
+    trie.m_size = *size;
+    trie.m_nodes = *nodes;
+    trie.m_table = *table;
+    trie.m_labels = {labels->data(), labels->size()};
+    return trie;
+}
+
+uint32_t DomainTrie::find_child(uint32_t parent, std::string_view label) const {
+    if (m_table.empty()) {
+        return ROOT;
+    }
+    uint32_t label_hash = hash_label(label);
+    size_t mask = m_table.size() - 1;
+    size_t i = slot_hash(parent, label_hash) & mask;
+    // A lookup must neither go out of the arrays nor loop forever whatever the data is
+    for (size_t probes_num = 0; probes_num < m_table.size(); ++probes_num, i = (i + 1) & mask) {
+        uint32_t index = m_table[i];
+        if (index == ROOT || index >= m_nodes.size()) {
+            return ROOT;
+        }
+        const Node &node = m_nodes[index];
+        if (node.parent == parent && node.label_hash == label_hash && node.label_offset <= m_labels.size()
+                && node.label_length <= m_labels.size() - node.label_offset
+                && label == m_labels.substr(node.label_offset, node.label_length)) {
+            return index;
+        }
+    }
+    return ROOT;
+}
+
+} // namespace ag
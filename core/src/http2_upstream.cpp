@@ -1,6 +1,8 @@
 #include "http2_upstream.h"
 
+#include <array>
 #include <cassert>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -127,18 +129,25 @@ void Http2Upstream::handle_response(const HttpHeadersEvent *http_event) {
 int Http2Upstream::read_out_pending_data(uint64_t id, TcpConnection *conn) {
     DataBuffer *pending = conn->unread_data.get();
 
+    std::array<U8View, DATA_BUFFER_PEEK_SEGMENTS> segments;
     while (conn->flags.test(TcpConnection::TCF_READ_ENABLED) && pending->size() > 0) {
-        BufferPeekResult res = pending->peek();
+        BufferPeekIovResult res = pending->peek_iov(segments);
         if (res.err.has_value()) {
             log_conn(this, id, err, "Failed to read buffered data: {}", *res.err);
             return -1;
         }
-        int r = handle_read(id, res.data.data(), res.data.size());
-        if (r > 0) {
-            pending->drain(r);
-        } else if (r < 0) {
-            return r;
+        size_t consumed = 0;
+        for (U8View segment : std::span{segments}.first(res.count)) {
+            int r = handle_read(id, segment.data(), segment.size());
+            if (r < 0) {
+                return r;
+            }
+            consumed += r;
+            if (size_t(r) < segment.size() || !conn->flags.test(TcpConnection::TCF_READ_ENABLED)) {
+                break;
+            }
         }
+        pending->drain(consumed);
     }
 
     return 0;
@@ -198,7 +207,7 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
                 size_t size = http_event->length - http_event->result;
 
                 if (pending == nullptr) {
-                    conn->unread_data = upstream->vpn->make_buffer(found.first);
+                    conn->unread_data = upstream->vpn->make_buffer();
                     pending = conn->unread_data.get();
                     if (std::optional<std::string> err = pending->init(); err.has_value()) {
                         log_conn(upstream, found.first, err, "Failed to initialize data buffer: {}", *err);
@@ -322,7 +331,9 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
         const HttpOutputEvent *http_event = (HttpOutputEvent *) data;
         log_upstream(upstream, trace, "Sending {} bytes to server", http_event->length);
 
-        VpnError error = tcp_socket_write(upstream->m_socket.get(), http_event->data, http_event->length);
+        VpnError error = (http_event->buffer != nullptr)
+                ? tcp_socket_write_buffer(upstream->m_socket.get(), http_event->buffer)
+                : tcp_socket_write(upstream->m_socket.get(), http_event->data, http_event->length);
         if (error.code != 0) {
             upstream->close_session_inner(VpnError{VPN_EC_ERROR, error.text});
         }
@@ -577,6 +588,12 @@ void Http2Upstream::close_session() {
         http_session_reset_stream(m_session.get(), (int32_t) id.value(), NGHTTP2_CANCEL);
     }
 
+    if (m_session != nullptr) {
+        HttpSessionCopyStats stats = http_session_get_copy_stats(m_session.get());
+        log_upstream(this, dbg, "Sent {} bytes of stream data, {} bytes of them copied", stats.sent_bytes,
+                stats.copied_bytes);
+    }
+
     m_session.reset();
     m_socket.reset();
     m_tcp_connections.clear();
@@ -700,12 +717,23 @@ void Http2Upstream::close_connection(uint64_t id, bool graceful, bool async) {
 }
 
 ssize_t Http2Upstream::send(uint64_t id, const uint8_t *data, size_t length) {
+    return send_data(id, data, length, nullptr);
+}
+
+ssize_t Http2Upstream::send_by_reference(uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef &buffer) {
+    return send_data(id, data, length, &buffer);
+}
+
+ssize_t Http2Upstream::send_data(uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef *buffer) {
     ssize_t r = 0;
 
     if (auto i = m_tcp_connections.find(id); i != m_tcp_connections.end()) {
         TcpConnection *conn = &i->second;
         if (!conn->flags.test(TcpConnection::TCF_STREAM_CLOSED)) {
-            r = http_session_send_data(m_session.get(), (int32_t) conn->stream_id, data, length, false);
+            auto stream_id = (int32_t) conn->stream_id;
+            r = (buffer != nullptr)
+                    ? http_session_send_data_by_reference(m_session.get(), stream_id, data, length, *buffer, false)
+                    : http_session_send_data(m_session.get(), stream_id, data, length, false);
             if (r == 0) {
                 r = (ssize_t) length;
             } else if (r == NGHTTP2_ERR_BUFFER_ERROR) {
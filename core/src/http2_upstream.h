@@ -76,6 +76,7 @@ private:
     void close_session() override;
     void close_connection(uint64_t id, bool graceful, bool async) override;
     ssize_t send(uint64_t id, const uint8_t *data, size_t length) override;
+    ssize_t send_by_reference(uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef &buffer) override;
     void consume(uint64_t id, size_t length) override;
     size_t available_to_send(uint64_t id) override;
     void update_flow_control(uint64_t id, TcpFlowCtrlInfo info) override;
@@ -106,6 +107,7 @@ private:
             uint64_t conn_id, const TunnelAddress *dst_addr, std::string_view app_name);
 
     void close_session_inner(std::optional<VpnError> error);
+    ssize_t send_data(uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef *buffer);
     void clean_tcp_connection_data(uint64_t id);
     int handle_read(uint64_t id, const uint8_t *data, size_t length);
     void handle_response(const HttpHeadersEvent *http_event);
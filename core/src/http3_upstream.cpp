@@ -1,7 +1,10 @@
 #include "http3_upstream.h"
 
 #include <algorithm>
+#include <array>
 #include <cstdlib>
+#include <cstring>
+#include <span>
 #include <unordered_set>
 
 #include <magic_enum/magic_enum.hpp>
@@ -12,6 +15,7 @@
 #include "net/udp_socket.h"
 #include "net/utils.h"
 #include "vpn/internal/vpn_client.h"
+#include "vpn/internal/wire_utils.h"
 #include "vpn/utils.h"
 
 #define log_upstream(ups_, lvl_, fmt_, ...) lvl_##log((ups_)->m_log, "[{}] " fmt_, (ups_)->id, ##__VA_ARGS__)
@@ -55,7 +59,8 @@ bool Http3Upstream::TcpConnection::has_unread_data() const {
 
 Http3Upstream::Http3Upstream(int id, const VpnUpstreamProtocolConfig &protocol_config)
         : ServerUpstream(id, protocol_config)
-        , m_udp_mux({this, mux_send_connect_request_callback, mux_send_data_callback, mux_consume_callback})
+        , m_udp_mux({this, udp_mux_send_connect_request_callback, mux_send_data_callback, mux_consume_callback,
+                  mux_send_datagram_callback})
         , m_icmp_mux({this, mux_send_connect_request_callback, mux_send_data_callback, mux_consume_callback}) {
 #if 0
     quiche_enable_debug_logging(
@@ -144,6 +149,7 @@ bool Http3Upstream::open_session(std::optional<Millis>) {
             .timeout = upstream_config.timeout,
             .max_idle_timeout = m_max_idle_timeout,
             .quic_version = (h3_config.quic_version == 0) ? QUICHE_PROTOCOL_VERSION : h3_config.quic_version,
+            .transport = upstream_config.quic_transport,
     };
 
     VpnError error = quic_connector_connect(m_quic_connector.get(), &connect_prm);
@@ -198,6 +204,8 @@ void Http3Upstream::close_session() {
     m_h3_conn.reset();
     m_quic_conn.reset();
     m_quic_timer.reset();
+    m_pacing_timer.reset();
+    m_pacer = {};
     m_socket.reset();
     m_quic_connector.reset();
     m_tcp_connections.clear();
@@ -467,10 +475,15 @@ VpnConnectionStats Http3Upstream::get_connection_stats() const {
         rtt_ns = std::max(rtt_ns, path_stats.rtt);
     }
 
+    const QuicPacer::Stats &pacing = m_pacer.stats();
     return {
             .rtt_us = uint32_t(rtt_ns / 1000),
             .packet_loss_ratio =
                     (stats.sent > 0) ? static_cast<double>(stats.lost) / static_cast<double>(stats.sent) : 0,
+            .pacing_delay_us = (pacing.paced_packets > 0)
+                    ? uint32_t(duration_cast<microseconds>(pacing.total_delay).count() / pacing.paced_packets)
+                    : 0,
+            .max_burst = uint32_t(pacing.max_burst),
     };
 }
 
@@ -561,6 +574,11 @@ void Http3Upstream::quic_timer_callback(evutil_socket_t, short, void *arg) {
     log_upstream(upstream, dbg, "Done");
 }
 
+void Http3Upstream::pacing_timer_callback(evutil_socket_t, short, void *arg) {
+    auto *upstream = (Http3Upstream *) arg;
+    upstream->flush_pending_quic_data();
+}
+
 bool Http3Upstream::flush_pending_quic_data() {
     if (m_close_on_idle_task_id.has_value()) {
         log_upstream(this, dbg, "Not sending packets when the connection is being closed on idle timeout");
@@ -591,10 +609,28 @@ bool Http3Upstream::flush_pending_quic_data() {
     // so it is sufficient to update the idle timeout only here.
     m_idle_timeout_at_ns = now_ns + duration_cast<nanoseconds>(m_max_idle_timeout).count();
 
-    uint8_t out[QUIC_MAX_UDP_PAYLOAD_SIZE];
-    while (true) {
+    // The packets are written in batches to save on system calls
+    uint8_t out[UDP_SOCKET_MAX_BATCH * QUIC_MAX_UDP_PAYLOAD_SIZE];
+    size_t lengths[UDP_SOCKET_MAX_BATCH];
+    size_t count = 0;
+    size_t offset = 0;
+    size_t burst = 0;
+    bool paced = false;
+
+    // The packet held by the pacer goes first, nothing is sent until it is due
+    if (m_pacer.due_at().has_value()) {
+        if (size_t length = m_pacer.release(out, steady_clock::now(), m_state == H3US_CLOSING); length > 0) {
+            lengths[count++] = length;
+            offset += length;
+            evtimer_del(m_pacing_timer.get());
+        } else {
+            paced = true;
+        }
+    }
+
+    while (!paced) {
         quiche_send_info info{};
-        ssize_t r = quiche_conn_send(m_quic_conn.get(), out, sizeof(out), &info);
+        ssize_t r = quiche_conn_send(m_quic_conn.get(), &out[offset], QUIC_MAX_UDP_PAYLOAD_SIZE, &info);
         if (r == QUICHE_ERR_DONE) {
             log_upstream(this, trace, "Done writing");
             break;
@@ -602,36 +638,31 @@ bool Http3Upstream::flush_pending_quic_data() {
 
         if (r < 0) {
             log_upstream(this, dbg, "Failed to create QUIC packet: {}", magic_enum::enum_name((quiche_error) r));
+            send_quic_packets(out, lengths, count);
             return false;
         }
 
-        if (VpnError err = udp_socket_write(m_socket.get(), out, r); err.code != 0) {
-            log_upstream(this, dbg, "Failed to send QUIC packet: {} ({})", safe_to_string_view(err.text), err.code);
-            switch (m_state) {
-            case H3US_ESTABLISHING:
-            case H3US_ESTABLISHED:
-                if (!AG_ERR_IS_EAGAIN(err.code) && err.code != AG_ENOBUFS && !m_flush_error_task_id.has_value()) {
-                    // in the other states it is enough to indicate an error by returning
-                    // the corresponding value from the function
-                    m_flush_error_task_id = event_loop::submit(this->vpn->parameters.ev_loop,
-                            {
-                                    this,
-                                    [](void *arg, TaskId) {
-                                        auto *self = (Http3Upstream *) arg;
-                                        self->m_flush_error_task_id.release();
-                                        ServerError event = {NON_ID, {VPN_EC_ERROR, "UDP socket failure"}};
-                                        self->handler.func(self->handler.arg, SERVER_EVENT_ERROR, &event);
-                                    },
-                            });
-                }
-                [[fallthrough]];
-            case H3US_IDLE:
-            case H3US_CLOSING:
+        if (hold_paced_packet(&out[offset], r, info)) {
+            paced = true;
+            break;
+        }
+
+        lengths[count++] = r;
+        offset += r;
+        if (count == UDP_SOCKET_MAX_BATCH) {
+            burst += count;
+            if (!send_quic_packets(out, lengths, count)) {
                 return false;
             }
+            count = 0;
+            offset = 0;
         }
+    }
 
-        log_upstream(this, trace, "Sent {} bytes", r);
+    burst += count;
+    m_pacer.on_burst(burst);
+    if (count > 0 && !send_quic_packets(out, lengths, count)) {
+        return false;
     }
 
     if (m_quic_timer == nullptr) {
@@ -649,6 +680,60 @@ bool Http3Upstream::flush_pending_quic_data() {
     return true;
 }
 
+bool Http3Upstream::hold_paced_packet(const uint8_t *packet, size_t length, const quiche_send_info &info) {
+    std::optional<steady_clock::time_point> send_at = QuicPacer::send_time(info);
+    steady_clock::time_point now = steady_clock::now();
+    if (!send_at.has_value() || m_state == H3US_CLOSING || !m_pacer.hold(packet, length, *send_at, now)) {
+        return false;
+    }
+
+    if (m_pacing_timer == nullptr) {
+        m_pacing_timer.reset(
+                evtimer_new(vpn_event_loop_get_base(this->vpn->parameters.ev_loop), pacing_timer_callback, this));
+    }
+
+    int64_t delay_us = ceil<microseconds>(*send_at - now).count();
+    const timeval tv = {.tv_sec = time_t(delay_us / 1'000'000), .tv_usec = suseconds_t(delay_us % 1'000'000)};
+    evtimer_add(m_pacing_timer.get(), &tv);
+    log_upstream(this, trace, "Holding packet of {} bytes for {}us", length, delay_us);
+    return true;
+}
+
+bool Http3Upstream::send_quic_packets(const uint8_t *buffer, const size_t *lengths, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+
+    if (VpnError err = udp_socket_write_batch(m_socket.get(), buffer, lengths, count); err.code != 0) {
+        log_upstream(this, dbg, "Failed to send QUIC packets: {} ({})", safe_to_string_view(err.text), err.code);
+        switch (m_state) {
+        case H3US_ESTABLISHING:
+        case H3US_ESTABLISHED:
+            if (!AG_ERR_IS_EAGAIN(err.code) && err.code != AG_ENOBUFS && !m_flush_error_task_id.has_value()) {
+                // in the other states it is enough to indicate an error by returning
+                // the corresponding value from the function
+                m_flush_error_task_id = event_loop::submit(this->vpn->parameters.ev_loop,
+                        {
+                                this,
+                                [](void *arg, TaskId) {
+                                    auto *self = (Http3Upstream *) arg;
+                                    self->m_flush_error_task_id.release();
+                                    ServerError event = {NON_ID, {VPN_EC_ERROR, "UDP socket failure"}};
+                                    self->handler.func(self->handler.arg, SERVER_EVENT_ERROR, &event);
+                                },
+                        });
+            }
+            [[fallthrough]];
+        case H3US_IDLE:
+        case H3US_CLOSING:
+            return false;
+        }
+    }
+
+    log_upstream(this, trace, "Sent {} packets", count);
+    return true;
+}
+
 void Http3Upstream::on_udp_packet() {
     constexpr size_t READ_BUDGET = 64;
 
@@ -661,10 +746,12 @@ void Http3Upstream::on_udp_packet() {
             .to = (sockaddr *) local_address.c_sockaddr(),
             .to_len = local_address.c_socklen(),
     };
-    uint8_t buffer[QUIC_MAX_UDP_PAYLOAD_SIZE];
-    for (size_t i = 0; i < READ_BUDGET; ++i) {
-        ssize_t r = udp_socket_recv(m_socket.get(), buffer, std::size(buffer));
-        if (r <= 0) {
+    uint8_t buffer[UDP_SOCKET_MAX_BATCH][QUIC_MAX_RECV_UDP_PAYLOAD_SIZE];
+    size_t lengths[UDP_SOCKET_MAX_BATCH];
+    for (size_t budget = READ_BUDGET; budget > 0;) {
+        size_t batch = std::min(budget, UDP_SOCKET_MAX_BATCH);
+        ssize_t n = udp_socket_recv_batch(m_socket.get(), buffer[0], std::size(buffer[0]), lengths, batch);
+        if (n <= 0) {
             int err = evutil_socket_geterror(udp_socket_get_fd(m_socket.get()));
             if (err != 0 && !AG_ERR_IS_EAGAIN(err)) {
                 log_upstream(
@@ -672,23 +759,34 @@ void Http3Upstream::on_udp_packet() {
             }
             break;
         }
+        budget -= n;
+
+        bool failed = false;
+        for (ssize_t i = 0; i < n; ++i) {
+            log_upstream(this, trace, "Read {} bytes from endpoint", lengths[i]);
+            ssize_t r = quiche_conn_recv(quic_conn, buffer[i], lengths[i], &info);
+            if (r < 0) {
+                // The rest of the batch has already been read out of the socket, so process it anyway
+                log_upstream(this, warn, "Failed to process packet: {}", magic_enum::enum_name((quiche_error) r));
+                failed = true;
+                continue;
+            }
 
-        log_upstream(this, trace, "Read {} bytes from endpoint", r);
-        r = quiche_conn_recv(quic_conn, buffer, r, &info);
-        if (r < 0) {
-            log_upstream(this, warn, "Failed to process packet: {}", magic_enum::enum_name((quiche_error) r));
-            break;
-        }
+            // Data receival indicates that the connection is alive.
+            // Cancelling the health check now should reduce the probability
+            // of bogus health check failures due to a slow remote.
+            cancel_health_check();
 
-        // Data receival indicates that the connection is alive.
-        // Cancelling the health check now should reduce the probability
-        // of bogus health check failures due to a slow remote.
-        cancel_health_check();
+            if (quiche_conn_is_closed(quic_conn)) {
+                log_upstream(this, dbg, "QUIC connection closed");
+                close_session_inner();
+                return;
+            }
+        }
 
-        if (quiche_conn_is_closed(quic_conn)) {
-            log_upstream(this, dbg, "QUIC connection closed");
-            close_session_inner();
-            return;
+        if (failed || size_t(n) < batch) {
+            // Either an error or the socket is drained
+            break;
         }
     }
 
@@ -751,6 +849,9 @@ void Http3Upstream::on_udp_packet() {
             quiche_h3_event_free(h3_event);
         }
 
+        // Datagrams are not reported by the poll if the peer's settings have not been received yet
+        this->read_datagrams();
+
         log_upstream(this, trace, "Poll done");
 
         // do some things here as they may now be available
@@ -887,6 +988,9 @@ void Http3Upstream::handle_h3_event(quiche_h3_event *h3_event, uint64_t stream_i
         break;
 
     case QUICHE_H3_EVENT_DATAGRAM:
+        this->read_datagrams();
+        break;
+
     case QUICHE_H3_EVENT_PRIORITY_UPDATE:
         log_stream(this, stream_id, warn, "Unexpected event: {}", magic_enum::enum_name(event_type));
         assert(0);
@@ -1090,13 +1194,16 @@ void Http3Upstream::close_session_inner(std::optional<VpnError> error) {
 }
 
 Http3Upstream::SendConnectRequestResult Http3Upstream::send_connect_request(
-        const TunnelAddress *dst_addr, std::string_view app_name) {
+        const TunnelAddress *dst_addr, std::string_view app_name, bool offer_datagrams) {
     if (m_h3_conn == nullptr) {
         log_upstream(this, dbg, "Failed to send connect request: upstream is not connected");
         return {std::nullopt, false};
     }
 
     HttpHeaders headers = make_http_connect_request(HTTP_VER_3_0, dst_addr, app_name, m_credentials);
+    if (offer_datagrams) {
+        headers.put_field(std::string{CAPSULE_PROTOCOL_HEADER}, "?1");
+    }
 
     std::vector<NameValue> nva = http_headers_to_nv_list(&headers);
     std::vector<quiche_h3_header> h3_headers(nva.size());
@@ -1178,7 +1285,7 @@ std::optional<uint64_t> Http3Upstream::get_stream_id(uint64_t id) const {
 
 bool Http3Upstream::push_unread_data(uint64_t conn_id, TcpConnection *conn, U8View data) const {
     if (conn->unread_data == nullptr) {
-        conn->unread_data = this->vpn->make_buffer(conn_id);
+        conn->unread_data = this->vpn->make_buffer();
         if (std::optional<std::string> err = conn->unread_data->init(); err.has_value()) {
             log_conn(this, conn_id, err, "Failed to initialize data buffer: {}", *err);
             return false;
@@ -1199,18 +1306,25 @@ int Http3Upstream::read_out_pending_data(uint64_t conn_id, TcpConnection *conn)
         return 0;
     }
 
+    std::array<U8View, DATA_BUFFER_PEEK_SEGMENTS> segments;
     while (conn->flags.test(TcpConnection::TCF_READ_ENABLED) && pending->size() > 0) {
-        BufferPeekResult res = pending->peek();
+        BufferPeekIovResult res = pending->peek_iov(segments);
         if (res.err.has_value()) {
             log_conn(this, conn_id, err, "Failed to read buffered data: {}", *res.err);
             return -1;
         }
-        int r = this->raise_read_event(conn_id, res.data);
-        if (r > 0) {
-            pending->drain(r);
-        } else if (r < 0) {
-            return r;
+        size_t consumed = 0;
+        for (U8View segment : std::span{segments}.first(res.count)) {
+            int r = this->raise_read_event(conn_id, segment);
+            if (r < 0) {
+                return r;
+            }
+            consumed += r;
+            if (size_t(r) < segment.size() || !conn->flags.test(TcpConnection::TCF_READ_ENABLED)) {
+                break;
+            }
         }
+        pending->drain(consumed);
     }
 
     return 0;
@@ -1311,6 +1425,14 @@ std::optional<uint64_t> Http3Upstream::mux_send_connect_request_callback(
     return self->send_connect_request(dst_addr, app_name).stream_id;
 }
 
+std::optional<uint64_t> Http3Upstream::udp_mux_send_connect_request_callback(
+        ServerUpstream *upstream, const TunnelAddress *dst_addr, std::string_view app_name) {
+    auto *self = (Http3Upstream *) upstream;
+    bool offer_datagrams = self->m_h3_conn != nullptr
+            && quiche_h3_dgram_enabled_by_peer(self->m_h3_conn.get(), self->m_quic_conn.get());
+    return self->send_connect_request(dst_addr, app_name, offer_datagrams).stream_id;
+}
+
 int Http3Upstream::mux_send_data_callback(ServerUpstream *upstream, uint64_t stream_id, U8View data) {
     auto *self = (Http3Upstream *) upstream;
     assert(self->m_udp_mux.get_stream_id() == stream_id || self->m_icmp_mux.get_stream_id() == stream_id);
@@ -1355,6 +1477,56 @@ void Http3Upstream::mux_consume_callback(ServerUpstream *, uint64_t, size_t) {
     // Nothing to do
 }
 
+int Http3Upstream::mux_send_datagram_callback(ServerUpstream *upstream, uint64_t stream_id, U8View data) {
+    auto *self = (Http3Upstream *) upstream;
+    assert(self->m_udp_mux.get_stream_id() == stream_id);
+
+    // HTTP datagrams are bound to the request stream by the quarter stream ID (RFC 9297)
+    size_t length = wire_utils::varint_size(stream_id / 4) + data.size();
+    ssize_t max_len = quiche_conn_dgram_max_writable_len(self->m_quic_conn.get());
+    if (max_len < 0 || length > (size_t) max_len) {
+        log_upstream(self, trace, "Datagram of {} bytes does not fit in QUIC packet ({})", length, max_len);
+        return -1;
+    }
+
+    uint8_t buffer[QUIC_MAX_UDP_PAYLOAD_SIZE];
+    wire_utils::Writer writer({buffer, length});
+    writer.put_varint(stream_id / 4);
+    writer.put_data(data);
+
+    ssize_t r = quiche_conn_dgram_send(self->m_quic_conn.get(), buffer, length);
+    if (r < 0) {
+        log_upstream(self, dbg, "Failed to send datagram: quiche_conn_dgram_send: {}",
+                magic_enum::enum_name((quiche_error) r));
+        return (int) r;
+    }
+
+    return 0;
+}
+
+void Http3Upstream::read_datagrams() {
+    uint8_t buffer[QUIC_MAX_RECV_UDP_PAYLOAD_SIZE];
+    while (true) {
+        ssize_t r = quiche_conn_dgram_recv(m_quic_conn.get(), buffer, std::size(buffer));
+        if (r < 0) {
+            if (r != QUICHE_ERR_DONE) {
+                log_upstream(this, dbg, "Failed to receive datagram: quiche_conn_dgram_recv: {}",
+                        magic_enum::enum_name((quiche_error) r));
+            }
+            break;
+        }
+
+        wire_utils::Reader reader({buffer, (size_t) r});
+        std::optional<uint64_t> quarter_stream_id = reader.get_varint();
+        if (!quarter_stream_id.has_value() || m_udp_mux.get_stream_id() != quarter_stream_id.value() * 4) {
+            log_upstream(this, dbg, "Drop datagram of {} bytes on unknown stream", r);
+            continue;
+        }
+
+        m_udp_mux.process_datagram(reader.get_buffer());
+    }
+}
+
 void Http3Upstream::handle_sleep() {
     log_upstream(this, dbg, "...");
 
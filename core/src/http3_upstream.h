@@ -17,6 +17,7 @@
 #include "http_udp_multiplexer.h"
 #include "net/quic_connector.h"
 #include "net/udp_socket.h"
+#include "quic_pacer.h"
 #include "vpn/internal/data_buffer.h"
 #include "vpn/internal/server_upstream.h"
 #include "vpn/utils.h"
@@ -89,6 +90,8 @@ private:
     HttpUdpMultiplexer m_udp_mux;
     HttpIcmpMultiplexer m_icmp_mux;
     DeclPtr<event, &event_free> m_quic_timer;
+    DeclPtr<event, &event_free> m_pacing_timer;
+    QuicPacer m_pacer;
     std::string m_credentials;
     std::optional<HealthCheckInfo> m_health_check_info;
     bool m_in_handler = false;
@@ -132,11 +135,14 @@ private:
     int kex_group_nid() const override;
 
     static void quic_timer_callback(evutil_socket_t, short, void *arg);
+    static void pacing_timer_callback(evutil_socket_t, short, void *arg);
     static void socket_handler(void *arg, UdpSocketEvent what, void *data);
     static void quic_connector_handler(void *arg, QuicConnectorEvent what, void *data);
     static int verify_callback(X509_STORE_CTX *store_ctx, void *arg);
 
     bool flush_pending_quic_data();
+    bool send_quic_packets(const uint8_t *buffer, const size_t *lengths, size_t count);
+    bool hold_paced_packet(const uint8_t *packet, size_t length, const quiche_send_info &info);
     void on_udp_packet();
     bool initiate_h3_session();
     std::pair<uint64_t, TcpConnection *> get_tcp_conn_by_stream_id(uint64_t id);
@@ -146,7 +152,9 @@ private:
     ssize_t read_out_h3_data(uint64_t stream_id, const uint8_t *buffer, size_t cap);
     void process_pending_data(uint64_t stream_id);
     void close_session_inner(std::optional<VpnError> error = std::nullopt);
-    SendConnectRequestResult send_connect_request(const TunnelAddress *dst_addr, std::string_view app_name);
+    SendConnectRequestResult send_connect_request(
+            const TunnelAddress *dst_addr, std::string_view app_name, bool offer_datagrams = false);
+    void read_datagrams();
     void close_tcp_connection(uint64_t id, bool graceful);
     void clean_tcp_connection_data(uint64_t id);
     [[nodiscard]] bool is_health_check_stream(uint64_t stream_id) const;
@@ -161,7 +169,10 @@ private:
     static void complete_read(void *arg, TaskId task_id);
     static std::optional<uint64_t> mux_send_connect_request_callback(
             ServerUpstream *upstream, const TunnelAddress *dst_addr, std::string_view app_name);
+    static std::optional<uint64_t> udp_mux_send_connect_request_callback(
+            ServerUpstream *upstream, const TunnelAddress *dst_addr, std::string_view app_name);
     static int mux_send_data_callback(ServerUpstream *upstream, uint64_t stream_id, U8View data);
+    static int mux_send_datagram_callback(ServerUpstream *upstream, uint64_t stream_id, U8View data);
     static void mux_consume_callback(ServerUpstream *, uint64_t, size_t);
 };
 
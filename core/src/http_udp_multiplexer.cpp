@@ -27,22 +27,29 @@ struct CompleteCtx {
 };
 
 static std::atomic_int g_next_mux_id = 0; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
-static constexpr Secs TIMER_PERIOD{15};
 
-static std::vector<uint8_t> compose_udp_packet(const SocketAddress *src, const SocketAddress *dst,
-        std::string_view app_name, const uint8_t *data, size_t length) {
+/**
+ * Compose an outgoing packet. If the context ID is specified, the packet is prefixed with it
+ * to be sent in an HTTP datagram.
+ */
+static std::vector<uint8_t> compose_udp_packet(std::optional<uint64_t> context_id, const SocketAddress *src,
+        const SocketAddress *dst, std::string_view app_name, const uint8_t *data, size_t length) {
+    app_name = app_name.substr(0, UINT8_MAX);
     size_t full_length = UDPPKT_IN_PREFIX_SIZE + UDPPKT_APPLEN_SIZE + app_name.size() + length;
+    size_t context_id_size = context_id.has_value() ? wire_utils::varint_size(context_id.value()) : 0;
 
-    std::vector<uint8_t> packet_buffer(full_length);
+    std::vector<uint8_t> packet_buffer(context_id_size + full_length);
     wire_utils::Writer writer({packet_buffer.data(), packet_buffer.size()});
 
+    if (context_id.has_value()) {
+        writer.put_varint(context_id.value());
+    }
     writer.put_u32(full_length - UDPPKT_LENGTH_SIZE);
     writer.put_ip_padded(*src);
     writer.put_u16(src->port());
     writer.put_ip_padded(*dst);
     writer.put_u16(dst->port());
 
-    app_name = app_name.substr(0, UINT8_MAX);
     writer.put_u8(uint8_t(app_name.size()));
     writer.put_data({(uint8_t *) app_name.data(), app_name.size()});
 
@@ -56,7 +63,11 @@ HttpUdpMultiplexer::HttpUdpMultiplexer(HttpUdpMultiplexerParameters parameters)
         , m_id(g_next_mux_id++) {
 }
 
-HttpUdpMultiplexer::~HttpUdpMultiplexer() = default;
+HttpUdpMultiplexer::~HttpUdpMultiplexer() {
+    for (auto &[id, conn] : m_connections) {
+        vpn_event_loop_timer_stop(m_params.parent->vpn->parameters.ev_loop, &conn.timer);
+    }
+}
 
 void HttpUdpMultiplexer::close(ServerError serv_err) {
     ServerUpstream *upstream = m_params.parent;
@@ -90,8 +101,10 @@ void HttpUdpMultiplexer::reset() {
     m_state = MS_IDLE;
     m_stream_id = 0;
     m_addr_to_id.clear();
+    m_context_to_id.clear();
+    m_next_context_id = DATAGRAM_FIRST_CONTEXT_ID;
+    m_datagrams_enabled = false;
     m_recv_connection = {};
-    m_timer_event.reset();
 }
 
 void HttpUdpMultiplexer::complete_udp_connection(void *arg, TaskId) {
@@ -139,9 +152,12 @@ bool HttpUdpMultiplexer::open_connection(uint64_t conn_id, const TunnelAddressPa
         m_state = MS_ESTABLISHED;
         [[fallthrough]];
     }
-    case MS_ESTABLISHED:
-        m_connections.emplace(conn_id,
+    case MS_ESTABLISHED: {
+        auto i = m_connections.emplace(conn_id,
                 Connection{
+                        .mux = this,
+                        .id = conn_id,
+                        .context_id = m_next_context_id,
                         .addr = *addr,
                         .app_name = std::string{app_name},
                         .timeout = steady_clock::now() + milliseconds(VPN_DEFAULT_UDP_TIMEOUT_MS),
@@ -153,15 +169,16 @@ bool HttpUdpMultiplexer::open_connection(uint64_t conn_id, const TunnelAddressPa
                                             delete (CompleteCtx *) arg;
                                         },
                                 }),
-                });
+                }).first;
+        m_context_to_id[m_next_context_id] = conn_id;
+        m_next_context_id += 2;
+        // The timeout is refreshed on every packet, the timer re-arms itself for the time left when it fires
+        Connection *conn = &i->second;
+        conn->timer = {.callback = timer_callback, .arg = conn};
+        vpn_event_loop_timer_start(
+                upstream->vpn->parameters.ev_loop, &conn->timer, Millis{VPN_DEFAULT_UDP_TIMEOUT_MS});
         break;
     }
-
-    if (m_timer_event == nullptr) {
-        m_timer_event.reset(event_new(
-                vpn_event_loop_get_base(upstream->vpn->parameters.ev_loop), -1, EV_PERSIST, timer_callback, this));
-        timeval tv = ms_to_timeval(Millis(TIMER_PERIOD).count());
-        event_add(m_timer_event.get(), &tv);
     }
 
     return true;
@@ -226,8 +243,25 @@ ssize_t HttpUdpMultiplexer::send(uint64_t id, U8View data) {
     SocketAddress *dst = std::get_if<SocketAddress>(&conn->addr.dst);
     log_conn(this, id, trace, "Sending UDP packet: {}->{} len={}", *src, *dst, data.size());
 
-    std::vector<uint8_t> packet = compose_udp_packet(src, dst, conn->app_name, data.data(), data.size());
-    int r = m_params.send_data_callback(m_params.parent, m_stream_id, {packet.data(), packet.size()});
+    std::optional<uint64_t> context_id;
+    if (m_datagrams_enabled) {
+        context_id = conn->context_id;
+    }
+    std::vector<uint8_t> packet = compose_udp_packet(context_id, src, dst, conn->app_name, data.data(), data.size());
+    U8View packet_view = {packet.data(), packet.size()};
+
+    int r = -1;
+    if (context_id.has_value()) {
+        r = m_params.send_datagram_callback(m_params.parent, m_stream_id, packet_view);
+        if (r != 0) {
+            // E.g., the packet does not fit in a QUIC datagram, so use the stream which is still open
+            log_conn(this, id, trace, "Failed to send packet in datagram, falling back to stream");
+            packet_view.remove_prefix(wire_utils::varint_size(context_id.value()));
+        }
+    }
+    if (r != 0) {
+        r = m_params.send_data_callback(m_params.parent, m_stream_id, packet_view);
+    }
     if (r == 0) {
         conn->timeout = steady_clock::now() + milliseconds(VPN_DEFAULT_UDP_TIMEOUT_MS);
         conn->sent_bytes_since_flush += data.size();
@@ -237,7 +271,7 @@ ssize_t HttpUdpMultiplexer::send(uint64_t id, U8View data) {
     return -1;
 }
 
-HttpUdpMultiplexer::PacketInfo HttpUdpMultiplexer::read_prefix(const std::vector<uint8_t> &data) const {
+HttpUdpMultiplexer::PacketInfo HttpUdpMultiplexer::read_prefix(U8View data) const {
     assert(data.size() == UDPPKT_IN_PREFIX_SIZE);
 
     PacketInfo info = {NON_ID, 0};
@@ -301,7 +335,7 @@ int HttpUdpMultiplexer::process_read_event(U8View data) {
 
             assert(rconn->buffer.size() == UDPPKT_IN_PREFIX_SIZE);
 
-            PacketInfo info = read_prefix(rconn->buffer);
+            PacketInfo info = read_prefix({rconn->buffer.data(), rconn->buffer.size()});
             bool drop_packet = false;
             if (info.id == NON_ID) {
                 // logged in `read_prefix`
@@ -338,8 +372,7 @@ int HttpUdpMultiplexer::process_read_event(U8View data) {
             rconn->bytes_left -= to_read;
 
             if (rconn->bytes_left == 0) {
-                ServerReadEvent serv_event = {rconn->id, rconn->buffer.data(), rconn->buffer.size(), 0};
-                upstream->handler.func(upstream->handler.arg, SERVER_EVENT_READ, &serv_event);
+                raise_read(rconn->id, {rconn->buffer.data(), rconn->buffer.size()});
                 *rconn = {};
             }
 
@@ -366,25 +399,73 @@ int HttpUdpMultiplexer::process_read_event(U8View data) {
     return 0;
 }
 
-void HttpUdpMultiplexer::timer_callback(evutil_socket_t, short, void *arg) {
-    auto *multiplexer = (HttpUdpMultiplexer *) arg;
-    ServerUpstream *upstream = multiplexer->m_params.parent;
+int HttpUdpMultiplexer::process_datagram(U8View data) {
+    if (m_state != MS_ESTABLISHED) {
+        log_mux(this, dbg, "Drop datagram as multiplexer is not established");
+        return -1;
+    }
 
-    time_point<steady_clock> now = steady_clock::now();
+    wire_utils::Reader reader(data);
+    std::optional<uint64_t> context_id = reader.get_varint();
+    U8View packet = reader.get_buffer();
+    std::optional<uint32_t> length = wire_utils::Reader(packet).get_u32();
+    if (!context_id.has_value() || packet.size() < UDPPKT_IN_PREFIX_SIZE
+            || length != packet.size() - UDPPKT_LENGTH_SIZE) {
+        log_mux(this, dbg, "Drop malformed datagram of {} bytes", data.size());
+        return -1;
+    }
 
-    for (auto i = multiplexer->m_connections.begin(); i != multiplexer->m_connections.end();) {
-        auto next = std::next(i);
+    PacketInfo info = {NON_ID, packet.size() - UDPPKT_IN_PREFIX_SIZE};
+    if (auto i = m_context_to_id.find(context_id.value()); i != m_context_to_id.end()) {
+        info.id = i->second;
+        log_conn(this, info.id, trace, "Got UDP datagram: context={} len={}", context_id.value(), info.payload_length);
+    } else {
+        // The endpoint does not track the context IDs, so fall back to the addresses
+        info = read_prefix(packet.substr(0, UDPPKT_IN_PREFIX_SIZE));
+    }
 
-        Connection *conn = &i->second;
-        if (conn->timeout <= now) {
-            uint64_t id = i->first;
-            log_conn(multiplexer, id, trace, "Timed out");
-            multiplexer->clean_connection_data(id);
-            upstream->handler.func(upstream->handler.arg, SERVER_EVENT_CONNECTION_CLOSED, &id);
-        }
+    auto i = m_connections.find(info.id);
+    if (i == m_connections.end()) {
+        // logged in `read_prefix`
+        return 0;
+    }
+    if (!i->second.read_enabled) {
+        log_conn(this, info.id, dbg, "Read is disabled, dropping packet");
+        return 0;
+    }
 
-        i = next;
+    i->second.timeout = steady_clock::now() + milliseconds(VPN_DEFAULT_UDP_TIMEOUT_MS);
+    packet.remove_prefix(UDPPKT_IN_PREFIX_SIZE);
+    raise_read(info.id, packet);
+    return 0;
+}
+
+bool HttpUdpMultiplexer::datagrams_enabled() const {
+    return m_datagrams_enabled;
+}
+
+void HttpUdpMultiplexer::raise_read(uint64_t id, U8View payload) {
+    ServerUpstream *upstream = m_params.parent;
+    ServerReadEvent serv_event = {id, payload.data(), payload.size(), 0};
+    upstream->handler.func(upstream->handler.arg, SERVER_EVENT_READ, &serv_event);
+}
+
+void HttpUdpMultiplexer::timer_callback(void *arg) {
+    auto *conn = (Connection *) arg;
+    HttpUdpMultiplexer *multiplexer = conn->mux;
+    ServerUpstream *upstream = multiplexer->m_params.parent;
+
+    time_point<steady_clock> now = steady_clock::now();
+    if (conn->timeout > now) {
+        vpn_event_loop_timer_start(upstream->vpn->parameters.ev_loop, &conn->timer,
+                ceil<milliseconds>(conn->timeout - now));
+        return;
     }
+
+    uint64_t id = conn->id;
+    log_conn(multiplexer, id, trace, "Timed out");
+    multiplexer->clean_connection_data(id);
+    upstream->handler.func(upstream->handler.arg, SERVER_EVENT_CONNECTION_CLOSED, &id);
 }
 
 void HttpUdpMultiplexer::handle_response(const HttpHeaders *response) {
@@ -393,6 +474,14 @@ void HttpUdpMultiplexer::handle_response(const HttpHeaders *response) {
     if (response->status_code != HTTP_OK_STATUS) {
         // will be raised in `close` after stream close
         m_pending_error = {0, {ag::utils::AG_ECONNREFUSED, "HTTP stream creation failed"}};
+        return;
+    }
+
+    // The endpoint confirms the datagram mode offered in the request by echoing the header
+    if (auto capsule_protocol = response->get_field(CAPSULE_PROTOCOL_HEADER);
+            m_params.send_datagram_callback != nullptr && capsule_protocol && *capsule_protocol == "?1") {
+        log_mux(this, dbg, "Sending packets in HTTP datagrams");
+        m_datagrams_enabled = true;
     }
 }
 
@@ -406,7 +495,9 @@ bool HttpUdpMultiplexer::clean_connection_data(uint64_t id) {
         m_recv_connection.state = RCS_DROPPING;
     }
 
+    vpn_event_loop_timer_stop(m_params.parent->vpn->parameters.ev_loop, &i->second.timer);
     m_addr_to_id.erase(i->second.addr);
+    m_context_to_id.erase(i->second.context_id);
     m_connections.erase(i);
     log_mux(this, dbg, "Remaining connections: {}", m_connections.size());
     return true;
@@ -2,6 +2,7 @@
 
 #include <chrono>
 #include <optional>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -26,6 +27,15 @@ namespace ag {
  * |  Length  | Source address | Source port | Destination address | Destination port | App name len (L) | App name | Payload |
  * | 4 bytes  |  16 bytes      | 2 bytes     |  16 bytes           | 2 bytes          | 1 byte           | L bytes  | N bytes |
  * +----------+----------------+-------------+---------------------+------------------+------------------+----------+---------+
+ * <p>
+ * In datagram mode (negotiated with `capsule-protocol` header, see RFC 9297) a packet may also be sent in
+ * an HTTP datagram associated with the multiplexer stream. The datagram payload is the packet prefixed with
+ * the context ID of its UDP "connection". The endpoint replies with the same context ID, or 0 if it is unknown.
+ * <p>
+ * +--------------------+-----------------------------+
+ * |  Context ID        | Incoming or outgoing packet |
+ * | variable-length    | N bytes                     |
+ * +--------------------+-----------------------------+
  */
 // clang-format on
 
@@ -37,6 +47,9 @@ static constexpr size_t UDPPKT_IN_PREFIX_SIZE = UDPPKT_LENGTH_SIZE + 2 * (UDPPKT
 static constexpr size_t UDPPKT_APPLEN_SIZE = 1;
 static constexpr size_t UDPPKT_APP_MAXSIZE = 255;
 
+/** Offers the datagram mode in the request and confirms it in the response */
+static constexpr std::string_view CAPSULE_PROTOCOL_HEADER = "capsule-protocol";
+
 static constexpr size_t MAX_UDP_PAYLOAD_SIZE = 65535 - 8; // 8 bytes header
 static constexpr size_t MAX_UDP_IN_PACKET_LENGTH = MAX_UDP_PAYLOAD_SIZE + UDPPKT_IN_PREFIX_SIZE - UDPPKT_LENGTH_SIZE;
 
@@ -48,6 +61,11 @@ struct HttpUdpMultiplexerParameters {
     /** @return 0 in case of success, non-zero value otherwise */
     int (*send_data_callback)(ServerUpstream *upstream, uint64_t stream_id, U8View data) = nullptr;
     void (*consume_callback)(ServerUpstream *upstream, uint64_t stream_id, size_t size) = nullptr;
+    /**
+     * Send an HTTP datagram associated with the stream. May be null if the transport has no datagram support.
+     * @return 0 in case of success, non-zero value if the packet must be sent on the stream instead
+     */
+    int (*send_datagram_callback)(ServerUpstream *upstream, uint64_t stream_id, U8View data) = nullptr;
 };
 
 /**
@@ -106,6 +124,17 @@ public:
      */
     int process_read_event(U8View data);
 
+    /**
+     * Process HTTP datagram payload received on the multiplexer stream
+     * @return 0 if successful
+     */
+    int process_datagram(U8View data);
+
+    /**
+     * Check if the UDP packets are sent in HTTP datagrams
+     */
+    [[nodiscard]] bool datagrams_enabled() const;
+
     /**
      * Handle response to stream creation request
      */
@@ -130,6 +159,9 @@ public:
     [[nodiscard]] size_t connections_num() const;
 
 private:
+    // Context ID 0 is reserved by RFC 9298 for the UDP payload, the client-allocated ones are even
+    static constexpr uint64_t DATAGRAM_FIRST_CONTEXT_ID = 2;
+
     enum MultiplexerState {
         MS_IDLE,
         MS_ESTABLISHED,
@@ -142,11 +174,15 @@ private:
     };
 
     struct Connection {
+        HttpUdpMultiplexer *mux = nullptr;
+        uint64_t id = NON_ID;
+        uint64_t context_id = 0;   // HTTP datagram context ID
         bool read_enabled = false; // if true `SERVER_EVENT_READ` can be raised
         TunnelAddressPair addr;
         std::string app_name;
         size_t sent_bytes_since_flush = 0; // number of bytes sent since last socket write buffer flush
         std::chrono::time_point<std::chrono::steady_clock> timeout;
+        VpnEventLoopTimer timer{}; // fires once `timeout` may have passed
         event_loop::AutoTaskId open_task_id;
         event_loop::AutoTaskId close_task_id;
     };
@@ -169,14 +205,17 @@ private:
     RecvConnection m_recv_connection = {};
     std::unordered_map<TunnelAddressPair, uint64_t> m_addr_to_id;
     std::unordered_map<uint64_t, Connection> m_connections;
-    EventPtr m_timer_event = nullptr;
+    std::unordered_map<uint64_t, uint64_t> m_context_to_id;
+    uint64_t m_next_context_id = DATAGRAM_FIRST_CONTEXT_ID;
+    bool m_datagrams_enabled = false;
     std::optional<ServerError> m_pending_error;
     ag::Logger m_log{"UDP_MUX"};
     int m_id;
 
     static void complete_udp_connection(void *arg, TaskId task_id);
-    static void timer_callback(evutil_socket_t, short, void *arg);
-    [[nodiscard]] PacketInfo read_prefix(const std::vector<uint8_t> &data) const;
+    static void timer_callback(void *arg);
+    [[nodiscard]] PacketInfo read_prefix(U8View data) const;
+    void raise_read(uint64_t id, U8View payload);
     /**
      * @return true if a connection with such id existed, false otherwise
      */
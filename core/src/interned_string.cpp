@@ -0,0 +1,41 @@
+#include "vpn/internal/interned_string.h"
+
+#include <mutex>
+#include <unordered_set>
+
+namespace ag {
+
+struct StringHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view str) const {
+        return std::hash<std::string_view>{}(str);
+    }
+};
+
+struct StringPool {
+    std::mutex mutex;
+    std::unordered_set<std::string, StringHash, std::equal_to<>> strings;
+};
+
+static StringPool &string_pool() {
+    // Never destroyed, as the strings may be referred to until the very exit
+    static auto *pool = new StringPool;
+    return *pool;
+}
+
+InternedString::InternedString(std::string_view str) {
+    if (str.empty()) {
+        return;
+    }
+
+    StringPool &pool = string_pool();
+    std::scoped_lock l(pool.mutex);
+    auto it = pool.strings.find(str);
+    if (it == pool.strings.end()) {
+        it = pool.strings.emplace(str).first;
+    }
+    m_str = &*it;
+}
+
+} // namespace ag
@@ -0,0 +1,104 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#include "common/logger.h"
+#include "common/utils.h"
+
+namespace ag {
+
+#ifdef _WIN32
+
+std::unique_ptr<MappedFile> MappedFile::open(const std::string &path, std::string &error) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = AG_FMT("Failed to open file: {}", GetLastError());
+        return nullptr;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        error = AG_FMT("Failed to get file size: {}", GetLastError());
+        CloseHandle(file);
+        return nullptr;
+    }
+    std::unique_ptr<MappedFile> self{new MappedFile};
+    self->m_size = size_t(size.QuadPart);
+    if (self->m_size == 0) {
+        CloseHandle(file);
+        return self;
+    }
+    // The mapping keeps the file open
+    self->m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (self->m_mapping == nullptr) {
+        error = AG_FMT("Failed to create file mapping: {}", GetLastError());
+        return nullptr;
+    }
+    self->m_data = (const uint8_t *) MapViewOfFile(self->m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (self->m_data == nullptr) {
+        error = AG_FMT("Failed to map file: {}", GetLastError());
+        return nullptr;
+    }
+    return self;
+}
+
+MappedFile::~MappedFile() {
+    if (m_data != nullptr) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping != nullptr) {
+        CloseHandle(m_mapping);
+    }
+}
+
+#else
+
+std::unique_ptr<MappedFile> MappedFile::open(const std::string &path, std::string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = AG_FMT("Failed to open file: {}", strerror(errno));
+        return nullptr;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        error = AG_FMT("Failed to get file size: {}", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    std::unique_ptr<MappedFile> self{new MappedFile};
+    self->m_size = size_t(st.st_size);
+    if (self->m_size == 0) {
+        close(fd);
+        return self;
+    }
+    // The mapping keeps the file open
+    void *data = mmap(nullptr, self->m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error = AG_FMT("Failed to map file: {}", strerror(errno));
+        return nullptr;
+    }
+    self->m_data = (const uint8_t *) data;
+    return self;
+}
+
+MappedFile::~MappedFile() {
+    if (m_data != nullptr) {
+        munmap((void *) m_data, m_size);
+    }
+}
+
+#endif // _WIN32
+
+} // namespace ag
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "vpn/utils.h"
+
+namespace ag {
+
+/**
+ * Read-only mapping of a whole file into memory. The pages are loaded on access and are backed by the file,
+ * so the system may drop them under memory pressure instead of swapping.
+ */
+class MappedFile {
+public:
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&) = delete;
+    MappedFile &operator=(MappedFile &&) = delete;
+
+    /**
+     * Map a file
+     * @return nullptr on error, in which case `error` receives the description
+     */
+    static std::unique_ptr<MappedFile> open(const std::string &path, std::string &error);
+
+    /** The file contents, aligned to the page size */
+    [[nodiscard]] U8View data() const {
+        return {m_data, m_size};
+    }
+
+private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void *m_mapping = nullptr;
+#endif // _WIN32
+
+    MappedFile() = default;
+};
+
+} // namespace ag
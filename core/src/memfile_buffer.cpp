@@ -1,27 +1,33 @@
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <unordered_set>
 
 #include "memfile_buffer.h"
 #include "memory_buffer.h"
-#include "vpn/platform.h"
+#include "vpn/internal/buffer_accountant.h"
 #include "vpn/utils.h"
 
 namespace ag {
 
-MemfileBuffer::MemfileBuffer(std::string path, size_t mem_threshold, size_t max_file_size)
+/** The buffers of the thread, swept for eviction once the budget is exhausted */
+static thread_local std::unordered_set<MemfileBuffer *> g_thread_buffers;
+static thread_local std::chrono::steady_clock::time_point g_last_sweep;
+
+MemfileBuffer::MemfileBuffer(std::string dir, size_t mem_threshold, size_t max_file_size)
         : m_mem_buffer(std::make_unique<MemoryBuffer>())
         , m_threshold(mem_threshold)
         , m_max_file_size(max_file_size)
-        , m_path(std::move(path)) {
-    assert(!m_path.empty());
+        , m_dir(std::move(dir))
+        , m_tail(std::make_unique<MemoryBuffer>()) {
+    assert(!m_dir.empty());
+    g_thread_buffers.insert(this);
 }
 
 MemfileBuffer::~MemfileBuffer() {
-    file::close(std::exchange(m_fd, file::INVALID_HANDLE));
-
-    if (!m_path.empty()) {
-        std::error_code err;
-        fs::remove(m_path, err);
+    g_thread_buffers.erase(this);
+    for (const SpilledExtent &e : m_extents) {
+        m_file->release(e.extent);
     }
 }
 
@@ -30,274 +36,237 @@ std::optional<std::string> MemfileBuffer::init() {
 }
 
 size_t MemfileBuffer::size() const {
-    ssize_t fsize = (m_fd != file::INVALID_HANDLE) ? file::get_size(m_fd) : 0;
-    assert(fsize >= (ssize_t) m_read_offset);
-
-    size_t stored_in_file = std::max(fsize, (ssize_t) 0) - m_read_offset;
-
-    return m_mem_buffer->size() + stored_in_file;
+    return m_mem_buffer->size() + m_spilled_size + m_tail->size();
 }
 
 std::optional<std::string> MemfileBuffer::push(U8View data) {
-    data = transfer_mem2mem(data);
-    return write_in_file(data);
+    // Keep the order: once something is spilled, the rest goes after it
+    if (m_extents.empty() && m_tail->size() == 0) {
+        size_t to_mem = std::min(get_free_mem_space(), data.size());
+        if (std::optional<std::string> err = m_mem_buffer->push(data.substr(0, to_mem)); err.has_value()) {
+            return err;
+        }
+        data.remove_prefix(to_mem);
+    }
+    std::optional<std::string> err = spill(data);
+    if (!err.has_value() && BufferAccountant::instance().exhausted()) {
+        evict_idle_buffers();
+    }
+    return err;
 }
 
 std::optional<std::string> MemfileBuffer::push(std::vector<uint8_t> data) {
-    data = transfer_mem2mem(std::move(data));
-    return write_in_file({data.data(), data.size()});
+    if (m_extents.empty() && m_tail->size() == 0 && data.size() <= get_free_mem_space()) {
+        return m_mem_buffer->push(std::move(data));
+    }
+    return push(U8View{data.data(), data.size()});
 }
 
 BufferPeekResult MemfileBuffer::peek() {
-    BufferPeekResult r = {transfer_file2mem()};
-    return !r.err.has_value() ? m_mem_buffer->peek() : r;
-}
-
-void MemfileBuffer::drain(size_t length) {
-    m_mem_buffer->drain(length);
-    transfer_file2mem();
-}
-
-size_t MemfileBuffer::get_free_mem_space() const {
-    return m_threshold - m_mem_buffer->size();
-}
-
-std::optional<std::string> MemfileBuffer::transfer_file2mem() {
-    if (m_fd == file::INVALID_HANDLE) {
-        return std::nullopt;
-    }
-
-    size_t free_space = get_free_mem_space();
-    if (free_space == 0) {
-        return std::nullopt;
+    if (m_mem_buffer->size() > 0) {
+        return m_mem_buffer->peek();
     }
-
-    ssize_t fsize = file::get_size(m_fd);
-    if (fsize == 0) {
-        return std::nullopt;
-    }
-    if (fsize < 0) {
-        return str_format("Failed to get file size: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    if (m_extents.empty()) {
+        return m_tail->peek();
     }
-
-    assert(fsize >= (ssize_t) m_read_offset);
-
-    size_t to_read = std::min(free_space, (size_t) (fsize - m_read_offset));
-    if ((size_t) fsize == m_read_offset) {
-        return std::nullopt;
+    if (std::optional<std::string> err = load_head(); err.has_value()) {
+        return {std::move(err), {}};
     }
+    return {std::nullopt, extent_data(m_extents.front())};
+}
 
-    ssize_t r = file::set_position(m_fd, m_read_offset);
-    if (r < 0) {
-        return str_format("Failed to set file offset: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+BufferPeekIovResult MemfileBuffer::peek_iov(std::span<U8View> segments) {
+    BufferPeekIovResult result = m_mem_buffer->peek_iov(segments);
+    if (result.err.has_value() || result.count == segments.size()) {
+        return result;
     }
-
-    std::vector<uint8_t> buf;
-    buf.resize(to_read);
-
-    uint8_t *buf_pos = buf.data();
-    uint8_t *buf_end = buf_pos + buf.size();
-
-    while (buf_pos != buf_end) {
-        ssize_t ret = file::read(m_fd, (char *) buf_pos, buf_end - buf_pos);
-        if (ret > 0) {
-            buf_pos += ret;
-            m_read_offset += ret;
-        } else if (ret == 0) {
-            return str_format("Unexpected EOF while reading file content");
+    if (!m_extents.empty()) {
+        if (result.count == 0) {
+            if (std::optional<std::string> err = load_head(); err.has_value()) {
+                return {std::move(err), 0};
+            }
         } else {
-            return str_format(
-                    "Failed to read file content: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+            prefetch();
+        }
+        // Do not wait for the rest of the extents
+        size_t n = std::min(m_extents.size(), PREFETCH_EXTENTS);
+        for (size_t i = 0; i < n; ++i) {
+            SpillFile::ExtentState state = m_extents[i].extent->state;
+            if (result.count == segments.size() || state == SpillFile::ES_READING || state == SpillFile::ES_FAILED) {
+                return result;
+            }
+            segments[result.count++] = extent_data(m_extents[i]);
+        }
+        if (n < m_extents.size()) {
+            return result;
         }
     }
-
-    return m_mem_buffer->push(std::move(buf));
+    BufferPeekIovResult tail = m_tail->peek_iov(segments.subspan(result.count));
+    result.count += tail.count;
+    return result;
 }
 
-std::vector<uint8_t> MemfileBuffer::transfer_mem2mem(std::vector<uint8_t> data) {
-    size_t free_space = get_free_mem_space();
-    if (free_space == 0) {
-        return data;
-    }
-
-    std::vector<uint8_t> chunk;
-    if (free_space >= data.size()) {
-        chunk.swap(data);
-    } else {
-        chunk = {data.data(), data.data() + free_space};
-    }
-
-    if (std::optional<std::string> err = m_mem_buffer->push(chunk); !err.has_value()) {
-        // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
-        data.erase(data.begin(), data.begin() + chunk.size());
+void MemfileBuffer::drain(size_t length) {
+    size_t from_mem = std::min(length, m_mem_buffer->size());
+    m_mem_buffer->drain(from_mem);
+    length -= from_mem;
+
+    while (length > 0 && !m_extents.empty()) {
+        SpilledExtent &e = m_extents.front();
+        size_t n = std::min(length, e.extent->size - e.begin);
+        e.begin += n;
+        m_spilled_size -= n;
+        length -= n;
+        if (e.begin == e.extent->size) {
+            m_file->release(e.extent);
+            m_extents.pop_front();
+        }
     }
+    m_tail->drain(std::min(length, m_tail->size()));
 
-    return data;
+    m_last_drain = std::chrono::steady_clock::now();
+    prefetch();
 }
 
-U8View MemfileBuffer::transfer_mem2mem(U8View data) {
-    size_t free_space = get_free_mem_space();
-    if (free_space == 0) {
-        return data;
-    }
-
-    U8View chunk;
-    if (free_space >= data.size()) {
-        chunk = data;
-    } else {
-        chunk = {data.data(), free_space};
-    }
-
-    if (std::optional<std::string> err = m_mem_buffer->push(chunk); !err.has_value()) {
-        data.remove_prefix(chunk.size());
+size_t MemfileBuffer::get_free_mem_space() const {
+    if (BufferAccountant::instance().under_pressure()) {
+        return 0;
     }
-
-    return data;
+    return m_threshold - std::min(m_threshold, m_mem_buffer->size());
 }
 
-static std::optional<std::string> transfer_file2file(file::Handle dst, file::Handle src, size_t size) {
-    if (size == 0) {
+std::optional<std::string> MemfileBuffer::open_file() {
+    if (m_file != nullptr) {
         return std::nullopt;
     }
-
-    std::vector<uint8_t> buf(size);
-    size_t buf_pos = 0;
-
-    while (buf_pos < buf.size()) {
-        ssize_t r = file::read(src, (char *) buf.data(), buf.size() - buf_pos);
-        if (r > 0) {
-            buf_pos += r;
-        } else if (r == 0) {
-            return str_format("Unexpected EOF while reading file content");
-        } else {
-            return str_format("%s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-        }
+    std::string error;
+    m_file = SpillFile::get(m_dir, error);
+    if (m_file == nullptr) {
+        return str_format("Failed to open spill file: %s", error.c_str());
     }
-
-    buf_pos = 0;
-    while (buf_pos < buf.size()) {
-        if (auto r = file::write(dst, buf.data(), buf.size() - buf_pos); r > 0) {
-            buf_pos += r;
-        } else {
-            return str_format("%s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-        }
-    }
-
     return std::nullopt;
 }
 
-bool MemfileBuffer::need_to_strip_file(size_t fsize, size_t data_size) const {
-    return fsize + data_size > m_max_file_size
-            || (m_read_offset > 0
-                    // current position is more than 30% of the file size
-                    && (m_read_offset > (m_max_file_size * 3 / 10)
-                            || m_read_offset > (fsize * 3 / 10)
-                            // file reached 80% of its maximum size
-                            || fsize > (m_max_file_size * 8 / 10)));
-}
-
-std::optional<std::string> MemfileBuffer::strip_file() {
-    ssize_t fsize = file::get_size(m_fd);
-    if (fsize < 0) {
-        return str_format("Failed to get file size: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-    }
-
-    if (size_t(fsize) < m_read_offset) {
-        return str_format("File size is less than the read offset");
+std::optional<std::string> MemfileBuffer::spill(U8View data) {
+    if (data.empty()) {
+        return std::nullopt;
     }
 
-    file::close(std::exchange(m_fd, file::INVALID_HANDLE));
-    std::string tmp_fpath = str_format("%s.tmp", m_path.c_str());
-
-    std::error_code fs_err;
-    fs::rename(m_path, tmp_fpath, fs_err);
-    if (fs_err) {
-        return str_format("Failed to rename file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    if (std::optional<std::string> err = open_file(); err.has_value()) {
+        return err;
     }
 
-    std::optional<std::string> err;
-    file::Handle tmp_fd = file::INVALID_HANDLE;
-    m_fd = file::open(m_path, file::CREAT | file::APPEND | file::RDWR);
-    if (m_fd == file::INVALID_HANDLE) {
-        err = str_format("Failed to open file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-        goto exit;
+    size_t spilled_size = m_spilled_size + m_tail->size();
+    if (spilled_size >= m_max_file_size) {
+        return "File reached its capacity";
     }
+    size_t to_spill = std::min(data.size(), m_max_file_size - spilled_size);
 
-    tmp_fd = file::open(tmp_fpath, file::RDONLY);
-    if (tmp_fd == file::INVALID_HANDLE) {
-        err = str_format("Failed to open temp file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-        goto exit;
+    if (std::optional<std::string> err = m_tail->push(data.substr(0, to_spill)); err.has_value()) {
+        return err;
     }
-
-    if (0 > file::set_position(tmp_fd, m_read_offset)) {
-        err = str_format("Failed to set file offset: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-        goto exit;
+    if (size_t full_size = m_tail->size() / SpillFile::EXTENT_SIZE * SpillFile::EXTENT_SIZE; full_size > 0) {
+        std::deque<SpilledExtent> extents = fill_extents(*m_tail, full_size);
+        m_spilled_size += full_size;
+        m_extents.insert(m_extents.end(), extents.begin(), extents.end());
+        // Pin before writing, so that the extents to be consumed soon are not read back
+        prefetch();
+        for (const SpilledExtent &e : extents) {
+            m_file->write(e.extent);
+        }
     }
 
-    err = transfer_file2file(m_fd, tmp_fd, size_t(fsize) - m_read_offset);
-    if (err.has_value()) {
-        err = str_format("Failed to transfer file content: %s", err->c_str());
-        goto exit;
+    if (to_spill < data.size()) {
+        return "File reached its capacity";
     }
+    return std::nullopt;
+}
 
-    m_read_offset = 0;
-
-exit:
-    file::close(tmp_fd);
-    if (err.has_value()) {
-        file::close(std::exchange(m_fd, file::INVALID_HANDLE));
-        fs::remove(m_path, fs_err);
-        fs_err.clear();
-        fs::rename(tmp_fpath, m_path, fs_err);
-        if (!fs_err) {
-            m_fd = file::open(m_path, file::APPEND | file::RDWR);
+std::deque<MemfileBuffer::SpilledExtent> MemfileBuffer::fill_extents(DataBuffer &from, size_t size) {
+    std::deque<SpilledExtent> extents;
+    while (size > 0) {
+        U8View chunk = from.peek().data;
+        chunk = chunk.substr(0, std::min(chunk.size(), size));
+        for (U8View rest = chunk; !rest.empty();) {
+            if (extents.empty() || extents.back().extent->size == SpillFile::EXTENT_SIZE) {
+                extents.push_back({std::make_shared<SpillFile::Extent>()});
+            }
+            SpillFile::Extent &extent = *extents.back().extent;
+            size_t n = std::min(rest.size(), SpillFile::EXTENT_SIZE - extent.size);
+            std::memcpy(extent.data.get() + extent.size, rest.data(), n);
+            extent.size += n;
+            rest.remove_prefix(n);
         }
+        from.drain(chunk.size());
+        size -= chunk.size();
     }
-    fs::remove(tmp_fpath, fs_err);
+    return extents;
+}
 
-    return err;
+void MemfileBuffer::evict_idle_buffers() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - g_last_sweep < IDLE_PERIOD) {
+        return;
+    }
+    g_last_sweep = now;
+    for (MemfileBuffer *buffer : g_thread_buffers) {
+        buffer->evict_memory();
+    }
 }
 
-std::optional<std::string> MemfileBuffer::write_in_file(U8View data) {
-    if (data.empty()) {
-        return std::nullopt;
+void MemfileBuffer::evict_memory() {
+    if (std::chrono::steady_clock::now() - m_last_drain < IDLE_PERIOD) {
+        return;
     }
 
-    if (m_fd == file::INVALID_HANDLE) {
-        m_fd = file::open(m_path, file::CREAT | file::APPEND | file::RDWR);
-        if (m_fd == file::INVALID_HANDLE) {
-            return str_format("Failed to open file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    // The prefetched extents are read back once the buffer is drained again
+    if (m_file != nullptr) {
+        for (const SpilledExtent &e : m_extents) {
+            m_file->unpin(e.extent);
         }
     }
 
-    int64_t fsize = file::get_size(m_fd);
-    if (fsize < 0) {
-        return str_format("Failed to get file size: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    size_t mem_size = m_mem_buffer->size();
+    size_t tail_size = m_tail->size();
+    // The memory is held in blocks, each of the buffers may take up to two blocks more than its data
+    size_t held = mem_size + tail_size + 4 * MemoryBuffer::BLOCK_SIZE;
+    if (mem_size + tail_size == 0 || held < BufferAccountant::instance().average_usage(BS_CONNECTION_BUFFERS)
+            || mem_size > m_max_file_size - std::min(m_max_file_size, m_spilled_size + tail_size)
+            || open_file().has_value()) {
+        return;
     }
 
-    if (need_to_strip_file(size_t(fsize), data.size())) {
-        if (std::optional<std::string> err = strip_file(); err.has_value()) {
-            return str_format("Failed to strip file: %s", err->c_str());
+    // The last extent of each part is written partially filled, as an extent can't be appended to once written
+    std::deque<SpilledExtent> head = fill_extents(*m_mem_buffer, mem_size);
+    std::deque<SpilledExtent> tail = fill_extents(*m_tail, tail_size);
+    for (const std::deque<SpilledExtent> *part : {&head, &tail}) {
+        for (const SpilledExtent &e : *part) {
+            m_file->write(e.extent);
         }
     }
+    m_extents.insert(m_extents.begin(), head.begin(), head.end());
+    m_extents.insert(m_extents.end(), tail.begin(), tail.end());
+    m_spilled_size += mem_size + tail_size;
+}
 
-    size_t to_write = 0;
-    fsize = file::get_size(m_fd);
-    if (fsize < 0) {
-        return str_format("Failed to get file size: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
-    }
-    if ((size_t) fsize >= m_max_file_size) {
-        return "File reached its capacity";
+void MemfileBuffer::prefetch() {
+    size_t n = std::min(m_extents.size(), PREFETCH_EXTENTS);
+    for (size_t i = 0; i < n; ++i) {
+        m_file->pin(m_extents[i].extent);
     }
+}
 
-    to_write = std::min(data.size(), (size_t) (m_max_file_size - fsize));
-
-    data = {data.data(), to_write};
-    if (!data.empty() && 0 >= file::write(m_fd, data.data(), data.size())) {
-        return str_format("Failed to write data: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+std::optional<std::string> MemfileBuffer::load_head() {
+    prefetch();
+    const SpillFile::Extent &extent = *m_extents.front().extent;
+    if (m_file->wait(extent) == SpillFile::ES_FAILED) {
+        return str_format("Failed to spill data: %s", extent.error.c_str());
     }
-
     return std::nullopt;
 }
 
+U8View MemfileBuffer::extent_data(const SpilledExtent &e) {
+    return {e.extent->data.get() + e.begin, e.extent->size - e.begin};
+}
+
 } // namespace ag
@@ -1,18 +1,39 @@
 #pragma once
 
-#include "common/file.h"
+#include <chrono>
+#include <deque>
+
+#include "spill_file.h"
 #include "vpn/internal/data_buffer.h"
 
 namespace ag {
 
+/**
+ * Buffer which keeps up to a threshold of data in memory and spills the rest to the shared spill file
+ * (see `SpillFile`). The spilled data are written and read back off the calling thread. The extents at
+ * the head of the queue are prefetched, so that a consumer rarely waits for the disk.
+ *
+ * The spilled data which do not make up a full extent yet are staged in a small memory buffer, so a buffer
+ * which spills a few bytes does not hold a whole extent.
+ *
+ * The buffer follows the memory budget (see `BufferAccountant`): under pressure it spills all the incoming
+ * data, and once the budget is exhausted, the idle buffers of the thread spill the data they keep in memory
+ * if they hold more than the average buffer, and drop their prefetched extents. A buffer is used by
+ * a single thread, and the pushes to any buffer of the thread sweep the rest of them.
+ */
 class MemfileBuffer : public DataBuffer {
 public:
+    /** Number of the extents at the head of the spilled data which are kept in memory */
+    static constexpr size_t PREFETCH_EXTENTS = 2;
+    /** A buffer is idle if it has not been drained for this long */
+    static constexpr std::chrono::seconds IDLE_PERIOD{1};
+
     /**
-     * @param path file path
-     * @param mem_threshold memory buffer size (exceeding this limit causes storing incoming data in file)
-     * @param max_file_size maximum file size (exceeding this limit causes data truncation)
+     * @param dir directory of the spill file
+     * @param mem_threshold memory buffer size (exceeding this limit causes spilling incoming data to the file)
+     * @param max_file_size maximum size of the spilled data (exceeding this limit causes data truncation)
      */
-    MemfileBuffer(std::string path, size_t mem_threshold, size_t max_file_size = SIZE_MAX);
+    MemfileBuffer(std::string dir, size_t mem_threshold, size_t max_file_size = SIZE_MAX);
     ~MemfileBuffer() override;
 
     MemfileBuffer(const MemfileBuffer &) = delete;
@@ -22,33 +43,50 @@ public:
     MemfileBuffer &operator=(MemfileBuffer &&) noexcept = delete;
 
 private:
+    struct SpilledExtent {
+        std::shared_ptr<SpillFile::Extent> extent;
+        size_t begin = 0; // number of the consumed bytes
+    };
+
     std::unique_ptr<DataBuffer> m_mem_buffer; // memory buffer
     size_t m_threshold = 0;                   // memory buffer theshold
-    size_t m_max_file_size = SIZE_MAX;        // maximum file size
-    file::Handle m_fd = file::INVALID_HANDLE; // file descriptor
-    size_t m_read_offset = 0;                 // file read offset
-    std::string m_path;                       // full file path
+    size_t m_max_file_size = SIZE_MAX;        // maximum size of the spilled data
+    std::string m_dir;                        // spill file directory
+    std::shared_ptr<SpillFile> m_file;        // spill file, opened on the first spill
+    std::deque<SpilledExtent> m_extents;      // spilled data, follows the memory buffer data
+    size_t m_spilled_size = 0;                // number of the unconsumed bytes in the extents
+    std::unique_ptr<DataBuffer> m_tail;       // spilled data staged for the next extent, follows the extents
+    std::chrono::steady_clock::time_point m_last_drain = std::chrono::steady_clock::now();
 
     std::optional<std::string> init() override;
     [[nodiscard]] size_t size() const override;
     std::optional<std::string> push(U8View data) override;
     std::optional<std::string> push(std::vector<uint8_t> data) override;
     BufferPeekResult peek() override;
+    BufferPeekIovResult peek_iov(std::span<U8View> segments) override;
     void drain(size_t length) override;
 
-    /** Fill free space in memory buffer with file content */
-    std::optional<std::string> transfer_file2mem();
-    /** Fill free space in memory buffer with given data */
-    std::vector<uint8_t> transfer_mem2mem(std::vector<uint8_t> data);
-    U8View transfer_mem2mem(U8View data);
     /** Get free space size in memory buffer */
     [[nodiscard]] size_t get_free_mem_space() const;
-    /** Check if read part needs to be stripped from file */
-    [[nodiscard]] bool need_to_strip_file(size_t fsize, size_t data_size) const;
-    /** Strip read part from file */
-    std::optional<std::string> strip_file();
-    /** Write data in file */
-    std::optional<std::string> write_in_file(U8View data);
+    /** Open the spill file if not yet */
+    std::optional<std::string> open_file();
+    /** Append data to the tail, each full extent of which goes to the file */
+    std::optional<std::string> spill(U8View data);
+    /** Move data from a memory buffer to new extents, which are to be written by the caller */
+    static std::deque<SpilledExtent> fill_extents(DataBuffer &from, size_t size);
+    /** Spill the memory of the idle buffers of the thread, at most once in `IDLE_PERIOD` */
+    static void evict_idle_buffers();
+    /**
+     * Move the memory buffer data to the head of the extents and the tail to the end of them,
+     * and drop the prefetched extents, if the buffer is a good candidate
+     */
+    void evict_memory();
+    /** Pin the extents at the head, so that they are prefetched */
+    void prefetch();
+    /** Wait until the first extent is in memory */
+    std::optional<std::string> load_head();
+    /** Get the unconsumed data of an extent which is in memory */
+    static U8View extent_data(const SpilledExtent &e);
 };
 
 } // namespace ag
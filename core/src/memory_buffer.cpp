@@ -2,12 +2,59 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+
+#include "vpn/internal/buffer_accountant.h"
 
 namespace ag {
 
+namespace {
+
+/**
+ * Free blocks of the thread. A connection's buffer lives on its event loop thread,
+ * so the buffers of all the connections of the loop reuse the same blocks without locking.
+ */
+class BlockPool {
+public:
+    // Keep at most this many free blocks, the rest is returned to the heap
+    static constexpr size_t MAX_FREE_BLOCKS = 256;
+
+    std::unique_ptr<uint8_t[]> acquire() {
+        if (m_free.empty()) {
+            return std::unique_ptr<uint8_t[]>(new uint8_t[MemoryBuffer::BLOCK_SIZE]);
+        }
+        std::unique_ptr<uint8_t[]> block = std::move(m_free.back());
+        m_free.pop_back();
+        return block;
+    }
+
+    void release(std::unique_ptr<uint8_t[]> block) {
+        if (m_free.size() < MAX_FREE_BLOCKS) {
+            m_free.emplace_back(std::move(block));
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<uint8_t[]>> m_free;
+};
+
+} // namespace
+
+static thread_local BlockPool g_block_pool;
+
 MemoryBuffer::MemoryBuffer() = default;
 
-MemoryBuffer::~MemoryBuffer() = default;
+MemoryBuffer::~MemoryBuffer() {
+    if (m_blocks.empty()) {
+        return;
+    }
+    BufferAccountant &accountant = BufferAccountant::instance();
+    accountant.discharge(BS_CONNECTION_BUFFERS, m_blocks.size() * BLOCK_SIZE);
+    accountant.remove_holder(BS_CONNECTION_BUFFERS);
+    for (Block &block : m_blocks) {
+        g_block_pool.release(std::move(block));
+    }
+}
 
 std::optional<std::string> MemoryBuffer::init() {
     return std::nullopt;
@@ -18,41 +65,72 @@ size_t MemoryBuffer::size() const {
 }
 
 std::optional<std::string> MemoryBuffer::push(U8View data) {
-    return push(std::vector<uint8_t>(data.data(), data.data() + data.length()));
-}
+    m_total_size += data.size();
 
-std::optional<std::string> MemoryBuffer::push(std::vector<uint8_t> data) {
-    if (!data.empty()) {
-        m_total_size += data.size();
-        m_chunks.emplace(std::move(data));
+    while (!data.empty()) {
+        if (m_blocks.empty() || m_tail == BLOCK_SIZE) {
+            BufferAccountant &accountant = BufferAccountant::instance();
+            if (m_blocks.empty()) {
+                accountant.add_holder(BS_CONNECTION_BUFFERS);
+            }
+            accountant.charge(BS_CONNECTION_BUFFERS, BLOCK_SIZE);
+            m_blocks.emplace_back(g_block_pool.acquire());
+            m_tail = 0;
+        }
+        size_t to_copy = std::min(BLOCK_SIZE - m_tail, data.size());
+        std::memcpy(m_blocks.back().get() + m_tail, data.data(), to_copy);
+        m_tail += to_copy;
+        data.remove_prefix(to_copy);
     }
+
     return std::nullopt;
 }
 
+std::optional<std::string> MemoryBuffer::push(std::vector<uint8_t> data) {
+    return push({data.data(), data.size()});
+}
+
+size_t MemoryBuffer::block_end(size_t index) const {
+    return (index + 1 == m_blocks.size()) ? m_tail : BLOCK_SIZE;
+}
+
 BufferPeekResult MemoryBuffer::peek() {
     U8View chunk;
-    if (!m_chunks.empty()) {
-        const std::vector<uint8_t> &front = m_chunks.front();
-        chunk = {front.data(), front.size()};
+    if (!m_blocks.empty()) {
+        chunk = {m_blocks.front().get() + m_head, block_end(0) - m_head};
     }
     return {std::nullopt, chunk};
 }
 
+BufferPeekIovResult MemoryBuffer::peek_iov(std::span<U8View> segments) {
+    size_t count = std::min(segments.size(), m_blocks.size());
+    for (size_t i = 0; i < count; ++i) {
+        size_t begin = (i == 0) ? m_head : 0;
+        segments[i] = {m_blocks[i].get() + begin, block_end(i) - begin};
+    }
+    return {std::nullopt, count};
+}
+
 void MemoryBuffer::drain(size_t length) {
     assert(length <= m_total_size);
     m_total_size -= length;
 
     while (length > 0) {
-        assert(!m_chunks.empty());
-
-        std::vector<uint8_t> &front = m_chunks.front();
-        size_t to_remove = std::min(front.size(), length);
-        // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
-        front.erase(front.begin(), front.begin() + to_remove);
+        assert(!m_blocks.empty());
 
+        size_t end = block_end(0);
+        size_t to_remove = std::min(end - m_head, length);
+        m_head += to_remove;
         length -= to_remove;
-        if (front.empty()) {
-            m_chunks.pop();
+        if (m_head == end) {
+            g_block_pool.release(std::move(m_blocks.front()));
+            m_blocks.pop_front();
+            m_head = 0;
+            BufferAccountant &accountant = BufferAccountant::instance();
+            accountant.discharge(BS_CONNECTION_BUFFERS, BLOCK_SIZE);
+            if (m_blocks.empty()) {
+                accountant.remove_holder(BS_CONNECTION_BUFFERS);
+            }
         }
     }
 }
@@ -1,27 +1,49 @@
 #pragma once
 
-#include <queue>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include "vpn/internal/data_buffer.h"
 
 namespace ag {
 
+/**
+ * Ring of fixed-size blocks. A push copies the data to the free space of the last block, so small chunks
+ * share blocks instead of getting an allocation each. The blocks are recycled through a per-thread pool
+ * shared by all the buffers of the thread. The blocks a buffer holds are charged to `BS_CONNECTION_BUFFERS`.
+ */
 class MemoryBuffer : public DataBuffer {
 public:
+    static constexpr size_t BLOCK_SIZE = 4096;
+
     MemoryBuffer();
     ~MemoryBuffer() override;
 
+    MemoryBuffer(const MemoryBuffer &) = delete;
+    MemoryBuffer &operator=(const MemoryBuffer &) = delete;
+
+    MemoryBuffer(MemoryBuffer &&) noexcept = delete;
+    MemoryBuffer &operator=(MemoryBuffer &&) noexcept = delete;
+
 private:
+    using Block = std::unique_ptr<uint8_t[]>;
+
     size_t m_total_size = 0;
-    std::queue<std::vector<uint8_t>> m_chunks;
+    std::deque<Block> m_blocks;
+    size_t m_head = 0; // read offset in the first block
+    size_t m_tail = 0; // write offset in the last block
 
     std::optional<std::string> init() override;
     [[nodiscard]] size_t size() const override;
     std::optional<std::string> push(U8View data) override;
     std::optional<std::string> push(std::vector<uint8_t> data) override;
     BufferPeekResult peek() override;
+    BufferPeekIovResult peek_iov(std::span<U8View> segments) override;
     void drain(size_t length) override;
+
+    /** Get the data end offset in the block with the specified index */
+    [[nodiscard]] size_t block_end(size_t index) const;
 };
 
 } // namespace ag
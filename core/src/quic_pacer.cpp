@@ -0,0 +1,60 @@
+#include "quic_pacer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+using namespace std::chrono;
+
+namespace ag {
+
+std::optional<QuicPacer::Clock::time_point> QuicPacer::send_time(const quiche_send_info &info) {
+#ifdef __linux__
+    // quiche fills in the send time only where its `Instant` is a `CLOCK_MONOTONIC` timespec,
+    // which is the clock `steady_clock` is based on
+    if (info.at.tv_sec == 0 && info.at.tv_nsec == 0) {
+        return std::nullopt;
+    }
+    return Clock::time_point(duration_cast<Clock::duration>(seconds(info.at.tv_sec) + nanoseconds(info.at.tv_nsec)));
+#else
+    (void) info;
+    return std::nullopt;
+#endif
+}
+
+bool QuicPacer::hold(const uint8_t *packet, size_t length, Clock::time_point send_at, Clock::time_point now) {
+    if (m_length > 0 || length <= MAX_UNPACED_PACKET_SIZE || length > sizeof(m_data)
+            || send_at <= now + GRANULARITY) {
+        return false;
+    }
+
+    memcpy(m_data, packet, length);
+    m_length = length;
+    m_send_at = send_at;
+    m_held_at = now;
+    return true;
+}
+
+size_t QuicPacer::release(uint8_t *out, Clock::time_point now, bool force) {
+    if (m_length == 0 || (!force && m_send_at > now + GRANULARITY)) {
+        return 0;
+    }
+
+    memcpy(out, m_data, m_length);
+    m_stats.paced_packets += 1;
+    m_stats.total_delay += now - m_held_at;
+    return std::exchange(m_length, 0);
+}
+
+std::optional<QuicPacer::Clock::time_point> QuicPacer::due_at() const {
+    if (m_length == 0) {
+        return std::nullopt;
+    }
+    return m_send_at;
+}
+
+void QuicPacer::on_burst(size_t packets_num) {
+    m_stats.max_burst = std::max(m_stats.max_burst, packets_num);
+}
+
+} // namespace ag
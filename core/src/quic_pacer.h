@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "vpn/platform.h" // Because quiche.h doesn't include the required headers
+#include <quiche.h>
+
+#include "vpn/utils.h"
+
+namespace ag {
+
+/**
+ * Holds a QUIC packet produced by quiche ahead of its send time until it is due. The owner produces
+ * no other packets meanwhile, so that the congestion controller's pacing rate is kept without queueing
+ * more than one packet.
+ *
+ * quiche does not tell whether a packet is ack-eliciting, so a packet small enough to be an ACK-only one
+ * is never held: delaying acknowledgements would inflate the peer's RTT estimate, while such packets
+ * hardly count against the pacing rate.
+ */
+class QuicPacer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /** Packets due within this time are sent right away */
+    static constexpr auto GRANULARITY = std::chrono::milliseconds(1);
+    /**
+     * Packets of this size and smaller bypass the pacer. It fits a short header with the longest
+     * connection ID, an ACK frame with a dozen ranges and the AEAD tag.
+     */
+    static constexpr size_t MAX_UNPACED_PACKET_SIZE = 100;
+
+    struct Stats {
+        uint64_t paced_packets = 0;
+        std::chrono::nanoseconds total_delay{};
+        size_t max_burst = 0;
+    };
+
+    /**
+     * Get the send time of a packet reported by quiche
+     * @return nullopt if quiche does not report it on this platform
+     */
+    static std::optional<Clock::time_point> send_time(const quiche_send_info &info);
+
+    /**
+     * Hold a packet if it is due later than `GRANULARITY` from now
+     * @return true if the packet is held, false if it should be sent right away
+     */
+    bool hold(const uint8_t *packet, size_t length, Clock::time_point send_at, Clock::time_point now);
+
+    /**
+     * Take the held packet out if it is due, or regardless of the send time if `force` is set
+     * @return the packet length, 0 if no packet is held or it is not due yet
+     */
+    size_t release(uint8_t *out, Clock::time_point now, bool force = false);
+
+    /** Get the time the held packet is due at, nullopt if no packet is held */
+    [[nodiscard]] std::optional<Clock::time_point> due_at() const;
+
+    /** Account a number of the packets sent back-to-back */
+    void on_burst(size_t packets_num);
+
+    [[nodiscard]] const Stats &stats() const {
+        return m_stats;
+    }
+
+private:
+    uint8_t m_data[QUIC_MAX_UDP_PAYLOAD_SIZE];
+    size_t m_length = 0; // 0 if no packet is held
+    Clock::time_point m_send_at;
+    Clock::time_point m_held_at;
+    Stats m_stats;
+};
+
+} // namespace ag
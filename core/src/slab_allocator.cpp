@@ -0,0 +1,148 @@
+#include "vpn/internal/slab_allocator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace ag {
+
+struct SlabAllocator::Chunk {
+    Chunk *prev = nullptr;
+    Chunk *next = nullptr;
+    void *free_list = nullptr; // free records, each one keeps the pointer to the next one
+    size_t used = 0;
+};
+
+static constexpr size_t RECORD_ALIGNMENT = alignof(std::max_align_t);
+
+static constexpr size_t round_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+static void *allocate_chunk() {
+#ifdef _WIN32
+    return _aligned_malloc(SlabAllocator::CHUNK_SIZE, SlabAllocator::CHUNK_SIZE);
+#else
+    return std::aligned_alloc(SlabAllocator::CHUNK_SIZE, SlabAllocator::CHUNK_SIZE);
+#endif
+}
+
+static void free_chunk(void *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    std::free(ptr); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+#endif
+}
+
+SlabAllocator::SlabAllocator(size_t record_size)
+        : m_record_size(round_up(std::max(record_size, sizeof(void *)), RECORD_ALIGNMENT))
+        , m_records_per_chunk((CHUNK_SIZE - round_up(sizeof(Chunk), RECORD_ALIGNMENT)) / m_record_size) {
+    assert(m_records_per_chunk > 0);
+}
+
+SlabAllocator::~SlabAllocator() {
+    // The chunks which still have records in use are left alone, as someone may still refer to them
+    for (Chunk *chunk = m_partial; chunk != nullptr;) {
+        Chunk *next = chunk->next;
+        if (chunk->used == 0) {
+            chunk->~Chunk();
+            free_chunk(chunk);
+        }
+        chunk = next;
+    }
+}
+
+void *SlabAllocator::allocate() {
+    std::scoped_lock l(m_mutex);
+
+    if (m_partial == nullptr) {
+        void *mem = allocate_chunk();
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        auto *chunk = new (mem) Chunk{};
+        // The records follow the chunk header
+        auto *records = (uint8_t *) mem + round_up(sizeof(Chunk), RECORD_ALIGNMENT);
+        for (size_t i = m_records_per_chunk; i > 0; --i) {
+            void *record = records + (i - 1) * m_record_size;
+            *(void **) record = chunk->free_list;
+            chunk->free_list = record;
+        }
+        ++m_chunks_num;
+        link(chunk);
+    }
+
+    Chunk *chunk = m_partial;
+    void *record = chunk->free_list;
+    chunk->free_list = *(void **) record;
+    ++chunk->used;
+    ++m_records_in_use;
+    if (chunk->free_list == nullptr) {
+        unlink(chunk);
+    }
+
+    return record;
+}
+
+void SlabAllocator::deallocate(void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+
+    auto *chunk = (Chunk *) ((uintptr_t) ptr & ~(uintptr_t) (CHUNK_SIZE - 1));
+
+    std::scoped_lock l(m_mutex);
+
+    bool was_full = chunk->free_list == nullptr;
+    *(void **) ptr = chunk->free_list;
+    chunk->free_list = ptr;
+    --chunk->used;
+    --m_records_in_use;
+    if (was_full) {
+        link(chunk);
+    }
+
+    // Keep the last chunk with free space to avoid allocating it again right away
+    if (chunk->used == 0 && (chunk->prev != nullptr || chunk->next != nullptr)) {
+        unlink(chunk);
+        --m_chunks_num;
+        chunk->~Chunk();
+        free_chunk(chunk);
+    }
+}
+
+SlabAllocator::Stats SlabAllocator::stats() const {
+    std::scoped_lock l(m_mutex);
+    return {m_records_in_use, m_chunks_num};
+}
+
+void SlabAllocator::link(Chunk *chunk) {
+    chunk->prev = nullptr;
+    chunk->next = m_partial;
+    if (m_partial != nullptr) {
+        m_partial->prev = chunk;
+    }
+    m_partial = chunk;
+}
+
+void SlabAllocator::unlink(Chunk *chunk) {
+    if (chunk->prev != nullptr) {
+        chunk->prev->next = chunk->next;
+    } else {
+        m_partial = chunk->next;
+    }
+    if (chunk->next != nullptr) {
+        chunk->next->prev = chunk->prev;
+    }
+    chunk->prev = nullptr;
+    chunk->next = nullptr;
+}
+
+} // namespace ag
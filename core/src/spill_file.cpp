@@ -0,0 +1,339 @@
+#include "spill_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#include "common/utils.h"
+#include "vpn/internal/buffer_accountant.h"
+#include "vpn/internal/utils.h"
+
+namespace ag {
+
+static std::mutex g_registry_mutex;
+static std::map<std::string, std::weak_ptr<SpillFile>> g_registry;
+
+SpillFile::Extent::Extent() {
+    allocate_data();
+}
+
+SpillFile::Extent::~Extent() {
+    drop_data();
+}
+
+void SpillFile::Extent::allocate_data() {
+    data.reset(new uint8_t[EXTENT_SIZE]);
+    BufferAccountant::instance().charge(BS_SPILL_EXTENTS, EXTENT_SIZE);
+}
+
+void SpillFile::Extent::drop_data() {
+    if (data != nullptr) {
+        data.reset();
+        BufferAccountant::instance().discharge(BS_SPILL_EXTENTS, EXTENT_SIZE);
+    }
+}
+
+std::shared_ptr<SpillFile> SpillFile::get(const std::string &dir, std::string &error) {
+    std::scoped_lock l(g_registry_mutex);
+    std::weak_ptr<SpillFile> &entry = g_registry[dir];
+    if (std::shared_ptr<SpillFile> file = entry.lock(); file != nullptr) {
+        return file;
+    }
+
+    std::shared_ptr<SpillFile> file{new SpillFile};
+    if (!file->open(dir, error)) {
+        g_registry.erase(dir);
+        return nullptr;
+    }
+    entry = file;
+    return file;
+}
+
+SpillFile::~SpillFile() {
+    {
+        std::scoped_lock l(m_mutex);
+        m_stopped = true;
+    }
+    m_jobs_cond.notify_all();
+    for (std::thread &worker : m_workers) {
+        worker.join();
+    }
+
+#ifdef _WIN32
+    if (m_handle != nullptr) {
+        CloseHandle(m_handle);
+    }
+#else
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+#endif // _WIN32
+    if (m_path.empty()) {
+        // Failed to open, so not registered
+        return;
+    }
+
+    std::error_code err;
+    fs::remove(m_path, err);
+
+    std::scoped_lock l(g_registry_mutex);
+    if (auto i = g_registry.find(m_dir); i != g_registry.end() && i->second.expired()) {
+        g_registry.erase(i);
+    }
+}
+
+bool SpillFile::open(std::string dir, std::string &error) {
+    static std::atomic<uint64_t> next_id = 0;
+    std::string path = make_buffer_file_path(dir.c_str(), next_id.fetch_add(1, std::memory_order_relaxed));
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+            nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        error = AG_FMT("Failed to open file: {}", GetLastError());
+        return false;
+    }
+    m_handle = handle;
+#else
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        error = AG_FMT("Failed to open file: {}", strerror(errno));
+        return false;
+    }
+#endif // _WIN32
+
+    m_dir = std::move(dir);
+    m_path = std::move(path);
+    m_workers.reserve(WORKERS_NUM);
+    for (size_t i = 0; i < WORKERS_NUM; ++i) {
+        m_workers.emplace_back(&SpillFile::run_worker, this);
+    }
+    return true;
+}
+
+void SpillFile::write(std::shared_ptr<Extent> extent) {
+    std::unique_lock l(m_mutex);
+    m_progress_cond.wait(l, [this] {
+        return m_pending_writes < MAX_PENDING_WRITES;
+    });
+    extent->offset = allocate_offset();
+    extent->state = ES_WRITING;
+    m_jobs.push_back({JT_WRITE, std::move(extent)});
+    ++m_pending_writes;
+    l.unlock();
+    m_jobs_cond.notify_one();
+}
+
+void SpillFile::pin(const std::shared_ptr<Extent> &extent) {
+    std::unique_lock l(m_mutex);
+    extent->pinned = true;
+    if (extent->state != ES_WRITTEN || extent->data != nullptr) {
+        return;
+    }
+    extent->allocate_data();
+    extent->state = ES_READING;
+    m_jobs.push_back({JT_READ, extent});
+    l.unlock();
+    m_jobs_cond.notify_one();
+}
+
+void SpillFile::unpin(const std::shared_ptr<Extent> &extent) {
+    std::scoped_lock l(m_mutex);
+    extent->pinned = false;
+    if (extent->state == ES_WRITTEN || extent->state == ES_READ) {
+        extent->drop_data();
+        extent->state = ES_WRITTEN;
+    }
+}
+
+SpillFile::ExtentState SpillFile::wait(const Extent &extent) {
+    std::unique_lock l(m_mutex);
+    m_progress_cond.wait(l, [&extent] {
+        return extent.state != ES_READING;
+    });
+    return extent.state;
+}
+
+void SpillFile::release(const std::shared_ptr<Extent> &extent) {
+    std::scoped_lock l(m_mutex);
+    switch (extent->state) {
+    case ES_FILLING:
+        break;
+    case ES_WRITING:
+    case ES_READING:
+        // The worker gives the extent back when done
+        extent->released = true;
+        break;
+    case ES_WRITTEN:
+    case ES_READ:
+    case ES_FAILED:
+        free_offset(extent->offset);
+        break;
+    }
+}
+
+void SpillFile::run_worker() {
+    std::unique_lock l(m_mutex);
+    while (true) {
+        m_jobs_cond.wait(l, [this] {
+            return m_stopped || !m_jobs.empty();
+        });
+        if (m_stopped) {
+            break;
+        }
+        Job job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        Extent &extent = *job.extent;
+        l.unlock();
+
+        // Only the worker touches the data of an extent in progress, so the I/O goes without the lock
+        std::string error;
+        bool ok = (job.type == JT_WRITE) ? write_at(extent.data.get(), EXTENT_SIZE, extent.offset, error)
+                                         : read_at(extent.data.get(), EXTENT_SIZE, extent.offset, error);
+
+        l.lock();
+        if (!ok) {
+            extent.error = std::move(error);
+            extent.state = ES_FAILED;
+        } else if (!extent.pinned) {
+            // The data is in the file, and the owner does not need it in memory
+            extent.state = ES_WRITTEN;
+            extent.drop_data();
+        } else {
+            extent.state = (job.type == JT_WRITE) ? ES_WRITTEN : ES_READ;
+        }
+        if (job.type == JT_WRITE) {
+            --m_pending_writes;
+        }
+        if (extent.released) {
+            free_offset(extent.offset);
+        }
+        m_progress_cond.notify_all();
+    }
+}
+
+uint64_t SpillFile::allocate_offset() {
+    ++m_used_extents;
+    if (!m_free_offsets.empty()) {
+        uint64_t offset = m_free_offsets.back();
+        m_free_offsets.pop_back();
+        return offset;
+    }
+    uint64_t offset = m_end_offset;
+    m_end_offset += EXTENT_SIZE;
+    return offset;
+}
+
+void SpillFile::free_offset(uint64_t offset) {
+    --m_used_extents;
+    if (m_used_extents > 0) {
+        m_free_offsets.push_back(offset);
+        return;
+    }
+    // Nothing is spilled anymore, give the disk space back
+    m_free_offsets.clear();
+    m_end_offset = 0;
+    truncate();
+}
+
+#ifdef _WIN32
+
+bool SpillFile::write_at(const uint8_t *data, size_t size, uint64_t offset, std::string &error) {
+    while (size > 0) {
+        OVERLAPPED overlapped{};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD written = 0;
+        if (!WriteFile(m_handle, data, DWORD(size), &written, &overlapped)) {
+            error = AG_FMT("Failed to write data: {}", GetLastError());
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+bool SpillFile::read_at(uint8_t *data, size_t size, uint64_t offset, std::string &error) {
+    while (size > 0) {
+        OVERLAPPED overlapped{};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(m_handle, data, DWORD(size), &read, &overlapped)) {
+            error = AG_FMT("Failed to read file content: {}", GetLastError());
+            return false;
+        }
+        if (read == 0) {
+            error = "Unexpected EOF while reading file content";
+            return false;
+        }
+        data += read;
+        size -= read;
+        offset += read;
+    }
+    return true;
+}
+
+void SpillFile::truncate() {
+    LARGE_INTEGER zero{};
+    if (SetFilePointerEx(m_handle, zero, nullptr, FILE_BEGIN)) {
+        SetEndOfFile(m_handle);
+    }
+}
+
+#else
+
+bool SpillFile::write_at(const uint8_t *data, size_t size, uint64_t offset, std::string &error) {
+    while (size > 0) {
+        ssize_t r = pwrite(m_fd, data, size, off_t(offset));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            error = AG_FMT("Failed to write data: {}", strerror(errno));
+            return false;
+        }
+        data += r;
+        size -= r;
+        offset += r;
+    }
+    return true;
+}
+
+bool SpillFile::read_at(uint8_t *data, size_t size, uint64_t offset, std::string &error) {
+    while (size > 0) {
+        ssize_t r = pread(m_fd, data, size, off_t(offset));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            error = AG_FMT("Failed to read file content: {}", strerror(errno));
+            return false;
+        }
+        if (r == 0) {
+            error = "Unexpected EOF while reading file content";
+            return false;
+        }
+        data += r;
+        size -= r;
+        offset += r;
+    }
+    return true;
+}
+
+void SpillFile::truncate() {
+    [[maybe_unused]] int r = ftruncate(m_fd, 0);
+}
+
+#endif // _WIN32
+
+} // namespace ag
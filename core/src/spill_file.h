@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ag {
+
+/**
+ * File which the memory-file buffers of the process spill their data to. It is divided into extents of
+ * `EXTENT_SIZE` bytes, and a buffer keeps its spilled data as a queue of extents, which go back to the file
+ * once consumed. So the writes are block-aligned, and the file never needs compacting.
+ *
+ * The extents are written and read by a pool of worker threads, so a slow disk does not stall the event loop
+ * which owns a buffer. The state of an extent changes as follows:
+ *
+ *      FILLING --write()--> WRITING --> WRITTEN --pin()--> READING --> READ --unpin()--> WRITTEN
+ *                                   \                              \
+ *                                    +--> FAILED                    +--> FAILED
+ *
+ * The data of an extent stays in memory while the extent is filled, written and read, so the owner can
+ * consume it in any state but `READING` and `FAILED`. A written extent drops its data unless it is pinned.
+ * An unpinned extent drops its data once it is written or read.
+ */
+class SpillFile {
+public:
+    /** Size of an extent, a multiple of the disk block size */
+    static constexpr size_t EXTENT_SIZE = 64 * 1024;
+    /** Number of the extents being written, after which `write` waits for the disk to catch up */
+    static constexpr size_t MAX_PENDING_WRITES = 64;
+    /** Number of the worker threads */
+    static constexpr size_t WORKERS_NUM = 2;
+
+    enum ExtentState {
+        ES_FILLING,
+        ES_WRITING,
+        ES_WRITTEN,
+        ES_READING,
+        ES_READ,
+        ES_FAILED,
+    };
+
+    /** An extent, its data are charged to `BS_SPILL_EXTENTS` while in memory */
+    struct Extent {
+        std::atomic<ExtentState> state = ES_FILLING;
+        /** The data, null if it is only in the file */
+        std::unique_ptr<uint8_t[]> data;
+        /** Number of the stored bytes */
+        size_t size = 0;
+        /** Offset in the file, valid since `write` */
+        uint64_t offset = 0;
+        /** Error description if failed */
+        std::string error;
+        /** Pinned extents keep the data after having been written */
+        bool pinned = false;
+        /** The owner has released the extent while it was in progress */
+        bool released = false;
+
+        Extent();
+        ~Extent();
+
+        Extent(const Extent &) = delete;
+        Extent &operator=(const Extent &) = delete;
+        Extent(Extent &&) = delete;
+        Extent &operator=(Extent &&) = delete;
+
+        void allocate_data();
+        void drop_data();
+    };
+
+    ~SpillFile();
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+    SpillFile(SpillFile &&) = delete;
+    SpillFile &operator=(SpillFile &&) = delete;
+
+    /**
+     * Get the spill file in a directory, it is shared by all the users of the directory in the process
+     * and is removed when the last one releases it
+     * @return nullptr on error, in which case `error` receives the description
+     */
+    static std::shared_ptr<SpillFile> get(const std::string &dir, std::string &error);
+
+    /**
+     * Start writing a full extent. Waits if `MAX_PENDING_WRITES` extents are being written already.
+     */
+    void write(std::shared_ptr<Extent> extent);
+
+    /**
+     * Pin an extent, so that it keeps the data once written. If the data has been dropped already,
+     * start reading it back.
+     */
+    void pin(const std::shared_ptr<Extent> &extent);
+
+    /**
+     * Unpin an extent, so that it drops the data once written or read. The data is read back by `pin`.
+     */
+    void unpin(const std::shared_ptr<Extent> &extent);
+
+    /**
+     * Wait until the data of a pinned extent is in memory
+     * @return the resulting state: any state but `ES_READING`
+     */
+    ExtentState wait(const Extent &extent);
+
+    /**
+     * Give an extent back to the file. The extent must not be used afterwards.
+     */
+    void release(const std::shared_ptr<Extent> &extent);
+
+private:
+    enum JobType {
+        JT_WRITE,
+        JT_READ,
+    };
+
+    struct Job {
+        JobType type;
+        std::shared_ptr<Extent> extent;
+    };
+
+#ifdef _WIN32
+    void *m_handle = nullptr;
+#else
+    int m_fd = -1;
+#endif // _WIN32
+    std::string m_dir;
+    std::string m_path;
+    std::mutex m_mutex;
+    std::condition_variable m_jobs_cond;     // Signalled when a job is added or the workers are stopped
+    std::condition_variable m_progress_cond; // Signalled when a job is done
+    std::deque<Job> m_jobs;
+    std::vector<std::thread> m_workers;
+    bool m_stopped = false;
+    size_t m_pending_writes = 0;
+    std::vector<uint64_t> m_free_offsets;
+    uint64_t m_end_offset = 0;
+    size_t m_used_extents = 0;
+
+    SpillFile() = default;
+
+    bool open(std::string dir, std::string &error);
+    void run_worker();
+    /** Take a free extent in the file, the mutex must be held */
+    uint64_t allocate_offset();
+    /** Give an extent in the file back, the mutex must be held */
+    void free_offset(uint64_t offset);
+    bool write_at(const uint8_t *data, size_t size, uint64_t offset, std::string &error);
+    bool read_at(uint8_t *data, size_t size, uint64_t offset, std::string &error);
+    void truncate();
+};
+
+} // namespace ag
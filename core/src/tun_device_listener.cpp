@@ -1,6 +1,7 @@
 #include "tun_device_listener.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
@@ -46,6 +47,7 @@ static VpnTunListenerConfig clone_config(const VpnTunListenerConfig *config) {
             .tunnel = config->tunnel,
             .mtu_size = config->mtu_size,
             .pcap_filename = safe_strdup(config->pcap_filename),
+            .vnet_hdr = config->vnet_hdr,
     };
 }
 
@@ -86,6 +88,7 @@ ClientListener::InitResult TunListener::init(VpnClient *vpn, ClientHandler handl
             .mtu_size = m_config.mtu_size,
             .pcap_filename = m_config.pcap_filename,
             .handler = {tcpip_handler, this},
+            .vnet_hdr = m_config.vnet_hdr,
     };
 
     m_tcpip = tcpip_open(&tcpip_params);
@@ -120,25 +123,24 @@ void TunListener::deinit() {
 }
 
 int TunListener::read_out_pending_data(uint64_t id, Connection *conn) const {
-    std::queue<std::vector<uint8_t>> &pending = conn->unread_data;
-
-    while ((conn->flags & CF_READ_ENABLED) && !pending.empty()) {
-        std::vector<uint8_t> &chunk = pending.front();
-        ClientRead event = {id, chunk.data(), chunk.size(), 0};
-        this->handler.func(this->handler.arg, CLIENT_EVENT_READ, &event);
-        if (event.result < 0) {
-            return event.result;
-        }
-        if (conn->proto == IPPROTO_UDP && ssize_t(chunk.size()) != event.result) {
-            log_conn(this, id, dbg, "UDP packet wasn't sent or sent partially: length={}, result={}", chunk.size(),
-                    event.result);
-            chunk.clear();
-        } else {
-            chunk.erase(chunk.begin(), chunk.begin() + event.result);
-        }
-        if (chunk.empty()) {
-            pending.pop();
+    DataBuffer *pending = conn->unread_data.get();
+
+    std::array<U8View, DATA_BUFFER_PEEK_SEGMENTS> segments;
+    while ((conn->flags & CF_READ_ENABLED) && pending->size() > 0) {
+        BufferPeekIovResult res = pending->peek_iov(segments);
+        size_t consumed = 0;
+        for (U8View segment : std::span{segments}.first(res.count)) {
+            ClientRead event = {id, segment.data(), segment.size(), 0};
+            this->handler.func(this->handler.arg, CLIENT_EVENT_READ, &event);
+            if (event.result < 0) {
+                return event.result;
+            }
+            consumed += event.result;
+            if (size_t(event.result) < segment.size() || !(conn->flags & CF_READ_ENABLED)) {
+                break;
+            }
         }
+        pending->drain(consumed);
     }
 
     return 0;
@@ -185,11 +187,11 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
             break;
         }
 
-        std::queue<std::vector<uint8_t>> &pending = conn->unread_data;
+        DataBuffer *pending = conn->unread_data.get();
         std::span<evbuffer_iovec> iov = {(evbuffer_iovec *) tcp_event->iov, tcp_event->iovlen};
         int conn_proto = conn->proto; // conn may be freed in the callback
-        if ((conn->flags & CF_READ_ENABLED) && pending.empty()) {
-            ClientRead event = {tcp_event->id, nullptr, 0, 0};
+        if ((conn->flags & CF_READ_ENABLED) && pending->size() == 0) {
+            ClientRead event = {tcp_event->id, nullptr, 0, 0, tcp_event->buffer};
             while (!iov.empty()) {
                 evbuffer_iovec *v = &iov.front();
                 do {
@@ -230,8 +232,8 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
             tcp_event->result = static_cast<int>(total_length);
         } else if (tcp_event->result >= 0) {
             // not completely sent
-            std::for_each(iov.begin(), iov.end(), [&pending](const evbuffer_iovec &vec) {
-                pending.emplace((uint8_t *) vec.iov_base, (uint8_t *) vec.iov_base + vec.iov_len);
+            std::for_each(iov.begin(), iov.end(), [pending](const evbuffer_iovec &vec) {
+                pending->push({(uint8_t *) vec.iov_base, vec.iov_len});
             });
         }
 
@@ -274,7 +276,7 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
         if (auto i = listener->m_connections.find(id); i != listener->m_connections.end()) {
             const Connection *conn = &i->second;
             log_conn(listener, id, dbg, "Remaining unsent={} unread={}", conn->scheduled_to_send,
-                    conn->unread_data.size());
+                    conn->unread_data->size());
             listener->m_connections.erase(i);
 
             dbglog(listener->m_log, "Remaining connections: {}", listener->m_connections.size());
@@ -340,8 +342,9 @@ void TunListener::close_connection(uint64_t id, bool graceful, bool async) {
         // defer closing until all the pending data is sent to client
         conn->flags |= CF_CLOSING;
     } else {
-        if (conn->scheduled_to_send > 0 || !conn->unread_data.empty()) {
-            log_conn(this, id, dbg, "Remaining unsent={} unread={}", conn->scheduled_to_send, conn->unread_data.size());
+        if (conn->scheduled_to_send > 0 || conn->unread_data->size() > 0) {
+            log_conn(this, id, dbg, "Remaining unsent={} unread={}", conn->scheduled_to_send,
+                    conn->unread_data->size());
         }
 
         if (!async) {
@@ -410,7 +413,7 @@ void TunListener::turn_read(uint64_t id, bool on) {
         conn->flags &= ~CF_READ_ENABLED;
     }
 
-    if (on && !conn->complete_read_task_id.has_value() && !conn->unread_data.empty()) {
+    if (on && !conn->complete_read_task_id.has_value() && conn->unread_data->size() > 0) {
         // we have some unread data on the connection - complete it
         conn->complete_read_task_id = event_loop::submit(
                 this->vpn->parameters.ev_loop, {new CompleteCtx{this, id}, complete_read, [](void *arg) {
@@ -2,10 +2,10 @@
 
 #include <list>
 #include <mutex>
-#include <queue>
 #include <unordered_map>
 #include <vector>
 
+#include "memory_buffer.h"
 #include "tcpip/tcpip.h"
 #include "vpn/internal/client_listener.h"
 #include "vpn/internal/vpn_client.h"
@@ -32,10 +32,10 @@ private:
         ssize_t scheduled_to_send = 0;
         uint32_t flags = 0;
         int proto = 0; // connection protocol (TCP/UDP)
-        // @todo: consider using `DataBuffer`, but it needs some modifications to guarantee
-        // that peeked chunks would be the same as pushed ones
-        // buffer for data raised with `TCPIP_EVENT_READ`, but wasn't actaully sent to server
-        std::queue<std::vector<uint8_t>> unread_data;
+        // buffer for data raised with `TCPIP_EVENT_READ`, but wasn't actaully sent to server.
+        // Only TCP data is buffered (UDP packets which can't be sent are dropped), so the chunk
+        // boundaries do not matter.
+        std::unique_ptr<DataBuffer> unread_data = std::make_unique<MemoryBuffer>();
         event_loop::AutoTaskId complete_read_task_id;
         event_loop::AutoTaskId close_task_id;
     };
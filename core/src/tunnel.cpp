@@ -1,10 +1,12 @@
 #include "vpn/internal/tunnel.h"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <bitset>
 #include <cassert>
 #include <optional>
+#include <span>
 #include <utility>
 #include <vector>
 
@@ -18,6 +20,7 @@
 #include "net/quic_utils.h"
 #include "net/utils.h"
 #include "socks_listener.h"
+#include "vpn/internal/buffer_accountant.h"
 #include "vpn/internal/utils.h"
 #include "vpn/internal/vpn_client.h"
 #include "vpn/utils.h"
@@ -124,7 +127,9 @@ static void destroy_connection(Tunnel *tunnel, uint64_t client_id, uint64_t serv
 
         if (conn->proto == IPPROTO_UDP && tunnel->udp_close_wait_hostname_cache) {
             std::scoped_lock l(tunnel->udp_close_wait_hostname_cache->mtx);
-            tunnel->udp_close_wait_hostname_cache->val.insert(conn->addr, conn->domain_extractor_result);
+            tunnel->udp_close_wait_hostname_cache->val.insert(conn->addr,
+                    (conn->domain_extractor_result != nullptr) ? *conn->domain_extractor_result
+                                                               : DomainExtractorResult{});
         }
 
         log_conn(tunnel, conn, dbg, "Destroyed (download={}, upload={})", conn->incoming_bytes, conn->outgoing_bytes);
@@ -308,13 +313,21 @@ static std::variant<TunnelDomainLookupAction, DomainExtractorResult> domain_look
             return TDLA_DROP;
         }
         if (quic_header->type == ag::quic_utils::INITIAL) {
-            // quic traffic
-            auto quic_data = ag::quic_utils::prepare_for_domain_lookup({data, length}, quic_header.value());
+            // quic traffic, the common sized packets are decrypted without allocations
+            std::array<uint8_t, ag::quic_utils::MAX_STACK_INITIAL_LEN> stack_buffer; // NOLINT(*-member-init)
+            std::vector<uint8_t> heap_buffer;
+            std::span<uint8_t> buffer = stack_buffer;
+            if (length > buffer.size()) {
+                heap_buffer.resize(length);
+                buffer = heap_buffer;
+            }
+            auto quic_data = ag::quic_utils::decrypt_initial({data, length}, quic_header.value(), buffer);
             if (!quic_data.has_value()) {
                 // no data for domain lookup
                 return TDLA_DONE;
             }
-            return conn->domain_extractor.proceed(dir, conn->proto, quic_data->data(), quic_data->size());
+            return conn->lookup_state().domain_extractor.proceed(
+                    dir, conn->proto, quic_data->data(), quic_data->size());
         }
     }
 
@@ -343,7 +356,7 @@ static std::variant<TunnelDomainLookupAction, DomainExtractorResult> domain_look
 
 static TunnelDomainLookupAction pass_through_domain_lookup(
         Tunnel *tunnel, VpnConnection *conn, DomainExtractorPacketDirection dir, const uint8_t *data, size_t length) {
-    DomainExtractor *domain_extractor = &conn->domain_extractor;
+    DomainExtractor *domain_extractor = &conn->lookup_state().domain_extractor;
     DomainExtractorResult r;
     TunnelDomainLookupAction action = TDLA_DONE;
     DomainFilter *filter = &tunnel->vpn->domain_filter;
@@ -357,7 +370,7 @@ static TunnelDomainLookupAction pass_through_domain_lookup(
         // tcp traffic
         r = domain_extractor->proceed(dir, conn->proto, data, length);
     }
-    conn->domain_extractor_result = r;
+    conn->domain_extractor_result = std::make_unique<DomainExtractorResult>(r);
 
     switch (r.status) {
     case DES_NOTFOUND:
@@ -397,12 +410,26 @@ static void dns_resolver_handler(void *arg, ClientEvent what, void *data) {
     self->listener_handler(self->dns_resolver, what, data);
 }
 
+// Get the flow control info of a client side connection for the server side. Under memory pressure
+// the window shrinks, so that the upstreams fetch less data than the client side can take in.
+static TcpFlowCtrlInfo client_flow_control_info(ClientListener &listener, uint64_t client_id) {
+    TcpFlowCtrlInfo info = listener.flow_control_info(client_id);
+    info.send_window_size = BufferAccountant::instance().limit_window(info.send_window_size);
+    return info;
+}
+
+// Check if a client side connection may keep reading after having sent some data to the server side.
+// Once the memory budget is exhausted, a TCP connection waits until the server side reports the data sent.
+static bool may_read_after_send(const VpnConnection *conn) {
+    return conn->proto != IPPROTO_TCP || !BufferAccountant::instance().exhausted();
+}
+
 // Send buffered data, if there is any, possibly not completely,
 // and turn listener read on/off.
 //
 // Return `false` on fatal error, `true` otherwise.
 //
-// Caller should check `conn->buffered_packets` after this function returns
+// Caller should check `conn->has_buffered_packets()` after this function returns
 // if handling a listener read event.
 static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
     VpnConnection *conn = vpn_connection_get_by_id(self->connections.by_client_id, conn_client_id);
@@ -411,7 +438,9 @@ static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
         return false;
     }
 
-    conn->send_buffered_task.release();
+    if (conn->buffered != nullptr) {
+        conn->buffered->send_task.release();
+    }
 
     std::shared_ptr<ServerUpstream> upstream = conn->upstream.lock();
     if (upstream == nullptr) {
@@ -426,16 +455,19 @@ static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
     }
 
     bool sent_zero_bytes = false;
-    for (auto it = conn->buffered_packets.begin(); it != conn->buffered_packets.end();) {
+    bool sent_some_bytes = false;
+    std::list<AccountedBytes<BS_TUNNEL_PACKETS>> &packets = conn->buffered_state().packets;
+    for (auto it = packets.begin(); it != packets.end();) {
         auto &packet = *it;
         log_conn(self, conn, trace, "Sending {} bytes from buffered packets", packet.size());
         ssize_t r = upstream->send(conn->server_id, packet.data(), packet.size());
+        sent_some_bytes = sent_some_bytes || r > 0;
         if (r >= 0 && size_t(r) == packet.size()) {
             conn->outgoing_bytes += r;
             if (conn->flags.test(CONNF_MONITOR_STATS)) {
                 self->statistics_monitor->update_upload(conn_client_id, r);
             }
-            it = conn->buffered_packets.erase(it);
+            it = packets.erase(it);
             continue;
         }
 
@@ -458,8 +490,9 @@ static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
     size_t server_can_send = upstream->available_to_send(conn->server_id);
     log_conn(self, conn, trace, "Can send to server side: {} bytes, upstream sent zero bytes: {}", server_can_send,
             sent_zero_bytes);
-    listener->turn_read(conn->client_id, server_can_send > 0 && !sent_zero_bytes);
-    upstream->update_flow_control(conn->server_id, listener->flow_control_info(conn_client_id));
+    listener->turn_read(conn->client_id,
+            server_can_send > 0 && !sent_zero_bytes && (!sent_some_bytes || may_read_after_send(conn)));
+    upstream->update_flow_control(conn->server_id, client_flow_control_info(*listener, conn_client_id));
     return true;
 }
 
@@ -536,7 +569,7 @@ static void schedule_send_buffered_data(Tunnel *tunnel, VpnConnection *conn) {
         Tunnel *tunnel;
         uint64_t conn_client_id;
     };
-    conn->send_buffered_task = event_loop::submit(tunnel->vpn->parameters.ev_loop,
+    conn->buffered_state().send_task = event_loop::submit(tunnel->vpn->parameters.ev_loop,
             {
                     new Ctx{tunnel, conn->client_id},
                     [](void *arg, TaskId) {
@@ -598,7 +631,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
                             : upstream.get() == this->fake_upstream.get()        ? "fake upstream"
                             : upstream.get() == this->dns_handler.get()          ? "DNS handler upstream"
                                                                                  : "unknown upstream");
-            report_connection_info(this, conn, conn->domain_extractor_result.domain.c_str());
+            report_connection_info(this, conn, conn->found_domain().c_str());
             conn->state = CONNS_WAITING_ACCEPT;
             listener->complete_connect_request(conn->client_id, CCR_PASS);
             break;
@@ -617,8 +650,9 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             conn->migrating_client_id = NON_ID;
             add_connection(this, conn);
             if (conn->proto == IPPROTO_UDP) {
-                std::swap(((UdpVpnConnection *) conn)->buffered_packets,
-                        ((UdpVpnConnection *) src_conn)->buffered_packets);
+                // The send tasks look the connections up by the client IDs, which have just been swapped,
+                // so they go along with the packets
+                std::swap(conn->buffered, src_conn->buffered);
             }
 
             if (std::shared_ptr<ServerUpstream> src_conn_upstream = src_conn->upstream.lock();
@@ -627,13 +661,13 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             }
 
             log_conn(this, conn, dbg, "Upstream has been switched successfully");
-            if (!conn->buffered_packets.empty()) {
+            if (conn->has_buffered_packets()) {
                 schedule_send_buffered_data(this, conn);
                 break;
             }
 
             listener->turn_read(conn->client_id, true);
-            upstream->update_flow_control(conn->server_id, listener->flow_control_info(conn->client_id));
+            upstream->update_flow_control(conn->server_id, client_flow_control_info(*listener, conn->client_id));
             break;
         }
         case CONNS_REJECTED: {
@@ -707,7 +741,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             log_conn(this, conn, dbg, "tdla={}", magic_enum::enum_name(action));
             switch (action) {
             case TDLA_DONE:
-                conn->flags.reset(CONNF_LOOKINGUP_DOMAIN);
+                conn->finish_domain_lookup();
                 break;
             case TDLA_PASS:
             case TDLA_WANT_MORE:
@@ -737,7 +771,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             if (conn->flags.test(CONNF_MONITOR_STATS)) {
                 this->statistics_monitor->update_download(conn->client_id, event->result);
             }
-            TcpFlowCtrlInfo info = listener->flow_control_info(conn->client_id);
+            TcpFlowCtrlInfo info = client_flow_control_info(*listener, conn->client_id);
             log_conn(this, conn, trace, "Can send to client side: {} bytes", info.send_buffer_size);
             upstream->update_flow_control(conn->server_id, info);
         } else {
@@ -781,7 +815,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
                         event->length, server_can_send);
             }
 
-            if (!conn->buffered_packets.empty()) {
+            if (conn->has_buffered_packets()) {
                 schedule_send_buffered_data(this, conn);
                 break;
             }
@@ -970,15 +1004,19 @@ static std::shared_ptr<ServerUpstream> select_upstream(
     sw_conn->flags.set(CONNF_LOOKINGUP_DOMAIN, conn->flags.test(CONNF_LOOKINGUP_DOMAIN));
     sw_conn->migrating_client_id = conn->client_id;
     sw_conn->app_name = conn->app_name;
-    sw_conn->domain_extractor_result = conn->domain_extractor_result;
+    if (conn->domain_extractor_result != nullptr) {
+        sw_conn->domain_extractor_result = std::make_unique<DomainExtractorResult>(*conn->domain_extractor_result);
+    }
     add_connection(self, sw_conn);
     if (conn->proto == IPPROTO_UDP) {
         // do not turn off reads on migrating UDP connections,
         // because otherwise the unread packets might be dropped
-        conn->buffered_packets.emplace_back(packet.begin(), packet.end());
+        conn->buffered_state().packets.emplace_back(packet.begin(), packet.end());
         processed = packet.size();
     } else {
-        sw_conn->buffered_packets = std::move(conn->buffered_packets);
+        if (conn->buffered != nullptr) {
+            sw_conn->buffered_state().packets = std::move(conn->buffered->packets);
+        }
         if (std::shared_ptr<ClientListener> listener = conn->listener.lock(); listener != nullptr) {
             listener->turn_read(conn->client_id, false);
         } else {
@@ -1007,7 +1045,7 @@ std::optional<VpnConnectAction> Tunnel::finalize_connect_action(ConnectRequestRe
     }
 
     if (!request_result.appname.empty()) {
-        conn->app_name = std::move(request_result.appname);
+        conn->app_name = request_result.appname;
     }
 #ifdef _WIN32
     std::string_view process_name = conn->app_name;
@@ -1599,7 +1637,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
         listener->turn_read(id, true);
 
         if (std::shared_ptr<ServerUpstream> upstream = conn->upstream.lock(); upstream != nullptr) {
-            upstream->update_flow_control(conn->server_id, listener->flow_control_info(conn->client_id));
+            upstream->update_flow_control(conn->server_id, client_flow_control_info(*listener, conn->client_id));
 
             if (listener.get() == this->vpn->client_listener.get()
                     && conn->upstream.lock().get() == this->vpn->endpoint_upstream.get()) {
@@ -1666,7 +1704,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
             log_conn(this, conn, dbg, "tdla={}", magic_enum::enum_name(action));
             switch (action) {
             case TDLA_DONE:
-                conn->flags.reset(CONNF_LOOKINGUP_DOMAIN);
+                conn->finish_domain_lookup();
                 break;
             case TDLA_PASS:
                 break;
@@ -1679,9 +1717,9 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
                 // If tunnel faced with Anti-Dpi which can split ClientHello into parts, it needs to wait other parts
                 // of ClientHello message (max - 3 parts)
                 static constexpr int MAX_LOOKUP_ATTEMPTS = 3;
-                if (conn->lookup_attempts_num++ < MAX_LOOKUP_ATTEMPTS) {
+                if (conn->lookup_state().attempts_num++ < MAX_LOOKUP_ATTEMPTS) {
                     log_conn(this, conn, trace, "Adding pending packet, length: {}", event->length);
-                    conn->buffered_packets.emplace_back(event->data, event->data + event->length);
+                    conn->buffered_state().packets.emplace_back(event->data, event->data + event->length);
                     event->result = static_cast<int>(event->length);
                     return;
                 }
@@ -1690,7 +1728,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
             }
             case TDLA_SHUTDOWN:
                 conn->action = invert_action(vpn_mode_to_action(this->vpn->domain_filter.get_mode()));
-                conn->flags.reset(CONNF_LOOKINGUP_DOMAIN);
+                conn->finish_domain_lookup();
                 migrate_to_another_upstream = true;
                 break;
             case TDLA_BLOCK:
@@ -1701,7 +1739,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
                 return;
             }
 
-            report_connection_info(this, conn, conn->domain_extractor_result.domain.c_str());
+            report_connection_info(this, conn, conn->found_domain().c_str());
             if (migrate_to_another_upstream) {
                 if (!conn->flags.test(CONNF_FIRST_PACKET)) {
                     log_conn(this, conn, dbg, "Can't switch upstream in the middle of handshake");
@@ -1756,20 +1794,22 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
 
         switch (conn->state) {
         case CONNS_CONNECTED: {
-            if (!conn->buffered_packets.empty()) {
+            if (conn->has_buffered_packets()) {
                 if (!send_buffered_data(this, conn->client_id)) {
                     // Listener should handle send error by closing connection.
                     event->result = -1;
                     return;
                 }
-                if (!conn->buffered_packets.empty()) {
+                if (conn->has_buffered_packets()) {
                     // Listener should wait, buffered data will be sent out on SERVER_EVENT_DATA_SENT.
                     event->result = 0;
                     return;
                 }
             }
             log_conn(this, conn, trace, "Sending {} bytes", event->length);
-            event->result = (int) upstream->send(conn->server_id, event->data, event->length);
+            event->result = (int) ((event->buffer != nullptr)
+                            ? upstream->send_by_reference(conn->server_id, event->data, event->length, *event->buffer)
+                            : upstream->send(conn->server_id, event->data, event->length));
             if (event->result > 0 || (size_t) event->result == event->length) {
                 conn->outgoing_bytes += event->result;
                 if (conn->flags.test(CONNF_MONITOR_STATS)) {
@@ -1777,7 +1817,8 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
                 }
                 size_t server_can_send = upstream->available_to_send(conn->server_id);
                 log_conn(this, conn, trace, "Can send to server side: {} bytes", server_can_send);
-                listener->turn_read(conn->client_id, server_can_send > 0);
+                listener->turn_read(
+                        conn->client_id, server_can_send > 0 && (event->result == 0 || may_read_after_send(conn)));
             } else if (event->result == 0) {
                 listener->turn_read(conn->client_id, false);
             } else if (event->result < 0) {
@@ -1788,7 +1829,12 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
         }
         case CONNS_CONNECTED_MIGRATING: {
             if (conn->proto == IPPROTO_UDP) {
-                conn->buffered_packets.emplace_back(event->data, event->data + event->length);
+                // UDP tolerates losses, so it is not worth going over the memory budget
+                if (BufferAccountant::instance().exhausted()) {
+                    log_conn(this, conn, dbg, "Memory budget exhausted, dropping packet, length: {}", event->length);
+                    break;
+                }
+                conn->buffered_state().packets.emplace_back(event->data, event->data + event->length);
                 break;
             }
             [[fallthrough]];
@@ -1821,7 +1867,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
 
         upstream->consume(conn->server_id, event->length);
 
-        TcpFlowCtrlInfo info = listener->flow_control_info(conn->client_id);
+        TcpFlowCtrlInfo info = client_flow_control_info(*listener, conn->client_id);
         upstream->update_flow_control(conn->server_id, info);
 
         // Issue a health check, if possible. If client is waiting for more data from
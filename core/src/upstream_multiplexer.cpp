@@ -2,7 +2,8 @@
 
 #include <algorithm>
 #include <cassert>
-#include <numeric>
+#include <cmath>
+#include <utility>
 
 #include <magic_enum/magic_enum.hpp>
 
@@ -29,6 +30,23 @@ enum UpstreamState {
     US_SESSION_OPENED,
 };
 
+/**
+ * Load of a child upstream. The counters are updated as the connections come and go and the traffic passes,
+ * the throughput and the RTT are sampled once per `LOAD_SAMPLE_PERIOD`.
+ */
+struct UpstreamLoad {
+    size_t open_connections = 0;    // connections opened through the multiplexer
+    size_t pending_connections = 0; // connections waiting for the session to open
+    size_t blocked_connections = 0; // connections which have nothing available to send
+    size_t period_bytes = 0;        // bytes passed in both directions since the period start
+    double throughput = 0;          // smoothed throughput, bytes per second
+    uint32_t srtt_us = 0;           // smoothed RTT
+    uint32_t min_rtt_us = 0;        // minimum of the sampled RTTs
+    double loss_ratio = 0;          // last sampled packet loss ratio
+    double loss_growth = 0;         // growth of the loss ratio, fading by half each `LOSS_GROWTH_HALF_LIFE`
+    std::chrono::steady_clock::time_point period_start = std::chrono::steady_clock::now();
+};
+
 struct UpstreamInfo {
     UpstreamInfo(const UpstreamMultiplexer::MakeUpstream &make_upstream,
             const VpnUpstreamProtocolConfig &protocol_config, int id, VpnClient *vpn,
@@ -41,12 +59,56 @@ struct UpstreamInfo {
     std::unique_ptr<MultiplexableUpstream> upstream;
     std::unique_ptr<UpstreamCtx> ctx;
     event_loop::AutoTaskId deferred_task_id;
+    event_loop::AutoTaskId idle_task_id;
+    UpstreamLoad load;
 };
 
-UpstreamMultiplexer::UpstreamMultiplexer(
-        int id, const VpnUpstreamProtocolConfig &protocol_config, size_t upstreams_num, MakeUpstream make_upstream)
+// The weight of the old value in a moving average which halves every `half_life`
+static double decay(std::chrono::duration<double> elapsed, std::chrono::duration<double> half_life) {
+    return std::exp2(-elapsed / half_life);
+}
+
+static void sample_stats(UpstreamInfo &info, std::chrono::duration<double> elapsed) {
+    VpnConnectionStats stats = info.upstream->get_connection_stats();
+    UpstreamLoad &load = info.load;
+    if (stats.rtt_us != 0) {
+        load.srtt_us = (load.srtt_us == 0) ? stats.rtt_us : (7 * load.srtt_us + stats.rtt_us) / 8;
+        load.min_rtt_us = (load.min_rtt_us == 0) ? stats.rtt_us : std::min(load.min_rtt_us, stats.rtt_us);
+    }
+    // A single bump of the ratio is remembered for a while, and a drop cancels the growth
+    double d = decay(elapsed, UpstreamMultiplexer::LOSS_GROWTH_HALF_LIFE);
+    load.loss_growth = std::max(0.0, d * load.loss_growth + stats.packet_loss_ratio - load.loss_ratio);
+    load.loss_ratio = stats.packet_loss_ratio;
+}
+
+static void update_load(UpstreamInfo &info, std::chrono::steady_clock::time_point now) {
+    UpstreamLoad &load = info.load;
+    std::chrono::duration<double> elapsed = now - load.period_start;
+    if (elapsed < UpstreamMultiplexer::LOAD_SAMPLE_PERIOD) {
+        return;
+    }
+
+    // The periods without samples count as the idle ones, so the old throughput fades out
+    // after a long pause instead of being halved once
+    double d = decay(elapsed, UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+    load.throughput = d * load.throughput + (1 - d) * double(load.period_bytes) / elapsed.count();
+    load.period_bytes = 0;
+    load.period_start = now;
+    if (info.state == US_SESSION_OPENED) {
+        sample_stats(info, elapsed);
+    }
+}
+
+static void account_traffic(UpstreamInfo &info, size_t bytes) {
+    update_load(info, std::chrono::steady_clock::now());
+    info.load.period_bytes += bytes;
+}
+
+UpstreamMultiplexer::UpstreamMultiplexer(int id, const VpnUpstreamProtocolConfig &protocol_config,
+        size_t upstreams_num, MakeUpstream make_upstream, Millis idle_upstream_timeout)
         : ServerUpstream(id, protocol_config)
         , m_max_upstreams_num((upstreams_num == 0) ? DEFAULT_UPSTREAMS_NUM : upstreams_num)
+        , m_idle_upstream_timeout(idle_upstream_timeout)
         , m_make_upstream(make_upstream) {
     m_upstreams_pool.reserve(m_max_upstreams_num);
 }
@@ -125,7 +187,7 @@ uint64_t UpstreamMultiplexer::open_connection(const TunnelAddressPair *addr, int
         }
     } else if (open_new_upstream(upstream_id, std::nullopt)) {
         log_ups_conn(this, upstream_id, conn_id, dbg, "Opening new upstream");
-        m_pending_connections.emplace(conn_id, PendingConnection{{upstream_id}, *addr, proto, std::string(app_name)});
+        add_pending_connection(conn_id, PendingConnection{{upstream_id}, *addr, proto, std::string(app_name)});
     } else if (std::optional<int> reserve_id = select_existing_upstream(upstream_id, true); reserve_id.has_value()) {
         upstream_id = reserve_id.value();
         log_ups_conn(this, upstream_id, conn_id, dbg, "Failed to create new upstream, using existing one");
@@ -153,9 +215,29 @@ void UpstreamMultiplexer::close_connection(uint64_t id, bool graceful, bool asyn
 ssize_t UpstreamMultiplexer::send(uint64_t id, const uint8_t *data, size_t length) {
     ssize_t result = -1;
 
-    MultiplexableUpstream *upstream = get_upstream_by_conn(id);
-    if (upstream != nullptr) {
-        result = upstream->send(id, data, length);
+    UpstreamInfo *info = get_upstream_info_by_conn(id);
+    if (info != nullptr) {
+        result = info->upstream->send(id, data, length);
+        if (result > 0) {
+            account_traffic(*info, result);
+        }
+    } else {
+        log_conn(this, id, dbg, "Connection was not found");
+    }
+
+    return result;
+}
+
+ssize_t UpstreamMultiplexer::send_by_reference(
+        uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef &buffer) {
+    ssize_t result = -1;
+
+    UpstreamInfo *info = get_upstream_info_by_conn(id);
+    if (info != nullptr) {
+        result = info->upstream->send_by_reference(id, data, length, buffer);
+        if (result > 0) {
+            account_traffic(*info, result);
+        }
     } else {
         log_conn(this, id, dbg, "Connection was not found");
     }
@@ -173,13 +255,21 @@ void UpstreamMultiplexer::consume(uint64_t id, size_t length) {
 }
 
 size_t UpstreamMultiplexer::available_to_send(uint64_t id) {
-    ssize_t result = 0;
-
-    MultiplexableUpstream *upstream = get_upstream_by_conn(id);
-    if (upstream != nullptr) {
-        result = static_cast<ssize_t>(upstream->available_to_send(id));
-    } else {
+    UpstreamInfo *info = get_upstream_info_by_conn(id);
+    if (info == nullptr) {
         log_conn(this, id, dbg, "Connection was not found");
+        return 0;
+    }
+
+    size_t result = info->upstream->available_to_send(id);
+    Connection &conn = m_connections.find(id)->second;
+    if (conn.blocked != (result == 0)) {
+        conn.blocked = (result == 0);
+        if (conn.blocked) {
+            ++info->load.blocked_connections;
+        } else {
+            --info->load.blocked_connections;
+        }
     }
 
     return result;
@@ -197,18 +287,17 @@ void UpstreamMultiplexer::update_flow_control(uint64_t id, TcpFlowCtrlInfo info)
 void UpstreamMultiplexer::do_health_check() {
     cancel_health_check();
 
-    UpstreamInfo *info = nullptr;
+    UpstreamInfo *probing = select_probing_upstream();
+    if (probing == nullptr) {
+        log_mux(this, warn, "No health check has been started: there are no open sessions");
+        return;
+    }
+
     for (auto &[id, i] : m_upstreams_pool) {
         if (i->state == US_SESSION_OPENED) {
-            i->upstream->do_health_check(/*need_result=*/(info == nullptr));
-            info = i.get();
+            i->upstream->do_health_check(/*need_result=*/(i.get() == probing));
         }
     }
-
-    if (info == nullptr) {
-        log_mux(this, warn, "No health check has been started: there are no open sessions");
-        return;
-    }
 }
 
 void UpstreamMultiplexer::cancel_health_check() {
@@ -234,6 +323,8 @@ VpnConnectionStats UpstreamMultiplexer::get_connection_stats() const {
             stats = {
                     PICK_WORST_RTT(stats.rtt_us, i_stats.rtt_us),
                     PICK_WORST_LOSS_RATIO(stats.packet_loss_ratio, i_stats.packet_loss_ratio),
+                    std::max(stats.pacing_delay_us, i_stats.pacing_delay_us),
+                    std::max(stats.max_burst, i_stats.max_burst),
             };
         }
     }
@@ -242,17 +333,34 @@ VpnConnectionStats UpstreamMultiplexer::get_connection_stats() const {
 }
 
 void UpstreamMultiplexer::on_icmp_request(IcmpEchoRequestEvent &event) {
-    for (const auto &[_, info] : m_upstreams_pool) {
-        if (info->state == US_SESSION_OPENED) {
-            info->upstream->on_icmp_request(event);
-            return;
-        }
+    if (UpstreamInfo *info = select_probing_upstream(); info != nullptr) {
+        info->upstream->on_icmp_request(event);
+        return;
     }
     log_mux(this, dbg, "Failed to find a connected upstream");
     assert(0);
     event.result = -1;
 }
 
+// The ICMP requests and the health checks stick to one session while it is open, so that the replies
+// and the result are not lost with a session closed for being idle
+UpstreamInfo *UpstreamMultiplexer::select_probing_upstream() {
+    if (m_probing_upstream_id.has_value()) {
+        auto it = m_upstreams_pool.find(*m_probing_upstream_id);
+        if (it != m_upstreams_pool.end() && it->second->state == US_SESSION_OPENED) {
+            return it->second.get();
+        }
+        m_probing_upstream_id.reset();
+    }
+    for (const auto &[id, info] : m_upstreams_pool) {
+        if (info->state == US_SESSION_OPENED) {
+            m_probing_upstream_id = id;
+            return info.get();
+        }
+    }
+    return nullptr;
+}
+
 void UpstreamMultiplexer::close_upstream(int upstream_id) {
     log_ups(this, upstream_id, dbg, "...");
 
@@ -304,21 +412,27 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
         }
 
         pool_it->second->state = US_SESSION_OPENED;
+        sample_stats(*pool_it->second, std::chrono::duration<double>::zero());
 
         for (auto i = mux->m_pending_connections.begin(); i != mux->m_pending_connections.end();) {
             const PendingConnection *conn = &i->second;
             if (conn->upstream_id == ctx->id) {
+                mux->forget_pending_connection(*conn);
                 mux->proceed_pending_connection(conn->upstream_id, i->first, conn);
                 i = mux->m_pending_connections.erase(i);
             } else {
                 ++i;
             }
         }
+        // The connections which were waiting for the session may have failed to open on it, or there may
+        // have been none from the start, as with a session opened in advance
+        mux->schedule_idle_upstream_close(*pool_it->second);
         break;
     case SERVER_EVENT_SESSION_CLOSED: {
         for (auto i = mux->m_pending_connections.begin(); i != mux->m_pending_connections.end();) {
             const PendingConnection *conn = &i->second;
             if (conn->upstream_id == ctx->id) {
+                mux->forget_pending_connection(*conn);
                 ServerError err_event = {i->first, {ag::utils::AG_ECONNREFUSED, "Session closed"}};
                 mux->handler.func(mux->handler.arg, SERVER_EVENT_ERROR, &err_event);
                 i = mux->m_pending_connections.erase(i);
@@ -333,7 +447,7 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
     case SERVER_EVENT_CONNECTION_CLOSED: {
         uint64_t id = *(uint64_t *) data;
         assert(mux->m_connections.count(id) != 0);
-        mux->m_connections.erase(id);
+        mux->forget_connection(id);
         log_mux(mux, dbg, "Remaining upstreams={} connections={} pending connections={}", mux->m_upstreams_pool.size(),
                 mux->m_connections.size(), mux->m_pending_connections.size());
         mux->handler.func(mux->handler.arg, what, data);
@@ -341,6 +455,9 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
     }
     case SERVER_EVENT_READ: {
         mux->handler.func(mux->handler.arg, what, data);
+        if (const auto *event = (ServerReadEvent *) data; event->result > 0) {
+            account_traffic(*pool_it->second, event->result);
+        }
         break;
     }
     case SERVER_EVENT_CONNECTION_OPENED:
@@ -354,7 +471,7 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
         const ServerError *event = (ServerError *) data;
         if (event->id != NON_ID) {
             // An error on connection also means that some data was received.
-            mux->m_connections.erase(event->id);
+            mux->forget_connection(event->id);
             log_mux(mux, dbg, "Remaining upstreams={} connections={} pending connections={}",
                     mux->m_upstreams_pool.size(), mux->m_connections.size(), mux->m_pending_connections.size());
             mux->handler.func(mux->handler.arg, SERVER_EVENT_ERROR, data);
@@ -381,7 +498,7 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
     }
 }
 
-MultiplexableUpstream *UpstreamMultiplexer::get_upstream_by_conn(uint64_t id) const {
+UpstreamInfo *UpstreamMultiplexer::get_upstream_info_by_conn(uint64_t id) const {
     auto it_id = m_connections.find(id);
     if (it_id == m_connections.end()) {
         log_conn(this, id, dbg, "Connection not found");
@@ -394,38 +511,55 @@ MultiplexableUpstream *UpstreamMultiplexer::get_upstream_by_conn(uint64_t id) co
         return nullptr;
     }
 
-    return pool_it->second->upstream.get();
+    return pool_it->second.get();
+}
+
+MultiplexableUpstream *UpstreamMultiplexer::get_upstream_by_conn(uint64_t id) const {
+    UpstreamInfo *info = get_upstream_info_by_conn(id);
+    return (info != nullptr) ? info->upstream.get() : nullptr;
 }
 
 std::optional<int> UpstreamMultiplexer::select_existing_upstream(
-        std::optional<int> ignored_upstream, bool allow_underflow) const {
-    // for the first try to pick underloaded upstream
-    for (const auto &[id, _] : m_upstreams_pool) {
-        if (ignored_upstream != id && connections_num_by_upstream(id) < NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD) {
-            return id;
+        std::optional<int> ignored_upstream, bool allow_underflow) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::optional<int> best_underloaded;
+    double best_underloaded_score = 0;
+    std::optional<int> least_loaded;
+    double least_loaded_score = 0;
+    bool least_loaded_degraded = false;
+    for (auto &[id, info] : m_upstreams_pool) {
+        if (id == ignored_upstream) {
+            continue;
         }
-    }
-
-    // if a caller wants an existing upstream or the number of open upstreams reached the cap,
-    // choose the least loaded
-    if (allow_underflow || m_upstreams_pool.size() == DEFAULT_UPSTREAMS_NUM) {
-        std::optional<decltype(m_upstreams_pool.begin())> least_loaded;
-        for (auto i = m_upstreams_pool.begin(); i != m_upstreams_pool.end(); ++i) {
-            if (i->first == ignored_upstream) {
-                continue;
-            }
 
-            if (!least_loaded.has_value()
-                    || (*least_loaded)->second->upstream->connections_num() > i->second->upstream->connections_num()) {
-                least_loaded = i;
-            }
+        update_load(*info, now);
+        double s = score(*info);
+        bool degraded = is_degraded(*info);
+        // a congested or lossy upstream is never underloaded: the pool grows instead
+        if (!degraded && weighted_load(*info) < NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD
+                && (!best_underloaded.has_value() || s < best_underloaded_score)) {
+            best_underloaded = id;
+            best_underloaded_score = s;
         }
-
-        if (least_loaded.has_value()) {
-            return (*least_loaded)->first;
+        if (!least_loaded.has_value()
+                || std::pair(degraded, s) < std::pair(least_loaded_degraded, least_loaded_score)) {
+            least_loaded = id;
+            least_loaded_score = s;
+            least_loaded_degraded = degraded;
         }
     }
 
+    // for the first try to pick the best of the underloaded upstreams
+    if (best_underloaded.has_value()) {
+        return best_underloaded;
+    }
+
+    // if a caller wants an existing upstream or the number of open upstreams reached the cap,
+    // choose the least loaded, preferring the healthy ones
+    if (allow_underflow || m_upstreams_pool.size() >= m_max_upstreams_num) {
+        return least_loaded;
+    }
+
     return std::nullopt;
 }
 
@@ -470,12 +604,12 @@ bool UpstreamMultiplexer::open_connection(
     switch (info->state) {
     case US_OPENING_SESSION:
         log_ups_conn(this, upstream_id, conn_id, trace, "Postpone connection until session is established");
-        m_pending_connections.emplace(conn_id, PendingConnection{{upstream_id}, *addr, proto, std::string(app_name)});
+        add_pending_connection(conn_id, PendingConnection{{upstream_id}, *addr, proto, std::string(app_name)});
         break;
     case US_SESSION_OPENED:
         successful = info->upstream->open_connection(conn_id, addr, proto, app_name);
         if (successful) {
-            m_connections.emplace(conn_id, Connection{upstream_id});
+            add_connection(*info, conn_id);
         }
         break;
     }
@@ -500,14 +634,95 @@ void UpstreamMultiplexer::proceed_pending_connection(int upstream_id, uint64_t c
     }
 }
 
-size_t UpstreamMultiplexer::connections_num_by_upstream(int id) const {
-    assert(m_upstreams_pool.count(id) != 0);
+size_t UpstreamMultiplexer::connections_num_by_upstream(const UpstreamInfo &info) {
+    return info.upstream->connections_num() + info.load.pending_connections;
+}
+
+// The load in connections: a heavy flow weighs as several light ones, and so does a connection
+// which the session can't send anything for
+double UpstreamMultiplexer::weighted_load(const UpstreamInfo &info) {
+    return double(connections_num_by_upstream(info)) + info.load.throughput / HEAVY_FLOW_THROUGHPUT
+            + BLOCKED_CONNECTION_WEIGHT * double(info.load.blocked_connections);
+}
+
+// The lower, the better the upstream is for a new connection: the load stretched by the RTT
+double UpstreamMultiplexer::score(const UpstreamInfo &info) {
+    return weighted_load(info) * double(info.load.srtt_us + RTT_FLOOR_US);
+}
+
+// Congested (the packets queue up somewhere on the path) or losing packets at the moment
+bool UpstreamMultiplexer::is_degraded(const UpstreamInfo &info) {
+    const UpstreamLoad &load = info.load;
+    return load.srtt_us > load.min_rtt_us + MAX_QUEUEING_DELAY_US
+            || (load.loss_ratio > LOSSY_RATIO && load.loss_growth > MIN_LOSS_GROWTH);
+}
+
+void UpstreamMultiplexer::add_connection(UpstreamInfo &info, uint64_t conn_id) {
+    m_connections.emplace(conn_id, Connection{info.ctx->id});
+    ++info.load.open_connections;
+    info.idle_task_id.reset();
+}
+
+void UpstreamMultiplexer::add_pending_connection(uint64_t conn_id, PendingConnection conn) {
+    if (auto i = m_upstreams_pool.find(conn.upstream_id); i != m_upstreams_pool.end()) {
+        ++i->second->load.pending_connections;
+        i->second->idle_task_id.reset();
+    }
+    m_pending_connections.emplace(conn_id, std::move(conn));
+}
+
+void UpstreamMultiplexer::forget_pending_connection(const PendingConnection &conn) {
+    if (auto i = m_upstreams_pool.find(conn.upstream_id); i != m_upstreams_pool.end()) {
+        --i->second->load.pending_connections;
+    }
+}
+
+void UpstreamMultiplexer::forget_connection(uint64_t conn_id) {
+    auto it = m_connections.find(conn_id);
+    if (it == m_connections.end()) {
+        return;
+    }
+    auto pool_it = m_upstreams_pool.find(it->second.upstream_id);
+    bool blocked = it->second.blocked;
+    m_connections.erase(it);
+    if (pool_it == m_upstreams_pool.end()) {
+        return;
+    }
+
+    UpstreamInfo *info = pool_it->second.get();
+    --info->load.open_connections;
+    if (blocked) {
+        --info->load.blocked_connections;
+    }
+    schedule_idle_upstream_close(*info);
+}
+
+void UpstreamMultiplexer::schedule_idle_upstream_close(UpstreamInfo &info) {
+    if (info.load.open_connections == 0 && info.load.pending_connections == 0 && m_upstreams_pool.size() > 1
+            && !info.idle_task_id.has_value()) {
+        info.idle_task_id = event_loop::schedule(
+                this->vpn->parameters.ev_loop, {info.ctx.get(), on_idle_upstream_timeout}, m_idle_upstream_timeout);
+    }
+}
+
+void UpstreamMultiplexer::on_idle_upstream_timeout(void *arg, TaskId) {
+    auto *ctx = (UpstreamCtx *) arg;
+    UpstreamMultiplexer *mux = ctx->mux;
+    UpstreamInfo *info = mux->m_upstreams_pool.at(ctx->id).get();
+    info->idle_task_id.release();
+
+    if (info->load.open_connections != 0 || info->load.pending_connections != 0
+            || mux->m_upstreams_pool.size() <= 1) {
+        return;
+    }
+    if (ctx->id == mux->m_probing_upstream_id) {
+        log_ups(mux, ctx->id, dbg, "Keeping idle upstream as it carries the ICMP requests and the health checks");
+        return;
+    }
 
-    return m_upstreams_pool.find(id)->second->upstream->connections_num()
-            + std::accumulate(m_pending_connections.begin(), m_pending_connections.end(), 0,
-                    [id](size_t acc, const auto &i) -> size_t {
-                        return acc + ((id == i.second.upstream_id) ? 1 : 0);
-                    });
+    log_ups(mux, ctx->id, dbg, "Closing idle upstream");
+    info->upstream->close_session();
+    mux->close_upstream(ctx->id);
 }
 
 void UpstreamMultiplexer::handle_sleep() {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
 #include <optional>
 #include <string>
@@ -19,12 +20,30 @@ public:
     static constexpr size_t DEFAULT_UPSTREAMS_NUM = 8;
     // Number of connection exceeding which a new upstream will be opened
     static constexpr size_t NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD = 5;
+    // Period over which the throughput of an upstream is sampled
+    static constexpr std::chrono::milliseconds LOAD_SAMPLE_PERIOD{250};
+    // Throughput an upstream carries which weighs as much as one more connection, in bytes per second
+    static constexpr double HEAVY_FLOW_THROUGHPUT = 1024 * 1024;
+    // Extra weight of a connection which has nothing available to send
+    static constexpr double BLOCKED_CONNECTION_WEIGHT = 1;
+    // Added to the RTT of an upstream when scoring, so that sub-millisecond RTTs do not dominate the load
+    static constexpr uint32_t RTT_FLOOR_US = 10000;
+    // Excess of the smoothed RTT over the minimum one, exceeding which an upstream is considered congested
+    static constexpr uint32_t MAX_QUEUEING_DELAY_US = 50000;
+    // Packet loss ratio, exceeding which an upstream is considered lossy while the ratio keeps growing
+    static constexpr double LOSSY_RATIO = 0.02;
+    // Growth of the packet loss ratio, exceeding which the ratio is considered growing
+    static constexpr double MIN_LOSS_GROWTH = 0.001;
+    // Time over which the remembered growth of the packet loss ratio halves
+    static constexpr Secs LOSS_GROWTH_HALF_LIFE{2};
+    // Time an upstream may stay without connections before it is closed, unless it is the last one
+    static constexpr Secs DEFAULT_IDLE_UPSTREAM_TIMEOUT{30};
 
     using MakeUpstream = std::unique_ptr<MultiplexableUpstream> (*)(
             const VpnUpstreamProtocolConfig &protocol_config, int id, VpnClient *vpn, ServerHandler handler);
 
-    UpstreamMultiplexer(
-            int id, const VpnUpstreamProtocolConfig &protocol_config, size_t upstreams_num, MakeUpstream make_upstream);
+    UpstreamMultiplexer(int id, const VpnUpstreamProtocolConfig &protocol_config, size_t upstreams_num,
+            MakeUpstream make_upstream, Millis idle_upstream_timeout = DEFAULT_IDLE_UPSTREAM_TIMEOUT);
     ~UpstreamMultiplexer() override;
 
     UpstreamMultiplexer() = delete;
@@ -36,6 +55,7 @@ public:
 private:
     struct Connection {
         int upstream_id;
+        bool blocked = false; // the last `available_to_send` call returned 0
     };
 
     struct PendingConnection : public Connection {
@@ -47,10 +67,13 @@ private:
     std::unordered_map<uint64_t, Connection> m_connections;
     std::unordered_map<int, std::unique_ptr<UpstreamInfo>> m_upstreams_pool;
     size_t m_max_upstreams_num = DEFAULT_UPSTREAMS_NUM;
+    Millis m_idle_upstream_timeout = DEFAULT_IDLE_UPSTREAM_TIMEOUT;
     std::unordered_map<uint64_t, PendingConnection> m_pending_connections;
     MakeUpstream m_make_upstream;
     std::optional<VpnError> m_pending_error;
     bool m_session_open = false; // True if session has been opened at least once.
+    // The upstream carrying the ICMP requests and the health checks, it is not closed for being idle
+    std::optional<int> m_probing_upstream_id;
 
     ag::Logger m_log{"UPSTREAM_MUX"};
 
@@ -61,6 +84,7 @@ private:
     uint64_t open_connection(const TunnelAddressPair *addr, int proto, std::string_view app_name) override;
     void close_connection(uint64_t id, bool graceful, bool async) override;
     ssize_t send(uint64_t id, const uint8_t *data, size_t length) override;
+    ssize_t send_by_reference(uint64_t id, const uint8_t *data, size_t length, const VpnBufferRef &buffer) override;
     void consume(uint64_t id, size_t length) override;
     size_t available_to_send(uint64_t id) override;
     void update_flow_control(uint64_t id, TcpFlowCtrlInfo info) override;
@@ -70,16 +94,27 @@ private:
     void on_icmp_request(IcmpEchoRequestEvent &event) override;
 
     static void child_upstream_handler(void *arg, ServerEvent what, void *data);
+    static void on_idle_upstream_timeout(void *arg, TaskId task_id);
 
+    [[nodiscard]] UpstreamInfo *get_upstream_info_by_conn(uint64_t id) const;
+    UpstreamInfo *select_probing_upstream();
     [[nodiscard]] MultiplexableUpstream *get_upstream_by_conn(uint64_t id) const;
     [[nodiscard]] std::optional<int> select_existing_upstream(
-            std::optional<int> ignored_upstream, bool allow_underflow) const;
+            std::optional<int> ignored_upstream, bool allow_underflow);
     int select_upstream_for_connection();
     bool open_new_upstream(int id, std::optional<Millis> timeout);
     bool open_connection(
             int upstream_id, uint64_t conn_id, const TunnelAddressPair *addr, int proto, std::string_view app_name);
     void proceed_pending_connection(int upstream_id, uint64_t conn_id, const PendingConnection *conn);
-    [[nodiscard]] size_t connections_num_by_upstream(int upstream_id) const;
+    [[nodiscard]] static size_t connections_num_by_upstream(const UpstreamInfo &info);
+    [[nodiscard]] static double weighted_load(const UpstreamInfo &info);
+    [[nodiscard]] static double score(const UpstreamInfo &info);
+    [[nodiscard]] static bool is_degraded(const UpstreamInfo &info);
+    void add_connection(UpstreamInfo &info, uint64_t conn_id);
+    void add_pending_connection(uint64_t conn_id, PendingConnection conn);
+    void forget_pending_connection(const PendingConnection &conn);
+    void forget_connection(uint64_t conn_id);
+    void schedule_idle_upstream_close(UpstreamInfo &info);
     void close_upstream(int upstream_id);
     void handle_sleep() override;
     void handle_wake() override;
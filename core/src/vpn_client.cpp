@@ -260,7 +260,15 @@ VpnError VpnClient::init(const VpnSettings *settings) {
 
     this->tunnel->udp_close_wait_hostname_cache = g_udp_close_wait_hostname_cache;
     this->kill_switch_on = settings->killswitch_enabled;
-    update_exclusions(settings->mode, {settings->exclusions.data, settings->exclusions.size});
+    std::shared_ptr<const DomainFilter::Exclusions> exclusions;
+    if (settings->exclusions_file != nullptr) {
+        exclusions = this->domain_filter.load_exclusions(settings->mode, settings->exclusions_file);
+    }
+    if (exclusions != nullptr) {
+        update_exclusions(std::move(exclusions));
+    } else {
+        update_exclusions(settings->mode, {settings->exclusions.data, settings->exclusions.size});
+    }
 
     if (settings->tmp_files_base_path != nullptr) {
         this->tmp_files_base_path = settings->tmp_files_base_path;
@@ -277,7 +285,8 @@ VpnError VpnClient::init(const VpnSettings *settings) {
             this->max_conn_buffer_file_size = VPN_DEFAULT_MAX_CONN_BUFFER_FILE_SIZE;
         }
     }
-    if (settings->ssl_sessions_storage_path != nullptr) {
+    // The cache counts its users, so every load is matched by exactly one dump in `deinit`
+    if (settings->ssl_sessions_storage_path != nullptr && !this->ssl_session_storage_path.has_value()) {
         this->ssl_session_storage_path = settings->ssl_sessions_storage_path;
         load_session_cache(*this->ssl_session_storage_path);
     }
@@ -545,7 +554,8 @@ void VpnClient::deinit() {
     this->tcp_socket.reset();
 
     if (this->ssl_session_storage_path.has_value()) {
-        dump_session_cache(*this->ssl_session_storage_path);
+        release_session_cache();
+        this->ssl_session_storage_path.reset();
     }
 
     if (this->bypass_upstream != nullptr) {
@@ -574,12 +584,19 @@ void VpnClient::process_client_packets(VpnPackets packets) {
 }
 
 void VpnClient::update_exclusions(VpnMode mode, std::string_view exclusions) {
-    log_client(this, dbg, "Mode={}", magic_enum::enum_name(mode));
-    this->exclusions_mode = mode;
-    this->domain_filter.update_exclusions(mode, exclusions);
+    update_exclusions(this->domain_filter.build_exclusions(mode, exclusions));
+}
+
+bool VpnClient::update_exclusions(std::shared_ptr<const DomainFilter::Exclusions> exclusions) {
+    if (!this->domain_filter.set_exclusions(std::move(exclusions))) {
+        return false;
+    }
+    this->exclusions_mode = this->domain_filter.get_mode();
+    log_client(this, dbg, "Mode={}", magic_enum::enum_name(this->exclusions_mode));
     if (this->fsm.get_state() == vpn_client::S_CONNECTED) {
         this->tunnel->on_exclusions_updated();
     }
+    return true;
 }
 
 void VpnClient::reset_connections(int uid) {
@@ -609,10 +626,10 @@ VpnConnectionStats VpnClient::get_connection_stats() const {
                                                               : VpnConnectionStats{};
 }
 
-std::unique_ptr<DataBuffer> VpnClient::make_buffer(uint64_t id) const {
+std::unique_ptr<DataBuffer> VpnClient::make_buffer() const {
     if (this->tmp_files_base_path.has_value()) {
-        return std::make_unique<MemfileBuffer>(make_buffer_file_path(this->tmp_files_base_path->c_str(), id),
-                this->conn_memory_buffer_threshold, this->max_conn_buffer_file_size);
+        return std::make_unique<MemfileBuffer>(
+                *this->tmp_files_base_path, this->conn_memory_buffer_threshold, this->max_conn_buffer_file_size);
     }
 
     return std::make_unique<MemoryBuffer>();
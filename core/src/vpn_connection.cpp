@@ -1,8 +1,35 @@
 #include "vpn/internal/vpn_connection.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+
 #include "net/dns_utils.h"
 
 namespace ag {
 
+static SlabAllocator &records_slab() {
+    static SlabAllocator slab(std::max(sizeof(TcpVpnConnection), sizeof(UdpVpnConnection)));
+    return slab;
+}
+
+void *VpnConnection::operator new(size_t size) {
+    assert(size <= records_slab().record_size());
+    void *ptr = records_slab().allocate();
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void VpnConnection::operator delete(void *ptr) {
+    records_slab().deallocate(ptr);
+}
+
+SlabAllocator::Stats VpnConnection::records_stats() {
+    return records_slab().stats();
+}
+
 VpnConnection::VpnConnection(TunnelAddressPair addr)
         : addr(std::move(addr)) {
 }
@@ -38,7 +65,31 @@ VpnConnection *VpnConnection::make(uint64_t client_id, TunnelAddressPair addr, i
 
 SockAddrTag VpnConnection::make_tag() const {
     const SocketAddress *dst = std::get_if<SocketAddress>(&this->addr.dst);
-    return {(dst != nullptr) ? *dst : SocketAddress{}, this->app_name};
+    return {(dst != nullptr) ? *dst : SocketAddress{}, this->app_name.str()};
+}
+
+VpnConnectionLookup &VpnConnection::lookup_state() {
+    if (this->lookup == nullptr) {
+        this->lookup = std::make_unique<VpnConnectionLookup>();
+    }
+    return *this->lookup;
+}
+
+void VpnConnection::finish_domain_lookup() {
+    this->flags.reset(CONNF_LOOKINGUP_DOMAIN);
+    this->lookup.reset();
+}
+
+const std::string &VpnConnection::found_domain() const {
+    static const std::string EMPTY;
+    return (this->domain_extractor_result != nullptr) ? this->domain_extractor_result->domain : EMPTY;
+}
+
+VpnConnectionBuffered &VpnConnection::buffered_state() {
+    if (this->buffered == nullptr) {
+        this->buffered = std::make_unique<VpnConnectionBuffered>();
+    }
+    return *this->buffered;
 }
 
 } // namespace ag
@@ -238,9 +238,9 @@ ssize_t VpnDnsResolver::send(uint64_t id, const uint8_t *data, size_t length) {
     this->state.connection_timeout_task = event_loop::schedule(
             this->vpn->parameters.ev_loop, {this, on_connection_timeout}, this->vpn->upstream_config.timeout);
 
-    dns_utils::DecodeResult r = dns_utils::decode_packet({data, length});
-    if (const auto *e = std::get_if<dns_utils::Error>(&r); e != nullptr) {
-        log_conn(this, id, dbg, "Failed to parse reply: {}", e->description);
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse({data, length});
+    if (!reader.has_value()) {
+        log_conn(this, id, dbg, "Failed to parse reply");
         return -1;
     }
 
@@ -250,22 +250,18 @@ ssize_t VpnDnsResolver::send(uint64_t id, const uint8_t *data, size_t length) {
     }
 
     std::vector<SocketAddress> resolved_addresses;
-    uint16_t reply_id; // NOLINT(cppcoreguidelines-init-variables)
-    if (const auto *inapplicable_packet = std::get_if<dns_utils::InapplicablePacket>(&r);
-            inapplicable_packet != nullptr) {
-        log_conn(this, id, trace, "Packet holds inapplicable packet");
-        reply_id = inapplicable_packet->id;
-    } else if (const auto *request = std::get_if<dns_utils::DecodedRequest>(&r); request != nullptr) {
+    uint16_t reply_id = reader->id();
+    if (!reader->is_response()) {
         log_conn(this, id, trace, "Packet holds DNS request");
-        reply_id = request->id;
+    } else if (reader->rcode() != LDNS_RCODE_NOERROR || !reader->has_question()) {
+        log_conn(this, id, trace, "Packet holds inapplicable packet");
     } else {
-        const auto &reply = std::get<dns_utils::DecodedReply>(r);
-        reply_id = reply.id;
-        resolved_addresses.reserve(reply.addresses.size());
-        std::transform(reply.addresses.begin(), reply.addresses.end(), std::back_inserter(resolved_addresses),
-                [](const dns_utils::AnswerAddress &a) {
-                    return SocketAddress({a.ip.data(), a.ip.size()}, 0);
-                });
+        reader->for_each_answer([&](const dns_utils::RecordView &record) {
+            if ((record.type == LDNS_RR_TYPE_A && record.rdata_length == 4)
+                    || (record.type == LDNS_RR_TYPE_AAAA && record.rdata_length == 16)) {
+                resolved_addresses.emplace_back(reader->rdata(record), 0);
+            }
+        });
         // @note: resolved addresses are passed to filter via the DNS sniffer in the tunnel
     }
 
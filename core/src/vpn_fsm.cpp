@@ -293,6 +293,7 @@ static void run_ping(void *ctx, void *) {
 #ifndef DISABLE_HTTP3
             .quic_version = QUICHE_PROTOCOL_VERSION,
 #endif
+            .quic_transport = vpn->upstream_config->quic_transport,
     };
 
     // Speed up recovery if we have already connected through a relay by pinging through the relay in parallel.
@@ -12,6 +12,7 @@
 #include "common/move_only_function.h"
 #include "socks_listener.h"
 #include "tun_device_listener.h"
+#include "vpn/internal/buffer_accountant.h"
 #include "vpn/internal/domain_filter.h"
 #include "vpn/internal/utils.h"
 #include "vpn/utils.h"
@@ -56,7 +57,16 @@ Vpn::Vpn()
         , id(g_next_id++) {
 }
 
-Vpn::~Vpn() = default;
+Vpn::~Vpn() {
+    {
+        std::scoped_lock l(this->exclusions_jobs_guard);
+        this->exclusions_builder_stopped = true;
+    }
+    this->exclusions_jobs_cond.notify_one();
+    if (this->exclusions_builder.joinable()) {
+        this->exclusions_builder.join();
+    }
+}
 
 void Vpn::update_upstream_config(AutoPod<VpnUpstreamConfig, vpn_upstream_config_destroy> config) {
     this->upstream_config = std::move(config);
@@ -114,6 +124,7 @@ vpn_client::EndpointConnectionConfig Vpn::make_client_upstream_config() const {
             .password = this->upstream_config->password,
             .ip_availability = ip_availability,
             .anti_dpi = this->upstream_config->anti_dpi,
+            .quic_transport = this->upstream_config->quic_transport,
     };
 }
 
@@ -204,6 +215,30 @@ void Vpn::submit(ag::MoveOnlyFunction<void()> func, std::optional<Millis> defer)
     }
 }
 
+void Vpn::build_exclusions(ag::MoveOnlyFunction<void()> job) {
+    std::scoped_lock l(this->exclusions_jobs_guard);
+    this->exclusions_jobs.emplace_back(std::move(job));
+    if (!this->exclusions_builder.joinable()) {
+        this->exclusions_builder = std::thread([this]() {
+            std::unique_lock jobs_lock(this->exclusions_jobs_guard);
+            while (true) {
+                this->exclusions_jobs_cond.wait(jobs_lock, [this]() {
+                    return this->exclusions_builder_stopped || !this->exclusions_jobs.empty();
+                });
+                if (this->exclusions_builder_stopped) {
+                    break;
+                }
+                ag::MoveOnlyFunction<void()> job = std::move(this->exclusions_jobs.front());
+                this->exclusions_jobs.pop_front();
+                jobs_lock.unlock();
+                job();
+                jobs_lock.lock();
+            }
+        });
+    }
+    this->exclusions_jobs_cond.notify_one();
+}
+
 void Vpn::complete_postponed_requests() {
     log_vpn(this, trace, "...");
     for (auto &request : this->postponed_requests) {
@@ -423,8 +458,6 @@ void vpn_stop(Vpn *vpn) {
     vpn->recovery = {};
     vpn->selected_endpoint.reset();
 
-    vpn->update_exclusions_task.release(); // The event loop is stopped, no need to reset()
-
     vpn->postponed_requests.clear();
     vpn->bypassed_connection_ids.clear();
 
@@ -501,9 +534,7 @@ void vpn_complete_connect_request(Vpn *vpn, const VpnConnectionInfo *info) {
     });
 }
 
-void vpn_update_exclusions(Vpn *vpn, VpnMode mode, VpnStr exclusions) {
-    log_vpn(vpn, info, "...");
-
+static void submit_exclusions(Vpn *vpn, std::shared_ptr<const DomainFilter::Exclusions> exclusions) {
     std::unique_lock l(vpn->stop_guard);
 
     if (!vpn_event_loop_is_active(vpn->ev_loop.get())) {
@@ -511,37 +542,56 @@ void vpn_update_exclusions(Vpn *vpn, VpnMode mode, VpnStr exclusions) {
         return;
     }
 
-    struct Ctx {
-        Vpn *vpn;
-        VpnMode mode;
-        std::string exclusions;
-    };
+    // The snapshots may be built concurrently and arrive out of order. Each one is installed by its own task,
+    // and the filter drops the ones older than the installed snapshot.
+    vpn->submit([vpn, exclusions = std::move(exclusions)]() mutable {
+        if (vpn->client.update_exclusions(std::move(exclusions))) {
+            vpn->client.reset_connections(-1);
+        }
+    });
+}
 
-    auto *ctx = new Ctx{
-            .vpn = vpn,
-            .mode = mode,
-            .exclusions = {exclusions.data, exclusions.size},
-    };
+void vpn_update_exclusions(Vpn *vpn, VpnMode mode, VpnStr exclusions) {
+    log_vpn(vpn, info, "...");
 
-    vpn->update_exclusions_task = event_loop::submit(vpn->ev_loop.get(),
-            {
-                    .arg = ctx,
-                    .action =
-                            [](void *arg, TaskId) {
-                                auto *ctx = (Ctx *) arg;
-                                ctx->vpn->update_exclusions_task.release();
-                                ctx->vpn->client.reset_connections(-1);
-                                ctx->vpn->client.update_exclusions(ctx->mode, ctx->exclusions);
-                            },
-                    .finalize =
-                            [](void *arg) {
-                                delete (Ctx *) arg;
-                            },
-            });
+    vpn->build_exclusions([vpn, mode, exclusions = std::string{exclusions.data, exclusions.size}]() {
+        submit_exclusions(vpn, vpn->client.domain_filter.build_exclusions(mode, exclusions));
+    });
 
     log_vpn(vpn, info, "Done");
 }
 
+void vpn_change_exclusions(Vpn *vpn, VpnStr added, VpnStr removed) {
+    log_vpn(vpn, info, "...");
+
+    vpn->build_exclusions([vpn, added = std::string{added.data, added.size},
+                                  removed = std::string{removed.data, removed.size}]() {
+        submit_exclusions(vpn, vpn->client.domain_filter.build_exclusions_update(added, removed));
+    });
+
+    log_vpn(vpn, info, "Done");
+}
+
+bool vpn_compile_exclusions(VpnStr exclusions, const char *path) {
+    DomainFilter filter;
+    std::shared_ptr snapshot = filter.build_exclusions(VPN_MODE_GENERAL, {exclusions.data, exclusions.size});
+    return filter.save_exclusions(*snapshot, path);
+}
+
+bool vpn_update_exclusions_from_file(Vpn *vpn, VpnMode mode, const char *path) {
+    log_vpn(vpn, info, "{}", path);
+
+    std::shared_ptr snapshot = vpn->client.domain_filter.load_exclusions(mode, path);
+    if (snapshot == nullptr) {
+        log_vpn(vpn, warn, "Failed to load exclusions");
+        return false;
+    }
+    submit_exclusions(vpn, std::move(snapshot));
+
+    log_vpn(vpn, info, "Done");
+    return true;
+}
+
 void vpn_reset_connections(Vpn *vpn, int uid) {
     log_vpn(vpn, info, "UID={}", uid);
 
@@ -646,6 +696,22 @@ void vpn_notify_wake(Vpn *vpn) {
     });
 }
 
+void vpn_set_buffers_memory_budget(size_t budget) {
+    BufferAccountant::instance().set_budget(budget);
+}
+
+VpnBuffersMemoryUsage vpn_get_buffers_memory_usage() {
+    const BufferAccountant &accountant = BufferAccountant::instance();
+    return {
+            .connection_buffers = accountant.usage(BS_CONNECTION_BUFFERS),
+            .spill_extents = accountant.usage(BS_SPILL_EXTENTS),
+            .tunnel_packets = accountant.usage(BS_TUNNEL_PACKETS),
+            .dns_pending = accountant.usage(BS_DNS_PENDING),
+            .total = accountant.total(),
+            .budget = accountant.budget(),
+    };
+}
+
 VpnExclusionValidationStatus vpn_validate_exclusion(const char *text) {
     switch (DomainFilter::validate_entry(text)) {
     case DFVS_OK_ADDR:
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -87,6 +89,8 @@ struct Vpn {
     void disconnect();
     bool run_event_loop();
     void submit(ag::MoveOnlyFunction<void()> func, std::optional<Millis> defer = std::nullopt);
+    /** Run a job on the exclusions builder thread, so that neither the caller nor the event loop waits for it */
+    void build_exclusions(ag::MoveOnlyFunction<void()> job);
     void complete_postponed_requests();
     void reset_bypassed_connections();
 
@@ -124,7 +128,12 @@ struct Vpn {
 
     mutable std::mutex stop_guard;
 
-    event_loop::AutoTaskId update_exclusions_task; // Guarded by stop_guard
+    // Builds the exclusions snapshots one by one in the order of the requests, started by the first request
+    std::thread exclusions_builder;
+    std::mutex exclusions_jobs_guard;
+    std::condition_variable exclusions_jobs_cond;
+    std::deque<ag::MoveOnlyFunction<void()>> exclusions_jobs; // Guarded by exclusions_jobs_guard
+    bool exclusions_builder_stopped = false;                  // Guarded by exclusions_jobs_guard
 
     ag::Logger log{vpn_manager::LOG_NAME};
     int id;
@@ -0,0 +1,199 @@
+#include <list>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "memfile_buffer.h"
+#include "memory_buffer.h"
+#include "vpn/internal/buffer_accountant.h"
+#include "vpn/internal/utils.h"
+
+using namespace ag;
+
+// NOLINTBEGIN(bugprone-unchecked-optional-access)
+class BufferAccountantTest : public testing::Test {
+protected:
+    const std::string DIR = "./buffer_accountant_test";
+    BufferAccountant &accountant = BufferAccountant::instance();
+
+    void SetUp() override {
+        std::error_code fs_err;
+        fs::create_directory(DIR, fs_err);
+        ASSERT_FALSE(fs_err) << fs_err.message();
+        ASSERT_EQ(accountant.total(), 0);
+    }
+
+    void TearDown() override {
+        accountant.set_budget(0);
+        ASSERT_EQ(accountant.total(), 0);
+        std::error_code fs_err;
+        fs::remove_all(DIR, fs_err);
+    }
+};
+
+TEST_F(BufferAccountantTest, MemoryBuffer) {
+    std::string data(MemoryBuffer::BLOCK_SIZE + 1, 'a');
+    {
+        std::unique_ptr<DataBuffer> buffer = std::make_unique<MemoryBuffer>();
+        ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), data.size()}).has_value());
+        ASSERT_EQ(accountant.usage(BS_CONNECTION_BUFFERS), 2 * MemoryBuffer::BLOCK_SIZE);
+        ASSERT_EQ(accountant.average_usage(BS_CONNECTION_BUFFERS), 2 * MemoryBuffer::BLOCK_SIZE);
+
+        buffer->drain(MemoryBuffer::BLOCK_SIZE);
+        ASSERT_EQ(accountant.usage(BS_CONNECTION_BUFFERS), MemoryBuffer::BLOCK_SIZE);
+    }
+    ASSERT_EQ(accountant.usage(BS_CONNECTION_BUFFERS), 0);
+    ASSERT_EQ(accountant.average_usage(BS_CONNECTION_BUFFERS), 0);
+}
+
+TEST_F(BufferAccountantTest, AccountedBytes) {
+    std::list<AccountedBytes<BS_TUNNEL_PACKETS>> packets;
+    packets.emplace_back(100);
+    packets.emplace_back(200);
+    ASSERT_EQ(accountant.usage(BS_TUNNEL_PACKETS), 300);
+    ASSERT_EQ(accountant.total(), 300);
+    packets.pop_front();
+    ASSERT_EQ(accountant.usage(BS_TUNNEL_PACKETS), 200);
+    packets.clear();
+    ASSERT_EQ(accountant.usage(BS_TUNNEL_PACKETS), 0);
+}
+
+TEST_F(BufferAccountantTest, Pressure) {
+    static constexpr size_t BUDGET = 1024 * 1024;
+    static constexpr size_t WINDOW = 8 * 1024 * 1024;
+
+    ASSERT_EQ(accountant.limit_window(WINDOW), WINDOW);
+    accountant.set_budget(BUDGET);
+    ASSERT_FALSE(accountant.under_pressure());
+    ASSERT_EQ(accountant.limit_window(WINDOW), WINDOW);
+
+    AccountedBytes<BS_DNS_PENDING> pending(BUDGET / 100 * BufferAccountant::PRESSURE_PERCENT);
+    ASSERT_TRUE(accountant.under_pressure());
+    ASSERT_FALSE(accountant.exhausted());
+    size_t window = accountant.limit_window(WINDOW);
+    ASSERT_LE(window, WINDOW);
+    ASSERT_GE(window, BufferAccountant::MIN_WINDOW);
+
+    AccountedBytes<BS_DNS_PENDING> more(BUDGET / 8);
+    ASSERT_LT(accountant.limit_window(WINDOW), window);
+
+    pending.resize(BUDGET);
+    ASSERT_TRUE(accountant.exhausted());
+    ASSERT_EQ(accountant.limit_window(WINDOW), BufferAccountant::MIN_WINDOW);
+}
+
+// Check that under pressure the incoming data go to the spill file instead of memory
+TEST_F(BufferAccountantTest, MemfileBufferSpills) {
+    std::string data(SpillFile::EXTENT_SIZE, 'a');
+    std::unique_ptr<DataBuffer> buffer = std::make_unique<MemfileBuffer>(DIR, 4 * SpillFile::EXTENT_SIZE);
+    ASSERT_FALSE(buffer->init().has_value());
+    ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), data.size()}).has_value());
+    ASSERT_EQ(accountant.usage(BS_SPILL_EXTENTS), 0);
+
+    accountant.set_budget(accountant.total());
+    ASSERT_TRUE(accountant.under_pressure());
+    ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), data.size()}).has_value());
+    ASSERT_GT(accountant.usage(BS_SPILL_EXTENTS), 0);
+    ASSERT_EQ(buffer->size(), 2 * data.size());
+
+    while (buffer->size() > 0) {
+        BufferPeekResult result = buffer->peek();
+        ASSERT_FALSE(result.err.has_value()) << *result.err;
+        buffer->drain(result.data.size());
+    }
+    buffer.reset();
+}
+
+// Check that an idle buffer gives its memory up once the budget is exhausted
+TEST_F(BufferAccountantTest, MemfileBufferEvicts) {
+    std::string data;
+    for (size_t i = 0; i < SpillFile::EXTENT_SIZE + 100; ++i) {
+        data.push_back(char('a' + i % 26));
+    }
+    std::unique_ptr<DataBuffer> buffer = std::make_unique<MemfileBuffer>(DIR, 4 * SpillFile::EXTENT_SIZE);
+    ASSERT_FALSE(buffer->init().has_value());
+    ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), data.size()}).has_value());
+    ASSERT_GT(accountant.usage(BS_CONNECTION_BUFFERS), 0);
+
+    std::this_thread::sleep_for(MemfileBuffer::IDLE_PERIOD);
+    accountant.set_budget(accountant.total());
+    ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), 1}).has_value());
+    ASSERT_EQ(accountant.usage(BS_CONNECTION_BUFFERS), 0);
+
+    std::string expected = data + data[0];
+    while (buffer->size() > 0) {
+        BufferPeekResult result = buffer->peek();
+        ASSERT_FALSE(result.err.has_value()) << *result.err;
+        ASSERT_EQ(expected.substr(0, result.data.size()), std::string((char *) result.data.data(), result.data.size()));
+        expected.erase(0, result.data.size());
+        buffer->drain(result.data.size());
+    }
+    ASSERT_TRUE(expected.empty());
+    buffer.reset();
+}
+
+// Check that under pressure a small push is staged in memory instead of taking a whole extent
+TEST_F(BufferAccountantTest, MemfileBufferStagesTail) {
+    std::string data(SpillFile::EXTENT_SIZE + 10, 'a');
+    std::unique_ptr<DataBuffer> buffer = std::make_unique<MemfileBuffer>(DIR, 4 * SpillFile::EXTENT_SIZE);
+    ASSERT_FALSE(buffer->init().has_value());
+    accountant.set_budget(1);
+    ASSERT_TRUE(accountant.under_pressure());
+
+    ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), 10}).has_value());
+    ASSERT_EQ(accountant.usage(BS_SPILL_EXTENTS), 0);
+    ASSERT_EQ(accountant.usage(BS_CONNECTION_BUFFERS), MemoryBuffer::BLOCK_SIZE);
+
+    ASSERT_FALSE(buffer->push({(uint8_t *) data.data(), SpillFile::EXTENT_SIZE}).has_value());
+    ASSERT_EQ(accountant.usage(BS_SPILL_EXTENTS), SpillFile::EXTENT_SIZE);
+    ASSERT_EQ(buffer->size(), data.size());
+
+    while (buffer->size() > 0) {
+        BufferPeekResult result = buffer->peek();
+        ASSERT_FALSE(result.err.has_value()) << *result.err;
+        buffer->drain(result.data.size());
+    }
+    buffer.reset();
+}
+
+// Check that the pushes to a buffer make the idle buffers of the thread give their memory up
+TEST_F(BufferAccountantTest, MemfileBufferEvictsIdleBuffers) {
+    std::string data;
+    for (size_t i = 0; i < 2 * SpillFile::EXTENT_SIZE + 100; ++i) {
+        data.push_back(char('a' + i % 26));
+    }
+    auto idle = std::make_unique<MemfileBuffer>(DIR, 0);
+    DataBuffer &idle_buffer = *idle;
+    ASSERT_FALSE(idle_buffer.init().has_value());
+    ASSERT_FALSE(idle_buffer.push({(uint8_t *) data.data(), data.size()}).has_value());
+    ASSERT_GT(accountant.usage(BS_CONNECTION_BUFFERS), 0);
+    ASSERT_EQ(accountant.usage(BS_SPILL_EXTENTS), MemfileBuffer::PREFETCH_EXTENTS * SpillFile::EXTENT_SIZE);
+
+    std::unique_ptr<DataBuffer> active = std::make_unique<MemfileBuffer>(DIR, SpillFile::EXTENT_SIZE);
+    ASSERT_FALSE(active->init().has_value());
+    std::this_thread::sleep_for(MemfileBuffer::IDLE_PERIOD);
+    active->drain(0);
+    accountant.set_budget(accountant.total());
+    ASSERT_FALSE(active->push({(uint8_t *) data.data(), 1}).has_value());
+    ASSERT_EQ(accountant.usage(BS_CONNECTION_BUFFERS), MemoryBuffer::BLOCK_SIZE);
+
+    // The prefetched extents are dropped once written
+    for (int i = 0; i < 100 && accountant.usage(BS_SPILL_EXTENTS) > 0; ++i) { // NOLINT(*-magic-numbers)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(accountant.usage(BS_SPILL_EXTENTS), 0);
+
+    std::string expected = data;
+    while (idle_buffer.size() > 0) {
+        BufferPeekResult result = idle_buffer.peek();
+        ASSERT_FALSE(result.err.has_value()) << *result.err;
+        ASSERT_EQ(expected.substr(0, result.data.size()), std::string((char *) result.data.data(), result.data.size()));
+        expected.erase(0, result.data.size());
+        idle_buffer.drain(result.data.size());
+    }
+    ASSERT_TRUE(expected.empty());
+    active.reset();
+    idle.reset();
+}
+// NOLINTEND(bugprone-unchecked-optional-access)
@@ -0,0 +1,94 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "vpn/internal/interned_string.h"
+#include "vpn/internal/slab_allocator.h"
+#include "vpn/internal/vpn_connection.h"
+
+using namespace ag;
+
+TEST(SlabAllocator, ReusesRecords) {
+    SlabAllocator slab(100);
+    ASSERT_EQ(slab.record_size() % alignof(std::max_align_t), 0);
+    ASSERT_GE(slab.record_size(), 100);
+
+    void *a = slab.allocate();
+    void *b = slab.allocate();
+    ASSERT_NE(a, nullptr);
+    ASSERT_NE(b, nullptr);
+    ASSERT_NE(a, b);
+    ASSERT_EQ(slab.stats().records_in_use, 2);
+
+    slab.deallocate(a);
+    ASSERT_EQ(slab.allocate(), a);
+    slab.deallocate(a);
+    slab.deallocate(b);
+    ASSERT_EQ(slab.stats().records_in_use, 0);
+}
+
+TEST(SlabAllocator, ReleasesChunks) {
+    SlabAllocator slab(100);
+    std::vector<void *> records;
+    for (size_t i = 0; i < 3 * slab.records_per_chunk(); ++i) {
+        records.push_back(slab.allocate());
+        ASSERT_NE(records.back(), nullptr);
+        std::memset(records.back(), 0xaa, 100);
+    }
+    ASSERT_EQ(slab.stats().chunks_num, 3);
+
+    for (void *r : records) {
+        slab.deallocate(r);
+    }
+    // one chunk is kept for the next allocations
+    ASSERT_EQ(slab.stats().chunks_num, 1);
+    ASSERT_EQ(slab.stats().records_in_use, 0);
+}
+
+TEST(InternedString, SharesStorage) {
+    InternedString a = std::string_view("com.example.application");
+    InternedString b;
+    ASSERT_TRUE(b.empty());
+    ASSERT_STREQ(b.c_str(), "");
+
+    b = std::string("com.example.") + "application";
+    ASSERT_EQ(a.c_str(), b.c_str());
+    ASSERT_EQ(std::string_view(b), "com.example.application");
+
+    b = std::string_view("");
+    ASSERT_TRUE(b.empty());
+}
+
+TEST(VpnConnection, Records) {
+    TunnelAddressPair addr = {SocketAddress("1.1.1.1:1"), SocketAddress("2.2.2.2:2")};
+    VpnConnection *tcp = VpnConnection::make(1, addr, IPPROTO_TCP);
+    VpnConnection *udp = VpnConnection::make(2, addr, IPPROTO_UDP);
+    ASSERT_EQ(VpnConnection::records_stats().records_in_use, 2);
+    ASSERT_EQ(tcp->lookup, nullptr);
+
+    tcp->flags.set(CONNF_LOOKINGUP_DOMAIN);
+    ++tcp->lookup_state().attempts_num;
+    ASSERT_NE(tcp->lookup, nullptr);
+    tcp->finish_domain_lookup();
+    ASSERT_FALSE(tcp->flags.test(CONNF_LOOKINGUP_DOMAIN));
+    ASSERT_EQ(tcp->lookup, nullptr);
+    ASSERT_TRUE(tcp->found_domain().empty());
+
+    ASSERT_FALSE(udp->has_buffered_packets());
+    ASSERT_EQ(udp->buffered, nullptr);
+    udp->buffered_state().packets.emplace_back(3, 0);
+    ASSERT_TRUE(udp->has_buffered_packets());
+
+    delete tcp;
+    delete udp;
+    ASSERT_EQ(VpnConnection::records_stats().records_in_use, 0);
+}
+
+// The members which most connections never need are allocated on demand, keep it that way
+TEST(VpnConnection, RecordSize) {
+    static constexpr size_t MAX_RECORD_SIZE = 480;
+    ASSERT_LE(sizeof(TcpVpnConnection), MAX_RECORD_SIZE);
+    ASSERT_LE(sizeof(UdpVpnConnection), MAX_RECORD_SIZE);
+}
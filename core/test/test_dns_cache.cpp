@@ -0,0 +1,229 @@
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "dns_cache.h"
+#include "net/dns_utils.h"
+
+using namespace ag;
+
+static constexpr uint32_t TTL = 100;
+
+class DnsCacheTest : public ::testing::Test {
+protected:
+    DnsCache m_cache;
+    SteadyClock::time_point m_now = SteadyClock::now();
+
+    static std::vector<uint8_t> make_query(std::string_view name) {
+        dns_utils::EncodeResult result = dns_utils::encode_request({dns_utils::RT_A, name});
+        return std::move(std::get<dns_utils::EncodedRequest>(result).data);
+    }
+
+    // Add an OPT record with the UDP payload size and the DO flag
+    static std::vector<uint8_t> add_opt(std::vector<uint8_t> query, uint16_t udp_size, bool dnssec_ok) {
+        query[11] = 1; // ARCOUNT
+        const uint8_t opt[] = {0x00, 0x00, 0x29, uint8_t(udp_size >> 8), uint8_t(udp_size), 0x00, 0x00,
+                uint8_t(dnssec_ok ? 0x80 : 0x00), 0x00, 0x00, 0x00};
+        query.insert(query.end(), std::begin(opt), std::end(opt));
+        return query;
+    }
+
+    // Answer with A records, which go after the question
+    static std::vector<uint8_t> make_response(
+            std::vector<uint8_t> query, uint8_t rcode = 0, uint32_t ttl = TTL, uint8_t answers_num = 1) {
+        query[2] |= 0x80;
+        query[3] = (query[3] & 0xf0) | rcode;
+        if (rcode != 0) {
+            return query;
+        }
+        size_t question_end = dns_utils::MessageReader::parse({query.data(), query.size()})->question_end();
+        query[7] = answers_num; // ANCOUNT
+        const uint8_t answer[] = {0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, uint8_t(ttl >> 24), uint8_t(ttl >> 16),
+                uint8_t(ttl >> 8), uint8_t(ttl), 0x00, 0x04, 0x01, 0x02, 0x03, 0x04};
+        for (size_t i = 0; i < answers_num; ++i) {
+            query.insert(query.begin() + ptrdiff_t(question_end), std::begin(answer), std::end(answer));
+        }
+        return query;
+    }
+
+    static uint32_t answer_ttl(const std::vector<uint8_t> &response) {
+        uint32_t ttl = 0;
+        dns_utils::MessageReader::parse({response.data(), response.size()})
+                ->for_each_answer([&](const dns_utils::RecordView &record) {
+                    ttl = record.ttl;
+                });
+        return ttl;
+    }
+
+    DnsCache::LookupResult lookup(const std::vector<uint8_t> &query, std::vector<uint8_t> &response,
+            bool serve_stale = true, DnsRoute route = DNS_ROUTE_PROXY, std::string_view resolver = "",
+            bool tcp = false) {
+        return m_cache.lookup(route, resolver, {query.data(), query.size()}, tcp, serve_stale, response, m_now);
+    }
+
+    void store(const std::vector<uint8_t> &response, DnsRoute route = DNS_ROUTE_PROXY,
+            std::string_view resolver = "") {
+        m_cache.store(route, resolver, {response.data(), response.size()}, m_now);
+    }
+};
+
+TEST_F(DnsCacheTest, Hit) {
+    std::vector<uint8_t> query = make_query("example.com");
+    std::vector<uint8_t> response;
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+
+    store(make_response(query));
+    m_now += Secs{30};
+
+    // Another query for the same name in a different case
+    std::vector<uint8_t> other_query = make_query("ExAmple.com");
+    DnsCache::LookupResult result = lookup(other_query, response);
+    ASSERT_EQ(result.status, DnsCache::LS_HIT);
+    ASSERT_FALSE(result.refresh);
+    ASSERT_EQ(response.size(), make_response(query).size());
+    // The ID and the question are taken from the query
+    ASSERT_TRUE(std::equal(other_query.begin(), other_query.begin() + 2, response.begin()));
+    ASSERT_TRUE(std::equal(other_query.begin() + 12, other_query.end(), response.begin() + 12));
+    ASSERT_EQ(answer_ttl(response), TTL - 30);
+
+    DnsCacheStats stats = m_cache.get_stats();
+    ASSERT_EQ(stats.hits, 1);
+    ASSERT_EQ(stats.misses, 1);
+}
+
+TEST_F(DnsCacheTest, RouteIsPartOfKey) {
+    std::vector<uint8_t> query = make_query("example.com");
+    store(make_response(query), DNS_ROUTE_SYSTEM_PROXY);
+
+    std::vector<uint8_t> response;
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+}
+
+TEST_F(DnsCacheTest, ResolverIsPartOfKey) {
+    std::vector<uint8_t> query = make_query("example.com");
+    store(make_response(query), DNS_ROUTE_TUNNEL, "1.1.1.1:53");
+
+    std::vector<uint8_t> response;
+    ASSERT_EQ(lookup(query, response, false, DNS_ROUTE_TUNNEL, "8.8.8.8:53").status, DnsCache::LS_MISS);
+    ASSERT_EQ(lookup(query, response, false, DNS_ROUTE_TUNNEL, "1.1.1.1:53").status, DnsCache::LS_HIT);
+}
+
+TEST_F(DnsCacheTest, DnssecFlagsArePartOfKey) {
+    std::vector<uint8_t> query = make_query("example.com");
+    std::vector<uint8_t> dnssec_query = add_opt(query, 1232, /*dnssec_ok*/ true);
+    store(make_response(dnssec_query));
+
+    std::vector<uint8_t> response;
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+    ASSERT_EQ(lookup(add_opt(query, 1232, /*dnssec_ok*/ false), response).status, DnsCache::LS_MISS);
+    std::vector<uint8_t> cd_query = dnssec_query;
+    cd_query[3] |= 0x10;
+    ASSERT_EQ(lookup(cd_query, response).status, DnsCache::LS_MISS);
+    ASSERT_EQ(lookup(dnssec_query, response).status, DnsCache::LS_HIT);
+}
+
+TEST_F(DnsCacheTest, TruncatedForUdpLimit) {
+    std::vector<uint8_t> query = make_query("example.com");
+    std::vector<uint8_t> full = make_response(add_opt(query, 4096, false), 0, TTL, 40);
+    ASSERT_GT(full.size(), 512);
+    store(full);
+
+    std::vector<uint8_t> response;
+    ASSERT_EQ(lookup(add_opt(query, 4096, false), response).status, DnsCache::LS_HIT);
+    ASSERT_EQ(response.size(), full.size());
+
+    // The requester does not take as much, so it gets the question with the TC flag to retry over TCP
+    std::vector<uint8_t> small_query = add_opt(query, 512, false);
+    ASSERT_EQ(lookup(small_query, response).status, DnsCache::LS_HIT);
+    ASSERT_EQ(response.size(), query.size());
+    ASSERT_TRUE(response[2] & 0x02);
+    std::optional reader = dns_utils::MessageReader::parse({response.data(), response.size()});
+    ASSERT_TRUE(reader.has_value());
+    ASSERT_TRUE(reader->is_truncated());
+
+    ASSERT_EQ(lookup(small_query, response, true, DNS_ROUTE_PROXY, "", /*tcp*/ true).status, DnsCache::LS_HIT);
+    ASSERT_EQ(response.size(), full.size());
+}
+
+TEST_F(DnsCacheTest, NotCached) {
+    std::vector<uint8_t> query = make_query("example.com");
+    std::vector<uint8_t> response;
+
+    store(make_response(query, LDNS_RCODE_SERVFAIL));
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+
+    store(make_response(query, 0, 0));
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+
+    std::vector<uint8_t> truncated = make_response(query);
+    truncated[2] |= 0x02;
+    store(truncated);
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+
+    // No records to take the TTL from
+    store(make_response(query, LDNS_RCODE_NXDOMAIN));
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+}
+
+TEST_F(DnsCacheTest, Stale) {
+    std::vector<uint8_t> query = make_query("example.com");
+    store(make_response(query));
+    m_now += Secs{TTL + 1};
+
+    std::vector<uint8_t> response;
+    ASSERT_EQ(lookup(query, response, /*serve_stale*/ false).status, DnsCache::LS_MISS);
+
+    DnsCache::LookupResult result = lookup(query, response);
+    ASSERT_EQ(result.status, DnsCache::LS_STALE_HIT);
+    ASSERT_TRUE(result.refresh);
+    ASSERT_EQ(answer_ttl(response), DnsCache::STALE_TTL.count());
+
+    // The refresh is in progress
+    result = lookup(query, response);
+    ASSERT_EQ(result.status, DnsCache::LS_STALE_HIT);
+    ASSERT_FALSE(result.refresh);
+
+    // The refresh is lost
+    m_now += DnsCache::REFRESH_TIMEOUT;
+    ASSERT_TRUE(lookup(query, response).refresh);
+
+    m_now += DnsCache::STALE_WINDOW;
+    ASSERT_EQ(lookup(query, response).status, DnsCache::LS_MISS);
+}
+
+TEST_F(DnsCacheTest, Prefetch) {
+    std::vector<uint8_t> query = make_query("example.com");
+    store(make_response(query));
+    std::vector<uint8_t> response;
+    ASSERT_FALSE(lookup(query, response).refresh);
+
+    m_now += Secs{TTL - 5};
+    DnsCache::LookupResult result = lookup(query, response);
+    ASSERT_EQ(result.status, DnsCache::LS_HIT);
+    ASSERT_TRUE(result.refresh);
+    ASSERT_FALSE(lookup(query, response).refresh);
+
+    // The refreshed response resets the entry
+    store(make_response(query));
+    ASSERT_EQ(answer_ttl(response), 5);
+    lookup(query, response);
+    ASSERT_EQ(answer_ttl(response), TTL);
+    ASSERT_EQ(m_cache.get_stats().prefetches, 1);
+}
+
+TEST_F(DnsCacheTest, Eviction) {
+    DnsCache cache{2};
+    std::vector<uint8_t> queries[] = {make_query("a.com"), make_query("b.com"), make_query("c.com")};
+    for (const auto &query : queries) {
+        std::vector<uint8_t> response = make_response(query);
+        cache.store(DNS_ROUTE_PROXY, "", {response.data(), response.size()}, m_now);
+    }
+
+    std::vector<uint8_t> response;
+    ASSERT_EQ(cache.lookup(DNS_ROUTE_PROXY, "", {queries[0].data(), queries[0].size()}, false, true, response, m_now)
+                      .status,
+            DnsCache::LS_MISS);
+    ASSERT_EQ(cache.lookup(DNS_ROUTE_PROXY, "", {queries[2].data(), queries[2].size()}, false, true, response, m_now)
+                      .status,
+            DnsCache::LS_HIT);
+}
@@ -298,6 +298,20 @@ static const TestParam TLS_TEST_SAMPLES[] = {
 };
 INSTANTIATE_TEST_SUITE_P(DomainExtractorTLS, OutgoingDataTcp, testing::ValuesIn(TLS_TEST_SAMPLES));
 
+TEST(DomainExtractorTLSSegments, Test) {
+    const TestParam &param = TLS_TEST_SAMPLES[0];
+    DomainExtractor domain_extractor = {};
+    DomainExtractorResult result = {DES_WANT_MORE};
+
+    // The Client Hello comes byte by byte
+    for (size_t i = 0; i < param.input.size() && result.status == DES_WANT_MORE; ++i) {
+        result = domain_extractor.proceed(param.dir, IPPROTO_TCP, &param.input[i], 1);
+    }
+
+    ASSERT_EQ(result.status, param.expected_status);
+    ASSERT_EQ(result.domain, param.expected_domain);
+}
+
 class TLSExchange : public testing::Test {
 public:
     DomainExtractor domain_extractor = {};
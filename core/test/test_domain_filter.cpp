@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <filesystem>
+#include <thread>
+
 #include <gtest/gtest.h>
 
+#include "vpn/internal/cidr_trie.h"
 #include "vpn/internal/domain_filter.h"
+#include "vpn/internal/domain_trie.h"
 #include "vpn/utils.h"
 
 using namespace ag;
@@ -55,6 +63,11 @@ static const MatchTestParam DOMAIN_MATCH_TEST_SAMPLES[] = {
         {VPN_MODE_GENERAL, "example.com *.example.com", "sub.example.com"},
         {VPN_MODE_GENERAL, "*.example.com example.com", "example.com"},
         {VPN_MODE_GENERAL, "*.example.com", "*.example.com"},
+
+        {VPN_MODE_GENERAL, "*.example.com", "a.b.c.example.com"},
+        {VPN_MODE_GENERAL, "*.com example.org", "www.com"},
+        {VPN_MODE_GENERAL, "sub.example.com example.com", "www.sub.example.com"},
+        {VPN_MODE_GENERAL, "example.com.", "example.com."},
 };
 INSTANTIATE_TEST_SUITE_P(Simple, DomainMatch, testing::ValuesIn(DOMAIN_MATCH_TEST_SAMPLES));
 
@@ -74,9 +87,284 @@ static const MatchTestParam DOMAIN_NOMATCH_TEST_SAMPLES[] = {
         {VPN_MODE_GENERAL, "example.com", "sub.example.org"},
         {VPN_MODE_GENERAL, "example.com", "example.com."},
         {VPN_MODE_GENERAL, "example.com", "*.example.com"},
+
+        {VPN_MODE_GENERAL, "*.example.com", "example.com"},
+        {VPN_MODE_GENERAL, "*.example.com", "notexample.com"},
+        {VPN_MODE_GENERAL, "example.com", "Example.com"},
+        {VPN_MODE_GENERAL, "sub.example.com", "sub.example.co"},
+        {VPN_MODE_GENERAL, "example.com", ""},
+        {VPN_MODE_GENERAL, "example.com", "www."},
+        {VPN_MODE_GENERAL, "example.com", "com"},
 };
 INSTANTIATE_TEST_SUITE_P(Simple, DomainNoMatch, testing::ValuesIn(DOMAIN_NOMATCH_TEST_SAMPLES));
 
+TEST(DomainFilterTest, ResolvableExclusions) {
+    DomainFilter filter = {};
+    ASSERT_TRUE(filter.update_exclusions(VPN_MODE_GENERAL, "example.com *.example.org www.example.net 1.1.1.1"));
+    std::vector<std::string_view> names = filter.get_resolvable_exclusions();
+    std::sort(names.begin(), names.end());
+    ASSERT_EQ(names, (std::vector<std::string_view>{"example.com", "example.net"}));
+}
+
+TEST(DomainFilterTest, Snapshots) {
+    DomainFilter filter = {};
+    ASSERT_TRUE(filter.update_exclusions(VPN_MODE_GENERAL, "example.com"));
+
+    // A snapshot is not used until it is installed
+    std::shared_ptr<const DomainFilter::Exclusions> snapshot;
+    std::thread([&] {
+        snapshot = filter.build_exclusions(VPN_MODE_SELECTIVE, "example.org 1.1.1.1");
+    }).join();
+    ASSERT_EQ(filter.match_domain("example.com"), DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_domain("example.org"), DFMS_DEFAULT);
+    ASSERT_EQ(filter.get_mode(), VPN_MODE_GENERAL);
+
+    filter.set_exclusions(snapshot);
+    ASSERT_EQ(filter.match_domain("example.com"), DFMS_DEFAULT);
+    ASSERT_EQ(filter.match_domain("example.org"), DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_tag({SocketAddress("1.1.1.1:443"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(filter.get_mode(), VPN_MODE_SELECTIVE);
+}
+
+TEST(DomainFilterTest, IncrementalUpdate) {
+    DomainFilter filter = {};
+    ASSERT_TRUE(filter.update_exclusions(
+            VPN_MODE_SELECTIVE, "example.com *.example.com example.org 1.1.1.1 10.0.0.0/8 192.168.0.0/16"));
+
+    filter.set_exclusions(filter.build_exclusions_update("example.net 2.2.2.2", "*.example.com example.org 1.1.1.1"));
+    ASSERT_EQ(filter.match_domain("example.com"), DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_domain("sub.example.com"), DFMS_DEFAULT);
+    ASSERT_EQ(filter.match_domain("example.org"), DFMS_DEFAULT);
+    ASSERT_EQ(filter.match_domain("example.net"), DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_tag({SocketAddress("1.1.1.1"), ""}).status, DFMS_DEFAULT);
+    ASSERT_EQ(filter.match_tag({SocketAddress("2.2.2.2"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(filter.get_mode(), VPN_MODE_SELECTIVE);
+
+    // Updates are based on the latest built snapshot, even if it is not installed yet
+    std::shared_ptr<const DomainFilter::Exclusions> snapshot = filter.build_exclusions_update("", "10.0.0.0/8");
+    snapshot = filter.build_exclusions_update("example.info", "");
+    filter.set_exclusions(snapshot);
+    ASSERT_EQ(filter.match_tag({SocketAddress("10.1.1.1"), ""}).status, DFMS_DEFAULT);
+    ASSERT_EQ(filter.match_tag({SocketAddress("192.168.1.1"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_domain("example.info"), DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_domain("example.net"), DFMS_EXCLUSION);
+
+    std::vector<std::string_view> names = filter.get_resolvable_exclusions();
+    std::sort(names.begin(), names.end());
+    ASSERT_EQ(names, (std::vector<std::string_view>{"example.com", "example.info", "example.net"}));
+}
+
+TEST(DomainFilterTest, StaleSnapshotIsDropped) {
+    DomainFilter filter = {};
+    std::shared_ptr<const DomainFilter::Exclusions> older = filter.build_exclusions(VPN_MODE_GENERAL, "example.com");
+    std::shared_ptr<const DomainFilter::Exclusions> newer = filter.build_exclusions_update("example.org", "");
+
+    // The snapshots built concurrently may be installed out of order
+    ASSERT_TRUE(filter.set_exclusions(newer));
+    ASSERT_FALSE(filter.set_exclusions(older));
+    ASSERT_EQ(filter.match_domain("example.com"), DFMS_EXCLUSION);
+    ASSERT_EQ(filter.match_domain("example.org"), DFMS_EXCLUSION);
+}
+
+TEST(DomainFilterTest, SaveLoad) {
+    std::string path = (std::filesystem::temp_directory_path() / "test_domain_filter_exclusions.bin").string();
+    DomainFilter filter = {};
+    std::shared_ptr snapshot = filter.build_exclusions(
+            VPN_MODE_GENERAL, "example.com *.example.org 1.1.1.1 [::1]:443 10.0.0.0/8 2001:db8::/32");
+    ASSERT_TRUE(filter.save_exclusions(*snapshot, path));
+
+    DomainFilter loaded = {};
+    snapshot = loaded.load_exclusions(VPN_MODE_SELECTIVE, path);
+    ASSERT_NE(snapshot, nullptr);
+    loaded.set_exclusions(snapshot);
+    ASSERT_EQ(loaded.get_mode(), VPN_MODE_SELECTIVE);
+    ASSERT_EQ(loaded.match_domain("www.example.com"), DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_domain("sub.example.org"), DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_domain("example.org"), DFMS_DEFAULT);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("1.1.1.1:80"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("[::1]:443"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("[::1]:80"), ""}).status, DFMS_DEFAULT);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("10.2.3.4:80"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("[2001:db8::1]:80"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.get_resolvable_exclusions(), (std::vector<std::string_view>{"example.com"}));
+
+    // The entries of a loaded snapshot are parsed on the first incremental update
+    loaded.set_exclusions(loaded.build_exclusions_update("example.net", "10.0.0.0/8 *.example.org"));
+    ASSERT_EQ(loaded.match_domain("example.com"), DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_domain("example.net"), DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_domain("sub.example.org"), DFMS_DEFAULT);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("10.2.3.4:80"), ""}).status, DFMS_DEFAULT);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("[::1]:443"), ""}).status, DFMS_EXCLUSION);
+    ASSERT_EQ(loaded.match_tag({SocketAddress("[2001:db8::1]:80"), ""}).status, DFMS_EXCLUSION);
+
+    // A file with a corrupted header is rejected, and so is a truncated one
+    FILE *file = std::fopen(path.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    std::fseek(file, 16, SEEK_SET); // NOLINT(*-magic-numbers)
+    std::fputc('x', file);
+    std::fclose(file);
+    ASSERT_EQ(loaded.load_exclusions(VPN_MODE_GENERAL, path), nullptr);
+    ASSERT_TRUE(filter.save_exclusions(*filter.build_exclusions(VPN_MODE_GENERAL, "example.com"), path));
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - FLAT_BUFFER_ALIGNMENT);
+    ASSERT_EQ(loaded.load_exclusions(VPN_MODE_GENERAL, path), nullptr);
+    ASSERT_EQ(loaded.load_exclusions(VPN_MODE_GENERAL, path + ".nonexistent"), nullptr);
+
+    std::filesystem::remove(path);
+}
+
+// Compile the ranges into `data` and view them
+static CidrTrie make_cidr_trie(std::span<const CidrRange> ranges, std::vector<uint8_t> &data) {
+    data.clear();
+    FlatBufferWriter out{data};
+    CidrTrie::build(ranges, out);
+    FlatBufferReader in{{data.data(), data.size()}};
+    return CidrTrie::view(in).value();
+}
+
+TEST(CidrTrieTest, Includes) {
+    std::vector<CidrRange> ranges = {CidrRange("10.0.0.0/8"), CidrRange("192.168.1.0/24"), CidrRange("172.16.0.0/12"),
+            CidrRange("1.2.3.4/32"), CidrRange("10.1.0.0/16"), CidrRange("2001:db8::/33"), CidrRange("::1/128")};
+    std::vector<uint8_t> data;
+    CidrTrie trie = make_cidr_trie(ranges, data);
+    ASSERT_EQ(trie.size(), ranges.size());
+
+    auto includes = [&trie](const char *address) {
+        return trie.includes(SocketAddress(address).addr());
+    };
+    ASSERT_TRUE(includes("10.255.0.1"));
+    ASSERT_TRUE(includes("10.1.2.3"));
+    ASSERT_TRUE(includes("192.168.1.255"));
+    ASSERT_FALSE(includes("192.168.2.1"));
+    ASSERT_TRUE(includes("172.31.255.255"));
+    ASSERT_FALSE(includes("172.32.0.0"));
+    ASSERT_FALSE(includes("172.15.255.255"));
+    ASSERT_TRUE(includes("1.2.3.4"));
+    ASSERT_FALSE(includes("1.2.3.5"));
+    ASSERT_FALSE(includes("11.0.0.1"));
+    ASSERT_TRUE(includes("2001:db8:7fff::1"));
+    ASSERT_FALSE(includes("2001:db8:8000::1"));
+    ASSERT_TRUE(includes("::1"));
+    ASSERT_FALSE(includes("::2"));
+    // The families do not mix
+    ASSERT_FALSE(includes("::a00:1"));
+
+    ASSERT_FALSE(CidrTrie{}.includes(SocketAddress("10.0.0.1").addr()));
+    std::vector<uint8_t> empty_data;
+    ASSERT_FALSE(make_cidr_trie({}, empty_data).includes(SocketAddress("10.0.0.1").addr()));
+    std::vector<CidrRange> everything = {CidrRange("0.0.0.0/0")};
+    std::vector<uint8_t> everything_data;
+    ASSERT_TRUE(make_cidr_trie(everything, everything_data).includes(SocketAddress("8.8.8.8").addr()));
+    ASSERT_FALSE(make_cidr_trie(everything, everything_data).includes(SocketAddress("::8").addr()));
+}
+
+TEST(CidrTrieTest, Malformed) {
+    std::vector<CidrRange> ranges = {CidrRange("10.0.0.0/8"), CidrRange("10.1.2.0/24")};
+    std::vector<uint8_t> data;
+    make_cidr_trie(ranges, data);
+    for (size_t size = 0; size < data.size(); size += FLAT_BUFFER_ALIGNMENT) {
+        FlatBufferReader in{{data.data(), size}};
+        ASSERT_FALSE(CidrTrie::view(in).has_value()) << size;
+    }
+
+    // A child out of the nodes array
+    std::vector<uint8_t> bad;
+    FlatBufferWriter out{bad};
+    out.write(uint64_t(1));
+    out.write(uint64_t(0));
+    std::vector<std::array<uint64_t, 9>> nodes(1);
+    nodes[0][4] = uint64_t(1) << 10; // The children bit of byte 10
+    nodes[0][8] = 7;                 // The first child
+    out.write_array<std::array<uint64_t, 9>>(nodes);
+    out.write(uint64_t(0));
+    out.write_array<std::array<uint64_t, 9>>({});
+    FlatBufferReader in{{bad.data(), bad.size()}};
+    std::optional trie = CidrTrie::view(in);
+    ASSERT_TRUE(trie.has_value());
+    ASSERT_FALSE(trie->includes(SocketAddress("10.0.0.1").addr()));
+}
+
+// Compile the names into `data` and view them
+static DomainTrie make_domain_trie(
+        const std::vector<std::pair<std::string_view, DomainTrie::Flags>> &domains, std::vector<uint8_t> &data) {
+    data.clear();
+    FlatBufferWriter out{data};
+    DomainTrie::build(domains, out);
+    FlatBufferReader in{{data.data(), data.size()}};
+    return DomainTrie::view(in).value();
+}
+
+TEST(DomainTrieTest, MatchSuffixes) {
+    std::vector<uint8_t> data;
+    DomainTrie trie = make_domain_trie({{"example.com", 1}, {"com", 2}, {"a.b.example.com", 4}, {"org.", 8}}, data);
+    ASSERT_EQ(trie.size(), 4);
+
+    std::vector<std::pair<size_t, DomainTrie::Flags>> matched;
+    auto collect = [&matched](size_t length, DomainTrie::Flags flags) {
+        matched.emplace_back(length, flags);
+        return false;
+    };
+    using Matches = std::vector<std::pair<size_t, DomainTrie::Flags>>;
+
+    ASSERT_FALSE(trie.match_suffixes("a.b.example.com", collect));
+    ASSERT_EQ(matched, (Matches{{3, 2}, {11, 1}, {15, 4}}));
+
+    // `b.example.com` is an intermediate node without flags
+    matched.clear();
+    ASSERT_FALSE(trie.match_suffixes("b.example.com", collect));
+    ASSERT_EQ(matched, (Matches{{3, 2}, {11, 1}}));
+
+    matched.clear();
+    ASSERT_FALSE(trie.match_suffixes("xexample.com", collect));
+    ASSERT_EQ(matched, (Matches{{3, 2}}));
+
+    matched.clear();
+    ASSERT_FALSE(trie.match_suffixes("example.org", collect));
+    ASSERT_FALSE(trie.match_suffixes("", collect));
+    ASSERT_TRUE(matched.empty());
+    ASSERT_FALSE(trie.match_suffixes("x.org.", collect));
+    ASSERT_EQ(matched, (Matches{{4, 8}}));
+
+    // Stopped at the first match
+    ASSERT_TRUE(trie.match_suffixes("www.example.com", [](size_t length, DomainTrie::Flags) {
+        return length == 3;
+    }));
+
+    DomainTrie empty;
+    ASSERT_TRUE(empty.empty());
+    matched.clear();
+    ASSERT_FALSE(empty.match_suffixes("com", collect));
+    ASSERT_FALSE(make_domain_trie({}, data).match_suffixes("com", collect));
+    ASSERT_TRUE(matched.empty());
+}
+
+TEST(DomainTrieTest, Malformed) {
+    std::vector<uint8_t> data;
+    make_domain_trie({{"example.com", 1}, {"example.org", 2}}, data);
+    for (size_t size = 0; size < data.size(); size += FLAT_BUFFER_ALIGNMENT) {
+        FlatBufferReader in{{data.data(), size}};
+        ASSERT_FALSE(DomainTrie::view(in).has_value()) << size;
+    }
+
+    // Node indices out of the nodes array and a table without free slots
+    auto collect = [](size_t, DomainTrie::Flags) {
+        return true;
+    };
+    for (const std::vector<uint32_t> &table : {std::vector<uint32_t>{0, 7}, std::vector<uint32_t>{1, 1}}) {
+        std::vector<uint8_t> bad;
+        FlatBufferWriter out{bad};
+        out.write(uint64_t(1));
+        // The root node and a node with the label out of the labels array
+        out.write_array<std::array<uint32_t, 5>>(std::vector<std::array<uint32_t, 5>>{{}, {0, 0, 2, 3, 1}});
+        out.write_array<uint32_t>(table);
+        out.write_array<char>(std::string_view{"com"});
+        FlatBufferReader in{{bad.data(), bad.size()}};
+        std::optional trie = DomainTrie::view(in);
+        ASSERT_TRUE(trie.has_value());
+        ASSERT_FALSE(trie->match_suffixes("example.com", collect));
+        ASSERT_FALSE(trie->match_suffixes("com", collect));
+    }
+}
+
 class AddressMatch : public MatchTest {};
 TEST_P(AddressMatch, Test) {
     const MatchTestParam &param = GetParam();
@@ -104,6 +392,9 @@ static const MatchTestParam ADDRESS_MATCH_TEST_SAMPLES[] = {
         {VPN_MODE_GENERAL, "2000::/64", "2000::1"},
         {VPN_MODE_GENERAL, "2000::/64", "[2000::1]"},
         {VPN_MODE_GENERAL, "2000::/64", "[2000::1]:123"},
+        {VPN_MODE_GENERAL, "10.0.0.0/8 192.168.0.0/16", "10.20.30.40"},
+        {VPN_MODE_GENERAL, "10.0.0.0/8 192.168.0.0/16", "192.168.255.255"},
+        {VPN_MODE_GENERAL, "192.168.0.0/16 192.168.1.0/24", "192.168.1.1"},
 };
 INSTANTIATE_TEST_SUITE_P(Simple, AddressMatch, testing::ValuesIn(ADDRESS_MATCH_TEST_SAMPLES));
 
@@ -130,6 +421,7 @@ static const MatchTestParam ADDRESS_NOMATCH_TEST_SAMPLES[] = {
         {VPN_MODE_GENERAL, "2000::/64", "2001::1"},
         {VPN_MODE_GENERAL, "2000::/64", "[2001::1]"},
         {VPN_MODE_GENERAL, "2000::/64", "[2001::1]:4433"},
+        {VPN_MODE_GENERAL, "10.0.0.0/8 192.168.0.0/16", "192.169.0.1"},
 };
 INSTANTIATE_TEST_SUITE_P(Simple, AddressNoMatch, testing::ValuesIn(ADDRESS_NOMATCH_TEST_SAMPLES));
 
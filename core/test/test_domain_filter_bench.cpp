@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/cidr_range.h"
+#include "common/net_utils.h"
+#include "vpn/internal/cidr_trie.h"
+#include "vpn/internal/domain_filter.h"
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t QUERIES_NUM = 1000000;
+static constexpr size_t CIDR_RANGES_NUM = 100000;
+static constexpr std::string_view WWW_PREFIX = "www.";
+static constexpr std::string_view TLDS[] = {"com", "org", "net", "io", "co.uk", "de", "ru"};
+
+enum MatchFlags : uint32_t {
+    EXACT = 1 << 0,
+    SUBDOMAINS = 1 << 1,
+};
+
+// The matching as it was done before the domains were compiled into a trie
+static bool match_map(const std::unordered_map<std::string, uint32_t> &domains, std::string_view domain) {
+    bool www_prefixed = domain.starts_with(WWW_PREFIX);
+    std::string seek = !www_prefixed ? std::string(domain) : std::string(domain.substr(WWW_PREFIX.length()));
+
+    while (true) {
+        auto i = domains.find(seek);
+        if (i != domains.end()) {
+            uint32_t flags = i->second;
+            bool found = ((flags & EXACT)
+                                 && (seek.length() == domain.length()
+                                         || (www_prefixed && seek.length() + WWW_PREFIX.length() == domain.length())))
+                    || ((flags & SUBDOMAINS) && (seek.length() < domain.length()));
+            if (found) {
+                return true;
+            }
+        }
+
+        size_t next_dot = seek.find('.');
+        if (next_dot == std::string::npos || next_dot + 1 == seek.length()) {
+            break;
+        }
+
+        seek.erase(0, next_dot + 1);
+    }
+
+    return false;
+}
+
+/**
+ * Compares the domain matching of `DomainFilter` with the matching through the hash map
+ * of the names, for several exclusion list sizes
+ */
+class DomainFilterBench : public testing::TestWithParam<size_t> {
+protected:
+    std::mt19937 m_rng{GetParam()};
+
+    std::string random_label() {
+        std::uniform_int_distribution<size_t> length(3, 12);
+        std::uniform_int_distribution<int> letter('a', 'z');
+        std::string label;
+        // The filter strips `www.` off the entries, the baseline does not
+        while (label.empty() || label == "www") {
+            label.assign(length(m_rng), 0);
+            for (char &c : label) {
+                c = char(letter(m_rng));
+            }
+        }
+        return label;
+    }
+
+    std::string random_domain() {
+        std::string domain = random_label();
+        if (m_rng() % 4 == 0) {
+            domain = random_label() + "." + domain;
+        }
+        return domain + "." + std::string(TLDS[m_rng() % std::size(TLDS)]);
+    }
+};
+
+TEST_P(DomainFilterBench, Match) {
+    size_t entries_num = GetParam();
+
+    std::unordered_map<std::string, uint32_t> map;
+    while (map.size() < entries_num) {
+        map[random_domain()] |= (m_rng() % 2 == 0) ? EXACT : SUBDOMAINS;
+    }
+
+    // A half of the queries hit the list: the names themselves, `www.` + the names and the subdomains
+    std::vector<std::string> queries;
+    queries.reserve(QUERIES_NUM);
+    std::vector<const std::string *> names;
+    names.reserve(map.size());
+    for (const auto &[name, flags] : map) {
+        names.push_back(&name);
+    }
+    for (size_t i = 0; i < QUERIES_NUM; ++i) {
+        const std::string &name = *names[m_rng() % names.size()];
+        switch (i % 4) {
+        case 0:
+            queries.push_back(name);
+            break;
+        case 1:
+            queries.push_back(random_label() + "." + name);
+            break;
+        case 2:
+            queries.push_back(std::string(WWW_PREFIX) + name);
+            break;
+        default:
+            queries.push_back(random_label() + "." + random_domain());
+            break;
+        }
+    }
+
+    std::string exclusions;
+    for (const auto &[name, flags] : map) {
+        if (flags & EXACT) {
+            exclusions.append(name).push_back(' ');
+        }
+        if (flags & SUBDOMAINS) {
+            exclusions.append("*.").append(name).push_back(' ');
+        }
+    }
+
+    Clock::time_point start = Clock::now();
+    DomainFilter filter;
+    ASSERT_TRUE(filter.update_exclusions(VPN_MODE_GENERAL, exclusions));
+    Clock::duration build_time = Clock::now() - start;
+
+    // Loading the compiled file is what a restart costs instead of parsing the list
+    std::string path = (std::filesystem::temp_directory_path() / "test_domain_filter_bench.bin").string();
+    ASSERT_TRUE(filter.save_exclusions(*filter.build_exclusions(VPN_MODE_GENERAL, exclusions), path));
+    size_t compiled_size = std::filesystem::file_size(path);
+    start = Clock::now();
+    std::shared_ptr<const DomainFilter::Exclusions> loaded = filter.load_exclusions(VPN_MODE_GENERAL, path);
+    Clock::duration load_time = Clock::now() - start;
+    ASSERT_NE(loaded, nullptr);
+    filter.set_exclusions(std::move(loaded));
+    std::filesystem::remove(path);
+
+    std::vector<bool> map_results(QUERIES_NUM);
+    start = Clock::now();
+    for (size_t i = 0; i < QUERIES_NUM; ++i) {
+        map_results[i] = match_map(map, queries[i]);
+    }
+    Clock::duration map_time = Clock::now() - start;
+
+    std::vector<bool> filter_results(QUERIES_NUM);
+    start = Clock::now();
+    for (size_t i = 0; i < QUERIES_NUM; ++i) {
+        filter_results[i] = filter.match_domain(queries[i]) == DFMS_EXCLUSION;
+    }
+    Clock::duration filter_time = Clock::now() - start;
+
+    ASSERT_EQ(map_results, filter_results);
+
+    auto ns_per_query = [](Clock::duration d) {
+        return std::chrono::duration<double, std::nano>(d).count() / QUERIES_NUM;
+    };
+    auto ms = [](Clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    printf("entries=%zu queries=%zu matched=%zu build=%.1fms load=%.1fms compiled=%zuKiB map=%.1fns/query "
+           "filter=%.1fns/query\n",
+            entries_num, QUERIES_NUM, size_t(std::count(filter_results.begin(), filter_results.end(), true)),
+            ms(build_time), ms(load_time), compiled_size / 1024, ns_per_query(map_time), ns_per_query(filter_time));
+}
+
+INSTANTIATE_TEST_SUITE_P(Entries, DomainFilterBench, testing::Values(1000, 100000, 1000000));
+
+/**
+ * Compares the address lookup through the compiled trie with the lookup through `CidrRangeSet`
+ * on a list of ranges of the size of a country-level IP list
+ */
+TEST(CidrBench, Includes) {
+    std::mt19937 rng{CIDR_RANGES_NUM};
+    auto random_address = [&rng](size_t size) {
+        Uint8Vector address(size);
+        for (uint8_t &byte : address) {
+            byte = uint8_t(rng());
+        }
+        return address;
+    };
+
+    // Mostly IPv4 ranges from /16 to /24, the rest are IPv6 ones from /24 to /48
+    std::vector<CidrRange> ranges;
+    ranges.reserve(CIDR_RANGES_NUM);
+    for (size_t i = 0; i < CIDR_RANGES_NUM; ++i) {
+        bool ipv6 = i % 10 == 0;
+        Uint8Vector address = random_address(ipv6 ? IPV6_ADDRESS_SIZE : IPV4_ADDRESS_SIZE);
+        size_t length = ipv6 ? 24 + rng() % 25 : 16 + rng() % 9;
+        ranges.emplace_back(CidrRange({address.data(), address.size()}, length));
+    }
+
+    // A half of the queries are addresses within the ranges
+    std::vector<Uint8Vector> queries;
+    queries.reserve(QUERIES_NUM);
+    for (size_t i = 0; i < QUERIES_NUM; ++i) {
+        const CidrRange &range = ranges[rng() % ranges.size()];
+        Uint8Vector address = random_address(range.get_address().size());
+        if (i % 2 == 0) {
+            const Uint8Vector &prefix = range.get_address();
+            const Uint8Vector &mask = range.get_mask();
+            for (size_t j = 0; j < address.size(); ++j) {
+                address[j] = (prefix[j] & mask[j]) | (address[j] & ~mask[j]);
+            }
+        }
+        queries.push_back(std::move(address));
+    }
+
+    Clock::time_point start = Clock::now();
+    CidrRangeSet set;
+    for (const CidrRange &range : ranges) {
+        set.insert(range);
+    }
+    Clock::duration set_build_time = Clock::now() - start;
+
+    start = Clock::now();
+    std::vector<uint8_t> compiled;
+    FlatBufferWriter out{compiled};
+    CidrTrie::build(ranges, out);
+    FlatBufferReader in{{compiled.data(), compiled.size()}};
+    CidrTrie trie = CidrTrie::view(in).value();
+    Clock::duration trie_build_time = Clock::now() - start;
+    ASSERT_EQ(trie.size(), ranges.size());
+
+    std::vector<bool> set_results(QUERIES_NUM);
+    start = Clock::now();
+    for (size_t i = 0; i < QUERIES_NUM; ++i) {
+        set_results[i] = set.includes(CidrRange({queries[i].data(), queries[i].size()}, queries[i].size() * 8));
+    }
+    Clock::duration set_time = Clock::now() - start;
+
+    std::vector<bool> trie_results(QUERIES_NUM);
+    start = Clock::now();
+    for (size_t i = 0; i < QUERIES_NUM; ++i) {
+        trie_results[i] = trie.includes({queries[i].data(), queries[i].size()});
+    }
+    Clock::duration trie_time = Clock::now() - start;
+
+    ASSERT_EQ(set_results, trie_results);
+
+    auto ms = [](Clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    auto ns_per_query = [](Clock::duration d) {
+        return std::chrono::duration<double, std::nano>(d).count() / QUERIES_NUM;
+    };
+    printf("ranges=%zu queries=%zu matched=%zu build set=%.1fms trie=%.1fms lookup set=%.1fns/query "
+           "trie=%.1fns/query\n",
+            CIDR_RANGES_NUM, QUERIES_NUM, size_t(std::count(trie_results.begin(), trie_results.end(), true)),
+            ms(set_build_time), ms(trie_build_time), ns_per_query(set_time), ns_per_query(trie_time));
+}
@@ -9,6 +9,7 @@
 #include "vpn/event_loop.h"
 #include "vpn/internal/server_upstream.h"
 #include "vpn/internal/vpn_client.h"
+#include "vpn/internal/wire_utils.h"
 
 static int cert_verify_handler(
         const char * /*host_name*/, const sockaddr * /*host_ip*/, const ag::CertVerifyCtx & /*ctx*/, void * /*arg*/) {
@@ -35,11 +36,14 @@ protected:
             .send_connect_request_callback = on_send_connect_request,
             .send_data_callback = on_send_data,
             .consume_callback = on_consume,
+            .send_datagram_callback = on_send_datagram,
     }};
     uint64_t next_stream_id = 1;
     size_t streams_num = 0;
     size_t consumed = 0;
     std::vector<uint8_t> output;
+    std::vector<std::vector<uint8_t>> datagrams;
+    bool datagram_fits = true;
     std::vector<uint8_t> decoded_data;
 
     void SetUp() override {
@@ -64,6 +68,15 @@ protected:
         return 0;
     }
 
+    static int on_send_datagram(ServerUpstream *upstream, uint64_t, ag::U8View data) {
+        auto *self = (HttpUdpMultiplexer *) upstream;
+        if (!self->datagram_fits) {
+            return -1;
+        }
+        self->datagrams.emplace_back(data.begin(), data.end());
+        return 0;
+    }
+
     static void on_consume(ServerUpstream *upstream, uint64_t, size_t size) {
         auto *self = (HttpUdpMultiplexer *) upstream;
         self->consumed += size;
@@ -233,3 +246,90 @@ TEST_F(HttpUdpMultiplexerDecoding, MultiplePacketsSingleChunk) {
     ASSERT_EQ(ag::encode_to_hex({decoded_data.data(), decoded_data.size()}),
             ag::encode_to_hex({(uint8_t *) expected_payload.data(), expected_payload.size()}));
 }
+
+class HttpUdpMultiplexerDatagram : public HttpUdpMultiplexerDecoding {
+protected:
+    static constexpr uint8_t CONTEXT_ID = 2;
+    static constexpr uint8_t EXPECTED_OUTGOING_PACKET[] = {// length
+            0x00, 0x00, 0x00, 0x2d,
+            // source ip
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
+            // source port
+            0x00, 0x01,
+            // destination ip
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x02, 0x02, 0x02,
+            // destination port
+            0x00, 0x02,
+            // app name length
+            0x03,
+            // app name
+            'a', 'p', 'p',
+            // payload
+            'h', 'e', 'l', 'l', 'o'};
+
+    void SetUp() override {
+        HttpUdpMultiplexerDecoding::SetUp();
+        ASSERT_FALSE(mux.datagrams_enabled());
+        ASSERT_TRUE(datagrams.empty());
+
+        ag::HttpHeaders response;
+        response.status_code = ag::HTTP_STATUS_200_OK;
+        response.put_field(std::string{ag::CAPSULE_PROTOCOL_HEADER}, "?1");
+        mux.handle_response(&response);
+        ASSERT_TRUE(mux.datagrams_enabled());
+        output.clear();
+    }
+
+    static std::vector<uint8_t> make_datagram(uint64_t context_id, ag::U8View packet) {
+        std::vector<uint8_t> datagram(ag::wire_utils::varint_size(context_id) + packet.size());
+        ag::wire_utils::Writer writer({datagram.data(), datagram.size()});
+        writer.put_varint(context_id);
+        writer.put_data(packet);
+        return datagram;
+    }
+};
+
+TEST_F(HttpUdpMultiplexerDatagram, Encoding) {
+    ASSERT_EQ(OUTGOING_PACKET.length(),
+            mux.send(CONNECTION_ID, {(uint8_t *) OUTGOING_PACKET.data(), OUTGOING_PACKET.length()}));
+    ASSERT_TRUE(output.empty());
+    ASSERT_EQ(datagrams.size(), 1);
+    std::vector<uint8_t> expected =
+            make_datagram(CONTEXT_ID, {EXPECTED_OUTGOING_PACKET, std::size(EXPECTED_OUTGOING_PACKET)});
+    ASSERT_EQ(ag::encode_to_hex({datagrams[0].data(), datagrams[0].size()}),
+            ag::encode_to_hex({expected.data(), expected.size()}));
+}
+
+TEST_F(HttpUdpMultiplexerDatagram, FallbackToStream) {
+    datagram_fits = false;
+    ASSERT_EQ(OUTGOING_PACKET.length(),
+            mux.send(CONNECTION_ID, {(uint8_t *) OUTGOING_PACKET.data(), OUTGOING_PACKET.length()}));
+    ASSERT_TRUE(datagrams.empty());
+    ASSERT_EQ(ag::encode_to_hex({output.data(), output.size()}),
+            ag::encode_to_hex({EXPECTED_OUTGOING_PACKET, std::size(EXPECTED_OUTGOING_PACKET)}));
+}
+
+TEST_F(HttpUdpMultiplexerDatagram, Decoding) {
+    std::vector<uint8_t> datagram = make_datagram(CONTEXT_ID, {INCOMING_PACKET, std::size(INCOMING_PACKET)});
+    ASSERT_EQ(0, mux.process_datagram({datagram.data(), datagram.size()}));
+    ASSERT_EQ(ag::encode_to_hex({decoded_data.data(), decoded_data.size()}),
+            ag::encode_to_hex({(uint8_t *) EXPECTED_PAYLOAD.data(), EXPECTED_PAYLOAD.size()}));
+}
+
+TEST_F(HttpUdpMultiplexerDatagram, DecodingUnknownContext) {
+    // The connection is found by the address pair
+    std::vector<uint8_t> datagram = make_datagram(0, {INCOMING_PACKET, std::size(INCOMING_PACKET)});
+    ASSERT_EQ(0, mux.process_datagram({datagram.data(), datagram.size()}));
+    ASSERT_EQ(ag::encode_to_hex({decoded_data.data(), decoded_data.size()}),
+            ag::encode_to_hex({(uint8_t *) EXPECTED_PAYLOAD.data(), EXPECTED_PAYLOAD.size()}));
+}
+
+TEST_F(HttpUdpMultiplexerDatagram, DecodingMalformed) {
+    // Truncated packet
+    std::vector<uint8_t> datagram = make_datagram(CONTEXT_ID, {INCOMING_PACKET, std::size(INCOMING_PACKET) - 1});
+    ASSERT_NE(0, mux.process_datagram({datagram.data(), datagram.size()}));
+    // Truncated context ID
+    constexpr uint8_t TRUNCATED_VARINT[] = {0x40};
+    ASSERT_NE(0, mux.process_datagram({TRUNCATED_VARINT, std::size(TRUNCATED_VARINT)}));
+    ASSERT_TRUE(decoded_data.empty()) << ag::encode_to_hex({decoded_data.data(), decoded_data.size()});
+}
@@ -1,7 +1,10 @@
+#include <array>
+#include <iterator>
+
 #include <gtest/gtest.h>
 
-#include "common/file.h"
 #include "memfile_buffer.h"
+#include "vpn/internal/utils.h"
 #include "vpn/utils.h"
 
 using namespace ag;
@@ -9,7 +12,7 @@ using namespace ag;
 // NOLINTBEGIN(bugprone-unchecked-optional-access))
 class MemfileBufferTest : public testing::Test {
 protected:
-    const std::string FILE_PATH = "./test.dat";
+    const std::string DIR = "./memfile_buffer_test";
     const std::string TEST_DATA_1 = "lalala";
     const std::string TEST_DATA_2 = "tratatata";
     const std::string COMPLETE_TEST_DATA = TEST_DATA_1 + TEST_DATA_2;
@@ -17,34 +20,55 @@ protected:
     std::unique_ptr<DataBuffer> buffer;
 
     void SetUp() override {
-        buffer = std::make_unique<MemfileBuffer>("./test.dat", TEST_DATA_1.size());
+        std::error_code fs_err;
+        fs::create_directory(DIR, fs_err);
+        ASSERT_FALSE(fs_err) << fs_err.message();
+
+        buffer = std::make_unique<MemfileBuffer>(DIR, TEST_DATA_1.size());
         std::optional<std::string> err = buffer->init();
         ASSERT_FALSE(err.has_value()) << err.value();
 
         err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
         ASSERT_FALSE(err.has_value()) << err.value();
         ASSERT_EQ(buffer->size(), TEST_DATA_1.size());
-        ASSERT_FALSE(fs::exists(FILE_PATH));
+        ASSERT_EQ(count_files(), 0);
 
         err = buffer->push({(uint8_t *) TEST_DATA_2.data(), TEST_DATA_2.size()});
         ASSERT_FALSE(err.has_value()) << err.value();
         ASSERT_EQ(buffer->size(), TEST_DATA_1.size() + TEST_DATA_2.size());
-        ASSERT_TRUE(fs::exists(FILE_PATH));
+        ASSERT_EQ(count_files(), 1);
     }
 
     void TearDown() override {
         buffer.reset();
-        ASSERT_FALSE(fs::exists(FILE_PATH));
+        ASSERT_EQ(count_files(), 0);
+        std::error_code fs_err;
+        fs::remove_all(DIR, fs_err);
     }
 
-    void check_file_content(file::Handle fd, const std::string &expected) {
-        ssize_t sz = file::get_size(fd);
-        ASSERT_GE(sz, 0) << sys::strerror(sys::last_error());
+    [[nodiscard]] size_t count_files() const {
+        std::error_code fs_err;
+        return std::distance(fs::directory_iterator(DIR, fs_err), fs::directory_iterator());
+    }
 
-        std::string content;
-        content.resize(sz);
-        ASSERT_EQ(file::read(fd, content.data(), content.size()), sz) << sys::strerror(sys::last_error());
-        ASSERT_EQ(content, expected);
+    static std::string make_data(size_t size, size_t seed) {
+        std::string data(size, '\0');
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = char('a' + (i + seed) % 26);
+        }
+        return data;
+    }
+
+    static void drain_all(DataBuffer &buffer, std::string expected) {
+        while (0 != buffer.size()) {
+            BufferPeekResult res = buffer.peek();
+            ASSERT_FALSE(res.err.has_value()) << res.err.value();
+            ASSERT_FALSE(res.data.empty());
+            ASSERT_EQ(expected.substr(0, res.data.size()), (std::string{(char *) res.data.data(), res.data.size()}));
+            buffer.drain(res.data.size());
+            expected.erase(0, res.data.size());
+        }
+        ASSERT_TRUE(expected.empty()) << expected.size();
     }
 };
 
@@ -104,29 +128,72 @@ TEST_F(MemfileBufferTest, Drain2) {
     ASSERT_TRUE(expected_data.empty()) << expected_data;
 }
 
-TEST_F(MemfileBufferTest, FileContent) {
-    file::Handle fd = file::open(FILE_PATH, file::RDONLY);
-    ASSERT_NE(fd, file::INVALID_HANDLE) << sys::strerror(sys::last_error());
+// Check that the data spanning several extents come out intact whatever the disk progress is
+TEST_F(MemfileBufferTest, Extents) {
+    std::string expected = COMPLETE_TEST_DATA;
+    for (size_t i = 0; i < 3 * SpillFile::EXTENT_SIZE / 1000; ++i) {
+        std::string chunk = make_data(1000 + i % 7, i);
+        std::optional<std::string> err = buffer->push({(uint8_t *) chunk.data(), chunk.size()});
+        ASSERT_FALSE(err.has_value()) << err.value();
+        expected += chunk;
+    }
+    ASSERT_EQ(buffer->size(), expected.size());
 
-    // using EXPECT_* just to let it get to the end and close the descriptor
+    ASSERT_NO_FATAL_FAILURE(drain_all(*buffer, expected));
 
-    EXPECT_EQ(file::get_size(fd), TEST_DATA_2.size()) << sys::strerror(sys::last_error());
-    EXPECT_NO_FATAL_FAILURE(check_file_content(fd, TEST_DATA_2));
+    // Once drained, the buffer goes on with memory
+    std::optional<std::string> err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    ASSERT_NO_FATAL_FAILURE(drain_all(*buffer, TEST_DATA_1));
+}
+
+TEST_F(MemfileBufferTest, PeekIov) {
+    std::string expected = COMPLETE_TEST_DATA;
+    std::string chunk = make_data(2 * SpillFile::EXTENT_SIZE, 0);
+    std::optional<std::string> err = buffer->push({(uint8_t *) chunk.data(), chunk.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    expected += chunk;
 
-    file::close(fd);
-    buffer->drain(TEST_DATA_1.size());
-    std::optional<std::string> err = buffer->push({(uint8_t *) TEST_DATA_2.data(), TEST_DATA_2.size()});
-    EXPECT_FALSE(err.has_value()) << err.value();
+    while (0 != buffer->size()) {
+        std::array<U8View, DATA_BUFFER_PEEK_SEGMENTS> segments;
+        BufferPeekIovResult res = buffer->peek_iov(segments);
+        ASSERT_FALSE(res.err.has_value()) << res.err.value();
+        ASSERT_GT(res.count, 0);
+        size_t drained = 0;
+        for (size_t i = 0; i < res.count; ++i) {
+            ASSERT_EQ(expected.substr(drained, segments[i].size()),
+                    (std::string{(char *) segments[i].data(), segments[i].size()}));
+            drained += segments[i].size();
+        }
+        buffer->drain(drained);
+        expected.erase(0, drained);
+    }
+    ASSERT_TRUE(expected.empty()) << expected.size();
+}
 
-    // re-open as the old file should've been removed
-    fd = file::open(FILE_PATH, 0);
-    EXPECT_NE(fd, file::INVALID_HANDLE) << sys::strerror(sys::last_error());
+TEST_F(MemfileBufferTest, Capacity) {
+    buffer = std::make_unique<MemfileBuffer>(DIR, TEST_DATA_1.size(), TEST_DATA_2.size());
+    std::optional<std::string> err = buffer->init();
+    ASSERT_FALSE(err.has_value()) << err.value();
 
-    // at the moment 2 `TEST_DATA_2` are in buffer, as the memory cap is `TEST_DATA_1.size()`
-    // file size should be:
-    EXPECT_EQ(file::get_size(fd), 2 * TEST_DATA_2.size() - TEST_DATA_1.size()) << sys::strerror(sys::last_error());
-    EXPECT_NO_FATAL_FAILURE(check_file_content(fd, TEST_DATA_2.substr(TEST_DATA_1.size()) + TEST_DATA_2));
+    err = buffer->push({(uint8_t *) COMPLETE_TEST_DATA.data(), COMPLETE_TEST_DATA.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
+    ASSERT_TRUE(err.has_value());
+    ASSERT_EQ(buffer->size(), COMPLETE_TEST_DATA.size());
+}
 
-    file::close(fd);
+// Check that the buffers spill to the same file
+TEST_F(MemfileBufferTest, SharedFile) {
+    MemfileBuffer other(DIR, 0);
+    std::optional<std::string> err = static_cast<DataBuffer &>(other).init();
+    ASSERT_FALSE(err.has_value()) << err.value();
+    std::string data = make_data(SpillFile::EXTENT_SIZE + 1, 0);
+    err = static_cast<DataBuffer &>(other).push({(uint8_t *) data.data(), data.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    ASSERT_EQ(count_files(), 1);
+
+    ASSERT_NO_FATAL_FAILURE(drain_all(other, data));
+    ASSERT_NO_FATAL_FAILURE(drain_all(*buffer, COMPLETE_TEST_DATA));
 }
 // NOLINTEND(bugprone-unchecked-optional-access)
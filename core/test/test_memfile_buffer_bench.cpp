@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "memfile_buffer.h"
+#include "vpn/internal/utils.h"
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr auto TICK = std::chrono::milliseconds(1);
+static constexpr size_t TICKS_NUM = 2000;
+// 1 Gbit/s and 100 Mbit/s in bytes per tick
+static constexpr size_t DOWNLOAD_RATE = 125000;
+static constexpr size_t CONSUME_RATE = 12500;
+static constexpr size_t CHUNK_SIZE = 16 * 1024;
+static constexpr size_t MEM_THRESHOLD = 1024 * 1024;
+
+static uint8_t byte_at(size_t position) {
+    return uint8_t(position ^ (position >> 11));
+}
+
+/**
+ * Simulates a 1 Gbit/s download into a connection which is drained at 100 Mbit/s, as the event loop
+ * would do it: each tick the received chunks are pushed and a part of the buffered data is sent.
+ * Measures how long the buffer holds the loop up per tick, then how fast the backlog is drained.
+ */
+class MemfileBufferBench : public testing::Test {
+protected:
+    const std::string DIR = "./memfile_buffer_bench";
+
+    void SetUp() override {
+        std::error_code fs_err;
+        fs::create_directory(DIR, fs_err);
+        ASSERT_FALSE(fs_err) << fs_err.message();
+    }
+
+    void TearDown() override {
+        std::error_code fs_err;
+        fs::remove_all(DIR, fs_err);
+    }
+
+    // Send up to `limit` bytes, checking that they come out in the order they went in
+    static size_t consume(DataBuffer &buffer, size_t limit, size_t &position) {
+        size_t consumed = 0;
+        while (consumed < limit && buffer.size() > 0) {
+            std::array<U8View, DATA_BUFFER_PEEK_SEGMENTS> segments;
+            BufferPeekIovResult res = buffer.peek_iov(segments);
+            EXPECT_FALSE(res.err.has_value()) << *res.err;
+            if (res.err.has_value() || res.count == 0) {
+                break;
+            }
+            size_t sent = 0;
+            for (size_t i = 0; i < res.count && consumed + sent < limit; ++i) {
+                U8View segment = segments[i].substr(0, limit - consumed - sent);
+                for (size_t j = 0; j < segment.size(); j += 997) {
+                    EXPECT_EQ(segment[j], byte_at(position + sent + j));
+                }
+                sent += segment.size();
+            }
+            buffer.drain(sent);
+            consumed += sent;
+            position += sent;
+        }
+        return consumed;
+    }
+};
+
+TEST_F(MemfileBufferBench, SlowConsumer) {
+    std::unique_ptr<DataBuffer> buffer = std::make_unique<MemfileBuffer>(DIR, MEM_THRESHOLD);
+    ASSERT_FALSE(buffer->init().has_value());
+
+    std::vector<uint8_t> chunk(CHUNK_SIZE);
+    size_t pushed = 0;
+    size_t consumed = 0;
+    size_t max_buffered = 0;
+    std::vector<Clock::duration> stalls;
+    stalls.reserve(TICKS_NUM);
+
+    Clock::time_point next_tick = Clock::now();
+    for (size_t tick = 0; tick < TICKS_NUM; ++tick) {
+        std::this_thread::sleep_until(next_tick);
+        next_tick += TICK;
+
+        Clock::time_point start = Clock::now();
+        for (size_t target = (tick + 1) * DOWNLOAD_RATE; pushed < target;) {
+            size_t n = std::min(CHUNK_SIZE, target - pushed);
+            for (size_t i = 0; i < n; ++i) {
+                chunk[i] = byte_at(pushed + i);
+            }
+            std::optional<std::string> err = buffer->push(U8View{chunk.data(), n});
+            ASSERT_FALSE(err.has_value()) << *err;
+            pushed += n;
+        }
+        consume(*buffer, CONSUME_RATE, consumed);
+        stalls.push_back(Clock::now() - start);
+        max_buffered = std::max(max_buffered, buffer->size());
+    }
+
+    Clock::time_point start = Clock::now();
+    consume(*buffer, SIZE_MAX, consumed);
+    Clock::duration drain_time = Clock::now() - start;
+    ASSERT_EQ(consumed, pushed);
+    ASSERT_EQ(buffer->size(), 0);
+
+    std::sort(stalls.begin(), stalls.end());
+    auto us = [](Clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+    printf("pushed=%zuMiB max_buffered=%zuMiB stall_per_tick: p50=%.0fus p99=%.0fus max=%.0fus "
+           "backlog_drain=%.0fMiB/s\n",
+            pushed >> 20, max_buffered >> 20, us(stalls[stalls.size() / 2]), us(stalls[stalls.size() * 99 / 100]),
+            us(stalls.back()), double(pushed - (TICKS_NUM * CONSUME_RATE)) / (1 << 20) / (us(drain_time) / 1e6));
+}
@@ -1,3 +1,6 @@
+#include <array>
+#include <span>
+
 #include <gtest/gtest.h>
 
 #include "memory_buffer.h"
@@ -87,4 +90,59 @@ TEST_F(MemoryBufferTest, Drain2) {
 
     ASSERT_TRUE(expected_data.empty()) << expected_data;
 }
+TEST_F(MemoryBufferTest, PeekIov) {
+    std::array<U8View, 4> segments;
+    BufferPeekIovResult res = m_buffer->peek_iov(segments);
+    ASSERT_FALSE(res.err.has_value()) << res.err.value();
+    ASSERT_GT(res.count, 0);
+    ASSERT_EQ(segments[0], m_buffer->peek().data);
+
+    std::string peeked;
+    for (U8View segment : std::span{segments}.first(res.count)) {
+        peeked.append((char *) segment.data(), segment.size());
+    }
+    ASSERT_EQ(peeked, COMPLETE_TEST_DATA);
+    ASSERT_EQ(m_buffer->size(), COMPLETE_TEST_DATA.size());
+}
+
+// Check that data spanning several blocks is peeked and drained in order
+TEST(MemoryBuffer, LargeData) {
+    std::unique_ptr<DataBuffer> buffer = std::make_unique<MemoryBuffer>();
+    ASSERT_FALSE(buffer->init().has_value());
+
+    std::string expected_data;
+    for (size_t i = 0; expected_data.size() < 5 * MemoryBuffer::BLOCK_SIZE; ++i) {
+        std::string chunk(i % 100 + 1, char('a' + i % 26));
+        ASSERT_FALSE(buffer->push({(uint8_t *) chunk.data(), chunk.size()}).has_value());
+        expected_data += chunk;
+    }
+    std::string big(3 * MemoryBuffer::BLOCK_SIZE / 2, 'x');
+    ASSERT_FALSE(buffer->push(std::vector<uint8_t>(big.begin(), big.end())).has_value());
+    expected_data += big;
+    ASSERT_EQ(buffer->size(), expected_data.size());
+
+    std::array<U8View, 3> segments;
+    while (buffer->size() > 0) {
+        BufferPeekIovResult res = buffer->peek_iov(segments);
+        ASSERT_FALSE(res.err.has_value()) << res.err.value();
+        ASSERT_GT(res.count, 0);
+        size_t peeked = 0;
+        for (U8View segment : std::span{segments}.first(res.count)) {
+            ASSERT_FALSE(segment.empty());
+            ASSERT_EQ(expected_data.substr(peeked, segment.size()),
+                    std::string((char *) segment.data(), segment.size()));
+            peeked += segment.size();
+        }
+        // Drain not at a block boundary
+        size_t to_drain = std::min(peeked, MemoryBuffer::BLOCK_SIZE + 7);
+        buffer->drain(to_drain);
+        expected_data.erase(0, to_drain);
+        ASSERT_EQ(buffer->size(), expected_data.size());
+    }
+    ASSERT_TRUE(expected_data.empty());
+
+    BufferPeekIovResult res = buffer->peek_iov(segments);
+    ASSERT_EQ(res.count, 0);
+    ASSERT_TRUE(buffer->peek().data.empty());
+}
 // NOLINTEND(bugprone-unchecked-optional-access)
@@ -49,6 +49,9 @@ void VpnClient::reject_connect_request(uint64_t id) {
 }
 void VpnClient::update_exclusions(VpnMode, std::string_view) {
 }
+bool VpnClient::update_exclusions(std::shared_ptr<const DomainFilter::Exclusions>) {
+    return true;
+}
 void VpnClient::reset_connections(int) {
 }
 void VpnClient::reset_connection(uint64_t id) {
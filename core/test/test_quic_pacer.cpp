@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "quic_pacer.h"
+
+using namespace std::chrono;
+using namespace ag;
+
+using Clock = QuicPacer::Clock;
+
+static constexpr size_t DATA_PACKET_SIZE = 1200;
+static constexpr size_t ACK_PACKET_SIZE = 50;
+
+/** The send time as quiche reports it */
+static quiche_send_info make_send_info(Clock::time_point at) {
+    nanoseconds since_epoch = at.time_since_epoch();
+    quiche_send_info info{};
+    info.at.tv_sec = decltype(info.at.tv_sec)(duration_cast<seconds>(since_epoch).count());
+    info.at.tv_nsec = decltype(info.at.tv_nsec)((since_epoch % seconds(1)).count());
+    return info;
+}
+
+static std::vector<uint8_t> make_packet(size_t size, uint8_t fill) {
+    return std::vector<uint8_t>(size, fill);
+}
+
+class QuicPacerTest : public ::testing::Test {
+protected:
+    QuicPacer m_pacer;
+    Clock::time_point m_now = Clock::now();
+    uint8_t m_out[QUIC_MAX_UDP_PAYLOAD_SIZE]{};
+};
+
+TEST_F(QuicPacerTest, SendTime) {
+    std::optional<Clock::time_point> send_at = QuicPacer::send_time(make_send_info(m_now + milliseconds(5)));
+#ifdef __linux__
+    ASSERT_TRUE(send_at.has_value());
+    ASSERT_EQ(duration_cast<nanoseconds>(*send_at - m_now), milliseconds(5));
+    ASSERT_FALSE(QuicPacer::send_time(quiche_send_info{}).has_value());
+#else
+    ASSERT_FALSE(send_at.has_value());
+#endif
+}
+
+TEST_F(QuicPacerTest, HoldAndRelease) {
+    std::vector<uint8_t> packet = make_packet(DATA_PACKET_SIZE, 0xab);
+
+    // Due within the granularity
+    ASSERT_FALSE(m_pacer.hold(packet.data(), packet.size(), m_now + microseconds(500), m_now));
+    ASSERT_FALSE(m_pacer.due_at().has_value());
+
+    Clock::time_point send_at = m_now + milliseconds(5);
+    ASSERT_TRUE(m_pacer.hold(packet.data(), packet.size(), send_at, m_now));
+    ASSERT_EQ(m_pacer.due_at(), send_at);
+    // Only one packet is held at a time
+    ASSERT_FALSE(m_pacer.hold(packet.data(), packet.size(), send_at + milliseconds(5), m_now));
+
+    ASSERT_EQ(m_pacer.release(m_out, m_now + milliseconds(2)), 0);
+    ASSERT_EQ(m_pacer.due_at(), send_at);
+
+    ASSERT_EQ(m_pacer.release(m_out, send_at), packet.size());
+    ASSERT_EQ(0, memcmp(m_out, packet.data(), packet.size()));
+    ASSERT_FALSE(m_pacer.due_at().has_value());
+    ASSERT_EQ(m_pacer.release(m_out, send_at), 0);
+}
+
+TEST_F(QuicPacerTest, ForcedRelease) {
+    std::vector<uint8_t> packet = make_packet(DATA_PACKET_SIZE, 0xcd);
+    ASSERT_TRUE(m_pacer.hold(packet.data(), packet.size(), m_now + seconds(1), m_now));
+    ASSERT_EQ(m_pacer.release(m_out, m_now, /*force*/ true), packet.size());
+    ASSERT_EQ(0, memcmp(m_out, packet.data(), packet.size()));
+    ASSERT_FALSE(m_pacer.due_at().has_value());
+}
+
+TEST_F(QuicPacerTest, AckBypassesPacer) {
+    std::vector<uint8_t> ack = make_packet(ACK_PACKET_SIZE, 0x01);
+    ASSERT_FALSE(m_pacer.hold(ack.data(), ack.size(), m_now + milliseconds(5), m_now));
+    ack = make_packet(QuicPacer::MAX_UNPACED_PACKET_SIZE, 0x01);
+    ASSERT_FALSE(m_pacer.hold(ack.data(), ack.size(), m_now + milliseconds(5), m_now));
+    ASSERT_FALSE(m_pacer.due_at().has_value());
+
+    std::vector<uint8_t> packet = make_packet(QuicPacer::MAX_UNPACED_PACKET_SIZE + 1, 0x02);
+    ASSERT_TRUE(m_pacer.hold(packet.data(), packet.size(), m_now + milliseconds(5), m_now));
+}
+
+TEST_F(QuicPacerTest, Stats) {
+    std::vector<uint8_t> packet = make_packet(DATA_PACKET_SIZE, 0xef);
+    ASSERT_EQ(m_pacer.stats().paced_packets, 0);
+    ASSERT_EQ(m_pacer.stats().max_burst, 0);
+
+    // Held for 3ms, released 1ms late
+    ASSERT_TRUE(m_pacer.hold(packet.data(), packet.size(), m_now + milliseconds(2), m_now));
+    ASSERT_EQ(m_pacer.release(m_out, m_now + milliseconds(3)), packet.size());
+    // Held for 5ms
+    m_now += milliseconds(10);
+    ASSERT_TRUE(m_pacer.hold(packet.data(), packet.size(), m_now + milliseconds(5), m_now));
+    ASSERT_EQ(m_pacer.release(m_out, m_now + milliseconds(5)), packet.size());
+    // Not held packets are not counted
+    ASSERT_FALSE(m_pacer.hold(packet.data(), packet.size(), m_now, m_now));
+
+    ASSERT_EQ(m_pacer.stats().paced_packets, 2);
+    ASSERT_EQ(m_pacer.stats().total_delay, milliseconds(8));
+
+    m_pacer.on_burst(3);
+    m_pacer.on_burst(10);
+    m_pacer.on_burst(1);
+    ASSERT_EQ(m_pacer.stats().max_burst, 10);
+}
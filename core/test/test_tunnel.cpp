@@ -513,7 +513,7 @@ TEST_F(FakeConnectionTest, ExcludedDomainWithAntiDpiImitation) {
     tun.fake_upstream->handler.func(
             tun.fake_upstream->handler.arg, SERVER_EVENT_CONNECTION_CLOSED, fake_upstream->closing_connections.data());
 
-    // Read=off while buffered_packets is pending.
+    // Read=off while the buffered packets are pending.
     ASSERT_FALSE(client_listener->connections[client_id].read_enabled);
 }
 
@@ -1,4 +1,5 @@
 #include <numeric>
+#include <thread>
 #include <unordered_set>
 
 #include <gtest/gtest.h>
@@ -16,6 +17,10 @@ static int cert_verify_handler(
 struct TestUpstreamInfo {
     ServerHandler handler;
     std::unordered_set<uint64_t> connections;
+    size_t window = 64 * 1024;
+    uint32_t rtt_us = 0;
+    double loss_ratio = 0;
+    bool refuse_connections = false;
 };
 
 class TestUpstream : public MultiplexableUpstream {
@@ -56,6 +61,8 @@ public:
     }
 
 protected:
+    static constexpr Millis IDLE_UPSTREAM_TIMEOUT{100};
+
     static std::unordered_map<int, TestUpstreamInfo> g_upstreams;
     static std::optional<int> g_health_checking_upstream_id;
     static bool g_open_session_result;
@@ -79,7 +86,8 @@ protected:
                 [](const VpnUpstreamProtocolConfig &, int id, VpnClient *vpn,
                         ServerHandler handler) -> std::unique_ptr<MultiplexableUpstream> {
                     return std::make_unique<TestUpstream>(id, vpn, handler);
-                });
+                },
+                IDLE_UPSTREAM_TIMEOUT);
         ASSERT_TRUE(this->vpn.endpoint_upstream->init(&this->vpn, {upstream_handler, this}));
 
         ASSERT_TRUE(this->vpn.endpoint_upstream->open_session());
@@ -159,6 +167,35 @@ protected:
         handler->func(handler->arg, SERVER_EVENT_CONNECTION_OPENED, &conn_id);
     }
 
+    // Make the first upstream and one more have a single connection each
+    void make_two_upstreams(int &id_1, int &id_2) {
+        for (size_t i = 0; i <= UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD; ++i) {
+            ASSERT_NO_FATAL_FAILURE(open_connection());
+        }
+        ASSERT_EQ(g_upstreams.size(), 2);
+
+        auto first = std::max_element(g_upstreams.begin(), g_upstreams.end(), [](const auto &l, const auto &r) {
+            return l.second.connections.size() < r.second.connections.size();
+        });
+        id_1 = first->first;
+        id_2 = (first == g_upstreams.begin()) ? std::next(first)->first : g_upstreams.begin()->first;
+        while (g_upstreams[id_1].connections.size() > 1) {
+            ASSERT_NO_FATAL_FAILURE(close_connection(id_1, *g_upstreams[id_1].connections.begin()));
+        }
+        ASSERT_EQ(g_upstreams[id_2].connections.size(), 1);
+    }
+
+    // Pretend a flow on the upstream has received some data
+    void receive(int upstream_id, size_t length) {
+        ASSERT_EQ(g_upstreams.count(upstream_id), 1) << upstream_id;
+        ASSERT_FALSE(g_upstreams[upstream_id].connections.empty()) << upstream_id;
+
+        std::vector<uint8_t> data(length);
+        ServerReadEvent event = {*g_upstreams[upstream_id].connections.begin(), data.data(), length, (int) length};
+        ServerHandler *handler = &g_upstreams[upstream_id].handler;
+        handler->func(handler->arg, SERVER_EVENT_READ, &event);
+    }
+
     void close_connection(int upstream_id, uint64_t conn_id) {
         ASSERT_EQ(g_upstreams.count(upstream_id), 1) << upstream_id;
         ASSERT_EQ(g_upstreams[upstream_id].connections.erase(conn_id), 1) << conn_id;
@@ -214,7 +251,8 @@ void TestUpstream::close_session() {
     test->close_upstream_silent(m_id);
 }
 bool TestUpstream::open_connection(uint64_t conn_id, const TunnelAddressPair *, int, std::string_view) {
-    return UpstreamMuxTest::g_upstreams[m_id].connections.emplace(conn_id).second;
+    TestUpstreamInfo &info = UpstreamMuxTest::g_upstreams[m_id];
+    return !info.refuse_connections && info.connections.emplace(conn_id).second;
 }
 void TestUpstream::close_connection(uint64_t conn_id, bool, bool) {
     UpstreamMuxTest::g_upstreams[m_id].connections.erase(conn_id);
@@ -225,7 +263,7 @@ ssize_t TestUpstream::send(uint64_t, const uint8_t *, size_t) {
 void TestUpstream::consume(uint64_t id, size_t length) {
 }
 size_t TestUpstream::available_to_send(uint64_t) {
-    return 0;
+    return UpstreamMuxTest::g_upstreams[m_id].window;
 }
 void TestUpstream::update_flow_control(uint64_t id, TcpFlowCtrlInfo info) {
 }
@@ -233,12 +271,15 @@ size_t TestUpstream::connections_num() const {
     return UpstreamMuxTest::g_upstreams[m_id].connections.size();
 }
 void TestUpstream::do_health_check(bool need_result) {
-    UpstreamMuxTest::g_health_checking_upstream_id = m_id;
+    if (need_result) {
+        UpstreamMuxTest::g_health_checking_upstream_id = m_id;
+    }
 }
 void TestUpstream::cancel_health_check() {
 }
 VpnConnectionStats TestUpstream::get_connection_stats() const {
-    return {};
+    const TestUpstreamInfo &info = UpstreamMuxTest::g_upstreams[m_id];
+    return {.rtt_us = info.rtt_us, .packet_loss_ratio = info.loss_ratio};
 }
 void TestUpstream::on_icmp_request(IcmpEchoRequestEvent &) {
 }
@@ -460,3 +501,194 @@ TEST_F(UpstreamMuxTest, FallbackToUnconnectedUpstream) {
     // check that `open_connection` was not called as the upstream is still not connected
     ASSERT_EQ(g_upstreams[first_upstream_id].connections.size(), 0) << first_upstream_id;
 }
+
+// Check that new connections avoid the upstream carrying a heavy flow
+TEST_F(UpstreamMuxTest, HeavyFlow) {
+    int heavy_id = 0;
+    int light_id = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(heavy_id, light_id));
+
+    // a few megabytes per second both ways weigh as several connections
+    for (size_t i = 0; i < 8; ++i) {
+        ASSERT_NO_FATAL_FAILURE(receive(heavy_id, size_t(UpstreamMultiplexer::HEAVY_FLOW_THROUGHPUT) / 4));
+        ASSERT_NO_FATAL_FAILURE(receive(light_id, 1024));
+    }
+    std::this_thread::sleep_for(UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+
+    for (size_t i = 1; i < UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD; ++i) {
+        ASSERT_NO_FATAL_FAILURE(open_connection());
+        ASSERT_EQ(g_upstreams[heavy_id].connections.size(), 1) << i;
+        ASSERT_EQ(g_upstreams[light_id].connections.size(), 1 + i) << i;
+    }
+}
+
+// Check that the throughput of a flow which has stopped fades out over the idle periods
+TEST_F(UpstreamMuxTest, HeavyFlowStops) {
+    int heavy_id = 0;
+    int light_id = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(heavy_id, light_id));
+
+    for (size_t i = 0; i < 8; ++i) {
+        ASSERT_NO_FATAL_FAILURE(receive(heavy_id, size_t(UpstreamMultiplexer::HEAVY_FLOW_THROUGHPUT) / 4));
+    }
+    std::this_thread::sleep_for(UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams[light_id].connections.size(), 2);
+
+    std::this_thread::sleep_for(4 * UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams[heavy_id].connections.size(), 2);
+}
+
+// Check that new connections prefer the upstream with the lower RTT
+TEST_F(UpstreamMuxTest, Rtt) {
+    int slow_id = 0;
+    int fast_id = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(slow_id, fast_id));
+
+    g_upstreams[slow_id].rtt_us = 200000;
+    g_upstreams[fast_id].rtt_us = 10000;
+    std::this_thread::sleep_for(UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+
+    for (size_t i = 1; i < UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD; ++i) {
+        ASSERT_NO_FATAL_FAILURE(open_connection());
+        ASSERT_EQ(g_upstreams[slow_id].connections.size(), 1) << i;
+    }
+}
+
+// Check that a connection with nothing available to send weighs more until it is unblocked
+TEST_F(UpstreamMuxTest, BlockedConnection) {
+    int blocked_id = 0;
+    int other_id = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(blocked_id, other_id));
+    uint64_t blocked_conn = *g_upstreams[blocked_id].connections.begin();
+
+    g_upstreams[blocked_id].window = 0;
+    ASSERT_EQ(this->vpn.endpoint_upstream->available_to_send(blocked_conn), 0);
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams[other_id].connections.size(), 2);
+
+    g_upstreams[blocked_id].window = 64 * 1024;
+    ASSERT_NE(this->vpn.endpoint_upstream->available_to_send(blocked_conn), 0);
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams[blocked_id].connections.size(), 2);
+}
+
+// Check that the upstreams left without connections are closed after a while, except the last one
+TEST_F(UpstreamMuxTest, IdleUpstreamsClose) {
+    int id_1 = 0;
+    int id_2 = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(id_1, id_2));
+
+    ASSERT_NO_FATAL_FAILURE(close_connection(id_2, *g_upstreams[id_2].connections.begin()));
+    std::this_thread::sleep_for(2 * IDLE_UPSTREAM_TIMEOUT);
+    run_event_loop_once();
+    ASSERT_EQ(g_upstreams.size(), 1);
+    ASSERT_EQ(g_upstreams.count(id_1), 1);
+
+    ASSERT_NO_FATAL_FAILURE(close_connection(id_1, *g_upstreams[id_1].connections.begin()));
+    std::this_thread::sleep_for(2 * IDLE_UPSTREAM_TIMEOUT);
+    run_event_loop_once();
+    ASSERT_EQ(g_upstreams.size(), 1);
+    ASSERT_FALSE(is_raised(SERVER_EVENT_SESSION_CLOSED)) << std::hex << events;
+}
+
+// Check that an idle upstream is not closed once it gets a new connection
+TEST_F(UpstreamMuxTest, IdleUpstreamReused) {
+    int id_1 = 0;
+    int id_2 = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(id_1, id_2));
+
+    ASSERT_NO_FATAL_FAILURE(close_connection(id_2, *g_upstreams[id_2].connections.begin()));
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams[id_2].connections.size(), 1);
+
+    std::this_thread::sleep_for(2 * IDLE_UPSTREAM_TIMEOUT);
+    run_event_loop_once();
+    ASSERT_EQ(g_upstreams.size(), 2);
+}
+
+// Check that an upstream which is left without connections right as its session opens is closed after a while
+TEST_F(UpstreamMuxTest, IdleUpstreamClosesAfterOpening) {
+    for (size_t i = 0; i < UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD; ++i) {
+        ASSERT_NO_FATAL_FAILURE(open_connection());
+    }
+    ASSERT_EQ(g_upstreams.size(), 1);
+    int first_id = g_upstreams.begin()->first;
+
+    uint64_t conn_id = initiate_connection();
+    ASSERT_NE(conn_id, NON_ID);
+    ASSERT_EQ(g_upstreams.size(), 2);
+    int new_id = (g_upstreams.begin()->first == first_id) ? std::next(g_upstreams.begin())->first
+                                                           : g_upstreams.begin()->first;
+
+    // The connection falls back on the first upstream
+    g_upstreams[new_id].refuse_connections = true;
+    ASSERT_NO_FATAL_FAILURE(notify_session_opened(new_id));
+    ASSERT_EQ(g_upstreams[first_id].connections.count(conn_id), 1);
+    ASSERT_TRUE(g_upstreams[new_id].connections.empty());
+
+    std::this_thread::sleep_for(2 * IDLE_UPSTREAM_TIMEOUT);
+    run_event_loop_once();
+    ASSERT_EQ(g_upstreams.size(), 1);
+    ASSERT_EQ(g_upstreams.count(first_id), 1);
+}
+
+// Check that the upstream carrying the health checks is not closed for being idle
+TEST_F(UpstreamMuxTest, IdleProbingUpstreamKept) {
+    int id_1 = 0;
+    int id_2 = 0;
+    ASSERT_NO_FATAL_FAILURE(make_two_upstreams(id_1, id_2));
+    g_health_checking_upstream_id.reset();
+    this->vpn.endpoint_upstream->do_health_check();
+    ASSERT_TRUE(g_health_checking_upstream_id.has_value());
+    int probing_id = g_health_checking_upstream_id.value();
+    int other_id = (probing_id == id_1) ? id_2 : id_1;
+
+    // The probing upstream goes idle first
+    while (!g_upstreams[probing_id].connections.empty()) {
+        ASSERT_NO_FATAL_FAILURE(close_connection(probing_id, *g_upstreams[probing_id].connections.begin()));
+    }
+    std::this_thread::sleep_for(IDLE_UPSTREAM_TIMEOUT / 2);
+    ASSERT_NO_FATAL_FAILURE(close_connection(other_id, *g_upstreams[other_id].connections.begin()));
+    std::this_thread::sleep_for(2 * IDLE_UPSTREAM_TIMEOUT);
+    run_event_loop_once();
+    ASSERT_EQ(g_upstreams.size(), 1);
+    ASSERT_EQ(g_upstreams.count(probing_id), 1);
+
+    g_health_checking_upstream_id.reset();
+    this->vpn.endpoint_upstream->do_health_check();
+    ASSERT_EQ(g_health_checking_upstream_id, probing_id);
+}
+
+// Check that a new upstream is opened instead of loading the one which is losing packets
+TEST_F(UpstreamMuxTest, LossyUpstream) {
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams.size(), 1);
+    int lossy_id = g_upstreams.begin()->first;
+
+    g_upstreams[lossy_id].loss_ratio = 2 * UpstreamMultiplexer::LOSSY_RATIO;
+    std::this_thread::sleep_for(UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams.size(), 2);
+    ASSERT_EQ(g_upstreams[lossy_id].connections.size(), 1);
+}
+
+// Check that an upstream stays lossy for a while after the loss ratio stops growing
+TEST_F(UpstreamMuxTest, LossyUpstreamRemembered) {
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    int lossy_id = g_upstreams.begin()->first;
+
+    g_upstreams[lossy_id].loss_ratio = 2 * UpstreamMultiplexer::LOSSY_RATIO;
+    std::this_thread::sleep_for(UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+    ASSERT_NO_FATAL_FAILURE(open_connection());
+    ASSERT_EQ(g_upstreams.size(), 2);
+
+    // The ratio is the same in the next sample
+    std::this_thread::sleep_for(UpstreamMultiplexer::LOAD_SAMPLE_PERIOD);
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_NO_FATAL_FAILURE(open_connection());
+    }
+    ASSERT_EQ(g_upstreams[lossy_id].connections.size(), 1);
+}
@@ -139,7 +139,7 @@ void DirectUpstream::cancel_icmp_request(const IcmpRequestKey &, uint16_t) {
 
 struct UpstreamInfo {};
 class Http2Upstream {};
-UpstreamMultiplexer::UpstreamMultiplexer(int id, const VpnUpstreamProtocolConfig &, size_t, MakeUpstream)
+UpstreamMultiplexer::UpstreamMultiplexer(int id, const VpnUpstreamProtocolConfig &, size_t, MakeUpstream, Millis)
         : ServerUpstream(id) {
 }
 UpstreamMultiplexer::~UpstreamMultiplexer() = default;
@@ -183,7 +183,7 @@ void UpstreamMultiplexer::child_upstream_handler(void *, ServerEvent, void *) {
 MultiplexableUpstream *UpstreamMultiplexer::get_upstream_by_conn(uint64_t) const {
     return nullptr;
 }
-std::optional<int> UpstreamMultiplexer::select_existing_upstream(std::optional<int>, bool) const {
+std::optional<int> UpstreamMultiplexer::select_existing_upstream(std::optional<int>, bool) {
     return std::nullopt;
 }
 int UpstreamMultiplexer::select_upstream_for_connection() {
@@ -197,7 +197,7 @@ bool UpstreamMultiplexer::open_connection(int, uint64_t, const TunnelAddressPair
 }
 void UpstreamMultiplexer::proceed_pending_connection(int, uint64_t, const PendingConnection *) {
 }
-size_t UpstreamMultiplexer::connections_num_by_upstream(int) const {
+size_t UpstreamMultiplexer::connections_num_by_upstream(const UpstreamInfo &) {
     return 0;
 }
 void UpstreamMultiplexer::on_icmp_request(IcmpEchoRequestEvent &) {
@@ -2,7 +2,9 @@
 
 #include <chrono>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -103,5 +105,117 @@ LdnsBufferPtr encode_pkt(const ldns_pkt *pkt);
 /** Remove the "ech" parameter from the SvcParams part of any SVCB/HTTPS record contained in `pkt`. */
 bool remove_svcparam_echconfig(ldns_pkt *pkt);
 
+/**
+ * Remove the "ech" parameter from the SvcParams part of any SVCB/HTTPS record in the answer section
+ * of a message in wire format. The message is modified in place: the record data lengths are
+ * rewritten and the compression pointers to the names past a removed parameter are adjusted.
+ * @return the new length of the message, the same one if nothing is removed or the message is malformed
+ */
+size_t remove_svcparam_echconfig(std::span<uint8_t> message);
+
+/** Maximum length of a domain name in the presentation format, with every octet escaped as `\DDD` */
+static constexpr size_t MAX_NAME_TEXT_LENGTH = 4 * 255;
+
+/** Domain name in the presentation format without the trailing dot, as in `DecodedRequest::name` */
+struct NameText {
+    char data[MAX_NAME_TEXT_LENGTH + 1]; // Null-terminated
+    size_t size = 0;
+
+    [[nodiscard]] std::string_view view() const {
+        return {data, size};
+    }
+    [[nodiscard]] const char *c_str() const {
+        return data;
+    }
+};
+
+/** Resource record located in a message */
+struct RecordView {
+    uint16_t type;
+    uint16_t rr_class;
+    uint32_t ttl;
+    size_t owner;          // Offset of the owner name
+    size_t rdata;          // Offset of the record data
+    uint16_t rdata_length; // Length of the record data
+};
+
+/**
+ * Reader of a DNS message in wire format, which does not allocate. The structure of the whole message
+ * is validated on parsing, so the accessors do not fail. The message must outlive the reader.
+ */
+class MessageReader {
+public:
+    /**
+     * Validate the message structure: the header, the sections' bounds and the names of the questions,
+     * the record owners and the CNAME records
+     * @return nullopt if the message is malformed
+     */
+    static std::optional<MessageReader> parse(U8View message);
+
+    [[nodiscard]] uint16_t id() const;
+    [[nodiscard]] bool is_response() const;
+    [[nodiscard]] uint8_t opcode() const;
+    [[nodiscard]] uint8_t rcode() const;
+    [[nodiscard]] bool is_truncated() const;
+
+    /** Check if there is at least one question */
+    [[nodiscard]] bool has_question() const;
+    /** Type of the first question. The message must have a question. */
+    [[nodiscard]] uint16_t question_type() const;
+    /** Class of the first question. The message must have a question. */
+    [[nodiscard]] uint16_t question_class() const;
+    /** Offset past the first question. The message must have a question. */
+    [[nodiscard]] size_t question_end() const;
+    /** Record type of the first question, if one of `RecordType`s. The message must have a question. */
+    [[nodiscard]] std::optional<RecordType> question_record_type() const;
+    /** Decode the name of the first question. The message must have a question. */
+    void question_name(NameText &name) const;
+
+    /**
+     * Decode a name
+     * @param offset an offset got from this reader: `RecordView::owner`, or `RecordView::rdata` of a CNAME
+     *               record with non-empty data
+     */
+    void read_name(size_t offset, NameText &name) const;
+
+    /** Get the record data */
+    [[nodiscard]] U8View rdata(const RecordView &record) const;
+
+    /** Call `f(const RecordView &)` for each record of the answer section in order */
+    template <typename F>
+    void for_each_answer(F &&f) const {
+        RecordView record; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        size_t offset = m_answer_offset;
+        for (size_t i = 0; i < m_answer_count; ++i) {
+            offset = read_record(offset, record);
+            f(record);
+        }
+    }
+
+    /** Call `f(const RecordView &)` for each record of the answer, authority and additional sections in order */
+    template <typename F>
+    void for_each_record(F &&f) const {
+        RecordView record; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        size_t offset = m_answer_offset;
+        for (size_t i = 0; i < m_record_count; ++i) {
+            offset = read_record(offset, record);
+            f(record);
+        }
+    }
+
+private:
+    U8View m_message;
+    size_t m_answer_offset = 0;
+    uint16_t m_answer_count = 0;
+    size_t m_record_count = 0;
+
+    explicit MessageReader(U8View message)
+            : m_message(message) {
+    }
+
+    // Return the offset of the next record
+    size_t read_record(size_t offset, RecordView &record) const;
+};
+
 } // namespace dns_utils
 } // namespace ag
@@ -3,6 +3,8 @@
 #include <cstddef>
 #include <cstdint>
 
+#include <event2/buffer.h>
+
 #include "common/logger.h"
 #include "net/http_header.h"
 #include "net/utils.h"
@@ -58,6 +60,11 @@ typedef struct {
 typedef struct {
     const uint8_t *data;
     size_t length;
+    /**
+     * If not null, the data to send is in this buffer instead of `data`. The handler should move
+     * it out (e.g. with `evbuffer_add_buffer`), the rest is discarded after the event.
+     */
+    struct evbuffer *buffer = nullptr;
 } HttpOutputEvent;
 
 typedef struct {
@@ -72,6 +79,11 @@ typedef struct {
     HttpVersion version;        // protocol version
 } HttpSessionParams;
 
+typedef struct {
+    uint64_t sent_bytes;   // payload bytes of the sent DATA frames
+    uint64_t copied_bytes; // bytes of the outgoing stream data copied on the way to `HTTP_EVENT_OUTPUT`
+} HttpSessionCopyStats;
+
 typedef struct {
     union {
         Http1Session *h1;
@@ -137,6 +149,19 @@ int http_session_send_headers(HttpSession *session, int32_t stream_id, const Htt
  */
 int http_session_send_data(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len, bool eof);
 
+/**
+ * Send HTTP Data keeping a reference to the buffer instead of copying the data into the session
+ * @param session HTTP session
+ * @param stream_id Stream ID
+ * @param data Pointer to plain data to send
+ * @param len Length of data
+ * @param buffer Owner of the data
+ * @param eof EOF flag. If true, END_STREAM flag is set
+ * @return 0 if success
+ */
+int http_session_send_data_by_reference(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        const VpnBufferRef &buffer, bool eof);
+
 /**
  * Send HTTP/2 settings
  * @param session HTTP session
@@ -195,4 +220,10 @@ size_t http_session_available_to_write(HttpSession *session, int32_t stream_id);
  */
 size_t http_session_available_to_read(HttpSession *session, int32_t stream_id);
 
+/**
+ * Get the statistics of copying the outgoing stream data (HTTP/2 only)
+ * @param session HTTP session
+ */
+HttpSessionCopyStats http_session_get_copy_stats(const HttpSession *session);
+
 } // namespace ag
@@ -40,6 +40,8 @@ typedef struct {
     const VpnRelay *relay_parallel;    // Ping through this relay in parallel with normal pings.
     uint32_t quic_max_idle_timeout_ms; // QUIC connection max idle timeout. Set `0` to use the default.
     uint32_t quic_version;             // QUIC version. Set `0` to use the default.
+    // QUIC transport tuning. Zero-initialize to use the defaults.
+    VpnQuicTransportConfig quic_transport;
 } LocationsPingerInfo;
 
 typedef struct {
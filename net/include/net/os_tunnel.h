@@ -125,8 +125,15 @@ public:
     /** Initialize tunnel with windows adapter settings */
     virtual VpnError init(const VpnOsTunnelSettings *settings, const VpnWinTunnelSettings *win_settings) = 0;
 #elif __linux__
-    /** Initialize tunnel */
-    virtual VpnError init(const VpnOsTunnelSettings *settings, std::optional<std::string> netns) = 0;
+    /**
+     * Initialize tunnel
+     * @param offload if true, try to open the device with `IFF_VNET_HDR` and enable checksum and
+     *                TCP segmentation offloads (see `is_vnet_hdr_enabled()`)
+     * @param queues number of descriptors to attach to the device. If greater than 1, the kernel
+     *               spreads the flows between them by flow hash (see `take_extra_queue_fds()`).
+     */
+    virtual VpnError init(const VpnOsTunnelSettings *settings, std::optional<std::string> netns,
+            bool offload = false, size_t queues = 1) = 0;
 #else
     /** Initialize tunnel */
     virtual VpnError init(const VpnOsTunnelSettings *settings) = 0;
@@ -160,6 +167,17 @@ public:
 
 #endif // _WIN32
 
+#ifdef __linux__
+    /** Check if packets on the descriptor are prefixed with `struct virtio_net_hdr` */
+    virtual bool is_vnet_hdr_enabled() const = 0;
+
+    /**
+     * Take the descriptors of the device queues other than the one returned by `get_fd()`.
+     * The caller becomes responsible for closing them.
+     */
+    virtual std::vector<evutil_socket_t> take_extra_queue_fds() = 0;
+#endif // __linux__
+
     VpnOsTunnel() = default;
     virtual ~VpnOsTunnel() = default;
 
@@ -184,7 +202,8 @@ protected:
 class VpnLinuxTunnel : public VpnOsTunnel {
 public:
     /** Initialize tunnel */
-    VpnError init(const VpnOsTunnelSettings *settings, std::optional<std::string> netns) override;
+    VpnError init(const VpnOsTunnelSettings *settings, std::optional<std::string> netns, bool offload = false,
+            size_t queues = 1) override;
     /** Get file descriptor */
     evutil_socket_t get_fd() override;
     /** Get interface name */
@@ -193,10 +212,15 @@ public:
     void deinit() override;
     /** Get result of setup system DNS */
     bool get_system_dns_setup_success() const override;
+    /** Check if packets on the descriptor are prefixed with `struct virtio_net_hdr` */
+    bool is_vnet_hdr_enabled() const override;
+    /** Take the descriptors of the extra device queues */
+    std::vector<evutil_socket_t> take_extra_queue_fds() override;
     ~VpnLinuxTunnel() override = default;
 
 private:
-    evutil_socket_t tun_open();
+    evutil_socket_t tun_open(bool offload);
+    void open_extra_queues(size_t queues);
     void setup_if();
     void setup_dns();
     bool check_sport_rule_support();
@@ -204,8 +228,11 @@ private:
     void teardown_routes(int16_t table_id);
 
     evutil_socket_t m_tun_fd{-1};
+    std::vector<evutil_socket_t> m_extra_queue_fds;
     std::string m_tun_name{};
     bool m_sport_supported{false};
+    bool m_multi_queue{false};
+    bool m_vnet_hdr{false};
     std::string m_netns{};
 };
 #elif __APPLE__ && !TARGET_OS_IPHONE
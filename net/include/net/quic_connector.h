@@ -55,6 +55,7 @@ struct QuicConnectorConnectParameters {
     Millis timeout;          // How long to wait for server response before giving up.
     Millis max_idle_timeout; // QUIC connection's maximum idle timeout.
     uint32_t quic_version;
+    VpnQuicTransportConfig transport; // Transport tuning, zero means the defaults.
 };
 
 #ifndef DISABLE_HTTP3
@@ -68,6 +69,13 @@ struct QuicConnectorResult {
 struct QuicConnectorResult {};
 #endif
 
+#ifndef DISABLE_HTTP3
+/**
+ * Apply the transport tuning to a QUIC config. The fields left zero are set to the library defaults.
+ */
+void quic_apply_transport_config(quiche_config *config, const VpnQuicTransportConfig &transport);
+#endif
+
 QuicConnector *quic_connector_create(const QuicConnectorParameters *parameters);
 
 /**
@@ -4,6 +4,7 @@
 
 #include <array>
 #include <optional>
+#include <span>
 #include <vector>
 
 #include "net/tls13_utils.h"
@@ -16,6 +17,8 @@ static constexpr size_t QUIC_MAX_CONN_ID_LEN = 20;
 static constexpr size_t QUIC_MAX_TOKEN_LEN = 128;
 /// default port for QUIC traffic
 static constexpr size_t DEFAULT_QUIC_PORT = 443;
+/// client Initial packets of this size and smaller are decrypted on the stack for the domain lookup
+static constexpr size_t MAX_STACK_INITIAL_LEN = 1500;
 /**
  * @struct
  * represents QUIC packet header.
@@ -56,6 +59,17 @@ enum QuicPacketType {
  */
 [[nodiscard]] std::optional<std::vector<uint8_t>> decrypt_initial(U8View initial_packet, const QuicPacketHeader &hd);
 
+/**
+ * Decrypt an initial packet into the caller's buffer. Initial packed is left unchanged.
+ * Accepts already decoded header.
+ * @param [in] initial_packet initial packet
+ * @param [in] hd decoded header
+ * @param [out] buffer buffer for the decrypted packet, at least as big as the initial packet
+ * @return the decrypted payload pointing into the buffer or std::nullopt if decryption failed
+ */
+[[nodiscard]] std::optional<U8View> decrypt_initial(
+        U8View initial_packet, const QuicPacketHeader &hd, std::span<uint8_t> buffer);
+
 /**
  * Find all CRYPTO frames in an initial QUIC packet payload and assemble them in order.
  * If the payload is malformed or doesn't contain CRYPTO frames, return std::nullopt.
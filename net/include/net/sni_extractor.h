@@ -0,0 +1,127 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <string_view>
+
+#include "vpn/utils.h"
+
+namespace ag {
+
+enum SniExtractorResult {
+    SNI_RMORE,     // need more data
+    SNI_RFOUND,    // found the server name
+    SNI_RNOTFOUND, // the Client Hello is over, but it has no server name
+    SNI_RERR,      // not a Client Hello
+};
+
+/**
+ * Single-pass Client Hello parser which looks for the server name indication. The fields are walked
+ * as the bytes come in, and only the server name itself is copied out, so a Client Hello split
+ * across any number of TCP segments, TLS records or QUIC CRYPTO frames is handled without buffering
+ * the message and without allocations.
+ */
+class TlsSniExtractor {
+public:
+    /** Maximum length of a server name the extractor keeps */
+    static constexpr size_t MAX_SERVER_NAME_LEN = 255;
+
+    /**
+     * Feed the next bytes of a TLS stream, i.e. the records as they come in TCP segments
+     * @return `SNI_RMORE` until the result is known, the result after that
+     */
+    SniExtractorResult feed_records(U8View data);
+
+    /**
+     * Feed the next bytes of the handshake messages, e.g. the contents of QUIC CRYPTO frames in order
+     * @return `SNI_RMORE` until the result is known, the result after that
+     */
+    SniExtractorResult feed_handshake(U8View data);
+
+    /** The server name, valid once `SNI_RFOUND` is returned */
+    [[nodiscard]] std::string_view server_name() const {
+        return {m_name.data(), m_name_len};
+    }
+
+private:
+    enum Field : uint8_t {
+        F_HANDSHAKE_HEADER,
+        F_VERSION,
+        F_RANDOM,
+        F_SESSION_ID_LEN,
+        F_SESSION_ID,
+        F_CIPHER_SUITES_LEN,
+        F_CIPHER_SUITES,
+        F_COMPRESSION_METHODS_LEN,
+        F_COMPRESSION_METHODS,
+        F_EXTENSIONS_LEN,
+        F_EXTENSION_HEADER,
+        F_EXTENSION,
+        F_SERVER_NAME_LIST_LEN,
+        F_SERVER_NAME_HEADER,
+        F_SERVER_NAME,
+        F_HOST_NAME,
+    };
+
+    static constexpr size_t RECORD_HEADER_LEN = 5;
+    static constexpr size_t HANDSHAKE_HEADER_LEN = 4;
+
+    SniExtractorResult m_result = SNI_RMORE;
+
+    std::array<uint8_t, RECORD_HEADER_LEN> m_record_header{};
+    size_t m_record_header_len = 0;
+    size_t m_record_left = 0;
+
+    Field m_field = F_HANDSHAKE_HEADER;
+    uint32_t m_pos = 0;                          // number of the handshake bytes walked through
+    uint32_t m_field_start = 0;                  // position of the current field
+    uint32_t m_field_end = HANDSHAKE_HEADER_LEN; // position after the current field
+    uint32_t m_hello_end = 0;
+    uint32_t m_extensions_end = 0;
+    uint32_t m_extension_end = 0;
+    uint32_t m_server_names_end = 0;
+    std::array<uint8_t, 4> m_scratch{}; // the current length field
+    std::array<char, MAX_SERVER_NAME_LEN> m_name; // NOLINT(*-member-init), only `m_name_len` bytes are read
+    size_t m_name_len = 0;
+
+    SniExtractorResult next_field(Field field, uint32_t len, uint32_t bound);
+    SniExtractorResult on_field(const uint8_t *field);
+    SniExtractorResult next_extension();
+    SniExtractorResult next_server_name();
+};
+
+/**
+ * Finds the server name in the client Initial packets of a QUIC connection. The CRYPTO frames are fed
+ * into `TlsSniExtractor` straight from the decrypted payload when they come in order. Only the frames
+ * which are ahead of a gap are copied to a fixed window until the gap is filled, as some clients
+ * shuffle the frames on purpose.
+ */
+class QuicSniExtractor {
+public:
+    /** Size of the window for the out-of-order CRYPTO data, enough for any common Client Hello */
+    static constexpr size_t CRYPTO_WINDOW_LEN = 4096;
+
+    /**
+     * Feed the decrypted payload of the next client Initial packet
+     * @return `SNI_RMORE` until the result is known, the result after that
+     */
+    SniExtractorResult feed_initial_payload(U8View payload);
+
+    /** The server name, valid once `SNI_RFOUND` is returned */
+    [[nodiscard]] std::string_view server_name() const {
+        return m_hello.server_name();
+    }
+
+private:
+    TlsSniExtractor m_hello;
+    SniExtractorResult m_result = SNI_RMORE;
+    uint64_t m_offset = 0; // CRYPTO stream offset the Client Hello is fed up to
+    bool m_seen_crypto = false;
+    std::array<uint8_t, CRYPTO_WINDOW_LEN> m_window; // NOLINT(*-member-init), only the filled bytes are read
+    std::bitset<CRYPTO_WINDOW_LEN> m_window_filled;
+
+    void on_crypto_frame(uint64_t offset, U8View data);
+};
+
+} // namespace ag
@@ -6,6 +6,7 @@
 
 #include "vpn/platform.h" // Unbreak Windows builddows
 
+#include <event2/buffer.h>
 #include <openssl/ssl.h>
 
 #include "common/defs.h"
@@ -145,6 +146,15 @@ size_t tcp_socket_available_to_write(const TcpSocket *socket);
  */
 VpnError tcp_socket_write(TcpSocket *socket, const uint8_t *data, size_t length);
 
+/**
+ * Send the contents of a buffer via socket. The data is moved to the socket's write buffer
+ * without copying, the buffer is left empty.
+ * @param socket socket
+ * @param buffer data to send
+ * @return 0 in case of success, non-zero value otherwise
+ */
+VpnError tcp_socket_write_buffer(TcpSocket *socket, struct evbuffer *buffer);
+
 /**
  * Get underlying descriptor
  * @param socket socket
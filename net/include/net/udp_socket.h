@@ -13,6 +13,11 @@ namespace ag {
 
 struct UdpSocket;
 
+/**
+ * Maximum number of datagrams passed to the batched read and write functions at once
+ */
+static constexpr size_t UDP_SOCKET_MAX_BATCH = 16;
+
 typedef enum {
     UDP_SOCKET_EVENT_PROTECT,  /**< Raised when socket needs to be protected (raised with `SocketProtectEvent`) */
     UDP_SOCKET_EVENT_READABLE, /**< Raised whenever socket has some data to read from (raised with `null`) */
@@ -55,6 +60,18 @@ void udp_socket_destroy(UdpSocket *socket);
  */
 VpnError udp_socket_write(UdpSocket *socket, const uint8_t *data, size_t length);
 
+/**
+ * Send several datagrams via a UDP socket with as few system calls as possible
+ * (`sendmmsg` and `UDP_SEGMENT` on Linux, one `send` per datagram elsewhere).
+ * Like `udp_socket_write`, the datagrams which do not fit in the system buffer are dropped.
+ * @param socket the socket
+ * @param buffer the datagrams laid out one after another
+ * @param lengths the datagram lengths
+ * @param count the number of datagrams (not greater than `UDP_SOCKET_MAX_BATCH`)
+ * @return 0 in case of success, non-zero value otherwise
+ */
+VpnError udp_socket_write_batch(UdpSocket *socket, const uint8_t *buffer, const size_t *lengths, size_t count);
+
 /**
  * Get underlying descriptor
  */
@@ -78,6 +95,17 @@ UdpSocket *udp_socket_acquire_fd(const UdpSocketParameters *parameters, evutil_s
  */
 ssize_t udp_socket_recv(UdpSocket *socket, uint8_t *buffer, size_t cap);
 
+/**
+ * Read several datagrams from the underlying fd (with a single `recvmmsg` on Linux).
+ * @param socket the socket
+ * @param buffer the buffer of `count * cap` bytes, the datagram `i` is placed at offset `i * cap`
+ * @param cap the maximum datagram length
+ * @param lengths (out) the received datagram lengths
+ * @param count the maximum number of datagrams to read (not greater than `UDP_SOCKET_MAX_BATCH`)
+ * @return the number of datagrams received, or a negative number if an error occurred.
+ */
+ssize_t udp_socket_recv_batch(UdpSocket *socket, uint8_t *buffer, size_t cap, size_t *lengths, size_t count);
+
 /**
  * Set the socket timeout. 0 disables timeout.
  */
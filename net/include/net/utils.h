@@ -245,13 +245,21 @@ static inline size_t varint_len(uint64_t varint_value) {
 using SslPtr = ag::DeclPtr<SSL, SSL_free>;
 
 /**
- * Dumps SSL sessions cache on disk
- * @param path Path to a directory where cache should be dumped
+ * Releases SSL sessions cache loaded by `load_session_cache`. Once the last user has released it,
+ * writes the pending changes on disk and stops persisting it.
  */
-void dump_session_cache(const std::string &path);
+void release_session_cache();
 
 /**
- * Loads SSL sessions cache from disk
+ * @deprecated The cache is persisted where it was loaded from, use `release_session_cache`
+ */
+[[deprecated("Use release_session_cache()")]] inline void dump_session_cache(const std::string & /*path*/) {
+    release_session_cache();
+}
+
+/**
+ * Loads SSL sessions cache from disk and starts persisting it there as it changes,
+ * so that the sessions survive a crash. Each call must be matched by `release_session_cache`.
  * @param path Path to a directory where cache was dumped
  */
 void load_session_cache(const std::string &path);
@@ -2,7 +2,9 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cctype>
 #include <cstring>
+#include <tuple>
 
 #include <ldns/ldns.h>
 
@@ -218,4 +220,376 @@ bool dns_utils::remove_svcparam_echconfig(ldns_pkt *response) {
     return modified;
 }
 
+
+static constexpr size_t DNS_HEADER_SIZE = 12;
+static constexpr size_t QUESTION_FIXED_SIZE = 4;  // type, class
+static constexpr size_t RECORD_FIXED_SIZE = 10;   // type, class, TTL, data length
+static constexpr size_t MAX_NAME_LENGTH = 255;    // RFC 1035 2.3.4
+static constexpr size_t MAX_POINTER_HOPS = MAX_NAME_LENGTH / 2;
+static constexpr uint8_t POINTER_MASK = 0xc0;
+
+static uint16_t read_u16(U8View message, size_t offset) {
+    return uint16_t((message[offset] << 8) | message[offset + 1]);
+}
+
+static uint32_t read_u32(U8View message, size_t offset) {
+    return (uint32_t(read_u16(message, offset)) << 16) | read_u16(message, offset + 2);
+}
+
+static void write_u16(std::span<uint8_t> message, size_t offset, uint16_t value) {
+    message[offset] = uint8_t(value >> 8);
+    message[offset + 1] = uint8_t(value);
+}
+
+// Escape the label octets the way `ldns_rdf2str()` does
+static void append_label(dns_utils::NameText &text, U8View label) {
+    for (uint8_t c : label) {
+        if (c == '.' || c == ';' || c == '(' || c == ')' || c == '\\') {
+            text.data[text.size++] = '\\';
+            text.data[text.size++] = char(c);
+        } else if (!(isascii(c) && isgraph(c))) {
+            text.data[text.size++] = '\\';
+            text.data[text.size++] = char('0' + c / 100);
+            text.data[text.size++] = char('0' + c / 10 % 10);
+            text.data[text.size++] = char('0' + c % 10);
+        } else {
+            text.data[text.size++] = char(c);
+        }
+    }
+    text.data[text.size++] = '.';
+}
+
+/**
+ * Walk the possibly compressed name at `offset` following the compression pointers
+ * @param text if not null, receives the name in the presentation format
+ * @return the offset past the name in the original position, or 0 if the name is malformed
+ */
+static size_t walk_name(U8View message, size_t offset, dns_utils::NameText *text) {
+    if (text != nullptr) {
+        text->size = 0;
+    }
+    size_t end = 0;
+    size_t name_length = 1; // The root label
+    size_t hops = 0;
+    for (;;) {
+        if (offset >= message.size()) {
+            return 0;
+        }
+        uint8_t length = message[offset];
+        if ((length & POINTER_MASK) == POINTER_MASK) {
+            if (offset + 1 >= message.size() || ++hops > MAX_POINTER_HOPS) {
+                return 0;
+            }
+            if (end == 0) {
+                end = offset + 2;
+            }
+            offset = read_u16(message, offset) & ~(uint16_t(POINTER_MASK) << 8);
+            continue;
+        }
+        if ((length & POINTER_MASK) != 0) {
+            return 0; // Extended label types are not supported
+        }
+        if (length == 0) {
+            break;
+        }
+        name_length += length + 1;
+        if (name_length > MAX_NAME_LENGTH || offset + 1 + length > message.size()) {
+            return 0;
+        }
+        if (text != nullptr) {
+            append_label(*text, message.substr(offset + 1, length));
+        }
+        offset += 1 + length;
+    }
+    if (text != nullptr) {
+        if (text->size > 0) {
+            --text->size; // Drop the trailing dot
+        }
+        text->data[text->size] = '\0';
+    }
+    return (end != 0) ? end : offset + 1;
+}
+
+std::optional<dns_utils::MessageReader> dns_utils::MessageReader::parse(U8View message) {
+    if (message.size() < DNS_HEADER_SIZE) {
+        return std::nullopt;
+    }
+
+    MessageReader reader{message};
+    size_t offset = DNS_HEADER_SIZE;
+    for (size_t i = read_u16(message, 4); i > 0; --i) {
+        offset = walk_name(message, offset, nullptr);
+        if (offset == 0 || offset + QUESTION_FIXED_SIZE > message.size()) {
+            return std::nullopt;
+        }
+        offset += QUESTION_FIXED_SIZE;
+    }
+
+    reader.m_answer_offset = offset;
+    reader.m_answer_count = read_u16(message, 6);
+    reader.m_record_count = size_t(reader.m_answer_count) + read_u16(message, 8) + read_u16(message, 10);
+    for (size_t i = 0; i < reader.m_record_count; ++i) {
+        size_t owner = offset;
+        offset = walk_name(message, owner, nullptr);
+        if (offset == 0 || offset + RECORD_FIXED_SIZE > message.size()) {
+            return std::nullopt;
+        }
+        uint16_t type = read_u16(message, offset);
+        size_t rdata = offset + RECORD_FIXED_SIZE;
+        size_t rdata_end = rdata + read_u16(message, offset + 8);
+        if (rdata_end > message.size()) {
+            return std::nullopt;
+        }
+        if (type == LDNS_RR_TYPE_CNAME && rdata != rdata_end) {
+            size_t name_end = walk_name(message, rdata, nullptr);
+            if (name_end == 0 || name_end > rdata_end) {
+                return std::nullopt;
+            }
+        }
+        offset = rdata_end;
+    }
+
+    return reader;
+}
+
+uint16_t dns_utils::MessageReader::id() const {
+    return read_u16(m_message, 0);
+}
+
+bool dns_utils::MessageReader::is_response() const {
+    return (m_message[2] & 0x80) != 0;
+}
+
+uint8_t dns_utils::MessageReader::rcode() const {
+    return m_message[3] & 0x0f;
+}
+
+uint8_t dns_utils::MessageReader::opcode() const {
+    return (m_message[2] >> 3) & 0x0f;
+}
+
+bool dns_utils::MessageReader::is_truncated() const {
+    return (m_message[2] & 0x02) != 0;
+}
+
+size_t dns_utils::MessageReader::question_end() const {
+    return walk_name(m_message, DNS_HEADER_SIZE, nullptr) + QUESTION_FIXED_SIZE;
+}
+
+bool dns_utils::MessageReader::has_question() const {
+    return read_u16(m_message, 4) != 0;
+}
+
+uint16_t dns_utils::MessageReader::question_type() const {
+    return read_u16(m_message, question_end() - QUESTION_FIXED_SIZE);
+}
+
+uint16_t dns_utils::MessageReader::question_class() const {
+    return read_u16(m_message, question_end() - QUESTION_FIXED_SIZE + 2);
+}
+
+std::optional<dns_utils::RecordType> dns_utils::MessageReader::question_record_type() const {
+    return ldns_to_utils_rr_type(ldns_rr_type(question_type()));
+}
+
+void dns_utils::MessageReader::question_name(NameText &name) const {
+    walk_name(m_message, DNS_HEADER_SIZE, &name);
+}
+
+void dns_utils::MessageReader::read_name(size_t offset, NameText &name) const {
+    walk_name(m_message, offset, &name);
+}
+
+U8View dns_utils::MessageReader::rdata(const RecordView &record) const {
+    return m_message.substr(record.rdata, record.rdata_length);
+}
+
+size_t dns_utils::MessageReader::read_record(size_t offset, RecordView &record) const {
+    record.owner = offset;
+    offset = walk_name(m_message, offset, nullptr);
+    record.type = read_u16(m_message, offset);
+    record.rr_class = read_u16(m_message, offset + 2);
+    record.ttl = read_u32(m_message, offset + 4);
+    record.rdata_length = read_u16(m_message, offset + 8);
+    record.rdata = offset + RECORD_FIXED_SIZE;
+    return record.rdata + record.rdata_length;
+}
+
+// Scan the labels of the name at `offset` without following the compression pointer.
+// Return the offset past the name, or 0 if it does not end before `limit`.
+// `pointer` receives the offset of the terminating compression pointer, if any, otherwise 0.
+static size_t scan_name(U8View message, size_t offset, size_t limit, size_t &pointer) {
+    pointer = 0;
+    while (offset < limit) {
+        uint8_t length = message[offset];
+        if ((length & POINTER_MASK) == POINTER_MASK) {
+            if (offset + 2 > limit) {
+                return 0;
+            }
+            pointer = offset;
+            return offset + 2;
+        }
+        if ((length & POINTER_MASK) != 0) {
+            return 0;
+        }
+        offset += 1 + length;
+        if (length == 0) {
+            return (offset <= limit) ? offset : 0;
+        }
+    }
+    return 0;
+}
+
+// Call `f(pointer offset)` for each compression pointer in the names the message may contain according
+// to RFC 3597 section 4: in the questions, the owners and the data of the well-known record types.
+// Return false if the message is malformed.
+template <typename F>
+static bool for_each_name_pointer(U8View message, F &&f) {
+    size_t pointer; // NOLINT(cppcoreguidelines-init-variables)
+    auto scan = [&](size_t offset, size_t limit) -> size_t {
+        size_t end = scan_name(message, offset, limit, pointer);
+        if (end != 0 && pointer != 0) {
+            f(pointer);
+        }
+        return end;
+    };
+
+    size_t offset = DNS_HEADER_SIZE;
+    for (size_t i = read_u16(message, 4); i > 0; --i) {
+        offset = scan(offset, message.size());
+        if (offset == 0) {
+            return false;
+        }
+        offset += QUESTION_FIXED_SIZE;
+    }
+
+    size_t records_num = size_t(read_u16(message, 6)) + read_u16(message, 8) + read_u16(message, 10);
+    for (size_t i = 0; i < records_num; ++i) {
+        offset = scan(offset, message.size());
+        if (offset == 0 || offset + RECORD_FIXED_SIZE > message.size()) {
+            return false;
+        }
+        uint16_t type = read_u16(message, offset);
+        size_t rdata = offset + RECORD_FIXED_SIZE;
+        size_t rdata_end = rdata + read_u16(message, offset + 8);
+        if (rdata_end > message.size()) {
+            return false;
+        }
+        offset = rdata_end;
+        if (rdata == rdata_end) {
+            continue;
+        }
+
+        switch (type) {
+        case LDNS_RR_TYPE_NS:
+        case LDNS_RR_TYPE_MD:
+        case LDNS_RR_TYPE_MF:
+        case LDNS_RR_TYPE_CNAME:
+        case LDNS_RR_TYPE_MB:
+        case LDNS_RR_TYPE_MG:
+        case LDNS_RR_TYPE_MR:
+        case LDNS_RR_TYPE_PTR:
+        case LDNS_RR_TYPE_DNAME:
+            if (scan(rdata, rdata_end) == 0) {
+                return false;
+            }
+            break;
+        case LDNS_RR_TYPE_SOA:
+        case LDNS_RR_TYPE_MINFO:
+        case LDNS_RR_TYPE_RP:
+            if (rdata = scan(rdata, rdata_end); rdata == 0 || scan(rdata, rdata_end) == 0) {
+                return false;
+            }
+            break;
+        case LDNS_RR_TYPE_MX:
+        case LDNS_RR_TYPE_AFSDB:
+        case LDNS_RR_TYPE_RT:
+        case LDNS_RR_TYPE_KX:
+            if (scan(rdata + 2, rdata_end) == 0) {
+                return false;
+            }
+            break;
+        case LDNS_RR_TYPE_SRV:
+            if (scan(rdata + 6, rdata_end) == 0) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+// Find the first "ech" parameter in the answer section.
+// Return the range of the parameter and the offset of the length of the record data containing it.
+static std::optional<std::tuple<size_t, size_t, size_t>> find_svcparam_echconfig(
+        U8View message, const dns_utils::MessageReader &reader) {
+    std::optional<std::tuple<size_t, size_t, size_t>> found;
+    reader.for_each_answer([&](const dns_utils::RecordView &record) {
+        if (found.has_value() || (record.type != LDNS_RR_TYPE_SVCB && record.type != LDNS_RR_TYPE_HTTPS)) {
+            return;
+        }
+        size_t end = record.rdata + record.rdata_length;
+        size_t pointer; // NOLINT(cppcoreguidelines-init-variables)
+        // Skip the priority and the target name
+        size_t offset = (record.rdata_length > 2) ? scan_name(message, record.rdata + 2, end, pointer) : 0;
+        if (offset == 0) {
+            return;
+        }
+        while (offset + 4 <= end) {
+            uint16_t key = read_u16(message, offset);
+            size_t param_end = offset + 4 + read_u16(message, offset + 2);
+            if (param_end > end) {
+                return;
+            }
+            if (key == LDNS_SVCPARAM_KEY_ECHCONFIG) {
+                found.emplace(offset, param_end, record.rdata - 2);
+                return;
+            }
+            offset = param_end;
+        }
+    });
+    return found;
+}
+
+size_t dns_utils::remove_svcparam_echconfig(std::span<uint8_t> message) {
+    size_t size = message.size();
+    for (;;) {
+        U8View view = {message.data(), size};
+        std::optional<MessageReader> reader = MessageReader::parse(view);
+        if (!reader.has_value()) {
+            return size;
+        }
+        auto found = find_svcparam_echconfig(view, *reader);
+        if (!found.has_value()) {
+            return size;
+        }
+
+        auto [begin, end, rdata_length] = *found;
+        size_t removed = end - begin;
+        auto target_of = [&](size_t pointer) -> size_t {
+            return read_u16(view, pointer) & ~(uint16_t(POINTER_MASK) << 8);
+        };
+        bool points_into_removed = false;
+        if (!for_each_name_pointer(view,
+                    [&](size_t pointer) {
+                        size_t target = target_of(pointer);
+                        points_into_removed = points_into_removed || (target >= begin && target < end);
+                    })
+                || points_into_removed) {
+            return size;
+        }
+        for_each_name_pointer(view, [&](size_t pointer) {
+            if (size_t target = target_of(pointer); target >= end) {
+                write_u16(message, pointer, uint16_t((target - removed) | (uint16_t(POINTER_MASK) << 8)));
+            }
+        });
+
+        write_u16(message, rdata_length, uint16_t(read_u16(view, rdata_length) - removed));
+        std::memmove(&message[begin], &message[end], size - end);
+        size -= removed;
+    }
+}
+
 } // namespace ag
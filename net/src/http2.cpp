@@ -21,6 +21,10 @@ static ag::Logger g_logger{"HTTP2"};
 #define DATA_QUEUE_CHUNK_SIZE 4096
 #define DATA_QUEUE_SIZE (10 * 1024 * 1024)
 
+static constexpr size_t FRAME_HEADER_LENGTH = 9;
+// Number of the source chunks looked at to fit a DATA frame to their boundaries
+static constexpr size_t DATA_FRAME_MAX_CHUNKS = 32;
+
 // taken from CoreLibs
 static const uint32_t SESSION_LOCAL_WINDOW_SIZE = 8 * 1024 * 1024;
 
@@ -37,7 +41,9 @@ static nghttp2_data_provider data_source_provider(void *source);
 static ssize_t data_source_readcb(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
         uint32_t *data_flags, nghttp2_data_source *source, void *user_data);
 static void data_source_free(DataSource *source);
-static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len, bool eof);
+static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len, const VpnBufferRef *buffer, bool eof);
+static size_t data_source_frame_length(DataSource *source, size_t max);
+static size_t data_source_move(DataSource *source, struct evbuffer *output, size_t length);
 static int data_source_schedule_send(nghttp2_session *session, int32_t stream_id, DataSource *source);
 static void stream_destroy(HttpStream *stream);
 
@@ -137,6 +143,38 @@ static ssize_t on_send_callback(
     return static_cast<ssize_t>(length);
 }
 
+/**
+ * Output the DATA frame chosen by `data_source_readcb`. The payload is moved from the stream's data
+ * source to the output by reference along with the frame header.
+ */
+static int on_send_data_callback(nghttp2_session *ngsession, nghttp2_frame *frame, const uint8_t *framehd,
+        size_t length, nghttp2_data_source *source, void *user_data) {
+    auto *session = (HttpSession *) user_data;
+    log_frsid(session, frame, trace, "(ngsession={}, length={}, padlen={})", (void *) ngsession, length,
+            frame->data.padlen);
+
+    Http2Session *h2_session = session->h2;
+    struct evbuffer *output = h2_session->output;
+    evbuffer_add(output, framehd, FRAME_HEADER_LENGTH);
+    if (frame->data.padlen > 0) {
+        auto pad_length = uint8_t(frame->data.padlen - 1);
+        evbuffer_add(output, &pad_length, 1);
+    }
+    h2_session->copied_bytes += data_source_move((DataSource *) source->ptr, output, length);
+    h2_session->sent_bytes += length;
+    if (frame->data.padlen > 1) {
+        static constexpr uint8_t PADDING[256] = {};
+        evbuffer_add(output, PADDING, frame->data.padlen - 1);
+    }
+
+    HttpSessionHandler *callbacks = &session->params.handler;
+    HttpOutputEvent event = {nullptr, evbuffer_get_length(output), output};
+    callbacks->handler(callbacks->arg, HTTP_EVENT_OUTPUT, &event);
+    evbuffer_drain(output, evbuffer_get_length(output));
+
+    return 0;
+}
+
 static int on_frame_recv_callback(nghttp2_session *ngsession, const nghttp2_frame *frame, void *user_data) {
     auto *session = (HttpSession *) user_data;
     log_frsid(session, frame, trace, "(type={}, ngsession={})", frame->hd.type, (void *) ngsession);
@@ -436,6 +474,8 @@ Http2Session *http2_session_init(HttpSession *ctx) {
     nghttp2_session_callbacks_set_error_callback(ngcallbacks, error_callback);
     // output callback
     nghttp2_session_callbacks_set_send_callback(ngcallbacks, on_send_callback);
+    // DATA frame output callback
+    nghttp2_session_callbacks_set_send_data_callback(ngcallbacks, on_send_data_callback);
 
     // Session options
     nghttp2_option_new(&ngoption);
@@ -457,6 +497,7 @@ Http2Session *http2_session_init(HttpSession *ctx) {
     session = (Http2Session *) calloc(1, sizeof(Http2Session));
     session->ngsession = ngsession;
     session->streams = kh_init(h2_streams_ht);
+    session->output = evbuffer_new();
 
 finish:
     return session;
@@ -497,6 +538,7 @@ int http2_session_close(HttpSession *session) {
         }
     }
     kh_destroy(h2_streams_ht, h2_session->streams);
+    evbuffer_free(h2_session->output);
 
     free(h2_session); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
 
@@ -586,7 +628,8 @@ finish:
     return r;
 }
 
-int http2_session_send_data(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len, bool eof) {
+int http2_session_send_data(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        const VpnBufferRef *buffer, bool eof) {
     log_sid(session, stream_id, trace, "eof={}", eof);
 
     Http2Session *h2_session = session->h2;
@@ -602,10 +645,13 @@ int http2_session_send_data(HttpSession *session, int32_t stream_id, const uint8
     }
 
     stream = kh_value(h2_session->streams, iter);
-    rv = data_source_add(stream, data, len, eof);
+    rv = data_source_add(stream, data, len, buffer, eof);
     if (rv != 0) {
         goto finish;
     }
+    if (buffer == nullptr) {
+        h2_session->copied_bytes += len;
+    }
     rv = data_source_schedule_send(ngsession, stream_id, (DataSource *) stream->data_source);
     if (rv != 0) {
         goto finish;
@@ -783,34 +829,34 @@ static nghttp2_data_provider data_source_provider(void *source) {
 
 /**
  * Data source read callback. Called by nghttp2 when it is ready to send data.
- * Returns data if it is in output buffer or ERR_DEFERRED if buffer is empty and no EOF flag set.
+ * Returns length of data to send if it is in output buffer or ERR_DEFERRED if buffer is empty and no EOF flag set.
  * If ERR_DEFERRED is set, nghttp2_session_resume_data() is called on next http2_data_provider_write() call.
+ * The data itself is left in the buffer to be output by `on_send_data_callback`.
  */
-static ssize_t data_source_readcb(nghttp2_session *ngsession, int32_t stream_id, uint8_t *buf, size_t length,
+static ssize_t data_source_readcb(nghttp2_session *ngsession, int32_t stream_id, uint8_t *, size_t length,
         uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
     HttpSession *session = (HttpSession *) user_data;
     DataSource *ds = (DataSource *) source->ptr;
 
     // Pause and destroy data source if no work on current buffer.
-    if (!ds->has_eof && 0 == evbuffer_get_length(ds->buf)) {
+    size_t available = evbuffer_get_length(ds->buf);
+    if (!ds->has_eof && 0 == available) {
         log_sid(session, stream_id, trace, "no work on current buffer");
         return NGHTTP2_ERR_DEFERRED;
     }
 
-    ssize_t n = evbuffer_remove(ds->buf, buf, length);
+    size_t n = data_source_frame_length(ds, length);
     log_sid(session, stream_id, trace, "{} bytes", n);
-    if (n < 0) {
-        return NGHTTP2_ERR_BUFFER_ERROR;
-    }
+    *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
 
     // If eof, set flag and destroy data source
-    if (ds->has_eof && 0 == evbuffer_get_length(ds->buf)) {
+    if (ds->has_eof && n == available) {
         log_sid(session, stream_id, trace, "no data left in buffers -- set eof flag");
         *data_flags |= NGHTTP2_DATA_FLAG_EOF;
     }
 
     HttpSessionHandler *callbacks = &session->params.handler;
-    HttpDataSentEvent event = {stream_id, (size_t) n};
+    HttpDataSentEvent event = {stream_id, n};
     callbacks->handler(callbacks->arg, HTTP_EVENT_DATA_SENT, &event);
 
     log_sid(session, stream_id, trace, "remote window size: session={} stream={}",
@@ -823,7 +869,8 @@ static ssize_t data_source_readcb(nghttp2_session *ngsession, int32_t stream_id,
     return static_cast<ssize_t>(event.length);
 }
 
-static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len, bool eof) {
+static int data_source_add(
+        HttpStream *stream, const uint8_t *data, size_t len, const VpnBufferRef *buffer, bool eof) {
     DataSource *source = (DataSource *) stream->data_source;
     if (source == nullptr) {
         // Lazy init source
@@ -831,10 +878,59 @@ static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len,
         stream->data_source = source;
     }
     source->has_eof |= eof;
-    int rv = evbuffer_add(source->buf, data, len);
+    if (buffer == nullptr || len == 0) {
+        return evbuffer_add(source->buf, data, len);
+    }
+    buffer->ref(buffer->arg);
+    int rv = evbuffer_add_reference(source->buf, data, len, buffer->unref, buffer->arg);
+    if (rv != 0) {
+        buffer->unref(data, len, buffer->arg);
+    }
     return rv;
 }
 
+/**
+ * Get the length of the next DATA frame payload not exceeding `max`. Only a chunk of the source
+ * cut in the middle has to be copied on output (see `data_source_move`), so the frame is ended
+ * on a chunk boundary unless the first chunk does not fit as a whole.
+ */
+static size_t data_source_frame_length(DataSource *source, size_t max) {
+    size_t available = evbuffer_get_length(source->buf);
+    if (available <= max) {
+        return available;
+    }
+
+    evbuffer_iovec chunks[DATA_FRAME_MAX_CHUNKS];
+    int n = evbuffer_peek(source->buf, (ev_ssize_t) max, nullptr, chunks, (int) std::size(chunks));
+    size_t length = 0;
+    for (int i = 0; i < std::min(n, (int) std::size(chunks)) && length + chunks[i].iov_len <= max; ++i) {
+        length += chunks[i].iov_len;
+    }
+    return (length != 0) ? length : max;
+}
+
+/**
+ * Move the data from the source to the output buffer. The whole chunks are moved by reference,
+ * the head of the last one is copied if the length ends in the middle of it.
+ * @return number of copied bytes
+ */
+static size_t data_source_move(DataSource *source, struct evbuffer *output, size_t length) {
+    size_t copied = 0;
+    while (length > 0) {
+        evbuffer_iovec chunk;
+        if (evbuffer_peek(source->buf, -1, nullptr, &chunk, 1) < 1) {
+            break;
+        }
+        size_t n = std::min(chunk.iov_len, length);
+        if (n < chunk.iov_len) {
+            copied += n;
+        }
+        evbuffer_remove_buffer(source->buf, output, n);
+        length -= n;
+    }
+    return copied;
+}
+
 extern "C" {
 int nghttp2_stream_check_deferred_item(struct nghttp2_stream *stream);
 }
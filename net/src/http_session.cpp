@@ -97,7 +97,7 @@ int http_session_send_data(HttpSession *session, int32_t stream_id, const uint8_
     case HTTP_VER_1_1:
         return http1_session_send_data(session, stream_id, data, len, eof);
     case HTTP_VER_2_0:
-        return http2_session_send_data(session, stream_id, data, len, eof);
+        return http2_session_send_data(session, stream_id, data, len, nullptr, eof);
     case HTTP_VER_3_0:
         assert(0);
         break;
@@ -105,4 +105,26 @@ int http_session_send_data(HttpSession *session, int32_t stream_id, const uint8_
     return -1;
 }
 
+int http_session_send_data_by_reference(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        const VpnBufferRef &buffer, bool eof) {
+    switch (session->params.version) {
+    case HTTP_VER_1_1:
+        // The data is passed to the output right away, nothing to keep
+        return http1_session_send_data(session, stream_id, data, len, eof);
+    case HTTP_VER_2_0:
+        return http2_session_send_data(session, stream_id, data, len, &buffer, eof);
+    case HTTP_VER_3_0:
+        assert(0);
+        break;
+    }
+    return -1;
+}
+
+HttpSessionCopyStats http_session_get_copy_stats(const HttpSession *session) {
+    if (session->params.version != HTTP_VER_2_0 || session->h2 == nullptr) {
+        return {};
+    }
+    return {session->h2->sent_bytes, session->h2->copied_bytes};
+}
+
 } // namespace ag
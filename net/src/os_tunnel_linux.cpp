@@ -8,6 +8,8 @@
 #include <linux/if_tun.h>
 #include <sys/ioctl.h>
 
+#include <algorithm>
+
 static const ag::Logger logger("OS_TUNNEL_LINUX");
 
 static constexpr auto TABLE_ID = 880;
@@ -67,12 +69,15 @@ static ag::Result<std::string, ag::tunnel_utils::ExecError> sys_cmd_with_output_
     return ag::tunnel_utils::sys_cmd_with_output(cmd);
 }
 
-ag::VpnError ag::VpnLinuxTunnel::init(const ag::VpnOsTunnelSettings *settings, std::optional<std::string> netns) {
+ag::VpnError ag::VpnLinuxTunnel::init(
+        const ag::VpnOsTunnelSettings *settings, std::optional<std::string> netns, bool offload, size_t queues) {
     init_settings(settings);
     m_netns = netns.value_or("");
-    if (tun_open() == -1) {
+    if (tun_open(offload) == -1) {
         return {-1, "Failed to init tunnel"};
     }
+    // Must be done before the interface is moved to another namespace as queues are attached by name
+    open_extra_queues(queues);
     setup_if();
     m_sport_supported = check_sport_rule_support();
     teardown_routes(TABLE_ID); // Remove stale rules from previous sessions
@@ -86,6 +91,9 @@ ag::VpnError ag::VpnLinuxTunnel::init(const ag::VpnOsTunnelSettings *settings, s
 
 void ag::VpnLinuxTunnel::deinit() {
     close(m_tun_fd);
+    for (evutil_socket_t fd : std::exchange(m_extra_queue_fds, {})) {
+        close(fd);
+    }
     teardown_routes(TABLE_ID);
     m_system_dns_setup_success = false;
 }
@@ -102,7 +110,15 @@ bool ag::VpnLinuxTunnel::get_system_dns_setup_success() const {
     return m_system_dns_setup_success;
 }
 
-evutil_socket_t ag::VpnLinuxTunnel::tun_open() {
+bool ag::VpnLinuxTunnel::is_vnet_hdr_enabled() const {
+    return m_vnet_hdr;
+}
+
+std::vector<evutil_socket_t> ag::VpnLinuxTunnel::take_extra_queue_fds() {
+    return std::exchange(m_extra_queue_fds, {});
+}
+
+evutil_socket_t ag::VpnLinuxTunnel::tun_open(bool offload) {
     evutil_socket_t fd = open("/dev/net/tun", O_RDWR);
 
     if (fd == -1) {
@@ -110,22 +126,71 @@ evutil_socket_t ag::VpnLinuxTunnel::tun_open() {
         return -1;
     }
 
+    // Multi-queue device lets the kernel spread flows across several descriptors
+    // attached to the same interface by flow hash
+    short vnet_flag = offload ? IFF_VNET_HDR : 0;
     struct ifreq ifr = {};
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-
-    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE | vnet_flag;
+    int r = ioctl(fd, TUNSETIFF, &ifr);
+    if (r == -1 && errno == EINVAL) {
+        dbglog(logger, "Multi-queue TUN is not supported, falling back to single queue");
+        ifr = {};
+        ifr.ifr_flags = IFF_TUN | IFF_NO_PI | vnet_flag;
+        r = ioctl(fd, TUNSETIFF, &ifr);
+    }
+    if (r == -1) {
         evutil_closesocket(fd);
         errlog(logger, "ioctl TUNSETIFF failed: {}", strerror(errno));
         return -1;
     }
+    m_multi_queue = (ifr.ifr_flags & IFF_MULTI_QUEUE) != 0;
+    m_vnet_hdr = (ifr.ifr_flags & IFF_VNET_HDR) != 0;
+    if (m_vnet_hdr) {
+        // Kernel may pass partially checksummed packets and TCP super-packets of up to 64 KiB to us
+        // and accepts the same from us
+        unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+        if (ioctl(fd, TUNSETOFFLOAD, offloads) == -1) {
+            warnlog(logger, "ioctl TUNSETOFFLOAD failed, offloads are disabled: {}", strerror(errno));
+        }
+    }
     m_tun_fd = fd;
     m_tun_name = ifr.ifr_name;
     m_if_index = if_nametoindex(ifr.ifr_name);
 
-    infolog(logger, "Device {} opened", ifr.ifr_name);
+    infolog(logger, "Device {} opened (multi-queue: {}, vnet header: {})", ifr.ifr_name, m_multi_queue, m_vnet_hdr);
     return fd;
 }
 
+void ag::VpnLinuxTunnel::open_extra_queues(size_t queues) {
+    if (queues <= 1) {
+        return;
+    }
+    if (!m_multi_queue) {
+        warnlog(logger, "Device is not multi-queue, all traffic goes through a single queue");
+        return;
+    }
+
+    for (size_t i = 1; i < queues; ++i) {
+        evutil_socket_t fd = open("/dev/net/tun", O_RDWR);
+        if (fd == -1) {
+            warnlog(logger, "Failed to open /dev/net/tun for queue {}: {}", i, strerror(errno));
+            break;
+        }
+        // Flags must match the ones the device was created with
+        struct ifreq ifr = {};
+        ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE | (m_vnet_hdr ? IFF_VNET_HDR : 0);
+        memcpy(ifr.ifr_name, m_tun_name.c_str(), std::min(m_tun_name.size(), size_t(IFNAMSIZ - 1)));
+        if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+            warnlog(logger, "Failed to attach queue {} to device {}: {}", i, m_tun_name, strerror(errno));
+            evutil_closesocket(fd);
+            break;
+        }
+        m_extra_queue_fds.push_back(fd);
+    }
+
+    infolog(logger, "Device {} has {} queues", m_tun_name, m_extra_queue_fds.size() + 1);
+}
+
 void ag::VpnLinuxTunnel::setup_if() {
     // Move interface to network namespace if specified
     if (!m_netns.empty()) {
@@ -118,6 +118,7 @@ struct Ping {
 
     uint32_t quic_max_idle_timeout_ms;
     uint32_t quic_version;
+    VpnQuicTransportConfig quic_transport;
 
     int minimum_round_timeout_ms;
 };
@@ -240,6 +241,7 @@ static void do_connect(void *arg, bool shortcut) {
                 .timeout = Millis{self->round_timeout_ms},
                 .max_idle_timeout = Millis{self->quic_max_idle_timeout_ms},
                 .quic_version = self->quic_version,
+                .transport = self->quic_transport,
         };
         error = quic_connector_connect(conn->quic_connector.get(), &parameters);
     } else {
@@ -593,6 +595,7 @@ Ping *ping_start(const PingInfo *info, PingHandler handler) {
     self->quic_max_idle_timeout_ms = info->quic_max_idle_timeout_ms ? info->quic_max_idle_timeout_ms
                                                                     : TIMEOUT_MULTIPLIER * DEFAULT_PING_TIMEOUT_MS;
     self->quic_version = info->quic_version ? info->quic_version : QUICHE_PROTOCOL_VERSION;
+    self->quic_transport = info->quic_transport;
 #endif
 
     constexpr uint32_t DEFAULT_IF_IDX = 0;
@@ -64,6 +64,7 @@ struct PingInfo {
     /// QUIC parameters. Set 0 to use defaults.
     uint32_t quic_max_idle_timeout_ms = 0;
     uint32_t quic_version = 0;
+    VpnQuicTransportConfig quic_transport{};
 };
 
 struct PingHandler {
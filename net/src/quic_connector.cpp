@@ -59,12 +59,48 @@ struct ag::QuicConnector {
     QuicConnectorParameters parameters = {};
     int64_t deadline_ns = 0;
     ag::TaskId report_task = -1;
-    uint8_t server_payload[QUIC_MAX_UDP_PAYLOAD_SIZE]{};
+    uint8_t server_payload[QUIC_MAX_RECV_UDP_PAYLOAD_SIZE]{};
     size_t server_payload_size = 0;
     std::optional<ag::VpnError> error;
     std::optional<ag::QuicConnectorResult> result;
 };
 
+void ag::quic_apply_transport_config(quiche_config *config, const VpnQuicTransportConfig &transport) {
+    switch (transport.congestion_control) {
+    case VPN_QUIC_CC_DEFAULT:
+        break;
+    case VPN_QUIC_CC_CUBIC:
+        quiche_config_set_cc_algorithm(config, QUICHE_CC_CUBIC);
+        break;
+    case VPN_QUIC_CC_RENO:
+        quiche_config_set_cc_algorithm(config, QUICHE_CC_RENO);
+        break;
+    case VPN_QUIC_CC_BBR:
+        quiche_config_set_cc_algorithm(config, QUICHE_CC_BBR);
+        break;
+    case VPN_QUIC_CC_BBR2:
+        quiche_config_set_cc_algorithm(config, QUICHE_CC_BBR2);
+        break;
+    }
+    quiche_config_enable_hystart(config, !transport.disable_hystart);
+
+    uint64_t max_data = transport.initial_max_data ? transport.initial_max_data : QUIC_CONNECTION_WINDOW_SIZE;
+    uint64_t max_stream_data =
+            transport.initial_max_stream_data ? transport.initial_max_stream_data : QUIC_STREAM_WINDOW_SIZE;
+    quiche_config_set_initial_max_data(config, max_data);
+    quiche_config_set_initial_max_stream_data_bidi_local(config, max_stream_data);
+    quiche_config_set_initial_max_stream_data_bidi_remote(config, max_stream_data);
+    quiche_config_set_initial_max_stream_data_uni(config, max_stream_data);
+    // A cap below the initial window would be meaningless, so zero means "do not grow"
+    quiche_config_set_max_connection_window(config, std::max(transport.max_connection_window, max_data));
+    quiche_config_set_max_stream_window(config, std::max(transport.max_stream_window, max_stream_data));
+
+    size_t max_recv_payload =
+            transport.max_recv_udp_payload_size ? transport.max_recv_udp_payload_size : QUIC_MAX_UDP_PAYLOAD_SIZE;
+    quiche_config_set_max_recv_udp_payload_size(
+            config, std::clamp(max_recv_payload, QUIC_MIN_UDP_PAYLOAD_SIZE, QUIC_MAX_RECV_UDP_PAYLOAD_SIZE));
+}
+
 ag::QuicConnector *ag::quic_connector_create(const ag::QuicConnectorParameters *parameters) {
     auto self = std::make_unique<QuicConnector>();
     self->parameters = *parameters;
@@ -108,17 +144,13 @@ ag::VpnError ag::quic_connector_connect(
     quiche_config_set_application_protos(
             config.get(), (uint8_t *) QUICHE_H3_APPLICATION_PROTOCOL, strlen(QUICHE_H3_APPLICATION_PROTOCOL));
     quiche_config_set_max_idle_timeout(config.get(), parameters->max_idle_timeout.count());
-    quiche_config_set_initial_max_data(config.get(), QUIC_CONNECTION_WINDOW_SIZE);
-    quiche_config_set_initial_max_stream_data_bidi_local(config.get(), QUIC_STREAM_WINDOW_SIZE);
-    quiche_config_set_initial_max_stream_data_bidi_remote(config.get(), QUIC_STREAM_WINDOW_SIZE);
-    quiche_config_set_initial_max_stream_data_uni(config.get(), QUIC_STREAM_WINDOW_SIZE);
     quiche_config_set_initial_max_streams_bidi(config.get(), QUIC_MAX_STREAMS_NUM);
     quiche_config_set_initial_max_streams_uni(config.get(), QUIC_MAX_STREAMS_NUM);
-    quiche_config_set_max_recv_udp_payload_size(config.get(), QUIC_MAX_UDP_PAYLOAD_SIZE);
     quiche_config_set_max_send_udp_payload_size(config.get(), QUIC_MAX_UDP_PAYLOAD_SIZE);
     quiche_config_set_disable_active_migration(config.get(), true);
-    quiche_config_set_max_connection_window(config.get(), QUIC_CONNECTION_WINDOW_SIZE);
-    quiche_config_set_max_stream_window(config.get(), QUIC_STREAM_WINDOW_SIZE);
+    quic_apply_transport_config(config.get(), parameters->transport);
+    // Also makes the HTTP/3 layer advertise `SETTINGS_H3_DATAGRAM`
+    quiche_config_enable_dgram(config.get(), true, QUIC_DGRAM_QUEUE_LEN, QUIC_DGRAM_QUEUE_LEN);
 
     uint8_t scid[QUIC_LOCAL_CONN_ID_LEN];
     static_assert(std::size(scid) <= QUICHE_MAX_CONN_ID_LEN);
@@ -34,6 +34,9 @@ static ag::Logger log{"QUIC_UTILS"};
 struct QuicInitialSalt {
     uint32_t version;
     std::array<uint8_t, QUIC_INITIAL_SALTLEN> salt;
+    std::string_view key_label = "quic key";
+    std::string_view iv_label = "quic iv";
+    std::string_view hp_label = "quic hp";
 };
 
 // Versions in decreasing order
@@ -54,6 +57,14 @@ static constexpr QuicInitialSalt QUIC_INITIAL_SALTS[] = {
                         0xcc, 0xbb, 0x7f, 0x0a}},
 };
 
+// QUIC v2 [RFC 9369 3.3]
+static constexpr QuicInitialSalt QUIC_V2_INITIAL_SALT = {.version = 0x6b3343cf,
+        .salt = {0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93, 0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9,
+                0xbd, 0x2e, 0xd9},
+        .key_label = "quicv2 key",
+        .iv_label = "quicv2 iv",
+        .hp_label = "quicv2 hp"};
+
 static uint64_t get_varint(size_t *length, const uint8_t *buf);
 
 extern "C" int ngtcp2_crypto_cipher_ctx_encrypt_init(
@@ -102,14 +113,32 @@ static constexpr auto MIN_CLIENT_INITIAL_LEN = 1200;
 // NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
 std::optional<std::vector<uint8_t>> quic_utils::decrypt_initial(
         U8View initial_packet, const quic_utils::QuicPacketHeader &hd) {
+    std::vector<uint8_t> decrypted_packet(initial_packet.size());
+    std::optional<U8View> payload = decrypt_initial(initial_packet, hd, decrypted_packet);
+    if (!payload.has_value()) {
+        return std::nullopt;
+    }
+    size_t payload_offset = payload->data() - decrypted_packet.data();
+    // remove info before payload start position
+    decrypted_packet.resize(payload_offset + payload->size());
+    // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
+    decrypted_packet.erase(decrypted_packet.begin(), decrypted_packet.begin() + payload_offset);
+    return decrypted_packet;
+}
+
+std::optional<U8View> quic_utils::decrypt_initial(
+        U8View initial_packet, const quic_utils::QuicPacketHeader &hd, std::span<uint8_t> buffer) {
 
-    if (initial_packet.size() < MIN_CLIENT_INITIAL_LEN) {
+    if (initial_packet.size() < MIN_CLIENT_INITIAL_LEN || buffer.size() < initial_packet.size()) {
         return std::nullopt;
     }
-    const auto *initial_salt_it = std::find_if(
-            std::begin(QUIC_INITIAL_SALTS), std::end(QUIC_INITIAL_SALTS), [&](const QuicInitialSalt &salt) {
-                return hd.version >= salt.version;
-            });
+    const QuicInitialSalt *initial_salt_it = &QUIC_V2_INITIAL_SALT;
+    if (hd.version != QUIC_V2_INITIAL_SALT.version) {
+        initial_salt_it = std::find_if(
+                std::begin(QUIC_INITIAL_SALTS), std::end(QUIC_INITIAL_SALTS), [&](const QuicInitialSalt &salt) {
+                    return hd.version >= salt.version;
+                });
+    }
     if (initial_salt_it == std::end(QUIC_INITIAL_SALTS)) {
         return std::nullopt;
     }
@@ -129,17 +158,17 @@ std::optional<std::vector<uint8_t>> quic_utils::decrypt_initial(
     }
     // Extract key for payload decryption
     std::array<uint8_t, QUIC_INITIAL_KEYLEN> payload_key{};
-    if (!tls13_utils::hkdf_expand_label(payload_key, client_secret, "quic key")) {
+    if (!tls13_utils::hkdf_expand_label(payload_key, client_secret, initial_salt_it->key_label)) {
         return std::nullopt;
     }
     // Extract initialization vector for getting nonce for payload decryption
     std::array<uint8_t, QUIC_INITIAL_IVLEN> payload_iv{};
-    if (!tls13_utils::hkdf_expand_label(payload_iv, client_secret, "quic iv")) {
+    if (!tls13_utils::hkdf_expand_label(payload_iv, client_secret, initial_salt_it->iv_label)) {
         return std::nullopt;
     }
     // Extract header protection data
     std::array<uint8_t, QUIC_INITIAL_KEYLEN> hp_key{};
-    if (!tls13_utils::hkdf_expand_label(hp_key, client_secret, "quic hp")) {
+    if (!tls13_utils::hkdf_expand_label(hp_key, client_secret, initial_salt_it->hp_label)) {
         return std::nullopt;
     }
     // Parse token length offset
@@ -149,11 +178,17 @@ std::optional<std::vector<uint8_t>> quic_utils::decrypt_initial(
     size_t token_length_size = 1 << (initial_packet[token_length_offset] >> 6);
     // Parse length offset
     size_t payload_length_offset = token_length_offset + token_length_size + hd.token_len;
+    if (payload_length_offset >= initial_packet.size()) {
+        return std::nullopt;
+    }
     size_t payload_length_size = 1 << (initial_packet[payload_length_offset] >> 6);
     // get packet number offset
     size_t pn_offset = 7 + hd.dcid_len + hd.scid_len + payload_length_size + token_length_size + hd.token_len;
     // get sample offset
     size_t sample_offset = pn_offset + 4;
+    if (sample_offset + QUIC_HPMASKLEN > initial_packet.size()) {
+        return std::nullopt;
+    }
     // create hp mask
     std::array<uint8_t, QUIC_HPMASKLEN> hp_mask{};
     if (!create_hp_mask(hp_mask.data(), hp_key.data(), initial_packet.data() + sample_offset)) {
@@ -161,8 +196,9 @@ std::optional<std::vector<uint8_t>> quic_utils::decrypt_initial(
     }
     // we got all preparation info
     // begin to decrypt initial packet
-    // copy initial packet as it shouldn't be changed
-    std::vector<uint8_t> decrypted_packet(initial_packet.data(), initial_packet.data() + initial_packet.size());
+    // copy the header as the initial packet shouldn't be changed, the payload is decrypted right into the buffer
+    uint8_t *decrypted_packet = buffer.data();
+    std::memcpy(decrypted_packet, initial_packet.data(), sample_offset);
     // get packet number length
     decrypted_packet[0] ^= hp_mask[0] & 0x0f; // Decrypt pkt_num_len
     size_t pn_length = (decrypted_packet[0] & 0x03) + 1;
@@ -176,25 +212,19 @@ std::optional<std::vector<uint8_t>> quic_utils::decrypt_initial(
     }
     size_t payload_offset = pn_offset + pn_length;
     size_t payload_len = get_varint(&payload_length_size, &decrypted_packet[payload_length_offset]) - pn_length;
-    if (payload_len > decrypted_packet.size() - payload_offset) {
+    if (payload_len > initial_packet.size() - payload_offset) {
         return std::nullopt;
     }
     size_t max_overhead = 0;
-    if (!decrypt_quic_payload(decrypted_packet.data() + payload_offset, payload_key.data(),
-                initial_packet.data() + payload_offset, payload_len, payload_iv.data(), decrypted_packet.data(),
+    if (!decrypt_quic_payload(decrypted_packet + payload_offset, payload_key.data(),
+                initial_packet.data() + payload_offset, payload_len, payload_iv.data(), decrypted_packet,
                 payload_offset, &max_overhead)) {
         return std::nullopt;
     }
-    if (max_overhead > payload_len + payload_offset) {
+    if (max_overhead > payload_len) {
         return std::nullopt;
     }
-    // decrypted packet size
-    size_t decrypted_size = payload_len + payload_offset - max_overhead;
-    // remove info before payload start position
-    decrypted_packet.resize(decrypted_size);
-    // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
-    decrypted_packet.erase(decrypted_packet.begin(), decrypted_packet.begin() + payload_offset);
-    return decrypted_packet;
+    return U8View{decrypted_packet + payload_offset, payload_len - max_overhead};
 }
 
 // get int from array of bytes
@@ -0,0 +1,313 @@
+#include "net/sni_extractor.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ag {
+
+static constexpr uint8_t CT_HANDSHAKE = 22;
+static constexpr uint8_t HS_CLIENT_HELLO = 1;
+static constexpr uint8_t TLS_MAJOR_VERSION = 3;
+static constexpr uint16_t EXT_SERVER_NAME = 0;
+static constexpr uint8_t SNI_HOST_NAME = 0;
+static constexpr uint32_t RANDOM_LEN = 32;
+static constexpr uint8_t MAX_SESSION_ID_LEN = 32;
+static constexpr size_t EXTENSION_HEADER_LEN = 4;
+static constexpr size_t SERVER_NAME_HEADER_LEN = 3;
+/** Maximum length of a TLS record (TLSCiphertext.length) */
+static constexpr size_t MAX_RECORD_LEN = (1 << 14) + 2048;
+
+/** Maximum number of CRYPTO frames in a packet which are sorted without copying */
+static constexpr size_t MAX_CRYPTO_FRAMES_NUM = 32;
+
+enum QuicFrameType : uint64_t {
+    QFT_PADDING = 0x00,
+    QFT_PING = 0x01,
+    QFT_CRYPTO = 0x06,
+};
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+static uint16_t read_u16(const uint8_t *d) {
+    return uint16_t(d[0] << 8 | d[1]);
+}
+
+static uint32_t read_u24(const uint8_t *d) {
+    return uint32_t(d[0] << 16 | d[1] << 8 | d[2]);
+}
+
+static bool read_varint(U8View &data, uint64_t &value) {
+    if (data.empty()) {
+        return false;
+    }
+    size_t len = size_t(1) << (data[0] >> 6);
+    if (len > data.size()) {
+        return false;
+    }
+    value = data[0] & 0x3f;
+    for (size_t i = 1; i < len; ++i) {
+        value = value << 8 | data[i];
+    }
+    data.remove_prefix(len);
+    return true;
+}
+// NOLINTEND(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+SniExtractorResult TlsSniExtractor::feed_records(U8View data) {
+    while (m_result == SNI_RMORE && !data.empty()) {
+        if (m_record_left == 0) {
+            size_t n = std::min(data.size(), RECORD_HEADER_LEN - m_record_header_len);
+            std::memcpy(&m_record_header[m_record_header_len], data.data(), n);
+            m_record_header_len += n;
+            data.remove_prefix(n);
+            if (m_record_header[0] != CT_HANDSHAKE) {
+                m_result = SNI_RERR;
+                break;
+            }
+            if (m_record_header_len < RECORD_HEADER_LEN) {
+                break;
+            }
+
+            m_record_header_len = 0;
+            m_record_left = read_u16(&m_record_header[3]);
+            if (m_record_header[1] != TLS_MAJOR_VERSION || m_record_header[2] == 0 || m_record_left == 0
+                    || m_record_left > MAX_RECORD_LEN) {
+                m_result = SNI_RERR;
+            }
+            continue;
+        }
+
+        size_t n = std::min(data.size(), m_record_left);
+        m_record_left -= n;
+        feed_handshake(data.substr(0, n));
+        data.remove_prefix(n);
+    }
+
+    return m_result;
+}
+
+SniExtractorResult TlsSniExtractor::feed_handshake(U8View data) {
+    while (m_result == SNI_RMORE && !data.empty()) {
+        size_t n = std::min<size_t>(data.size(), m_field_end - m_pos);
+        const uint8_t *field = m_scratch.data();
+        switch (m_field) {
+        case F_RANDOM:
+        case F_SESSION_ID:
+        case F_CIPHER_SUITES:
+        case F_COMPRESSION_METHODS:
+        case F_EXTENSION:
+        case F_SERVER_NAME:
+            break;
+        case F_HOST_NAME:
+            std::memcpy(&m_name[m_pos - m_field_start], data.data(), n);
+            break;
+        default:
+            if (m_pos == m_field_start && m_pos + n == m_field_end) {
+                field = data.data(); // the length field is read in place unless it's split
+            } else {
+                std::memcpy(&m_scratch[m_pos - m_field_start], data.data(), n);
+            }
+            break;
+        }
+
+        m_pos += n;
+        data.remove_prefix(n);
+        // An empty field is over as soon as it starts
+        while (m_result == SNI_RMORE && m_pos == m_field_end) {
+            m_result = on_field(field);
+        }
+    }
+
+    return m_result;
+}
+
+SniExtractorResult TlsSniExtractor::next_field(Field field, uint32_t len, uint32_t bound) {
+    if (len > bound - m_pos) {
+        return SNI_RERR;
+    }
+    m_field = field;
+    m_field_start = m_pos;
+    m_field_end = m_pos + len;
+    return SNI_RMORE;
+}
+
+SniExtractorResult TlsSniExtractor::next_extension() {
+    if (m_pos == m_extensions_end) {
+        return SNI_RNOTFOUND;
+    }
+    return next_field(F_EXTENSION_HEADER, EXTENSION_HEADER_LEN, m_extensions_end);
+}
+
+SniExtractorResult TlsSniExtractor::next_server_name() {
+    if (m_pos == m_server_names_end) {
+        // Skip whatever follows the list in the extension
+        return next_field(F_EXTENSION, m_extension_end - m_pos, m_extension_end);
+    }
+    return next_field(F_SERVER_NAME_HEADER, SERVER_NAME_HEADER_LEN, m_server_names_end);
+}
+
+SniExtractorResult TlsSniExtractor::on_field(const uint8_t *s) {
+    switch (m_field) {
+    case F_HANDSHAKE_HEADER:
+        if (s[0] != HS_CLIENT_HELLO) {
+            return SNI_RERR;
+        }
+        m_hello_end = m_pos + read_u24(&s[1]);
+        return next_field(F_VERSION, 2, m_hello_end);
+    case F_VERSION:
+        if (s[0] != TLS_MAJOR_VERSION) {
+            return SNI_RERR;
+        }
+        return next_field(F_RANDOM, RANDOM_LEN, m_hello_end);
+    case F_RANDOM:
+        return next_field(F_SESSION_ID_LEN, 1, m_hello_end);
+    case F_SESSION_ID_LEN:
+        if (s[0] > MAX_SESSION_ID_LEN) {
+            return SNI_RERR;
+        }
+        return next_field(F_SESSION_ID, s[0], m_hello_end);
+    case F_SESSION_ID:
+        return next_field(F_CIPHER_SUITES_LEN, 2, m_hello_end);
+    case F_CIPHER_SUITES_LEN:
+        return next_field(F_CIPHER_SUITES, read_u16(s), m_hello_end);
+    case F_CIPHER_SUITES:
+        return next_field(F_COMPRESSION_METHODS_LEN, 1, m_hello_end);
+    case F_COMPRESSION_METHODS_LEN:
+        return next_field(F_COMPRESSION_METHODS, s[0], m_hello_end);
+    case F_COMPRESSION_METHODS:
+        if (m_pos == m_hello_end) {
+            return SNI_RNOTFOUND; // no extensions at all
+        }
+        return next_field(F_EXTENSIONS_LEN, 2, m_hello_end);
+    case F_EXTENSIONS_LEN:
+        if (read_u16(s) > m_hello_end - m_pos) {
+            return SNI_RERR;
+        }
+        m_extensions_end = m_pos + read_u16(s);
+        return next_extension();
+    case F_EXTENSION_HEADER: {
+        uint16_t len = read_u16(&s[2]);
+        if (read_u16(s) != EXT_SERVER_NAME) {
+            return next_field(F_EXTENSION, len, m_extensions_end);
+        }
+        if (len > m_extensions_end - m_pos) {
+            return SNI_RERR;
+        }
+        m_extension_end = m_pos + len;
+        return next_field(F_SERVER_NAME_LIST_LEN, 2, m_extension_end);
+    }
+    case F_EXTENSION:
+        return next_extension();
+    case F_SERVER_NAME_LIST_LEN:
+        if (read_u16(s) > m_extension_end - m_pos) {
+            return SNI_RERR;
+        }
+        m_server_names_end = m_pos + read_u16(s);
+        return next_server_name();
+    case F_SERVER_NAME_HEADER: {
+        uint16_t len = read_u16(&s[1]);
+        if (s[0] != SNI_HOST_NAME) {
+            return next_field(F_SERVER_NAME, len, m_server_names_end);
+        }
+        if (len == 0 || len > MAX_SERVER_NAME_LEN) {
+            return SNI_RNOTFOUND; // can't be a domain name
+        }
+        return next_field(F_HOST_NAME, len, m_server_names_end);
+    }
+    case F_SERVER_NAME:
+        return next_server_name();
+    case F_HOST_NAME:
+        m_name_len = m_field_end - m_field_start;
+        return SNI_RFOUND;
+    }
+
+    return SNI_RERR;
+}
+
+SniExtractorResult QuicSniExtractor::feed_initial_payload(U8View payload) {
+    struct Fragment {
+        uint64_t offset;
+        U8View data;
+    };
+
+    if (m_result != SNI_RMORE) {
+        return m_result;
+    }
+
+    // The fragments are sorted by offset, so that the ones in order are fed without copying
+    std::array<Fragment, MAX_CRYPTO_FRAMES_NUM> fragments;
+    size_t fragments_num = 0;
+    uint64_t type = 0;
+    while (read_varint(payload, type)) {
+        if (type == QFT_PADDING || type == QFT_PING) {
+            continue;
+        }
+        if (type != QFT_CRYPTO) {
+            break; // unexpected frame, can't decode the rest
+        }
+
+        uint64_t offset = 0;
+        uint64_t len = 0;
+        if (!read_varint(payload, offset) || !read_varint(payload, len) || len > payload.size()) {
+            m_result = SNI_RERR;
+            return m_result;
+        }
+        Fragment fragment = {offset, payload.substr(0, len)};
+        payload.remove_prefix(len);
+        m_seen_crypto = true;
+
+        if (fragments_num == fragments.size()) {
+            on_crypto_frame(fragment.offset, fragment.data);
+            continue;
+        }
+        size_t i = fragments_num++;
+        for (; i > 0 && fragments[i - 1].offset > fragment.offset; --i) {
+            fragments[i] = fragments[i - 1];
+        }
+        fragments[i] = fragment;
+    }
+
+    for (size_t i = 0; i < fragments_num && m_result == SNI_RMORE; ++i) {
+        on_crypto_frame(fragments[i].offset, fragments[i].data);
+    }
+
+    if (!m_seen_crypto) {
+        m_result = SNI_RNOTFOUND;
+    }
+
+    return m_result;
+}
+
+void QuicSniExtractor::on_crypto_frame(uint64_t offset, U8View data) {
+    if (m_result != SNI_RMORE || offset + data.size() <= m_offset) {
+        return;
+    }
+
+    if (offset > m_offset) {
+        // There is a gap before the fragment, keep it until the gap is filled
+        if (offset < CRYPTO_WINDOW_LEN) {
+            size_t n = std::min<size_t>(data.size(), CRYPTO_WINDOW_LEN - offset);
+            std::memcpy(&m_window[offset], data.data(), n);
+            for (size_t i = offset; i < offset + n; ++i) {
+                m_window_filled.set(i);
+            }
+        }
+        return;
+    }
+
+    data.remove_prefix(m_offset - offset);
+    m_offset += data.size();
+    m_result = m_hello.feed_handshake(data);
+
+    // The fragments received earlier may continue the fed data
+    while (m_result == SNI_RMORE && m_offset < CRYPTO_WINDOW_LEN && m_window_filled.test(m_offset)) {
+        size_t end = m_offset;
+        while (end < CRYPTO_WINDOW_LEN && m_window_filled.test(end)) {
+            ++end;
+        }
+        U8View chunk = {&m_window[m_offset], end - m_offset};
+        m_offset = end;
+        m_result = m_hello.feed_handshake(chunk);
+    }
+}
+
+} // namespace ag
@@ -0,0 +1,632 @@
+#include "ssl_session_cache.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+
+#include "common/cache.h"
+#include "common/logger.h"
+#include "common/utils.h"
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+namespace ag {
+
+using SessionPtr = DeclPtr<SSL_SESSION, &SSL_SESSION_free>;
+
+static const Logger g_logger("SSL_SESSION_CACHE");
+
+static constexpr auto SESSION_LIFETIME = std::chrono::hours(24);
+/** Number of the independently locked parts of the cache */
+static constexpr size_t SHARDS_NUM = 16;
+/** Number of the servers each shard keeps the sessions for */
+static constexpr size_t SHARD_CAPACITY = 64;
+/** Number of the sessions kept for a server */
+static constexpr size_t MAX_SESSIONS_PER_KEY = 9;
+
+static constexpr std::string_view JOURNAL_FILE_NAME = "ssl_sessions.journal";
+static constexpr std::string_view JOURNAL_TMP_FILE_NAME = "ssl_sessions.journal.tmp";
+static constexpr std::string_view JOURNAL_MAGIC = "SSLJRNL1";
+/** The journal is rewritten once it has got this many records more than the last rewrite left, at least */
+static constexpr size_t JOURNAL_COMPACT_THRESHOLD = 1024;
+/** How long the pending records may wait for the writer, which is not always woken up by the producers */
+static constexpr auto JOURNAL_FLUSH_INTERVAL = std::chrono::milliseconds(100);
+static constexpr size_t MAX_ENCODED_SESSION_LEN = 64 * 1024;
+
+/** The files with single sessions the cache was dumped to by the earlier versions */
+static constexpr std::string_view LEGACY_FILE_PREFIX = "cache_";
+static constexpr char LEGACY_INDEX_DELIMITER = '_';
+
+static bool check_session_timings(SSL_SESSION *session) {
+    auto session_created = std::chrono::seconds(SSL_SESSION_get_time(session));
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    auto session_timeout = std::chrono::seconds(SSL_SESSION_get_timeout(session));
+    if (now > session_created + SESSION_LIFETIME) {
+        return false;
+    }
+    return now < session_created + session_timeout;
+}
+
+/**
+ * The key is the SHA-256 of the server name followed by 'Q' for QUIC or 'T' for TCP,
+ * so that the names are not kept on disk
+ */
+static std::string make_key(std::string_view sni, bool quic) {
+    std::string key(SHA256_DIGEST_LENGTH + 1, '\0');
+    SHA256((const uint8_t *) sni.data(), sni.length(), (uint8_t *) key.data());
+    key.back() = quic ? 'Q' : 'T';
+    return key;
+}
+
+struct CachedSession {
+    uint64_t seq; // number of the session in the journal
+    SessionPtr session;
+};
+
+/**
+ * Helper class that allows to store
+ * multiple SSL sessions as a single unit.
+ */
+class SessionAccumulator {
+private:
+    mutable std::list<CachedSession> m_list; // the most recent first
+
+public:
+    void insert(uint64_t seq, SessionPtr session) const {
+        if (m_list.size() >= MAX_SESSIONS_PER_KEY) {
+            m_list.pop_back();
+        }
+        m_list.emplace_front(CachedSession{seq, std::move(session)});
+    }
+    std::optional<CachedSession> pop() const {
+        while (!m_list.empty()) {
+            CachedSession entry = std::move(m_list.front());
+            m_list.pop_front();
+            if (entry.session && check_session_timings(entry.session.get())) {
+                return entry;
+            }
+        }
+        return std::nullopt;
+    }
+    const auto &list() const {
+        return m_list;
+    }
+    size_t size() const {
+        return m_list.size();
+    }
+};
+
+struct alignas(64) CacheShard {
+    std::mutex mutex;
+    LruCache<std::string, SessionAccumulator> sessions{SHARD_CAPACITY};
+};
+
+static std::array<CacheShard, SHARDS_NUM> g_shards;
+/**
+ * Starts from the current time, so that the sessions cached by different runs
+ * or before the journal is loaded do not share the numbers
+ */
+static std::atomic<uint64_t> g_next_seq{uint64_t(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
+                .count())};
+
+static CacheShard &shard_of(const std::string &key) {
+    return g_shards[uint8_t(key[0]) % SHARDS_NUM];
+}
+
+/** @return number of the sessions cached for the key */
+static size_t insert_session(const std::string &key, uint64_t seq, SessionPtr session) {
+    CacheShard &shard = shard_of(key);
+    std::scoped_lock l(shard.mutex);
+    if (auto accum = shard.sessions.get(key)) {
+        accum->insert(seq, std::move(session));
+        return accum->size();
+    }
+    SessionAccumulator accum;
+    accum.insert(seq, std::move(session));
+    shard.sessions.insert(key, std::move(accum));
+    return 1;
+}
+
+enum JournalRecordType : uint8_t {
+    JRT_ADD = 1,  // a session is cached: seq, key length, key, encoded session length, encoded session
+    JRT_TAKE = 2, // a session is taken out of the cache: seq
+};
+
+static void put_uint(std::vector<uint8_t> &buffer, uint64_t value, size_t size) {
+    for (size_t i = size; i > 0; --i) {
+        buffer.push_back(uint8_t(value >> (8 * (i - 1))));
+    }
+}
+
+static std::optional<uint64_t> get_uint(U8View &data, size_t size) {
+    if (data.size() < size) {
+        return std::nullopt;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = value << 8 | data[i];
+    }
+    data.remove_prefix(size);
+    return value;
+}
+
+static void encode_add(std::vector<uint8_t> &buffer, uint64_t seq, const std::string &key, SSL_SESSION *session) {
+    int len = i2d_SSL_SESSION(session, nullptr);
+    if (len <= 0 || size_t(len) > MAX_ENCODED_SESSION_LEN) {
+        return;
+    }
+    buffer.push_back(JRT_ADD);
+    put_uint(buffer, seq, 8);
+    put_uint(buffer, key.size(), 1);
+    buffer.insert(buffer.end(), key.begin(), key.end());
+    put_uint(buffer, len, 4);
+    size_t offset = buffer.size();
+    buffer.resize(offset + len);
+    uint8_t *out = &buffer[offset];
+    if (i2d_SSL_SESSION(session, &out) != len) {
+        buffer.resize(offset - key.size() - 14);
+    }
+}
+
+static void encode_take(std::vector<uint8_t> &buffer, uint64_t seq) {
+    buffer.push_back(JRT_TAKE);
+    put_uint(buffer, seq, 8);
+}
+
+struct JournalEntry {
+    std::string key;
+    SessionPtr session;
+};
+
+/**
+ * Apply the journal records to the sessions ordered by seq. Stops at a truncated record,
+ * which is the one being written when the process died.
+ */
+static void replay_journal(U8View data, std::map<uint64_t, JournalEntry> &entries) {
+    while (!data.empty()) {
+        auto type = get_uint(data, 1);
+        auto seq = get_uint(data, 8);
+        if (!seq.has_value()) {
+            break;
+        }
+        if (type == JRT_TAKE) {
+            entries.erase(*seq);
+            continue;
+        }
+        if (type != JRT_ADD) {
+            warnlog(g_logger, "Unexpected record in SSL sessions journal: {}", *type);
+            break;
+        }
+
+        auto key_len = get_uint(data, 1);
+        if (!key_len.has_value() || data.size() < *key_len) {
+            break;
+        }
+        std::string key{(const char *) data.data(), *key_len};
+        data.remove_prefix(*key_len);
+        auto len = get_uint(data, 4);
+        if (!len.has_value() || data.size() < *len) {
+            break;
+        }
+        const uint8_t *p = data.data();
+        SessionPtr session{d2i_SSL_SESSION(nullptr, &p, long(*len))};
+        data.remove_prefix(*len);
+        if (session != nullptr && !key.empty()) {
+            entries[*seq] = {std::move(key), std::move(session)};
+        }
+    }
+}
+
+static std::optional<std::vector<uint8_t>> read_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    return std::vector<uint8_t>{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+/** Parse an index followed by the delimiter off the file name */
+static bool parse_legacy_index(std::string_view &name, size_t &index) {
+    auto [p, err] = std::from_chars(name.data(), name.data() + name.size(), index);
+    if (err != std::errc() || p == name.data() + name.size() || *p != LEGACY_INDEX_DELIMITER) {
+        return false;
+    }
+    name.remove_prefix(p - name.data() + 1);
+    return true;
+}
+
+/**
+ * Read the sessions dumped by the earlier versions, and remove the files. The order the sessions
+ * were cached in is restored from the file names: `cache_<key index>_<session index>_<hex key>`,
+ * the lower indices are the more recent.
+ */
+static void load_legacy_files(const std::filesystem::path &dir, std::map<uint64_t, JournalEntry> &entries) {
+    std::map<std::pair<size_t, size_t>, JournalEntry> legacy;
+    std::vector<std::filesystem::path> files_to_remove;
+    std::error_code ec;
+    for (const auto &file : std::filesystem::directory_iterator(dir, ec)) {
+        std::string filename = file.path().filename().string();
+        std::string_view name = filename;
+        if (!name.starts_with(LEGACY_FILE_PREFIX)) {
+            continue;
+        }
+        files_to_remove.emplace_back(file.path());
+        name.remove_prefix(LEGACY_FILE_PREFIX.size());
+
+        size_t index = 0;
+        size_t session_index = 0;
+        if (!parse_legacy_index(name, index) || !parse_legacy_index(name, session_index)) {
+            continue;
+        }
+        if (name.size() != SHA256_DIGEST_LENGTH * 2 + 1) {
+            continue;
+        }
+        std::string key(SHA256_DIGEST_LENGTH + 1, '\0');
+        for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+            std::from_chars(&name[2 * i], &name[2 * i + 2], *(uint8_t *) &key[i], 16);
+        }
+        key.back() = name.back();
+
+        std::string path = file.path().string();
+        UniquePtr<FILE, &fclose> f(fopen(path.c_str(), "r"));
+        SSL_SESSION *session = nullptr;
+        if (f != nullptr && PEM_read_SSL_SESSION(f.get(), &session, nullptr, nullptr)) {
+            legacy[{index, session_index}] = {std::move(key), SessionPtr{session}};
+        }
+    }
+    for (const auto &file : files_to_remove) {
+        std::filesystem::remove(file, ec);
+    }
+
+    uint64_t seq = entries.empty() ? 1 : entries.rbegin()->first + 1;
+    for (auto it = legacy.rbegin(); it != legacy.rend(); ++it) {
+        entries[seq++] = std::move(it->second);
+    }
+}
+
+/**
+ * Persists the cache in an append-only journal. The cache threads push the records to a lock-free
+ * stack, and a background thread writes them out in batches. Once the journal has grown enough,
+ * the writer rewrites it from the current cache contents.
+ */
+class SessionJournal {
+public:
+    SessionJournal() = default;
+    ~SessionJournal() {
+        std::scoped_lock control_lock(m_control_mutex);
+        if (m_writer.joinable()) {
+            stop();
+        }
+    }
+
+    SessionJournal(const SessionJournal &) = delete;
+    SessionJournal &operator=(const SessionJournal &) = delete;
+    SessionJournal(SessionJournal &&) = delete;
+    SessionJournal &operator=(SessionJournal &&) = delete;
+
+    /** Start persisting the cache in a directory, or add a user if it is persisted already */
+    void open(std::filesystem::path dir);
+    /** Remove a user, the last one stops persisting */
+    void close();
+
+    void add(uint64_t seq, const std::string &key, SSL_SESSION *session) {
+        if (m_active.load(std::memory_order_relaxed)) {
+            SSL_SESSION_up_ref(session);
+            push(new Record{nullptr, JRT_ADD, seq, key, SessionPtr{session}});
+        }
+    }
+
+    void take(uint64_t seq) {
+        if (m_active.load(std::memory_order_relaxed)) {
+            push(new Record{nullptr, JRT_TAKE, seq, {}, nullptr});
+        }
+    }
+
+private:
+    struct Record {
+        Record *next;
+        JournalRecordType type;
+        uint64_t seq;
+        std::string key;
+        SessionPtr session;
+    };
+
+    std::mutex m_control_mutex; // serializes `open` and `close`
+    size_t m_users_num = 0;     // number of the `open` calls not yet matched by `close`
+    std::atomic<bool> m_active{false};
+    std::atomic<Record *> m_pending{nullptr};
+    std::mutex m_mutex;
+    std::condition_variable m_cond; // signalled when the records are pushed to an empty stack or on stop
+    bool m_stopping = false;
+    std::thread m_writer;
+    // Accessed by the writer thread while it runs, and by `open` and `close` otherwise
+    std::filesystem::path m_dir;
+    UniquePtr<FILE, &fclose> m_file;
+    size_t m_records_num = 0;   // number of the records in the journal
+    size_t m_compacted_num = 0; // number of the records the last rewrite left
+
+    void push(Record *record);
+    /** Stop the writer and write the rest, `m_control_mutex` must be held */
+    void stop();
+    void run_writer();
+    void write_pending();
+    void drop_pending();
+    bool compact();
+};
+
+static SessionJournal g_journal;
+
+void SessionJournal::push(Record *record) {
+    Record *head = m_pending.load(std::memory_order_relaxed);
+    do {
+        record->next = head;
+    } while (!m_pending.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+    if (head == nullptr) {
+        m_cond.notify_one();
+    }
+}
+
+void SessionJournal::open(std::filesystem::path dir) {
+    std::scoped_lock control_lock(m_control_mutex);
+    ++m_users_num;
+    if (m_writer.joinable()) {
+        // Switching the directory under the other users would let the tickets they take escape the journal
+        if (std::error_code ec; !std::filesystem::equivalent(m_dir, dir, ec)) {
+            warnlog(g_logger, "SSL sessions are stored in {} already, ignoring {}", m_dir.string(), dir.string());
+        }
+        return;
+    }
+
+    std::error_code ec;
+    if (!std::filesystem::exists(dir, ec)) {
+        warnlog(g_logger, "SSL sessions won't be loaded and stored on disk because provided path doesn't exists: {}",
+                dir.string());
+        return;
+    }
+    m_dir = std::move(dir);
+    // Whatever was pushed after the previous journal was closed belongs to no journal
+    drop_pending();
+
+    std::map<uint64_t, JournalEntry> entries;
+    if (auto journal = read_file(m_dir / JOURNAL_FILE_NAME); journal.has_value()) {
+        U8View data = {journal->data(), journal->size()};
+        if (data.starts_with(U8View{(const uint8_t *) JOURNAL_MAGIC.data(), JOURNAL_MAGIC.size()})) {
+            data.remove_prefix(JOURNAL_MAGIC.size());
+            replay_journal(data, entries);
+        }
+    }
+    load_legacy_files(m_dir, entries);
+
+    // The sessions cached by this process already, e.g. loaded from the same journal earlier
+    std::unordered_set<uint64_t> cached_seqs;
+    for (CacheShard &shard : g_shards) {
+        std::scoped_lock l(shard.mutex);
+        shard.sessions.iterate_values([&](const std::string &, const SessionAccumulator &accum) {
+            for (const CachedSession &entry : accum.list()) {
+                cached_seqs.insert(entry.seq);
+            }
+            return true;
+        });
+    }
+
+    size_t sessions_num = 0;
+    uint64_t max_seq = 0;
+    for (auto &[seq, entry] : entries) {
+        max_seq = seq;
+        if (!cached_seqs.contains(seq) && check_session_timings(entry.session.get())) {
+            insert_session(entry.key, seq, std::move(entry.session));
+            ++sessions_num;
+        }
+    }
+    uint64_t next_seq = g_next_seq.load(std::memory_order_relaxed);
+    while (next_seq <= max_seq
+            && !g_next_seq.compare_exchange_weak(next_seq, max_seq + 1, std::memory_order_relaxed)) {
+    }
+    dbglog(g_logger, "Loaded {} SSL sessions from disk cache", sessions_num);
+
+    // Rewrite the journal right away, so that the expired sessions and a torn record are gone
+    if (!compact()) {
+        return;
+    }
+    m_stopping = false;
+    m_active.store(true, std::memory_order_relaxed);
+    m_writer = std::thread(&SessionJournal::run_writer, this);
+}
+
+void SessionJournal::close() {
+    std::scoped_lock control_lock(m_control_mutex);
+    if (m_users_num == 0) {
+        return;
+    }
+    if (--m_users_num == 0 && m_writer.joinable()) {
+        stop();
+    }
+}
+
+void SessionJournal::stop() {
+    m_active.store(false, std::memory_order_relaxed);
+    {
+        std::scoped_lock l(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_one();
+    m_writer.join();
+
+    write_pending();
+    compact();
+    m_file.reset();
+    dbglog(g_logger, "Cached {} SSL sessions on disk", m_compacted_num);
+}
+
+void SessionJournal::run_writer() {
+    for (;;) {
+        {
+            std::unique_lock l(m_mutex);
+            m_cond.wait_for(l, JOURNAL_FLUSH_INTERVAL, [this] {
+                return m_stopping || m_pending.load(std::memory_order_relaxed) != nullptr;
+            });
+            if (m_stopping) {
+                return;
+            }
+        }
+        write_pending();
+        if (m_records_num > m_compacted_num + std::max(m_compacted_num, JOURNAL_COMPACT_THRESHOLD)) {
+            compact();
+        }
+    }
+}
+
+void SessionJournal::write_pending() {
+    Record *head = m_pending.exchange(nullptr, std::memory_order_acquire);
+    // The stack has the most recent record on top, restore the order
+    Record *ordered = nullptr;
+    while (head != nullptr) {
+        Record *next = head->next;
+        head->next = ordered;
+        ordered = head;
+        head = next;
+    }
+
+    std::vector<uint8_t> buffer;
+    while (ordered != nullptr) {
+        std::unique_ptr<Record> record{ordered};
+        ordered = ordered->next;
+        if (record->type == JRT_ADD) {
+            encode_add(buffer, record->seq, record->key, record->session.get());
+        } else {
+            encode_take(buffer, record->seq);
+        }
+        ++m_records_num;
+    }
+
+    // Flushed to the system on every batch: a crashed process loses nothing written here
+    if (!buffer.empty() && m_file != nullptr
+            && (fwrite(buffer.data(), 1, buffer.size(), m_file.get()) != buffer.size() || fflush(m_file.get()) != 0)) {
+        warnlog(g_logger, "Failed to write SSL sessions journal: {}", strerror(errno));
+        m_file.reset();
+    }
+}
+
+void SessionJournal::drop_pending() {
+    Record *head = m_pending.exchange(nullptr, std::memory_order_acquire);
+    while (head != nullptr) {
+        std::unique_ptr<Record> record{head};
+        head = head->next;
+    }
+}
+
+bool SessionJournal::compact() {
+    std::vector<std::tuple<uint64_t, std::string, SessionPtr>> sessions;
+    for (CacheShard &shard : g_shards) {
+        std::scoped_lock l(shard.mutex);
+        shard.sessions.iterate_values([&](const std::string &key, const SessionAccumulator &accum) {
+            for (const CachedSession &entry : accum.list()) {
+                SSL_SESSION_up_ref(entry.session.get());
+                sessions.emplace_back(entry.seq, key, SessionPtr{entry.session.get()});
+            }
+            return true;
+        });
+    }
+    // Encoded with no shard locked
+    std::vector<uint8_t> buffer{JOURNAL_MAGIC.begin(), JOURNAL_MAGIC.end()};
+    size_t records_num = 0;
+    for (const auto &[seq, key, session] : sessions) {
+        if (check_session_timings(session.get())) {
+            encode_add(buffer, seq, key, session.get());
+            ++records_num;
+        }
+    }
+
+    m_file.reset();
+    std::filesystem::path tmp_path = m_dir / JOURNAL_TMP_FILE_NAME;
+    std::filesystem::path path = m_dir / JOURNAL_FILE_NAME;
+    std::string tmp_path_str = tmp_path.string();
+    UniquePtr<FILE, &fclose> tmp_file(fopen(tmp_path_str.c_str(), "wb"));
+    if (tmp_file == nullptr || fwrite(buffer.data(), 1, buffer.size(), tmp_file.get()) != buffer.size()
+            || fclose(tmp_file.release()) != 0) {
+        warnlog(g_logger, "Failed to write SSL sessions journal: {}", strerror(errno));
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        warnlog(g_logger, "Failed to replace SSL sessions journal: {}", ec.message());
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+
+    std::string path_str = path.string();
+    m_file.reset(fopen(path_str.c_str(), "ab"));
+    if (m_file == nullptr) {
+        warnlog(g_logger, "Failed to open SSL sessions journal: {}", strerror(errno));
+        return false;
+    }
+    m_records_num = records_num;
+    m_compacted_num = records_num;
+    return true;
+}
+
+void cache_ssl_session(std::string_view sni, bool quic, SessionPtr session) {
+    std::string key = make_key(sni, quic);
+    uint64_t seq = g_next_seq.fetch_add(1, std::memory_order_relaxed);
+    g_journal.add(seq, key, session.get());
+    size_t sessions_num = insert_session(key, seq, std::move(session));
+    dbglog(g_logger, "{} sessions remaining for SNI: {}, QUIC: {}", sessions_num, sni, quic);
+}
+
+SessionPtr pop_cached_ssl_session(std::string_view sni, bool quic) {
+    std::string key = make_key(sni, quic);
+    CacheShard &shard = shard_of(key);
+    std::optional<CachedSession> entry;
+    size_t sessions_num = 0;
+    {
+        std::scoped_lock l(shard.mutex);
+        auto accum = shard.sessions.get(key);
+        if (!accum) {
+            return nullptr;
+        }
+        entry = accum->pop();
+        sessions_num = accum->size();
+        if (sessions_num == 0) {
+            shard.sessions.erase(key);
+        }
+    }
+    dbglog(g_logger, "{} sessions remaining for SNI: {}, QUIC: {}", sessions_num, sni, quic);
+    if (!entry.has_value()) {
+        return nullptr;
+    }
+    // A ticket is not to be reused, even after a restart
+    g_journal.take(entry->seq);
+    return std::move(entry->session);
+}
+
+void load_ssl_session_cache(const std::string &dir) {
+    g_journal.open(dir);
+}
+
+void close_ssl_session_cache() {
+    g_journal.close();
+}
+
+} // namespace ag
+// NOLINTEND(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <openssl/ssl.h>
+
+#include "vpn/utils.h"
+
+namespace ag {
+
+/**
+ * Put a client session into the process-wide cache. The sessions are keyed by the server name and
+ * whether they belong to a QUIC connection. The cache is split into independently locked shards by
+ * the key hash, so the handshakes to different servers do not contend.
+ * If the cache is persisted (see `load_ssl_session_cache`), the session is appended to the journal
+ * by the background writer.
+ */
+void cache_ssl_session(std::string_view sni, bool quic, DeclPtr<SSL_SESSION, &SSL_SESSION_free> session);
+
+/**
+ * Take the most recent valid session for a server out of the cache, as the tickets are meant to be used once
+ * @return null if there is none
+ */
+DeclPtr<SSL_SESSION, &SSL_SESSION_free> pop_cached_ssl_session(std::string_view sni, bool quic);
+
+/**
+ * Load the sessions persisted in a directory into the cache, and start persisting the cache there.
+ * The changes are appended to a journal file as they happen, so the sessions survive a crash.
+ * The calls are counted: if the cache is persisted already, only the number of the users grows.
+ * Each call must be matched by `close_ssl_session_cache`.
+ */
+void load_ssl_session_cache(const std::string &dir);
+
+/**
+ * Release a user of the persisted cache. Once the last one is gone, write the pending changes,
+ * compact the journal and stop persisting the cache.
+ */
+void close_ssl_session_cache();
+
+} // namespace ag
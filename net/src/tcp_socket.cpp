@@ -278,6 +278,19 @@ VpnError tcp_socket_write(TcpSocket *socket, const uint8_t *data, size_t length)
     return error;
 }
 
+VpnError tcp_socket_write_buffer(TcpSocket *socket, struct evbuffer *buffer) {
+    struct bufferevent *bev = socket->bev;
+
+    VpnError error = {bufferevent_write_buffer(bev, buffer), ""};
+    if (error.code == 0) {
+        tcp_socket_update_timeout(socket);
+    } else {
+        error = make_vpn_error_from_fd(bufferevent_getfd(bev));
+    }
+
+    return error;
+}
+
 size_t tcp_socket_available_to_write(const TcpSocket *socket) {
     size_t write_queue_size = evbuffer_get_length(bufferevent_get_output(socket->bev));
     return (write_queue_size <= MAX_WRITE_BUFFER_LEN) ? MAX_WRITE_BUFFER_LEN - write_queue_size : 0;
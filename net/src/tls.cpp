@@ -547,36 +547,104 @@ static int exts_data(TlsReader *reader, U8View data) {
     return TLS_RDONE;
 }
 
-/** Get X509 object from raw data. */
-static X509 *ossl_cert_decode(const uint8_t *data, size_t len) {
-    BIO *b = BIO_new(BIO_s_mem());
-    if (b == nullptr) {
-        return nullptr;
+typedef enum {
+    DER_INTEGER = 0x02,
+    DER_OID = 0x06,
+    DER_SEQUENCE = 0x30,
+    DER_SET = 0x31,
+    DER_EXPLICIT_0 = 0xa0,
+} DerTag;
+
+/** DER encoding of the commonName attribute type (2.5.4.3) */
+static constexpr uint8_t OID_COMMON_NAME[] = {0x55, 0x04, 0x03};
+
+/**
+Read the DER element at the start of `data`: set its tag and contents and advance `data` past it.
+Return false on malformed data. */
+static bool der_next(U8View &data, uint8_t *tag, U8View *contents) {
+    // NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    if (data.size() < 2 || (data[0] & 0x1f) == 0x1f) { // the multi-byte tags are not used in the certificate name
+        return false;
+    }
+
+    size_t len = data[1];
+    size_t header_len = 2;
+    if (len & 0x80) {
+        size_t len_bytes = len & 0x7f;
+        if (len_bytes == 0 || len_bytes > sizeof(uint32_t) || data.size() < 2 + len_bytes) {
+            return false; // indefinite length is not allowed in DER
+        }
+        len = 0;
+        for (size_t i = 0; i < len_bytes; ++i) {
+            len = len << 8 | data[2 + i];
+        }
+        header_len += len_bytes;
     }
+    // NOLINTEND(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
 
-    BIO_write(b, data, static_cast<int>(len));
-    X509 *x = d2i_X509_bio(b, nullptr);
-    BIO_free(b);
-    return x;
+    if (len > data.size() - header_len) {
+        return false;
+    }
+
+    *tag = data[0];
+    *contents = data.substr(header_len, len);
+    data.remove_prefix(header_len + len);
+    return true;
+}
+
+/** Read the DER element with the expected tag. */
+static bool der_expect(U8View &data, uint8_t tag, U8View *contents) {
+    uint8_t t = 0;
+    return der_next(data, &t, contents) && t == tag;
 }
 
-/** Set subject.CN data. */
-static int ossl_cert_subj_CN(TlsReader *reader, X509 *x) {
-    X509_NAME *subj = X509_get_subject_name(x);
-    if (subj == nullptr) {
+/**
+Find subject.CN walking the DER encoded certificate, without decoding the whole certificate.
+Return 0 on success;  <0 on error. */
+static int der_cert_subj_CN(TlsReader *reader, U8View data) {
+    U8View cert;
+    U8View tbs;
+    if (!der_expect(data, DER_SEQUENCE, &cert) || !der_expect(cert, DER_SEQUENCE, &tbs)) {
         return -1;
     }
 
-    reader->x509_subject_common_name.resize(1024);
-    int n = X509_NAME_get_text_by_NID(subj, NID_commonName, reader->x509_subject_common_name.data(),
-            int(reader->x509_subject_common_name.size()));
-    if (n < 0) {
-        reader->x509_subject_common_name.resize(0);
+    // version, serialNumber, signature, issuer, validity, subject
+    uint8_t tag = 0;
+    U8View field;
+    if (!der_next(tbs, &tag, &field)) {
         return -1;
     }
+    if (tag == DER_EXPLICIT_0 && !der_next(tbs, &tag, &field)) {
+        return -1;
+    }
+    U8View subject;
+    if (tag != DER_INTEGER || !der_expect(tbs, DER_SEQUENCE, &field) || !der_expect(tbs, DER_SEQUENCE, &field)
+            || !der_expect(tbs, DER_SEQUENCE, &field) || !der_expect(tbs, DER_SEQUENCE, &subject)) {
+        return -1;
+    }
+
+    // Name ::= SEQUENCE OF SET OF SEQUENCE { type OBJECT IDENTIFIER, value ANY }
+    while (!subject.empty()) {
+        U8View rdn;
+        if (!der_expect(subject, DER_SET, &rdn)) {
+            return -1;
+        }
+        while (!rdn.empty()) {
+            U8View attr;
+            U8View type;
+            U8View value;
+            if (!der_expect(rdn, DER_SEQUENCE, &attr) || !der_expect(attr, DER_OID, &type)
+                    || !der_next(attr, &tag, &value)) {
+                return -1;
+            }
+            if (type == U8View{OID_COMMON_NAME, std::size(OID_COMMON_NAME)}) {
+                reader->x509_subject_common_name.assign((char *) value.data(), value.size());
+                return 0;
+            }
+        }
+    }
 
-    reader->x509_subject_common_name.resize(n);
-    return 0;
+    return -1;
 }
 
 /** Parse certificates.
@@ -599,14 +667,7 @@ static int certs_parse(TlsReader *reader, U8View data) {
 
     d += TLS_LENGTH_24_SIZE;
 
-    X509 *x = ossl_cert_decode(d, size);
-    if (x == nullptr) {
-        return -1;
-    }
-
-    int r = ossl_cert_subj_CN(reader, x);
-    X509_free(x);
-    if (r != 0) {
+    if (0 != der_cert_subj_CN(reader, {d, size_t(size)})) {
         return -1;
     }
 
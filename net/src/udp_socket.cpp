@@ -1,12 +1,27 @@
 #include "net/udp_socket.h"
 
 #include <atomic>
+#include <cassert>
+#include <cstring>
 #include <optional>
 #include <utility>
 
 #include <event2/event.h>
 #include <event2/util.h>
 
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // from `linux/udp.h`, since Linux 4.18
+#endif
+#endif
+
 #include "common/logger.h"
 
 static ag::Logger g_logger{"UDP_SOCKET"};
@@ -22,6 +37,13 @@ static constexpr int MAX_DATAGRAM_PROCESS_DELAY_SECS = 10;
 
 static constexpr size_t LOG_ID_PREFIX_SIZE = 11;
 
+#ifdef __linux__
+// The kernel limits a segmented send to 64 segments (`UDP_MAX_SEGMENTS`) and to the maximum UDP payload size
+// (without the UDP and IPv6 headers)
+static_assert(ag::UDP_SOCKET_MAX_BATCH <= 64);
+static_assert(ag::UDP_SOCKET_MAX_BATCH * ag::QUIC_MAX_UDP_PAYLOAD_SIZE <= ag::UDP_MAX_DATAGRAM_SIZE - 8 - 40);
+#endif
+
 namespace ag {
 
 struct UdpSocket {
@@ -29,6 +51,7 @@ struct UdpSocket {
     struct timeval timeout_ts;
     UdpSocketParameters parameters;
     std::optional<int> subscribe_id;
+    bool gso_enabled; // the same-sized datagrams may be sent in a single segmented message
     char log_id[LOG_ID_PREFIX_SIZE + SOCKADDR_STR_BUF_SIZE];
 };
 
@@ -141,6 +164,12 @@ static UdpSocket *udp_socket_create_inner(const UdpSocketParameters *parameters,
                     err);
         }
 
+#ifdef __linux__
+        // Setting zero segment size only checks that the kernel supports `UDP_SEGMENT`
+        int segment_size = 0;
+        sock->gso_enabled = 0 == setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size));
+#endif
+
 #ifdef __MACH__
         int enabled = 1;
         if (0 != setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &enabled, sizeof(enabled))) {
@@ -230,6 +259,93 @@ VpnError udp_socket_write(UdpSocket *socket, const uint8_t *data, size_t length)
     return error;
 }
 
+#ifdef __linux__
+
+VpnError udp_socket_write_batch(UdpSocket *socket, const uint8_t *buffer, const size_t *lengths, size_t count) {
+    assert(count <= UDP_SOCKET_MAX_BATCH);
+
+    iovec iovs[UDP_SOCKET_MAX_BATCH];
+    mmsghdr msgs[UDP_SOCKET_MAX_BATCH] = {};
+    alignas(cmsghdr) uint8_t controls[UDP_SOCKET_MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))] = {};
+    size_t msgs_num = 0;
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i] = {.iov_base = (void *) buffer, .iov_len = lengths[i]};
+        buffer += lengths[i];
+
+        // A segmented message consists of the datagrams of the same size, only the last one may be shorter
+        msghdr *prev = (msgs_num > 0) ? &msgs[msgs_num - 1].msg_hdr : nullptr;
+        if (socket->gso_enabled && prev != nullptr && lengths[i] <= prev->msg_iov[0].iov_len
+                && prev->msg_iov[prev->msg_iovlen - 1].iov_len == prev->msg_iov[0].iov_len) {
+            prev->msg_iovlen += 1;
+            continue;
+        }
+
+        msgs[msgs_num++].msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1};
+    }
+
+    for (size_t i = 0; i < msgs_num; ++i) {
+        msghdr *hdr = &msgs[i].msg_hdr;
+        if (hdr->msg_iovlen > 1) {
+            hdr->msg_control = controls[i];
+            hdr->msg_controllen = sizeof(controls[i]);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            auto segment_size = uint16_t(hdr->msg_iov[0].iov_len);
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+    }
+
+    VpnError error = {};
+    evutil_socket_t fd = event_get_fd(socket->event);
+    for (size_t sent = 0; sent < msgs_num;) {
+        int r = sendmmsg(fd, &msgs[sent], msgs_num - sent, 0);
+        if (r >= 0) {
+            sent += r;
+            continue;
+        }
+
+        int err_code = evutil_socket_geterror(fd);
+        if (err_code == AG_EINTR) {
+            continue;
+        }
+        if (AG_ERR_IS_EAGAIN(err_code)) {
+            log_sock(socket, dbg, "Dropping {} messages due to system buffer overflow", msgs_num - sent);
+            break;
+        }
+        if (err_code == EIO && socket->gso_enabled) {
+            // The network device can't checksum the segments, so resend the rest one by one
+            log_sock(socket, dbg, "Segmentation offload is not supported by device, disabling it");
+            socket->gso_enabled = false;
+            size_t first = msgs[sent].msg_hdr.msg_iov - iovs;
+            return udp_socket_write_batch(socket, (uint8_t *) iovs[first].iov_base, &lengths[first], count - first);
+        }
+        error = make_vpn_from_socket_error(err_code);
+        break;
+    }
+
+    if (error.code == 0) {
+        socket->timeout_ts = get_next_timeout_ts(socket);
+    }
+
+    return error;
+}
+
+#else // __linux__
+
+VpnError udp_socket_write_batch(UdpSocket *socket, const uint8_t *buffer, const size_t *lengths, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (VpnError error = udp_socket_write(socket, buffer, lengths[i]); error.code != 0) {
+            return error;
+        }
+        buffer += lengths[i];
+    }
+    return {};
+}
+
+#endif // __linux__
+
 evutil_socket_t udp_socket_get_fd(const UdpSocket *socket) {
     return event_get_fd(socket->event);
 }
@@ -281,6 +397,43 @@ ssize_t udp_socket_recv(UdpSocket *socket, uint8_t *buffer, size_t cap) {
     return ret;
 }
 
+ssize_t udp_socket_recv_batch(UdpSocket *socket, uint8_t *buffer, size_t cap, size_t *lengths, size_t count) {
+    assert(count <= UDP_SOCKET_MAX_BATCH);
+
+#ifdef __linux__
+    evutil_socket_t fd = udp_socket_get_fd(socket);
+
+    iovec iovs[UDP_SOCKET_MAX_BATCH];
+    mmsghdr msgs[UDP_SOCKET_MAX_BATCH] = {};
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i] = {.iov_base = &buffer[i * cap], .iov_len = cap};
+        msgs[i].msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1};
+    }
+
+    int ret; // NOLINT(cppcoreguidelines-init-variables)
+    do {
+        ret = recvmmsg(fd, msgs, count, 0, nullptr);
+    } while (ret < 0 && AG_EINTR == evutil_socket_geterror(fd));
+
+    for (int i = 0; i < ret; ++i) {
+        lengths[i] = msgs[i].msg_len;
+    }
+
+    return ret;
+#else
+    size_t received = 0;
+    for (; received < count; ++received) {
+        ssize_t ret = udp_socket_recv(socket, &buffer[received * cap], cap);
+        if (ret < 0) {
+            return (received > 0) ? ssize_t(received) : ret;
+        }
+        lengths[received] = ret;
+    }
+
+    return ssize_t(received);
+#endif
+}
+
 void udp_socket_set_timeout(UdpSocket *socket, Millis timeout) {
     if (!socket->parameters.socket_manager) {
         return;
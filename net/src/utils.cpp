@@ -5,10 +5,7 @@
 #include <cctype>
 #include <chrono>
 #include <cstring>
-#include <filesystem>
-#include <fstream>
 #include <openssl/rand.h>
-#include <set>
 #include <span>
 #include <tuple>
 #include <unordered_map>
@@ -34,13 +31,13 @@
 #include <magic_enum/magic_enum.hpp>
 #include <openssl/ssl.h>
 
-#include "common/cache.h"
 #include "common/logger.h"
 #include "common/net_utils.h"
 #include "common/utils.h"
 #include "net/dns_utils.h"
 #include "net/http_header.h"
 #include "net/http_session.h"
+#include "ssl_session_cache.h"
 #include "vpn/platform.h"
 #include "vpn/utils.h"
 
@@ -610,91 +607,9 @@ bool is_private_or_linklocal_ipv4_address(const in_addr *ip_ptr) {
             || ((ip_int & 0xFFFF0000) == 0xC0A80000); // 192.168.0.0/16
 }
 
-static constexpr auto SESSION_LIFETIME = std::chrono::hours(24);
-
-static bool check_session_timings(SSL_SESSION *session) {
-    auto session_created = std::chrono::seconds(SSL_SESSION_get_time(session));
-    auto now = std::chrono::system_clock::now().time_since_epoch();
-    auto session_timeout = std::chrono::seconds(SSL_SESSION_get_timeout(session));
-    if (now > session_created + SESSION_LIFETIME) {
-        return false;
-    }
-    return now < session_created + session_timeout;
-}
-
-/**
- * Helper class that allows to store
- * multiple SSL sessions as a single unit.
- */
-class SessionAccumulator {
-private:
-    size_t m_max_size;
-    mutable std::list<DeclPtr<SSL_SESSION, &SSL_SESSION_free>> m_list;
-    static constexpr auto DEFAULT_MAX_SIZE = 9;
-
-public:
-    explicit SessionAccumulator(size_t max_size = DEFAULT_MAX_SIZE)
-            : m_max_size(max_size) {
-    }
-    void insert(DeclPtr<SSL_SESSION, &SSL_SESSION_free> session) const {
-        if (m_list.size() >= m_max_size && !m_list.empty()) {
-            m_list.pop_back();
-        }
-        m_list.emplace_front(std::move(session));
-    }
-    DeclPtr<SSL_SESSION, &SSL_SESSION_free> pop() const {
-        while (!m_list.empty()) {
-            auto session = std::move(m_list.front());
-            m_list.pop_front();
-            if (session && check_session_timings(session.get())) {
-                return session;
-            }
-        }
-        return nullptr;
-    }
-    const auto &list() const {
-        return m_list;
-    }
-    size_t size() const {
-        return m_list.size();
-    }
-};
-
-static std::mutex g_session_cache_mutex;
-static LruCache<std::string, SessionAccumulator> g_session_cache;
-
-static std::string session_cache_key(std::string_view sni, bool quic) {
-    uint8_t sni_hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char *) sni.data(), sni.length(), sni_hash);
-
-    std::string key;
-    key.reserve(SHA256_DIGEST_LENGTH * 2 + 1);
-
-    static constexpr char hex[] = "0123456789ABCDEF";
-    for (size_t i = 0; i != sizeof(sni_hash); i++) {
-        key += hex[sni_hash[i] >> 4];
-        key += hex[sni_hash[i] & 0x0f];
-    }
-
-    key += quic ? "Q" : "T";
-
-    return key;
-}
-
 static int cache_session(SSL *ssl, SSL_SESSION *session, bool quic) {
-    std::lock_guard l{g_session_cache_mutex};
     if (const char *hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name)) {
-        auto key = session_cache_key(hostname, quic);
-        if (auto accum = g_session_cache.get(key)) {
-            accum->insert(DeclPtr<SSL_SESSION, &SSL_SESSION_free>{session});
-            dbglog(g_logger, "{} sessions remaining for SNI: {}, QUIC: {}", accum->list().size(), hostname, quic);
-        } else {
-            SessionAccumulator session_accum;
-            session_accum.insert(DeclPtr<SSL_SESSION, &SSL_SESSION_free>{session});
-            dbglog(g_logger, "{} sessions remaining for SNI: {}, QUIC: {}", session_accum.list().size(), hostname,
-                    quic);
-            g_session_cache.insert(key, std::move(session_accum));
-        }
+        cache_ssl_session(hostname, quic, DeclPtr<SSL_SESSION, &SSL_SESSION_free>{session});
         return 1;
     }
     return 0;
@@ -708,169 +623,12 @@ static int cache_session_tcp_cb(SSL *ssl, SSL_SESSION *session) {
     return cache_session(ssl, session, /*quic*/ false);
 }
 
-static DeclPtr<SSL_SESSION, &SSL_SESSION_free> pop_session_from_cache(const std::string &sni, bool quic) {
-    auto key = session_cache_key(sni, quic);
-    std::lock_guard l{g_session_cache_mutex};
-    if (auto it = g_session_cache.get(key)) {
-        auto session = it->pop();
-        dbglog(g_logger, "{} sessions remaining for SNI: {}, QUIC: {}", it->list().size(), sni, quic);
-        if (it->size() == 0) {
-            g_session_cache.erase(key);
-        }
-        return session;
-    }
-    return nullptr;
-}
-
-class SessionStorage {
-public:
-    explicit SessionStorage(std::filesystem::path path)
-            : m_dir(std::move(path)) {
-    }
-    void load_ssl_cache() {
-        if (!exists(m_dir)) {
-            warnlog(g_logger,
-                    "SSL sessions won't be loaded and stored on disk because provided path doesn't exists: {}",
-                    m_dir.string());
-            return;
-        }
-        std::lock_guard l{g_session_cache_mutex};
-        std::map<size_t, std::pair<std::string, std::map<size_t, DeclPtr<SSL_SESSION, &SSL_SESSION_free>>>>
-                sorted_cache;
-        std::set<std::filesystem::path> files_to_remove;
-        size_t sessions_counter = 0;
-
-        for (const auto &entry : std::filesystem::directory_iterator(m_dir)) {
-            auto filename = entry.path().filename().string();
-            auto parsed_filename = parse_filename(filename);
-            if (!parsed_filename) {
-                continue;
-            }
-            files_to_remove.emplace(entry.path());
-            auto session = read_session(entry.path());
-            if (session && check_session_timings(session.get())) {
-                sessions_counter++;
-                auto entry = sorted_cache.find(parsed_filename->index);
-                if (entry == sorted_cache.end()) {
-                    entry = sorted_cache
-                                    .insert(std::pair{parsed_filename->index,
-                                            std::pair{parsed_filename->key,
-                                                    std::map<size_t, DeclPtr<SSL_SESSION, &SSL_SESSION_free>>{}}})
-                                    .first;
-                    entry->second.first = parsed_filename->key;
-                }
-                entry->second.second.insert({parsed_filename->session_index, std::move(session)});
-            }
-        }
-        dbglog(g_logger, "Loaded {} SSL sessions for {} domains from disk cache", sessions_counter,
-                sorted_cache.size());
-        for (const auto &file : files_to_remove) {
-            std::error_code ec;
-            std::filesystem::remove(file, ec);
-        }
-        // Reversly build cache so last inserted session will become MRU
-        for (auto itr = sorted_cache.rbegin(); itr != sorted_cache.rend(); itr++) {
-            auto &[cache_key, sessions] = itr->second;
-            SessionAccumulator session_accum;
-            for (auto s_itr = sessions.rbegin(); s_itr != sessions.rend(); s_itr++) {
-                session_accum.insert(std::move(s_itr->second));
-            }
-            g_session_cache.insert(cache_key, std::move(session_accum));
-        }
-    }
-
-    void save_ssl_cache() {
-        if (!exists(m_dir)) {
-            return;
-        }
-        std::lock_guard l{g_session_cache_mutex};
-        size_t sessions_counter = 0;
-        size_t key_index = 0;
-        g_session_cache.iterate_values([&](const std::string &cache_key, const SessionAccumulator &accum) {
-            size_t session_index = 0;
-            for (const auto &session : accum.list()) {
-                if (session && check_session_timings(session.get())) {
-                    auto key = std::string(FILE_PREFIX) + std::to_string(key_index) + INDEX_DELIMETER
-                            + std::to_string(session_index) + INDEX_DELIMETER + cache_key;
-                    write_session(m_dir / key, session.get());
-                    session_index++;
-                }
-            }
-            key_index++;
-            sessions_counter += session_index;
-            return true;
-        });
-        dbglog(g_logger, "Cached {} SSL sessions on disk", sessions_counter);
-    }
-
-private:
-    static constexpr std::string_view FILE_PREFIX = "cache_";
-    static constexpr char INDEX_DELIMETER = '_';
-
-    struct FileNameEntry {
-        size_t index;
-        size_t session_index;
-        std::string_view key;
-    };
-    std::optional<FileNameEntry> parse_filename(std::string_view filename) {
-        if (!filename.starts_with(FILE_PREFIX)) {
-            return std::nullopt;
-        }
-        filename.remove_prefix(FILE_PREFIX.size());
-        auto index_str = filename.substr(0, filename.find_first_of(INDEX_DELIMETER));
-        size_t index = 0;
-        auto ec = std::from_chars(index_str.data(), index_str.data() + index_str.size(), index).ec;
-        if (ec != std::errc()) {
-            return std::nullopt;
-        }
-        filename.remove_prefix(index_str.size() + 1);
-        auto session_index_str = filename.substr(0, filename.find_first_of(INDEX_DELIMETER));
-        size_t session_index = 0;
-        ec = std::from_chars(
-                session_index_str.data(), session_index_str.data() + session_index_str.size(), session_index)
-                     .ec;
-        if (ec != std::errc()) {
-            return std::nullopt;
-        }
-        auto hash = filename.substr(session_index_str.size() + 1);
-        return FileNameEntry{index, session_index, hash};
-    }
-
-    DeclPtr<SSL_SESSION, &SSL_SESSION_free> read_session(const std::filesystem::path &path) {
-        if (!exists(path)) {
-            return nullptr;
-        }
-        auto path_str = path.string();
-        ag::UniquePtr<FILE, &fclose> f(fopen(path_str.c_str(), "r"));
-        if (!f) {
-            return nullptr;
-        }
-        SSL_SESSION *session = nullptr;
-        if (PEM_read_SSL_SESSION(f.get(), &session, nullptr, nullptr)) {
-            return DeclPtr<SSL_SESSION, &SSL_SESSION_free>{session};
-        }
-        return nullptr;
-    }
-    void write_session(const std::filesystem::path &path, SSL_SESSION *session) {
-        auto path_str = path.string();
-        ag::UniquePtr<FILE, &fclose> f(fopen(path_str.c_str(), "w"));
-        if (!f) {
-            return;
-        }
-        if (!PEM_write_SSL_SESSION(f.get(), session)) {
-            remove(path);
-        }
-    }
-
-    std::filesystem::path m_dir;
-};
-
-void dump_session_cache(const std::string &path) {
-    SessionStorage(path).save_ssl_cache();
+void release_session_cache() {
+    close_ssl_session_cache();
 }
 
 void load_session_cache(const std::string &path) {
-    SessionStorage(path).load_ssl_cache();
+    load_ssl_session_cache(path);
 }
 
 #ifdef OPENSSL_IS_BORINGSSL
@@ -929,7 +687,9 @@ std::variant<SslPtr, std::string> make_ssl(int (*verification_callback)(X509_STO
         return "Failed to set ALPN protocols";
     }
 
-    SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_CLIENT);
+    // The sessions are kept in our own cache. The internal one would only mark them non-resumable
+    // once the context is freed along with the connection.
+    SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
     SSL_CTX_sess_set_new_cb(ctx.get(), quic ? cache_session_quic_cb : cache_session_tcp_cb);
 
 // Mimic Chrome's ClientHello if we are using BoringSSL.
@@ -1046,7 +806,7 @@ std::variant<SslPtr, std::string> make_ssl(int (*verification_callback)(X509_STO
 
     SSL_set_connect_state(ssl.get());
 
-    if (auto session = pop_session_from_cache(sni, quic)) {
+    if (auto session = pop_cached_ssl_session(sni, quic)) {
         SSL_set_session(ssl.get(), session.get()); // Callee uprefs session.
     }
 
@@ -1,4 +1,8 @@
 #include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -234,3 +238,240 @@ TEST_F(DNSUtilsEncode, AAAA) {
     ASSERT_EQ(pkt.size(), std::size(EXPECTED));
     ASSERT_EQ(0, memcmp(pkt.data() + 2, EXPECTED + 2, pkt.size() - 2)); // don't check ID
 }
+
+// A response to an HTTPS query with the "alpn", "ech" and "ipv4hint" parameters, followed by a CNAME record
+// and an A record, the owner of which is compressed with a pointer to the name past the "ech" parameter
+static constexpr uint8_t HTTPS_RESPONSE[] = {
+        // DNS header
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,
+        // Question: "example.com." HTTPS IN (offset 12)
+        0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x41, 0x00, 0x01,
+        // Answer: "example.com." HTTPS IN 300 (offset 29)
+        0xc0, 0x0c, 0x00, 0x41, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x1a,
+        0x00, 0x01, 0x00,                                     // priority = 1, target = "."
+        0x00, 0x01, 0x00, 0x03, 0x02, 0x68, 0x32,             // alpn = "h2"
+        0x00, 0x05, 0x00, 0x04, 0xde, 0xad, 0xbe, 0xef,       // ech
+        0x00, 0x04, 0x00, 0x04, 0x01, 0x02, 0x03, 0x04,       // ipv4hint = 1.2.3.4
+        // Answer: "www.example.com." CNAME IN 60 "example.com." (offset 67)
+        0x03, 0x77, 0x77, 0x77, 0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x02, 0xc0, 0x0c,
+        // Answer: "www.example.com." A IN 60 93.184.216.34
+        0xc0, 0x43, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04, 0x5d, 0xb8, 0xd8, 0x22};
+
+static constexpr uint8_t CNAME_RESPONSE[] = {0x96, 0xf0, 0x81, 0xa0, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x01,
+        0x03, 0x77, 0x77, 0x77, 0x04, 0x68, 0x61, 0x62, 0x72, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01,
+        0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0d, 0xfd, 0x00, 0x02, 0xc0, 0x10, 0xc0, 0x10, 0x00, 0x01,
+        0x00, 0x01, 0x00, 0x00, 0x0d, 0xfd, 0x00, 0x04, 0xb2, 0xf8, 0xed, 0x44, 0x00, 0x00, 0x29, 0x02, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00};
+
+// The names and the addresses the same way `decode_packet()` collects them
+static std::optional<dns_utils::DecodedReply> read_reply(U8View message) {
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse(message);
+    if (!reader.has_value() || !reader->is_response() || reader->rcode() != 0 || !reader->has_question()) {
+        return std::nullopt;
+    }
+
+    dns_utils::DecodedReply reply;
+    reply.id = reader->id();
+    reply.question_type = reader->question_record_type();
+    dns_utils::NameText name;
+    auto add_name = [&](size_t offset) {
+        reader->read_name(offset, name);
+        if (std::find(reply.names.begin(), reply.names.end(), name.view()) == reply.names.end()) {
+            reply.names.emplace_back(name.view());
+        }
+    };
+    reader->for_each_answer([&](const dns_utils::RecordView &record) {
+        switch (record.type) {
+        case 1:  // A
+        case 28: // AAAA
+            if (record.rdata_length == ((record.type == 1) ? 4 : 16)) {
+                add_name(record.owner);
+                U8View ip = reader->rdata(record);
+                reply.addresses.push_back({{ip.begin(), ip.end()}, std::chrono::seconds(record.ttl)});
+            }
+            break;
+        case 5: // CNAME
+            if (record.rdata_length > 0) {
+                add_name(record.owner);
+                add_name(record.rdata);
+            }
+            break;
+        case 64: // SVCB
+        case 65: // HTTPS
+            add_name(record.owner);
+            break;
+        default:
+            break;
+        }
+    });
+    return reply;
+}
+
+static std::string pkt_to_string(U8View message) {
+    dns_utils::LdnsPktPtr pkt = dns_utils::decode_pkt(message);
+    if (pkt == nullptr) {
+        return "";
+    }
+    DeclPtr<char, &free> str{ldns_pkt2str(pkt.get())};
+    return str.get();
+}
+
+class DNSUtilsReader : public ::testing::Test {
+protected:
+    void SetUp() override {
+#ifdef _WIN32
+        WSADATA wsa_data = {};
+        ASSERT_EQ(0, WSAStartup(MAKEWORD(2, 2), &wsa_data));
+#endif
+    }
+
+    // Compare the reader with `decode_packet()` if both succeed
+    static void check_same_as_ldns(U8View message) {
+        std::optional<dns_utils::DecodedReply> reply = read_reply(message);
+        dns_utils::DecodeResult result = dns_utils::decode_packet(message);
+        auto *expected = std::get_if<dns_utils::DecodedReply>(&result);
+        if (!reply.has_value() || expected == nullptr) {
+            return;
+        }
+        ASSERT_EQ(reply->id, expected->id);
+        ASSERT_EQ(reply->question_type, expected->question_type);
+        ASSERT_EQ(reply->names, expected->names);
+        ASSERT_EQ(reply->addresses.size(), expected->addresses.size());
+        for (size_t i = 0; i < reply->addresses.size(); ++i) {
+            ASSERT_EQ(reply->addresses[i].ip, expected->addresses[i].ip);
+            ASSERT_EQ(reply->addresses[i].ttl, expected->addresses[i].ttl);
+        }
+    }
+};
+
+TEST_F(DNSUtilsReader, Cname) {
+    std::optional<dns_utils::DecodedReply> reply = read_reply({CNAME_RESPONSE, std::size(CNAME_RESPONSE)});
+    ASSERT_TRUE(reply.has_value());
+    ASSERT_EQ(reply->id, 0x96f0);
+    ASSERT_EQ(reply->question_type, dns_utils::RT_A);
+    ASSERT_EQ(reply->names, (std::vector<std::string>{"www.habr.com", "habr.com"}));
+    ASSERT_EQ(reply->addresses.size(), 1);
+    SocketAddress ip({reply->addresses[0].ip.data(), reply->addresses[0].ip.size()}, 0);
+    ASSERT_EQ(ip.str(), "178.248.237.68:0");
+    ASSERT_EQ(reply->addresses[0].ttl, std::chrono::seconds(3581));
+    check_same_as_ldns({CNAME_RESPONSE, std::size(CNAME_RESPONSE)});
+}
+
+TEST_F(DNSUtilsReader, Request) {
+    dns_utils::EncodeResult result = dns_utils::encode_request({dns_utils::RT_AAAA, "example.com"});
+    const auto &request = std::get<dns_utils::EncodedRequest>(result);
+
+    std::optional<dns_utils::MessageReader> reader
+            = dns_utils::MessageReader::parse({request.data.data(), request.data.size()});
+    ASSERT_TRUE(reader.has_value());
+    ASSERT_EQ(reader->id(), request.id);
+    ASSERT_FALSE(reader->is_response());
+    ASSERT_TRUE(reader->has_question());
+    ASSERT_EQ(reader->question_record_type(), dns_utils::RT_AAAA);
+    dns_utils::NameText name;
+    reader->question_name(name);
+    ASSERT_EQ(name.view(), "example.com");
+    ASSERT_STREQ(name.c_str(), "example.com");
+}
+
+TEST_F(DNSUtilsReader, EscapedName) {
+    static constexpr uint8_t REQUEST[] = {0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x04, 'a', '.', ' ', 0x01, 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01};
+
+    std::optional<dns_utils::MessageReader> reader = dns_utils::MessageReader::parse({REQUEST, std::size(REQUEST)});
+    ASSERT_TRUE(reader.has_value());
+    dns_utils::NameText name;
+    reader->question_name(name);
+    ASSERT_EQ(name.view(), "a\\.\\032\\001.com");
+
+    dns_utils::DecodeResult result = dns_utils::decode_packet({REQUEST, std::size(REQUEST)});
+    ASSERT_EQ(std::get<dns_utils::DecodedRequest>(result).name, name.view());
+}
+
+TEST_F(DNSUtilsReader, Malformed) {
+    static constexpr uint8_t INVALID_RDLENGTH[] = {0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00,
+            0x00, 0x01, 0x61, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c,
+            0x00, 0x03};
+    static constexpr uint8_t INVALID_POINTER[] = {0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00,
+            0x00, 0x01, 0x61, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0xff, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c,
+            0x00, 0x04, 0x7f, 0x00, 0x00, 0x01};
+    static constexpr uint8_t POINTER_LOOP[] = {0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x01, 0x61, 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01};
+
+    ASSERT_FALSE(dns_utils::MessageReader::parse({INVALID_RDLENGTH, std::size(INVALID_RDLENGTH)}).has_value());
+    ASSERT_FALSE(dns_utils::MessageReader::parse({INVALID_POINTER, std::size(INVALID_POINTER)}).has_value());
+    ASSERT_FALSE(dns_utils::MessageReader::parse({POINTER_LOOP, std::size(POINTER_LOOP)}).has_value());
+    ASSERT_FALSE(dns_utils::MessageReader::parse({HTTPS_RESPONSE, 11}).has_value());
+}
+
+TEST_F(DNSUtilsReader, EmptyRdata) {
+    static constexpr uint8_t RESPONSE[] = {0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+            0x01, 0x61, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00,
+            0x00};
+
+    std::optional<dns_utils::DecodedReply> reply = read_reply({RESPONSE, std::size(RESPONSE)});
+    ASSERT_TRUE(reply.has_value());
+    ASSERT_TRUE(reply->names.empty());
+}
+
+TEST_F(DNSUtilsReader, RemoveEch) {
+    std::vector<uint8_t> message(std::begin(HTTPS_RESPONSE), std::end(HTTPS_RESPONSE));
+    size_t size = dns_utils::remove_svcparam_echconfig(std::span{message});
+    ASSERT_EQ(size, std::size(HTTPS_RESPONSE) - 8);
+    message.resize(size);
+
+    std::vector<uint8_t> expected(std::begin(HTTPS_RESPONSE), std::end(HTTPS_RESPONSE));
+    expected.erase(expected.begin() + 51, expected.begin() + 59);
+    expected[40] -= 8;                   // RDLENGTH of the HTTPS record
+    expected[expected.size() - 15] -= 8; // The pointer to the CNAME record owner
+    ASSERT_EQ(message, expected);
+
+    // Check against the ldns implementation
+    dns_utils::LdnsPktPtr pkt = dns_utils::decode_pkt({HTTPS_RESPONSE, std::size(HTTPS_RESPONSE)});
+    ASSERT_TRUE(dns_utils::remove_svcparam_echconfig(pkt.get()));
+    DeclPtr<char, &free> expected_str{ldns_pkt2str(pkt.get())};
+    ASSERT_EQ(pkt_to_string({message.data(), message.size()}), expected_str.get());
+
+    std::optional<dns_utils::DecodedReply> reply = read_reply({message.data(), message.size()});
+    ASSERT_TRUE(reply.has_value());
+    ASSERT_EQ(reply->names, (std::vector<std::string>{"example.com", "www.example.com"}));
+    ASSERT_EQ(reply->addresses.size(), 1);
+    check_same_as_ldns({message.data(), message.size()});
+
+    // Nothing to remove any more
+    ASSERT_EQ(size, dns_utils::remove_svcparam_echconfig(std::span{message}));
+}
+
+TEST_F(DNSUtilsReader, Fuzz) {
+    std::mt19937 random(42); // NOLINT(cert-msc51-cpp)
+    for (U8View sample : {U8View{HTTPS_RESPONSE, std::size(HTTPS_RESPONSE)},
+                 U8View{CNAME_RESPONSE, std::size(CNAME_RESPONSE)}}) {
+        for (size_t i = 0; i < 20000; ++i) {
+            std::vector<uint8_t> message(sample.begin(), sample.end());
+            for (size_t n = 1 + random() % 3; n > 0; --n) {
+                message[random() % message.size()] = uint8_t(random());
+            }
+            message.resize(message.size() - random() % 4);
+            U8View view = {message.data(), message.size()};
+
+            ASSERT_NO_FATAL_FAILURE(check_same_as_ldns(view));
+
+            std::vector<uint8_t> original = message;
+            size_t size = dns_utils::remove_svcparam_echconfig(std::span{message});
+            ASSERT_LE(size, message.size());
+            if (size == message.size()) {
+                continue;
+            }
+            // A modified message is still well-formed and is the same as the one modified by ldns
+            ASSERT_TRUE(dns_utils::MessageReader::parse({message.data(), size}).has_value());
+            dns_utils::LdnsPktPtr pkt = dns_utils::decode_pkt({original.data(), original.size()});
+            if (pkt == nullptr) {
+                continue;
+            }
+            while (dns_utils::remove_svcparam_echconfig(pkt.get())) {
+            }
+            DeclPtr<char, &free> expected{ldns_pkt2str(pkt.get())};
+            ASSERT_EQ(pkt_to_string({message.data(), size}), expected.get());
+        }
+    }
+}
@@ -0,0 +1,144 @@
+#include <cstdint>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <gtest/gtest.h>
+#include <nghttp2/nghttp2.h>
+
+#include "common/defs.h"
+#include "net/http_session.h"
+
+using namespace ag;
+
+static constexpr int32_t STREAM_ID = 1;
+static constexpr size_t CHUNK_SIZE = 1460;
+static constexpr size_t CHUNKS_NUM = 20;
+
+/**
+ * Checks that the stream data passed by reference reaches the output without being copied
+ */
+class Http2DataPath : public testing::Test {
+protected:
+    DeclPtr<nghttp2_session, &nghttp2_session_del> m_server;
+    DeclPtr<HttpSession, &http_session_close> m_client;
+    DeclPtr<evbuffer, &evbuffer_free> m_wire{evbuffer_new()};
+    std::vector<uint8_t> m_received;
+    int m_references = 0;
+    size_t m_copied_to_wire = 0;
+
+    static void client_handler(void *arg, HttpEventId what, void *data) {
+        auto *self = (Http2DataPath *) arg;
+        if (what != HTTP_EVENT_OUTPUT) {
+            return;
+        }
+        auto *event = (HttpOutputEvent *) data;
+        if (event->buffer != nullptr) {
+            evbuffer_add_buffer(self->m_wire.get(), event->buffer);
+        } else {
+            evbuffer_add(self->m_wire.get(), event->data, event->length);
+            self->m_copied_to_wire += event->length;
+        }
+    }
+
+    static int on_data_chunk_recv(
+            nghttp2_session *, uint8_t, int32_t, const uint8_t *data, size_t len, void *user_data) {
+        auto *self = (Http2DataPath *) user_data;
+        self->m_received.insert(self->m_received.end(), data, data + len);
+        return 0;
+    }
+
+    static void ref(void *arg) {
+        ++((Http2DataPath *) arg)->m_references;
+    }
+
+    static void unref(const void *, size_t, void *arg) {
+        --((Http2DataPath *) arg)->m_references;
+    }
+
+    void SetUp() override {
+        nghttp2_session_callbacks *callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv);
+        nghttp2_session *server;
+        ASSERT_EQ(0, nghttp2_session_server_new(&server, callbacks, this));
+        nghttp2_session_callbacks_del(callbacks);
+        m_server.reset(server);
+        ASSERT_EQ(0, nghttp2_submit_settings(m_server.get(), NGHTTP2_FLAG_NONE, nullptr, 0));
+
+        HttpSessionParams params = {1, {client_handler, this}, 1024 * 1024, HTTP_VER_2_0};
+        m_client.reset(http_session_open(&params));
+        ASSERT_NE(m_client, nullptr);
+        ASSERT_EQ(0, http_session_send_settings(m_client.get()));
+
+        HttpHeaders headers;
+        headers.version = HTTP_VER_2_0;
+        headers.method = "CONNECT";
+        headers.authority = "example.org:443";
+        ASSERT_EQ(0, http_session_send_headers(m_client.get(), STREAM_ID, &headers, false));
+        exchange();
+    }
+
+    void TearDown() override {
+        m_client.reset();
+        ASSERT_EQ(m_references, 0);
+    }
+
+    // Pass the client output to the server and the server output back to the client
+    void exchange() {
+        while (evbuffer_get_length(m_wire.get()) > 0) {
+            size_t length = evbuffer_get_length(m_wire.get());
+            ASSERT_EQ((ssize_t) length,
+                    nghttp2_session_mem_recv(m_server.get(), evbuffer_pullup(m_wire.get(), -1), length));
+            evbuffer_drain(m_wire.get(), length);
+
+            for (;;) {
+                const uint8_t *data;
+                ssize_t r = nghttp2_session_mem_send(m_server.get(), &data);
+                ASSERT_GE(r, 0);
+                if (r == 0) {
+                    break;
+                }
+                ASSERT_EQ(r, http_session_input(m_client.get(), data, r));
+            }
+        }
+    }
+};
+
+TEST_F(Http2DataPath, ByReference) {
+    std::vector<uint8_t> chunks(CHUNK_SIZE * CHUNKS_NUM);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i] = uint8_t(i);
+    }
+
+    VpnBufferRef buffer = {ref, unref, this};
+    for (size_t i = 0; i < CHUNKS_NUM; ++i) {
+        ASSERT_EQ(0,
+                http_session_send_data_by_reference(
+                        m_client.get(), STREAM_ID, &chunks[i * CHUNK_SIZE], CHUNK_SIZE, buffer, false));
+    }
+    // The data is referenced until it is written out
+    ASSERT_GT(m_references, 0);
+    m_copied_to_wire = 0;
+    exchange();
+
+    ASSERT_EQ(m_received, chunks);
+    ASSERT_EQ(m_references, 0);
+    HttpSessionCopyStats stats = http_session_get_copy_stats(m_client.get());
+    ASSERT_EQ(stats.sent_bytes, chunks.size());
+    ASSERT_EQ(stats.copied_bytes, 0u);
+    // Only the control frames go through the copying output
+    ASSERT_LT(m_copied_to_wire, 100u);
+}
+
+TEST_F(Http2DataPath, ByCopy) {
+    std::vector<uint8_t> chunks(CHUNK_SIZE * CHUNKS_NUM, 'x');
+    for (size_t i = 0; i < CHUNKS_NUM; ++i) {
+        ASSERT_EQ(0, http_session_send_data(m_client.get(), STREAM_ID, &chunks[i * CHUNK_SIZE], CHUNK_SIZE, false));
+    }
+    exchange();
+
+    ASSERT_EQ(m_received, chunks);
+    HttpSessionCopyStats stats = http_session_get_copy_stats(m_client.get());
+    ASSERT_EQ(stats.sent_bytes, chunks.size());
+    ASSERT_GE(stats.copied_bytes, chunks.size());
+}
@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <event2/util.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <quiche.h>
+
+#include "common/defs.h"
+#include "common/socket_address.h"
+#include "net/quic_connector.h"
+#include "vpn/utils.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t TRANSFER_SIZE = 32 * 1024 * 1024;
+static constexpr uint64_t STREAM_ID = 0;
+static constexpr auto TRANSFER_TIMEOUT = std::chrono::seconds(30);
+
+struct TransportSetting {
+    const char *name;
+    VpnQuicTransportConfig transport;
+};
+
+static int select_alpn(SSL *, const uint8_t **out, uint8_t *out_len, const uint8_t *in, unsigned in_len, void *) {
+    if (OPENSSL_NPN_NEGOTIATED
+            != SSL_select_next_proto((uint8_t **) out, out_len, QUIC_H3_ALPN_PROTOS, std::size(QUIC_H3_ALPN_PROTOS), in,
+                    in_len)) {
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// A context with a freshly generated self-signed certificate
+static UniquePtr<SSL_CTX, &SSL_CTX_free> make_server_ctx() {
+    UniquePtr<EVP_PKEY, &EVP_PKEY_free> key{EVP_PKEY_new()};
+    UniquePtr<EC_KEY, &EC_KEY_free> ec_key{EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)};
+    if (!EC_KEY_generate_key(ec_key.get()) || !EVP_PKEY_assign_EC_KEY(key.get(), ec_key.release())) {
+        return nullptr;
+    }
+
+    UniquePtr<X509, &X509_free> cert{X509_new()};
+    X509_set_version(cert.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert.get()), 3600);
+    X509_NAME *name = X509_get_subject_name(cert.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const uint8_t *) "localhost", -1, -1, 0);
+    X509_set_issuer_name(cert.get(), name);
+    X509_set_pubkey(cert.get(), key.get());
+    if (!X509_sign(cert.get(), key.get(), EVP_sha256())) {
+        return nullptr;
+    }
+
+    UniquePtr<SSL_CTX, &SSL_CTX_free> ctx{SSL_CTX_new(TLS_method())};
+    if (!SSL_CTX_use_certificate(ctx.get(), cert.get()) || !SSL_CTX_use_PrivateKey(ctx.get(), key.get())) {
+        return nullptr;
+    }
+    SSL_CTX_set_alpn_select_cb(ctx.get(), select_alpn, nullptr);
+    return ctx;
+}
+
+struct QuicPeer {
+    evutil_socket_t fd = EVUTIL_INVALID_SOCKET;
+    SocketAddress local;
+    SocketAddress remote;
+    DeclPtr<quiche_conn, &quiche_conn_free> conn;
+
+    QuicPeer() = default;
+    ~QuicPeer() {
+        if (fd != EVUTIL_INVALID_SOCKET) {
+            evutil_closesocket(fd);
+        }
+    }
+
+    QuicPeer(const QuicPeer &) = delete;
+    QuicPeer &operator=(const QuicPeer &) = delete;
+    QuicPeer(QuicPeer &&) = delete;
+    QuicPeer &operator=(QuicPeer &&) = delete;
+
+    bool bind() {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        SocketAddress loopback("127.0.0.1", 0);
+        if (fd == EVUTIL_INVALID_SOCKET || 0 != ::bind(fd, loopback.c_sockaddr(), loopback.c_socklen())
+                || 0 != evutil_make_socket_nonblocking(fd)) {
+            return false;
+        }
+        local = local_socket_address_from_fd(fd);
+        return local.valid();
+    }
+
+    // Return the number of packets sent
+    size_t flush() {
+        size_t sent = 0;
+        uint8_t buffer[QUIC_MAX_RECV_UDP_PAYLOAD_SIZE];
+        quiche_send_info info{};
+        for (;;) {
+            ssize_t r = quiche_conn_send(conn.get(), buffer, std::size(buffer), &info);
+            if (r <= 0) {
+                break;
+            }
+            // A packet dropped due to a full socket buffer is recovered by QUIC like on a real network
+            sendto(fd, (const char *) buffer, r, 0, remote.c_sockaddr(), remote.c_socklen());
+            ++sent;
+        }
+        return sent;
+    }
+
+    // Return the number of packets received
+    size_t receive() {
+        size_t received = 0;
+        uint8_t buffer[QUIC_MAX_RECV_UDP_PAYLOAD_SIZE];
+        quiche_recv_info info{
+                .from = (sockaddr *) remote.c_sockaddr(),
+                .from_len = remote.c_socklen(),
+                .to = (sockaddr *) local.c_sockaddr(),
+                .to_len = local.c_socklen(),
+        };
+        for (;;) {
+            ssize_t r = recv(fd, (char *) buffer, std::size(buffer), 0);
+            if (r <= 0) {
+                break;
+            }
+            quiche_conn_recv(conn.get(), buffer, r, &info);
+            ++received;
+        }
+        return received;
+    }
+};
+
+/**
+ * Measures the throughput of a bulk upload over a loopback QUIC connection
+ * with different congestion control and flow control settings
+ */
+class QuicTransportBench : public testing::TestWithParam<TransportSetting> {
+protected:
+    QuicPeer m_client;
+    QuicPeer m_server;
+
+    void SetUp() override {
+#ifdef _WIN32
+        WSADATA wsa_data;
+        ASSERT_EQ(0, WSAStartup(MAKEWORD(2, 2), &wsa_data));
+#endif
+        ASSERT_TRUE(m_client.bind());
+        ASSERT_TRUE(m_server.bind());
+        m_client.remote = m_server.local;
+        m_server.remote = m_client.local;
+
+        DeclPtr<quiche_config, &quiche_config_free> config{quiche_config_new(QUICHE_PROTOCOL_VERSION)};
+        ASSERT_NE(config, nullptr);
+        quiche_config_verify_peer(config.get(), false);
+        quiche_config_set_application_protos(config.get(), QUIC_H3_ALPN_PROTOS, std::size(QUIC_H3_ALPN_PROTOS));
+        quiche_config_set_max_idle_timeout(config.get(), 5000);
+        quiche_config_set_initial_max_streams_bidi(config.get(), 1);
+        // Let the peer's `max_recv_udp_payload_size` be the limiting one
+        quiche_config_set_max_send_udp_payload_size(config.get(), QUIC_MAX_RECV_UDP_PAYLOAD_SIZE);
+        quic_apply_transport_config(config.get(), GetParam().transport);
+
+        uint8_t scid[QUIC_LOCAL_CONN_ID_LEN];
+        ASSERT_EQ(1, RAND_bytes(scid, std::size(scid)));
+        m_client.conn.reset(quiche_connect("localhost", scid, std::size(scid), m_client.local.c_sockaddr(),
+                m_client.local.c_socklen(), m_server.local.c_sockaddr(), m_server.local.c_socklen(), config.get()));
+        ASSERT_NE(m_client.conn, nullptr);
+
+        UniquePtr<SSL_CTX, &SSL_CTX_free> ctx = make_server_ctx();
+        ASSERT_NE(ctx, nullptr);
+        ASSERT_EQ(1, RAND_bytes(scid, std::size(scid)));
+        // clang-format off
+        m_server.conn.reset(quiche_conn_new_with_tls(
+                scid, std::size(scid), nullptr, 0,
+                m_server.local.c_sockaddr(), m_server.local.c_socklen(),
+                m_client.local.c_sockaddr(), m_client.local.c_socklen(),
+                config.get(), SSL_new(ctx.get()), true));
+        // clang-format on
+        ASSERT_NE(m_server.conn, nullptr);
+    }
+};
+
+TEST_P(QuicTransportBench, Upload) {
+    std::vector<uint8_t> chunk(64 * 1024);
+    RAND_bytes(chunk.data(), chunk.size());
+    std::vector<uint8_t> sink(64 * 1024);
+
+    size_t uploaded = 0;
+    size_t downloaded = 0;
+    bool fin = false;
+    Clock::time_point start{};
+    Clock::time_point deadline = Clock::now() + TRANSFER_TIMEOUT;
+    while (!fin && Clock::now() < deadline) {
+        if (quiche_conn_is_established(m_client.conn.get())) {
+            if (start == Clock::time_point{}) {
+                start = Clock::now();
+            }
+            while (uploaded < TRANSFER_SIZE) {
+                size_t length = std::min(chunk.size(), TRANSFER_SIZE - uploaded);
+                ssize_t r = quiche_conn_stream_send(
+                        m_client.conn.get(), STREAM_ID, chunk.data(), length, uploaded + length == TRANSFER_SIZE);
+                if (r <= 0) {
+                    break;
+                }
+                uploaded += r;
+            }
+        }
+
+        size_t activity = m_client.flush() + m_server.flush();
+        activity += m_server.receive() + m_client.receive();
+
+        for (;;) {
+            bool stream_fin = false;
+            ssize_t r = quiche_conn_stream_recv(m_server.conn.get(), STREAM_ID, sink.data(), sink.size(), &stream_fin);
+            if (r < 0) {
+                break;
+            }
+            downloaded += r;
+            fin = fin || stream_fin;
+        }
+
+        if (activity == 0) {
+            // Nothing is in flight on the loopback, so the progress depends on the timers (e.g. loss detection)
+            uint64_t timeout_ms = std::min(quiche_conn_timeout_as_millis(m_client.conn.get()),
+                    quiche_conn_timeout_as_millis(m_server.conn.get()));
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min<uint64_t>(timeout_ms, 1)));
+            quiche_conn_on_timeout(m_client.conn.get());
+            quiche_conn_on_timeout(m_server.conn.get());
+        }
+
+        ASSERT_FALSE(quiche_conn_is_closed(m_client.conn.get()));
+        ASSERT_FALSE(quiche_conn_is_closed(m_server.conn.get()));
+    }
+    ASSERT_TRUE(fin) << "Transfer timed out: " << downloaded << " of " << TRANSFER_SIZE << " bytes received";
+    ASSERT_EQ(downloaded, TRANSFER_SIZE);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    quiche_stats stats{};
+    quiche_conn_stats(m_client.conn.get(), &stats);
+    printf("setting=%s size=%zu throughput=%.1f Mbit/s sent=%zu lost=%zu\n", GetParam().name, TRANSFER_SIZE,
+            double(TRANSFER_SIZE) * 8 / seconds / 1e6, stats.sent, stats.lost);
+}
+
+// clang-format off
+INSTANTIATE_TEST_SUITE_P(Settings, QuicTransportBench, testing::Values(
+        TransportSetting{"default", {}},
+        TransportSetting{"reno", {.congestion_control = VPN_QUIC_CC_RENO}},
+        TransportSetting{"cubic_no_hystart", {.congestion_control = VPN_QUIC_CC_CUBIC, .disable_hystart = true}},
+        TransportSetting{"bbr", {.congestion_control = VPN_QUIC_CC_BBR}},
+        TransportSetting{"bbr2", {.congestion_control = VPN_QUIC_CC_BBR2}},
+        TransportSetting{"small_stream_window", {.initial_max_stream_data = 128 * 1024}},
+        TransportSetting{"stream_window_autotune",
+                {.initial_max_stream_data = 128 * 1024, .max_stream_window = 16 * 1024 * 1024}},
+        TransportSetting{"max_recv_udp_payload", {.max_recv_udp_payload_size = QUIC_MAX_RECV_UDP_PAYLOAD_SIZE}}),
+        [](const testing::TestParamInfo<TransportSetting> &info) {
+            return std::string(info.param.name);
+        });
+// clang-format on
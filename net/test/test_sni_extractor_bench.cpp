@@ -0,0 +1,169 @@
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <openssl/ec.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "net/sni_extractor.h"
+#include "net/tls.h"
+#include "quic_initial_packets.h"
+#include "vpn/utils.h"
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static double mib_per_sec(size_t bytes_num, Clock::time_point start) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return double(bytes_num) / elapsed.count() / (1024 * 1024);
+}
+
+/** The first flight of an OpenSSL client, i.e. a Client Hello record with an SNI */
+static std::vector<uint8_t> make_client_hello(const char *sni) {
+    DeclPtr<SSL_CTX, &SSL_CTX_free> ctx{SSL_CTX_new(TLS_client_method())};
+    DeclPtr<SSL, &SSL_free> ssl{SSL_new(ctx.get())};
+    SSL_set_tlsext_host_name(ssl.get(), sni);
+    BIO *out = BIO_new(BIO_s_mem());
+    SSL_set_bio(ssl.get(), BIO_new(BIO_s_mem()), out);
+    SSL_connect(ssl.get());
+    uint8_t *data = nullptr;
+    long size = BIO_get_mem_data(out, &data);
+    return {data, data + size};
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+/** A Certificate record carrying a self-signed certificate */
+static std::vector<uint8_t> make_certificate_record(std::vector<uint8_t> &der) {
+    DeclPtr<EVP_PKEY, &EVP_PKEY_free> pkey{EVP_PKEY_new()};
+    EC_KEY *ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    DeclPtr<X509, &X509_free> cert{X509_new()};
+    if (ec == nullptr || !EC_KEY_generate_key(ec) || !EVP_PKEY_assign_EC_KEY(pkey.get(), ec)
+            || !X509_set_version(cert.get(), X509_VERSION_3)
+            || !X509_NAME_add_entry_by_txt(X509_get_subject_name(cert.get()), "CN", MBSTRING_UTF8,
+                    (const uint8_t *) "bench.example.org", -1, -1, 0)
+            || !X509_set_issuer_name(cert.get(), X509_get_subject_name(cert.get()))
+            || !X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0)
+            || !X509_gmtime_adj(X509_getm_notAfter(cert.get()), 3600) // NOLINT(*-magic-numbers)
+            || !X509_set_pubkey(cert.get(), pkey.get()) || !X509_sign(cert.get(), pkey.get(), EVP_sha256())) {
+        return {};
+    }
+    int der_size = i2d_X509(cert.get(), nullptr);
+    der.resize(der_size);
+    uint8_t *p = der.data();
+    i2d_X509(cert.get(), &p);
+
+    auto put24 = [](std::vector<uint8_t> &v, size_t n) {
+        v.insert(v.end(), {uint8_t(n >> 16), uint8_t(n >> 8), uint8_t(n)});
+    };
+    std::vector<uint8_t> record{0x16, 0x03, 0x03, uint8_t((der.size() + 10) >> 8), uint8_t(der.size() + 10), 0x0b};
+    put24(record, der.size() + 6);
+    put24(record, der.size() + 3);
+    put24(record, der.size());
+    record.insert(record.end(), der.begin(), der.end());
+    return record;
+}
+#pragma GCC diagnostic pop
+
+/**
+ * Compares the domain lookup through `QuicSniExtractor` with the decryption into a vector followed by
+ * the reassembly of the CRYPTO frames and `tls_parse()`
+ */
+TEST(SniExtractorBench, QuicInitial) {
+    static constexpr size_t ITERATIONS_NUM = 2000;
+
+    std::vector<std::vector<uint8_t>> packets = client_initial_packets();
+    size_t bytes_num = 0;
+    for (const std::vector<uint8_t> &pkt : packets) {
+        bytes_num += pkt.size() * ITERATIONS_NUM;
+    }
+
+    auto measure = [&](std::string (*find_sni)(const std::vector<uint8_t> &)) {
+        size_t found_num = 0;
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < ITERATIONS_NUM; ++i) {
+            for (const std::vector<uint8_t> &pkt : packets) {
+                found_num += !find_sni(pkt).empty();
+            }
+        }
+        double result = mib_per_sec(bytes_num, start);
+        EXPECT_EQ(found_num, packets.size() * ITERATIONS_NUM);
+        return result;
+    };
+
+    double reassembling = measure(&find_sni_reassembling);
+    double streaming = measure(&find_sni_streaming);
+    printf("Initial packets: reassembling %.1f MiB/s, streaming %.1f MiB/s\n", reassembling, streaming);
+}
+
+/** Compares `TlsSniExtractor` with buffering for `tls_parse()` */
+TEST(SniExtractorBench, ClientHello) {
+    static constexpr size_t ITERATIONS_NUM = 100000;
+    const std::vector<uint8_t> hellos[] = {
+            make_client_hello("duckduckgo.com"),
+            make_client_hello("www.google.com"),
+    };
+
+    size_t bytes_num = 0;
+    size_t found_num = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < ITERATIONS_NUM; ++i) {
+        for (const std::vector<uint8_t> &hello : hellos) {
+            // The domain extractor used to collect the flow data in a buffer for `tls_parse()`
+            std::vector<uint8_t> buffer(hello.begin(), hello.end());
+            TlsReader t = {};
+            tls_input(&t, buffer.data(), buffer.size());
+            found_num += tls_parse(&t) == TLS_RCLIENT_HELLO && tls_parse(&t) == TLS_RCLIENT_HELLO_SNI;
+            bytes_num += hello.size();
+        }
+    }
+    double reader = mib_per_sec(bytes_num, start);
+    ASSERT_EQ(found_num, ITERATIONS_NUM * std::size(hellos));
+
+    found_num = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < ITERATIONS_NUM; ++i) {
+        for (const std::vector<uint8_t> &hello : hellos) {
+            TlsSniExtractor t;
+            found_num += t.feed_records({hello.data(), hello.size()}) == SNI_RFOUND;
+        }
+    }
+    double extractor = mib_per_sec(bytes_num, start);
+    ASSERT_EQ(found_num, ITERATIONS_NUM * std::size(hellos));
+    printf("Client Hello: buffered tls_parse %.1f MiB/s, TlsSniExtractor %.1f MiB/s\n", reader, extractor);
+}
+
+/** Compares the certificate walk of `tls_parse()` with `d2i_X509()` */
+TEST(SniExtractorBench, CertificateCommonName) {
+    static constexpr size_t ITERATIONS_NUM = 10000;
+    std::vector<uint8_t> der;
+    std::vector<uint8_t> record = make_certificate_record(der);
+    ASSERT_FALSE(record.empty());
+    size_t bytes_num = der.size() * ITERATIONS_NUM;
+
+    size_t found_num = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < ITERATIONS_NUM; ++i) {
+        const uint8_t *p = der.data();
+        X509 *x = d2i_X509(nullptr, &p, long(der.size()));
+        char cn[256];
+        found_num += 0 < X509_NAME_get_text_by_NID(X509_get_subject_name(x), NID_commonName, cn, sizeof(cn));
+        X509_free(x);
+    }
+    double decoder = mib_per_sec(bytes_num, start);
+    ASSERT_EQ(found_num, ITERATIONS_NUM);
+
+    found_num = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < ITERATIONS_NUM; ++i) {
+        TlsReader t = {};
+        tls_input(&t, record.data(), record.size());
+        found_num += tls_parse(&t) == TLS_RCERT;
+    }
+    double walker = mib_per_sec(bytes_num, start);
+    ASSERT_EQ(found_num, ITERATIONS_NUM);
+    printf("Certificate CN: d2i_X509 %.1f MiB/s, DER walk %.1f MiB/s\n", decoder, walker);
+}
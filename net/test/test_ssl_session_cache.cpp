@@ -0,0 +1,203 @@
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <openssl/ec.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "ssl_session_cache.h"
+#include "vpn/utils.h"
+
+using SslCtxPtr = ag::DeclPtr<SSL_CTX, &SSL_CTX_free>;
+using SslPtr = ag::DeclPtr<SSL, &SSL_free>;
+using SessionPtr = ag::DeclPtr<SSL_SESSION, &SSL_SESSION_free>;
+
+static constexpr std::string_view JOURNAL_FILE_NAME = "ssl_sessions.journal";
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+static SslCtxPtr make_server_ctx() {
+    SslCtxPtr ctx{SSL_CTX_new(TLS_server_method())};
+    ag::DeclPtr<EVP_PKEY, &EVP_PKEY_free> pkey{EVP_PKEY_new()};
+    EC_KEY *ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (ec == nullptr || !EC_KEY_generate_key(ec) || !EVP_PKEY_assign_EC_KEY(pkey.get(), ec)) {
+        return nullptr;
+    }
+    ag::DeclPtr<X509, &X509_free> cert{X509_new()};
+    if (!X509_set_version(cert.get(), X509_VERSION_3)
+            || !X509_NAME_add_entry_by_txt(X509_get_subject_name(cert.get()), "CN", MBSTRING_UTF8,
+                    (const uint8_t *) "Self-signed cert", -1, -1, 0)
+            || !X509_set_issuer_name(cert.get(), X509_get_subject_name(cert.get()))
+            || !X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0)
+            || !X509_gmtime_adj(X509_getm_notAfter(cert.get()), 3600) // NOLINT(*-magic-numbers)
+            || !X509_set_pubkey(cert.get(), pkey.get()) || !X509_sign(cert.get(), pkey.get(), EVP_sha256())
+            || !SSL_CTX_use_certificate(ctx.get(), cert.get()) || !SSL_CTX_use_PrivateKey(ctx.get(), pkey.get())) {
+        return nullptr;
+    }
+    return ctx;
+}
+#pragma GCC diagnostic pop
+
+static int cache_session_cb(SSL *ssl, SSL_SESSION *session) {
+    ag::cache_ssl_session(SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name), /*quic*/ false, SessionPtr{session});
+    return 1;
+}
+
+/**
+ * Run a TLS 1.3 handshake in memory, the client caches the tickets it receives
+ * @return true if the client has resumed the session
+ */
+static bool handshake(SSL_CTX *server_ctx, const char *sni, SSL_SESSION *session = nullptr) {
+    SslCtxPtr client_ctx{SSL_CTX_new(TLS_client_method())};
+    SSL_CTX_set_session_cache_mode(client_ctx.get(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(client_ctx.get(), cache_session_cb);
+    SslPtr client{SSL_new(client_ctx.get())};
+    SslPtr server{SSL_new(server_ctx)};
+    SSL_set_tlsext_host_name(client.get(), sni);
+    if (session != nullptr) {
+        SSL_set_session(client.get(), session);
+    }
+
+    BIO *client_bio = nullptr;
+    BIO *server_bio = nullptr;
+    BIO_new_bio_pair(&client_bio, 0, &server_bio, 0);
+    SSL_set_bio(client.get(), client_bio, client_bio);
+    SSL_set_bio(server.get(), server_bio, server_bio);
+    SSL_set_connect_state(client.get());
+    SSL_set_accept_state(server.get());
+
+    for (int i = 0; i < 10 && (!SSL_is_init_finished(client.get()) || !SSL_is_init_finished(server.get())); ++i) {
+        SSL_do_handshake(client.get());
+        SSL_do_handshake(server.get());
+    }
+    EXPECT_TRUE(SSL_is_init_finished(client.get()));
+
+    // The tickets are processed by the client along with the application data
+    uint8_t byte = 0;
+    EXPECT_EQ(SSL_write(server.get(), "x", 1), 1);
+    EXPECT_EQ(SSL_read(client.get(), &byte, 1), 1);
+    bool reused = SSL_session_reused(client.get());
+    // An unclean shutdown makes OpenSSL mark the session non-resumable
+    SSL_shutdown(client.get());
+    return reused;
+}
+
+/** Wait until the background writer has written the records and has nothing more to write */
+static bool wait_journal_flushed(const std::filesystem::path &dir) {
+    std::filesystem::path path = dir / JOURNAL_FILE_NAME;
+    uintmax_t size = 0;
+    for (int stable_num = 0, i = 0; i < 100; ++i) { // NOLINT(*-magic-numbers)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // NOLINT(*-magic-numbers)
+        std::error_code ec;
+        uintmax_t new_size = std::filesystem::file_size(path, ec);
+        stable_num = (new_size == size) ? stable_num + 1 : 0;
+        size = new_size;
+        if (size > std::string_view("SSLJRNL1").size() && stable_num == 3) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class SslSessionCache : public ::testing::Test {
+protected:
+    std::filesystem::path m_dir;
+
+    void SetUp() override {
+        m_dir = std::filesystem::temp_directory_path()
+                / ("ssl_session_cache_" + std::string(testing::UnitTest::GetInstance()->current_test_info()->name()));
+        std::filesystem::remove_all(m_dir);
+        std::filesystem::create_directories(m_dir);
+    }
+
+    void TearDown() override {
+        ag::close_ssl_session_cache();
+        std::filesystem::remove_all(m_dir);
+    }
+};
+
+TEST_F(SslSessionCache, Resumes) {
+    SslCtxPtr server_ctx = make_server_ctx();
+    ASSERT_NE(server_ctx, nullptr);
+    ASSERT_FALSE(handshake(server_ctx.get(), "resumes.example.org"));
+
+    ASSERT_EQ(ag::pop_cached_ssl_session("resumes.example.org", /*quic*/ true), nullptr);
+    ASSERT_EQ(ag::pop_cached_ssl_session("other.example.org", /*quic*/ false), nullptr);
+    SessionPtr session = ag::pop_cached_ssl_session("resumes.example.org", /*quic*/ false);
+    ASSERT_NE(session, nullptr);
+    ASSERT_TRUE(handshake(server_ctx.get(), "resumes.example.org", session.get()));
+}
+
+TEST_F(SslSessionCache, SurvivesCrash) {
+    EXPECT_EXIT(
+            {
+                ag::load_ssl_session_cache(m_dir.string());
+                SslCtxPtr server_ctx = make_server_ctx();
+                handshake(server_ctx.get(), "crash.example.org");
+                std::_Exit(wait_journal_flushed(m_dir) ? 0 : 1);
+            },
+            ::testing::ExitedWithCode(0), "");
+
+    ag::load_ssl_session_cache(m_dir.string());
+    SessionPtr session = ag::pop_cached_ssl_session("crash.example.org", /*quic*/ false);
+    ASSERT_NE(session, nullptr);
+    ASSERT_TRUE(SSL_SESSION_has_ticket(session.get()));
+}
+
+TEST_F(SslSessionCache, TakenSessionIsNotRestored) {
+    EXPECT_EXIT(
+            {
+                ag::load_ssl_session_cache(m_dir.string());
+                SslCtxPtr server_ctx = make_server_ctx();
+                handshake(server_ctx.get(), "taken.example.org");
+                while (ag::pop_cached_ssl_session("taken.example.org", /*quic*/ false) != nullptr) {
+                }
+                std::_Exit(wait_journal_flushed(m_dir) ? 0 : 1);
+            },
+            ::testing::ExitedWithCode(0), "");
+
+    ag::load_ssl_session_cache(m_dir.string());
+    ASSERT_EQ(ag::pop_cached_ssl_session("taken.example.org", /*quic*/ false), nullptr);
+}
+
+static size_t pop_all(const char *sni) {
+    size_t sessions_num = 0;
+    while (ag::pop_cached_ssl_session(sni, /*quic*/ false) != nullptr) {
+        ++sessions_num;
+    }
+    return sessions_num;
+}
+
+TEST_F(SslSessionCache, TakenSessionStaysGone) {
+    SslCtxPtr server_ctx = make_server_ctx();
+    ASSERT_NE(server_ctx, nullptr);
+    ag::load_ssl_session_cache(m_dir.string());
+    ag::load_ssl_session_cache(m_dir.string());
+    handshake(server_ctx.get(), "close.example.org");
+
+    // The other user keeps the journal going
+    ag::close_ssl_session_cache();
+    ASSERT_GT(pop_all("close.example.org"), 0);
+    ag::close_ssl_session_cache();
+
+    ag::load_ssl_session_cache(m_dir.string());
+    ASSERT_EQ(ag::pop_cached_ssl_session("close.example.org", /*quic*/ false), nullptr);
+}
+
+TEST_F(SslSessionCache, ReloadDoesNotDuplicate) {
+    SslCtxPtr server_ctx = make_server_ctx();
+    ASSERT_NE(server_ctx, nullptr);
+    handshake(server_ctx.get(), "count.example.org");
+    size_t tickets_num = pop_all("count.example.org");
+    ASSERT_GT(tickets_num, 0);
+
+    ag::load_ssl_session_cache(m_dir.string());
+    handshake(server_ctx.get(), "reload.example.org");
+    ag::close_ssl_session_cache();
+    ag::load_ssl_session_cache(m_dir.string());
+    ASSERT_EQ(pop_all("reload.example.org"), tickets_num);
+}
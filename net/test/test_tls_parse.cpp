@@ -1,5 +1,11 @@
 #include <assert.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+#include "net/sni_extractor.h"
 #include "net/tls.h"
 
 using namespace ag;
@@ -637,9 +643,57 @@ static void test_tls_long_rec() {
     assert(TLS_RDONE == tls_parse(&t));
 }
 
+static SniExtractorResult extract_sni(TlsSniExtractor &extractor, const void *data, size_t size, size_t step) {
+    SniExtractorResult r = SNI_RMORE;
+    for (size_t i = 0; i < size && r == SNI_RMORE; i += step) {
+        r = extractor.feed_records({(uint8_t *) data + i, std::min(step, size - i)});
+    }
+    return r;
+}
+
+static void test_sni_extractor() {
+    // Whole, split into TCP segments of any size
+    for (size_t step : {size_t(1), size_t(2), size_t(7), size_t(100), sizeof(SSL_CLI_HELLO_TLSV13)}) {
+        TlsSniExtractor t;
+        assert(SNI_RFOUND == extract_sni(t, SSL_CLI_HELLO_ALPN, sizeof(SSL_CLI_HELLO_ALPN), step));
+        assert(t.server_name() == "duckduckgo.com");
+
+        t = {};
+        assert(SNI_RFOUND == extract_sni(t, SSL_CLI_HELLO_TLSV13, sizeof(SSL_CLI_HELLO_TLSV13), step));
+        assert(t.server_name() == "www.google.com");
+
+        t = {};
+        assert(SNI_RNOTFOUND == extract_sni(t, SSL_CLI_HELLO_NOTLSHOST, sizeof(SSL_CLI_HELLO_NOTLSHOST), step));
+
+        t = {};
+        assert(SNI_RERR == extract_sni(t, SSL_CLI_HELLO_BAD, sizeof(SSL_CLI_HELLO_BAD), step));
+
+        t = {};
+        assert(SNI_RERR == extract_sni(t, SERV_HELLO, sizeof(SERV_HELLO), step));
+    }
+
+    // Client Hello split into several records
+    static constexpr size_t REC_HEADER_SIZE = 5;
+    static constexpr size_t FRAGMENT_SIZE = 50;
+    std::vector<uint8_t> records;
+    const uint8_t *hello = SSL_CLI_HELLO_TLSV13 + REC_HEADER_SIZE;
+    size_t hello_size = sizeof(SSL_CLI_HELLO_TLSV13) - REC_HEADER_SIZE;
+    for (size_t i = 0; i < hello_size; i += FRAGMENT_SIZE) {
+        size_t n = std::min(FRAGMENT_SIZE, hello_size - i);
+        records.insert(records.end(), {0x16, 0x03, 0x01, 0x00, uint8_t(n)});
+        records.insert(records.end(), hello + i, hello + i + n);
+    }
+    for (size_t step : {size_t(1), size_t(13), records.size()}) {
+        TlsSniExtractor t;
+        assert(SNI_RFOUND == extract_sni(t, records.data(), records.size(), step));
+        assert(t.server_name() == "www.google.com");
+    }
+}
+
 int main() {
     test_tls_reader();
     test_tls_long_rec();
+    test_sni_extractor();
 
     printf("%s\n", "OK");
     return 0;
@@ -74,6 +74,8 @@ typedef struct {
     size_t iovlen;                    /**< message vector size */
     const struct evbuffer_iovec *iov; /**< message vector */
     int result; /**< operation result - filled by caller: >= 0 if successful, negative otherwise */
+    /** Owner of the message buffers, may be referenced to keep the data after the event (null if may not) */
+    const VpnBufferRef *buffer;
 } TcpipReadEvent;
 
 typedef struct {
@@ -95,6 +97,16 @@ typedef struct {
     } packet;                                /**< note, that it's a single packet which should be sent in one piece */
 } TcpipTunOutputEvent;
 
+/**
+ * Statistics of packets read from the TUN device in fd mode
+ */
+typedef struct {
+    uint64_t wakeups;    /**< number of TUN read events handled */
+    uint64_t packets;    /**< total number of packets read from TUN device */
+    uint32_t last_batch; /**< number of packets processed on the latest wakeup */
+    uint32_t max_batch;  /**< maximum number of packets processed on a single wakeup */
+} TcpipTunIngressStats;
+
 /**
  * This structure holds user-provided callback functions, needed for
  * TCP/IP connect procedure
@@ -113,6 +125,11 @@ typedef struct {
     uint32_t mtu_size;         /**< Maximum transfer unit for TCP protocol (if 0 `DEFAULT_MTU_SIZE` will be used) */
     const char *pcap_filename; /**< Pcap file name */
     TcpipHandler handler;      /**< callbacks structure for TCP connection (@see tcpip_callbacks_t) */
+    /**
+     * Linux only: packets on `tun_fd` are prefixed with `struct virtio_net_hdr` (device is opened with
+     * `IFF_VNET_HDR`). Checksum offloads and TCP segmentation offloads are handled in both directions.
+     */
+    bool vnet_hdr;
 } TcpipParameters;
 
 /**
@@ -197,6 +214,12 @@ void tcpip_close_connection(TcpipCtx *ctx, uint64_t id, bool graceful);
  */
 TcpFlowCtrlInfo tcpip_flow_ctrl_info(const TcpipCtx *ctx, uint64_t id);
 
+/**
+ * Get statistics of packets read from the TUN device
+ * @param ctx context of TCP/IP stack
+ */
+TcpipTunIngressStats tcpip_get_tun_ingress_stats(const TcpipCtx *ctx);
+
 /**
  * Process ICMP echo reply
  * @param ctx context of TCP/IP stack
@@ -55,6 +55,7 @@ static void process_forwarded_connection(TcpConnDescriptor *);
 static void process_rejected_connection(TcpConnDescriptor *);
 static void process_dropped_connection(TcpConnDescriptor *);
 static void process_unreachable_connection(TcpConnDescriptor *);
+static void timeout_callback(void *arg);
 
 static void tcp_refresh_connection_timeout(TcpConnDescriptor *connection) {
     int timeout;
@@ -271,11 +272,12 @@ void tcp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id, bool graceful) {
     free(connection); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
 }
 
-int tcp_cm_receive(TcpConnDescriptor *connection, size_t iovlen, const evbuffer_iovec *iov) {
+int tcp_cm_receive(
+        TcpConnDescriptor *connection, size_t iovlen, const evbuffer_iovec *iov, const VpnBufferRef *buffer) {
     TcpipCtx *ctx = connection->common.parent_ctx;
     TcpipHandler *callbacks = &ctx->parameters.handler;
 
-    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0};
+    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0, buffer};
     callbacks->handler(callbacks->arg, TCPIP_EVENT_READ, &event);
 
     return event.result;
@@ -297,6 +299,7 @@ TcpConnDescriptor *tcp_cm_create_descriptor(TcpipCtx *ctx, struct pbuf *buffer,
 
     common->addr = {*src_addr, src_port, *dst_addr, dst_port};
     common->parent_ctx = ctx;
+    common->timeout_timer = {.callback = timeout_callback, .arg = connection};
 
     connection->buffer = buffer;
 
@@ -334,7 +337,7 @@ void tcp_cm_request_connection(TcpipCtx *ctx, TcpConnDescriptor *connection) {
     callbacks->handler(callbacks->arg, TCPIP_EVENT_CONNECT_REQUEST, &event);
 }
 
-void tcp_cm_timer_tick(TcpipCtx *ctx) {
+static void timeout_callback(void *arg) {
     /*
      * Idle timeout for established TCP connections is disabled (set to 1 week)
      * TCP/IP stack should close TCP connections only if one of endpoints is disconnected.
@@ -347,20 +350,11 @@ void tcp_cm_timer_tick(TcpipCtx *ctx) {
      *
      * For tunneled connections, there is 30 seconds timeout for connecting to remote host.
      */
-
-    timeval now;
-    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &now);
-
-    khash_t(connections_by_id) *table = ctx->tcp.connections.by_id;
-    for (khiter_t it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
-            continue;
-        }
-        auto *conn = (TcpConnDescriptor *) kh_value(table, it);
-        if (timercmp(&conn->common.conn_timeout, &now, <)) {
-            log_conn(conn, dbg, "Connection has timed out in state {}", tcp_conn_state_str(conn->state));
-            tcp_cm_close_descriptor(ctx, conn->common.id, false);
-        }
+    auto *conn = (TcpConnDescriptor *) arg;
+    TcpipCtx *ctx = conn->common.parent_ctx;
+    if (tcpip_connection_timed_out(ctx, &conn->common)) {
+        log_conn(conn, dbg, "Connection has timed out in state {}", tcp_conn_state_str(conn->state));
+        tcp_cm_close_descriptor(ctx, conn->common.id, false);
     }
 }
 
@@ -83,10 +83,12 @@ void tcp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id, bool graceful);
  * @param descriptor connection descriptor
  * @param data received data
  * @param size size of received data
+ * @param buffer owner of the received data (see `TcpipReadEvent`)
  *
  * @return     0 if success, -1 otherwise
  */
-int tcp_cm_receive(TcpConnDescriptor *descriptor, size_t iovlen, const struct evbuffer_iovec *iov);
+int tcp_cm_receive(
+        TcpConnDescriptor *descriptor, size_t iovlen, const struct evbuffer_iovec *iov, const VpnBufferRef *buffer);
 
 /**
  * Creates and initializes new TCP connection descriptor
@@ -112,13 +114,6 @@ TcpConnDescriptor *tcp_cm_create_descriptor(TcpipCtx *ctx, struct pbuf *buffer,
  */
 void tcp_cm_request_connection(TcpipCtx *ctx, TcpConnDescriptor *descriptor);
 
-/**
- * Notifies TCP connection manager of timer tick event
- *
- * @param ctx initialized earlier TCP/IP context instance
- */
-void tcp_cm_timer_tick(TcpipCtx *ctx);
-
 /**
  * Notifies TCP connection manager of accept event on connection
  *
@@ -21,6 +21,7 @@
 #include "tcp_connection.h"
 #include "tcp_raw.h"
 #include "tcpip_common.h"
+#include "vpn_packet_pool.h"
 
 namespace ag {
 
@@ -111,7 +112,21 @@ static err_t tcp_raw_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
     return ERR_OK;
 }
 
-static err_t process_data(TcpConnDescriptor *conn, const struct pbuf *buffer) {
+/**
+ * How many times the memory pinned by a referenced chain may exceed its payload. The queues count only
+ * the payload bytes, so a small segment in a large packet block is copied rather than held.
+ */
+static constexpr size_t MAX_REFERENCED_OVERHEAD = 2;
+
+static void ref_buffer(void *arg) {
+    pbuf_ref((struct pbuf *) arg);
+}
+
+static void unref_buffer(const void *, size_t, void *arg) {
+    pbuf_free((struct pbuf *) arg);
+}
+
+static err_t process_data(TcpConnDescriptor *conn, struct pbuf *buffer) {
     log_conn(conn, trace, "send {} bytes", buffer->len);
 
     size_t chain_length = pbuf_clen(buffer);
@@ -125,7 +140,17 @@ static err_t process_data(TcpConnDescriptor *conn, const struct pbuf *buffer) {
         });
     }
 
-    int recv_result = tcp_cm_receive(conn, iov.size(), iov.data());
+    // The head of the chain keeps the rest of it alive, so a reference to it covers all the data.
+    // The data the stack does not own (e.g. the Wintun ring) must be released as soon as possible,
+    // and a mostly empty packet block is not worth keeping, so these are copied by the receiver.
+    size_t held = 0;
+    for (const struct pbuf *iter = buffer; iter != nullptr && held != SIZE_MAX; iter = iter->next) {
+        size_t size = VpnPacketPool::held_size(iter);
+        held = (size == SIZE_MAX) ? SIZE_MAX : held + size;
+    }
+    VpnBufferRef ref = {ref_buffer, unref_buffer, buffer};
+    bool by_reference = held <= MAX_REFERENCED_OVERHEAD * buffer->tot_len;
+    int recv_result = tcp_cm_receive(conn, iov.size(), iov.data(), by_reference ? &ref : nullptr);
     if (0 > recv_result) {
         // Negative result means connection is closed during receive
         return ERR_ABRT;
@@ -137,6 +137,10 @@ TcpFlowCtrlInfo tcpip_flow_ctrl_info(const TcpipCtx *ctx, uint64_t id) {
     return {};
 }
 
+TcpipTunIngressStats tcpip_get_tun_ingress_stats(const TcpipCtx *ctx) {
+    return ctx->tun_ingress_stats;
+}
+
 void tcpip_process_icmp_echo_reply(TcpipCtx *ctx, const IcmpEchoReply *reply) {
     icmp_rm_process_reply(ctx, reply);
 }
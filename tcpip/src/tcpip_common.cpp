@@ -4,6 +4,7 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
@@ -31,20 +32,18 @@
 
 namespace ag {
 
-#define TIMER_PERIOD_S (TCPIP_DEFAULT_CONNECTION_TIMEOUT_S / 10)
-
 /**
  * Read at most this much packets from TUN fd
  * before deferring until the next event loop iteration.
+ * All the packets read on a single wakeup are passed to the stack as one batch.
  */
 static constexpr size_t TUN_READ_BUDGET = 64;
 
-static constexpr int DEFAULT_PACKET_POOL_SIZE = 25;
+// A whole batch is held until it is processed, plus some blocks may be retained by lwIP
+static constexpr int DEFAULT_PACKET_POOL_SIZE = 2 * TUN_READ_BUDGET;
+// Only the headers are pooled for the packets passed to `tcpip_tun_input`, which are allocated by the caller
+static constexpr uint32_t PBUF_HEADER_POOL_MTU = 0;
 static constexpr const char *NETIF_NAME = "tn";
-static constexpr TimerTickNotifyFn TIMER_TICK_NOTIFIERS[] = {
-        tcp_cm_timer_tick,
-        udp_cm_timer_tick,
-};
 
 static void dump_packet_to_pcap(TcpipCtx *ctx, const uint8_t *data, size_t len);
 static void dump_packet_iovec_to_pcap(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks);
@@ -56,7 +55,12 @@ static err_t tun_output_to_utun_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chun
 #ifndef _WIN32
 static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks);
 #endif
+#ifdef __linux__
+static err_t tun_output_to_vnet_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks);
+#endif
 static err_t tun_output_to_callback(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family);
+static err_t write_tun_output(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family);
+static void flush_held_acks(TcpipCtx *ctx);
 
 static err_t tun_output(const struct netif *netif, const struct pbuf *packet_buffer, int family) {
     auto *ctx = (TcpipCtx *) netif->state;
@@ -75,26 +79,51 @@ static err_t tun_output(const struct netif *netif, const struct pbuf *packet_buf
 
     tracelog(ctx->logger, "TUN output: {} bytes", (int) packet_buffer->tot_len);
 
+    if (ctx->acks != nullptr) {
+        if (ctx->acks->hold({chunks.data(), chunks.size()}, family)) {
+            tracelog(ctx->logger, "TUN output: holding ACK until the input batch is processed");
+            return ERR_OK;
+        }
+        // Keep the order of the packets
+        flush_held_acks(ctx);
+    }
+
+    return write_tun_output(ctx, {chunks.data(), chunks.size()}, family);
+}
+
+static err_t write_tun_output(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family) {
     err_t err;
     if (ctx->parameters.tun_fd != -1) {
 #ifdef __MACH__
-        err = tun_output_to_utun_fd(ctx, {chunks.data(), chunks.size()}, family);
+        err = tun_output_to_utun_fd(ctx, chunks, family);
+#elif defined __linux__
+        err = ctx->parameters.vnet_hdr ? tun_output_to_vnet_fd(ctx, chunks) : tun_output_to_fd(ctx, chunks);
 #elif !defined _WIN32
-        err = tun_output_to_fd(ctx, {chunks.data(), chunks.size()});
+        err = tun_output_to_fd(ctx, chunks);
 #else
         err = ERR_ARG;
 #endif
     } else {
-        err = tun_output_to_callback(ctx, {chunks.data(), chunks.size()}, family);
+        err = tun_output_to_callback(ctx, chunks, family);
     }
 
     if (err == ERR_OK && ctx->pcap_fd != -1) {
-        dump_packet_iovec_to_pcap(ctx, {chunks.data(), chunks.size()});
+        dump_packet_iovec_to_pcap(ctx, chunks);
     }
 
     return err;
 }
 
+static void flush_held_acks(TcpipCtx *ctx) {
+    for (const TunAckCoalescer::Ack &ack : ctx->acks->held()) {
+        evbuffer_iovec chunk = {.iov_base = (void *) ack.data, .iov_len = ack.length};
+        if (err_t err = write_tun_output(ctx, {&chunk, 1}, ack.family); err != ERR_OK) {
+            dbglog(ctx->logger, "TUN output: failed to write held ACK ({})", err);
+        }
+    }
+    ctx->acks->reset();
+}
+
 static err_t tun_output_to_callback(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family) {
     TcpipTunOutputEvent info = {family, {chunks.size(), chunks.data()}};
 
@@ -122,6 +151,52 @@ static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks) {
 }
 #endif // !defined _WIN32
 
+#ifdef __linux__
+static err_t flush_gso_segments(TcpipCtx *ctx) {
+    if (ctx->gso->empty()) {
+        return ERR_OK;
+    }
+
+    TunVnetHdr hdr{};
+    std::span<const uint8_t> packet = ctx->gso->finish(&hdr);
+    tracelog(ctx->logger, "TUN output: {} segments in {} bytes", ctx->gso->segments(), packet.size());
+    evbuffer_iovec chunks[] = {{.iov_base = &hdr, .iov_len = sizeof(hdr)},
+            {.iov_base = (void *) packet.data(), .iov_len = packet.size()}};
+    err_t err = tun_output_to_fd(ctx, chunks);
+    ctx->gso->reset();
+    return err;
+}
+
+static void gso_flush_callback(evutil_socket_t, short, void *arg) {
+    flush_gso_segments((TcpipCtx *) arg);
+}
+
+static err_t tun_output_to_vnet_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks) {
+    TunGsoCoalescer::AppendResult result = ctx->gso->append(chunks);
+    if (result == TunGsoCoalescer::GSO_MISMATCH) {
+        flush_gso_segments(ctx);
+        result = ctx->gso->append(chunks);
+    }
+    if (result == TunGsoCoalescer::GSO_APPENDED) {
+        if (ctx->gso->segments() == 1) {
+            // Write the super-packet out after the stack is done with the current batch of events
+            event_active(ctx->gso_flush_event, 0, 0);
+        }
+        return ERR_OK;
+    }
+
+    // Keep the order of the packets
+    flush_gso_segments(ctx);
+
+    TunVnetHdr hdr{};
+    std::vector<evbuffer_iovec> new_chunks;
+    new_chunks.reserve(chunks.size() + 1);
+    new_chunks.push_back({.iov_base = &hdr, .iov_len = sizeof(hdr)});
+    new_chunks.insert(new_chunks.end(), chunks.begin(), chunks.end());
+    return tun_output_to_fd(ctx, {new_chunks.data(), new_chunks.size()});
+}
+#endif // __linux__
+
 #ifdef __MACH__
 struct UtunHdr {
     int family;
@@ -161,21 +236,20 @@ static err_t netif_init_cb(struct netif *netif) {
 }
 
 enum TunReadStatus {
-    TRS_OK,   // data was read from tun device and sent to netif driver
+    TRS_OK,   // data was read from tun device
     TRS_DROP, // read data was malformed, so another read is required
     TRS_STOP  // no more data can be read from tun device
 };
 
 /**
- * Read data from tun device and send it to netif driver.
- * If packet is VpnPacket was sent to netif driver, its destructor will be called on the driver's side,
- * else call VpnPacket's destructor manually to avoid leak.
+ * Read a single packet from tun device.
+ * If status is not `TRS_OK`, the caller must call VpnPacket's destructor manually to avoid leak.
  * @param ctx context holder for tcp/ip stack
  * @param packet container for reading data from tun device
  * @return see TunReadStatus fields description
  */
 #ifdef __MACH__
-static TunReadStatus process_data_from_utun(TcpipCtx *ctx, VpnPacket *packet) {
+static TunReadStatus read_data_from_utun(TcpipCtx *ctx, VpnPacket *packet) {
     UtunHdr hdr{};
 
     static constexpr int HDR_SIZE = sizeof(hdr);
@@ -195,53 +269,56 @@ static TunReadStatus process_data_from_utun(TcpipCtx *ctx, VpnPacket *packet) {
 
     tracelog(ctx->logger, "data from UTUN: {} bytes", bytes_read);
     packet->size = bytes_read - HDR_SIZE;
-    process_input_packet(ctx, packet);
     return TRS_OK;
 }
 #else  /* __MACH__ */
-static TunReadStatus process_data_from_tun(TcpipCtx *ctx, VpnPacket *packet) {
-
-    ssize_t bytes_read = read(ctx->parameters.tun_fd, packet->data, ctx->parameters.mtu_size);
+#ifdef __linux__
+static TunReadStatus read_data_from_vnet_tun(TcpipCtx *ctx, VpnPacket *packet) {
+    TunVnetHdr hdr{};
+    evbuffer_iovec iov[] = {{.iov_base = &hdr, .iov_len = sizeof(hdr)},
+            {.iov_base = packet->data, .iov_len = TUN_VNET_MAX_PACKET_SIZE}};
+    ssize_t bytes_read = readv(ctx->parameters.tun_fd, iov, std::size(iov));
     if (bytes_read <= 0) {
         if (EWOULDBLOCK != errno) {
             errlog(ctx->logger, "data from TUN: read failed (errno={})", strerror(errno));
         }
         return TRS_STOP;
     }
-    packet->size = bytes_read;
-    tracelog(ctx->logger, "data from TUN: {} bytes", bytes_read);
+    if (bytes_read < ssize_t(sizeof(hdr))) {
+        errlog(ctx->logger, "data from TUN: read less than header size bytes");
+        return TRS_DROP;
+    }
 
-    process_input_packet(ctx, packet);
+    packet->size = bytes_read - sizeof(hdr);
+    // Super-packets are passed to the stack as is, but their checksums are left for us to complete
+    if (!tun_vnet_complete_checksum(hdr, packet->data, packet->size)) {
+        dbglog(ctx->logger, "data from TUN: invalid checksum offsets in header, dropping");
+        return TRS_DROP;
+    }
+    tracelog(ctx->logger, "data from TUN: {} bytes (gso type {})", packet->size, hdr.gso_type);
     return TRS_OK;
 }
-#endif /* else of __MACH__ */
+#endif // __linux__
 
-struct ZeroCopyPBuf {
-    pbuf_custom p;
-    VpnPacket v;
-};
-
-static void zerocopy_pbuf_free(struct pbuf *buf) {
-    auto *buf_custom = (ZeroCopyPBuf *) buf;
-    if (buf_custom->v.destructor) {
-        buf_custom->v.destructor(buf_custom->v.destructor_arg, buf_custom->v.data);
+static TunReadStatus read_data_from_tun(TcpipCtx *ctx, VpnPacket *packet) {
+#ifdef __linux__
+    if (ctx->parameters.vnet_hdr) {
+        return read_data_from_vnet_tun(ctx, packet);
     }
-    delete buf_custom;
-}
-
-static pbuf *zerocopy_pbuf_create(VpnPacket *packet) {
-    auto *buf_custom = new ZeroCopyPBuf{};
-    buf_custom->p.custom_free_function = zerocopy_pbuf_free;
-    buf_custom->v = *packet;
+#endif // __linux__
 
-    pbuf *buffer = pbuf_alloced_custom(
-            PBUF_RAW, buf_custom->v.size, PBUF_REF, &buf_custom->p, buf_custom->v.data, u16_t(buf_custom->v.size));
-    if (buffer == nullptr) {
-        delete buf_custom;
-        return nullptr;
+    ssize_t bytes_read = read(ctx->parameters.tun_fd, packet->data, ctx->parameters.mtu_size);
+    if (bytes_read <= 0) {
+        if (EWOULDBLOCK != errno) {
+            errlog(ctx->logger, "data from TUN: read failed (errno={})", strerror(errno));
+        }
+        return TRS_STOP;
     }
-    return buffer;
+    packet->size = bytes_read;
+    tracelog(ctx->logger, "data from TUN: {} bytes", bytes_read);
+    return TRS_OK;
 }
+#endif /* else of __MACH__ */
 
 static void process_input_packet(TcpipCtx *ctx, VpnPacket *packet) {
     // Dump to PCap
@@ -249,7 +326,14 @@ static void process_input_packet(TcpipCtx *ctx, VpnPacket *packet) {
         dump_packet_to_pcap(ctx, packet->data, packet->size);
     }
 
-    pbuf *buffer = zerocopy_pbuf_create(packet);
+    pbuf *buffer = ctx->pool->make_pbuf(packet);
+    if (buffer == nullptr) {
+        errlog(ctx->logger, "data from TUN: failed to wrap packet into pbuf");
+        if (packet->destructor) {
+            packet->destructor(packet->destructor_arg, packet->data);
+        }
+        return;
+    }
     err_t result = netif_input(buffer, ctx->netif);
 
     if (ERR_OK != result) {
@@ -268,26 +352,39 @@ static void tun_event_callback(evutil_socket_t fd, short ev_flag, void *arg) {
             (ev_flag & EV_READ) ? " read" : "", (ev_flag & EV_WRITE) ? " write" : "",
             (ev_flag & EV_SIGNAL) ? " signal" : "");
 
+    VpnPacket batch[TUN_READ_BUDGET];
+    uint32_t batch_size = 0;
     for (size_t i = 0; i < TUN_READ_BUDGET; ++i) {
         TunReadStatus status{};
-        VpnPacket packet = ctx->pool->get_packet();
+        VpnPacket *packet = &batch[batch_size];
+        *packet = ctx->pool->get_packet();
 #ifdef __MACH__
-        status = process_data_from_utun(ctx, &packet);
+        status = read_data_from_utun(ctx, packet);
 #else
-        status = process_data_from_tun(ctx, &packet);
+        status = read_data_from_tun(ctx, packet);
 #endif
-        if (status != TRS_OK && packet.destructor) {
-            packet.destructor(packet.destructor_arg, packet.data);
+        if (status == TRS_OK) {
+            ++batch_size;
+            continue;
+        }
+        if (packet->destructor) {
+            packet->destructor(packet->destructor_arg, packet->data);
         }
         if (status == TRS_STOP) {
             break;
         }
     }
-}
 
-static void timer_callback(evutil_socket_t, short, void *arg) {
-    for (auto fn : TIMER_TICK_NOTIFIERS) {
-        fn((TcpipCtx *) arg);
+    TcpipTunIngressStats *stats = &ctx->tun_ingress_stats;
+    stats->wakeups += 1;
+    stats->packets += batch_size;
+    stats->last_batch = batch_size;
+    stats->max_batch = std::max(stats->max_batch, batch_size);
+    tracelog(ctx->logger, "tun event: read {} packets", batch_size);
+
+    if (batch_size > 0) {
+        VpnPackets packets = {.data = batch, .size = batch_size};
+        tcpip_process_input_packets(ctx, &packets);
     }
 }
 
@@ -314,21 +411,15 @@ static bool configure_events(TcpipCtx *ctx) {
         ctx->tun_event = nullptr;
     }
 
-    ctx->timer_event = event_new(ev_base, EVENT_WITHOUT_FD, EV_PERSIST, timer_callback, ctx);
-    if (nullptr == ctx->timer_event) {
-        errlog(ctx->logger, "init: failed to create event");
-        event_free(ctx->tun_event);
-        return false;
-    }
-
-    static constexpr struct timeval TV = {.tv_sec = TIMER_PERIOD_S, .tv_usec = 0};
-    int add_result = event_add(ctx->timer_event, &TV);
-    if (-1 == add_result) {
-        errlog(ctx->logger, "configure: failed to add TUN event");
-        event_free(ctx->tun_event);
-        event_free(ctx->timer_event);
-        return false;
+#ifdef __linux__
+    if (ctx->gso != nullptr) {
+        ctx->gso_flush_event = event_new(ev_base, EVENT_WITHOUT_FD, 0, gso_flush_callback, ctx);
+        if (nullptr == ctx->gso_flush_event) {
+            errlog(ctx->logger, "configure: failed to create GSO flush event");
+            return false;
+        }
     }
+#endif // __linux__
 
     tracelog(ctx->logger, "configure: OK");
     return true;
@@ -336,6 +427,7 @@ static bool configure_events(TcpipCtx *ctx) {
 
 static void release_resources(TcpipCtx *ctx) {
     delete ctx->pool;
+    delete ctx->gso;
 
     if (ctx->parameters.tun_fd != -1) {
         close(ctx->parameters.tun_fd);
@@ -355,8 +447,9 @@ static void clean_up_events(TcpipCtx *ctx) {
         ctx->tun_event = nullptr;
     }
 
-    if (ctx->timer_event != nullptr) {
-        event_free(ctx->timer_event);
+    if (ctx->gso_flush_event != nullptr) {
+        event_free(ctx->gso_flush_event);
+        ctx->gso_flush_event = nullptr;
     }
 }
 
@@ -369,8 +462,21 @@ TcpipCtx *tcpip_init_internal(const TcpipParameters *params) {
 
     ctx->parameters = *params;
     ctx->parameters.mtu_size = (0 == ctx->parameters.mtu_size) ? DEFAULT_MTU_SIZE : ctx->parameters.mtu_size;
-    if (ctx->parameters.tun_fd != -1) {
-        ctx->pool = new VpnPacketPool(DEFAULT_PACKET_POOL_SIZE, ctx->parameters.mtu_size);
+#ifdef __linux__
+    if (ctx->parameters.tun_fd != -1 && ctx->parameters.vnet_hdr) {
+        // Incoming super-packets are much larger than MTU
+        ctx->pool = new VpnPacketPool(DEFAULT_PACKET_POOL_SIZE, TUN_VNET_MAX_PACKET_SIZE);
+        ctx->gso = new TunGsoCoalescer;
+    }
+#else
+    if (ctx->parameters.vnet_hdr) {
+        warnlog(ctx->logger, "init: virtio-net header is supported only on Linux, ignoring");
+        ctx->parameters.vnet_hdr = false;
+    }
+#endif // __linux__
+    if (ctx->pool == nullptr) {
+        ctx->pool = new VpnPacketPool(DEFAULT_PACKET_POOL_SIZE,
+                (ctx->parameters.tun_fd != -1) ? ctx->parameters.mtu_size : PBUF_HEADER_POOL_MTU);
     }
     if (!configure_events(ctx)) {
         errlog(ctx->logger, "init: failed to create events");
@@ -419,9 +525,22 @@ static void release_lwip_resources(TcpipCtx *ctx) {
 }
 
 void tcpip_close_internal(TcpipCtx *ctx) {
+    if (ctx->tun_ingress_stats.wakeups > 0) {
+        const TcpipTunIngressStats &stats = ctx->tun_ingress_stats;
+        dbglog(ctx->logger, "TUN ingress: {} packets on {} wakeups (max batch {})", stats.packets, stats.wakeups,
+                stats.max_batch);
+    }
+
     tcp_cm_close(ctx);
     udp_cm_close(ctx);
     icmp_rm_close(ctx);
+#ifdef __linux__
+    // The flush event is about to be freed, so write out the segments coalesced so far,
+    // including the ones sent while closing the connections
+    if (ctx->gso != nullptr) {
+        flush_gso_segments(ctx);
+    }
+#endif // __linux__
 
     release_lwip_resources(ctx);
     clean_up_events(ctx);
@@ -441,6 +560,31 @@ void tcpip_refresh_connection_timeout_with_interval(TcpipCtx *ctx, TcpipConnecti
     timeout_interval.tv_usec = 0;
 
     evutil_timeradd(&current_time, &timeout_interval, &connection->conn_timeout);
+
+    // Timeouts are refreshed on every packet, but mostly move forward. So the timer is re-armed
+    // only if the deadline gets earlier, otherwise it is re-armed for the time left once it fires.
+    if (!vpn_event_loop_timer_is_pending(&connection->timeout_timer)
+            || timercmp(&connection->conn_timeout, &connection->timer_deadline, <)) {
+        connection->timer_deadline = connection->conn_timeout;
+        vpn_event_loop_timer_start(
+                ctx->parameters.event_loop, &connection->timeout_timer, Millis(timeval_to_ms(timeout_interval)));
+    }
+}
+
+bool tcpip_connection_timed_out(TcpipCtx *ctx, TcpipConnection *connection) {
+    timeval current_time{};
+    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &current_time);
+    if (!timercmp(&current_time, &connection->conn_timeout, <)) {
+        return true;
+    }
+
+    timeval time_left{};
+    evutil_timersub(&connection->conn_timeout, &current_time, &time_left);
+    connection->timer_deadline = connection->conn_timeout;
+    // Round up, so that the timer does not fire right before the deadline
+    vpn_event_loop_timer_start(
+            ctx->parameters.event_loop, &connection->timeout_timer, Millis(timeval_to_ms(time_left) + 1));
+    return false;
 }
 
 static void dump_packet_to_pcap(TcpipCtx *ctx, const uint8_t *data, size_t len) {
@@ -495,11 +639,24 @@ static void open_pcap_file(TcpipCtx *ctx, const char *pcap_filename) {
 void tcpip_process_input_packets(TcpipCtx *ctx, VpnPackets *packets) {
     tracelog(ctx->logger, "TUN: processing {} input packets", packets->size);
 
+    // lwIP acknowledges every other segment, so the pure ACKs produced for the batch are held
+    // and only the latest one of each flow is written once the whole batch is processed
+    TunAckCoalescer acks;
+    bool coalesce_acks = packets->size > 1 && ctx->acks == nullptr;
+    if (coalesce_acks) {
+        ctx->acks = &acks;
+    }
+
     for (size_t i = 0; i < packets->size; ++i) {
         tracelog(ctx->logger, "TUN: packet length {}", packets->data[i].size);
         process_input_packet(ctx, &packets->data[i]);
     }
 
+    if (coalesce_acks) {
+        flush_held_acks(ctx);
+        ctx->acks = nullptr;
+    }
+
     tracelog(ctx->logger, "TUN: processed {} input packets", packets->size);
 }
 
@@ -571,6 +728,8 @@ int tcpip_put_connection(ConnectionTables *tables, TcpipConnection *connection)
 }
 
 void tcpip_remove_connection(ConnectionTables *tables, TcpipConnection *connection) {
+    vpn_event_loop_timer_stop(connection->parent_ctx->parameters.event_loop, &connection->timeout_timer);
+
     khiter_t iter = kh_get(connections_by_id, tables->by_id, connection->id);
     if (iter != kh_end(tables->by_id)) {
         kh_del(connections_by_id, tables->by_id, iter);
@@ -16,6 +16,8 @@
 #include "icmp_request_manager.h"
 #include "tcp_conn_manager.h"
 #include "tcpip/tcpip.h"
+#include "tun_ack_coalescer.h"
+#include "tun_vnet.h"
 #include "udp_conn_manager.h"
 #include "vpn/utils.h"
 #include "vpn_packet_pool.h"
@@ -27,21 +29,22 @@
 namespace ag {
 
 struct TcpipCtx {
-    TcpipParameters parameters; /**< Parameters of TCP/IP stack */
-    uint8_t *tun_input_buffer;  /**< Buffer for incoming data of TUN device */
-    struct event *tun_event;    /**< Event for TUN data handling */
-    struct event *timer_event;  /**< General timer event */
-    TcpCtx tcp;                 /**< TCP connections context */
-    UdpCtx udp;                 /**< UDP connections context */
-    IcmpCtx icmp;               /**< ICMP requests context */
-    struct netif *netif;        /**< Network interface */
-    int pcap_fd;                /**< PCap output file descriptor */
-    VpnPacketPool *pool;        /**< Pool with pre-allocated data blocks for VpnPackets */
+    TcpipParameters parameters;             /**< Parameters of TCP/IP stack */
+    uint8_t *tun_input_buffer;              /**< Buffer for incoming data of TUN device */
+    struct event *tun_event;                /**< Event for TUN data handling */
+    TcpCtx tcp;                             /**< TCP connections context */
+    UdpCtx udp;                             /**< UDP connections context */
+    IcmpCtx icmp;                           /**< ICMP requests context */
+    struct netif *netif;                    /**< Network interface */
+    int pcap_fd;                            /**< PCap output file descriptor */
+    VpnPacketPool *pool;                    /**< Pool of VpnPacket blocks (only lwIP headers if there is no TUN fd) */
+    TcpipTunIngressStats tun_ingress_stats; /**< Statistics of packets read from TUN device */
+    TunGsoCoalescer *gso;                   /**< Coalescer of outgoing TCP segments (vnet header mode) */
+    struct event *gso_flush_event;          /**< Event for writing out coalesced TCP segments */
+    TunAckCoalescer *acks;                  /**< Holder of pure ACKs while a batch of input packets is processed */
     ag::Logger logger{"TCPIP.COMMON"};
 };
 
-typedef void (*TimerTickNotifyFn)(TcpipCtx *ctx);
-
 /**
  * Private TCP/IP initialize function
  *
@@ -76,6 +79,16 @@ void tcpip_refresh_connection_timeout_with_interval(TcpipCtx *ctx, TcpipConnecti
  */
 void tcpip_refresh_connection_timeout(TcpipCtx *ctx, TcpipConnection *connection);
 
+/**
+ * Checks if connection has timed out. If not, re-arms the connection timeout timer for the time left.
+ * Intended to be called from the timeout timer callback.
+ *
+ * @param ctx pointer to TCP/IP context
+ * @param connection connection
+ * @return true if connection has timed out
+ */
+bool tcpip_connection_timed_out(TcpipCtx *ctx, TcpipConnection *connection);
+
 /**
  * Passes incoming packet to native TCP/IP stack and waits synchronously while they'll be processed
  * @param ctx pointer to context of TCP/IP stack
@@ -9,6 +9,7 @@
 #include <lwip/ip_addr.h>
 
 #include "tcpip/tcpip.h"
+#include "vpn/event_loop.h"
 
 namespace ag {
 
@@ -23,10 +24,12 @@ typedef struct {
  * Common part of TCP/IP connections
  */
 typedef struct {
-    uint64_t id;                 /**< Connection request ID */
-    AddressPair addr;            /**< Source-destination address pair */
-    TcpipCtx *parent_ctx;        /**< Parent tcpip context structure */
-    struct timeval conn_timeout; /**< The moment when connection will be timed out */
+    uint64_t id;                     /**< Connection request ID */
+    AddressPair addr;                /**< Source-destination address pair */
+    TcpipCtx *parent_ctx;            /**< Parent tcpip context structure */
+    struct timeval conn_timeout;     /**< The moment when connection will be timed out */
+    struct timeval timer_deadline;   /**< The moment `timeout_timer` is armed for */
+    VpnEventLoopTimer timeout_timer; /**< Checks the connection timeout, set up by the connection manager */
 } TcpipConnection;
 
 uint64_t addr_pair_hash(const AddressPair *addr);
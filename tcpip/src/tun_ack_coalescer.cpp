@@ -0,0 +1,137 @@
+#include "tun_ack_coalescer.h"
+
+#include <cstring>
+
+namespace ag {
+
+static constexpr uint8_t IP_PROTO_TCP = 6;
+
+static constexpr size_t IPV4_MIN_HDR_LEN = 20;
+static constexpr size_t IPV6_HDR_LEN = 40;
+static constexpr size_t TCP_MIN_HDR_LEN = 20;
+static constexpr size_t TCP_ACK_OFFSET = 8;
+static constexpr size_t TCP_FLAGS_OFFSET = 13;
+
+static constexpr uint8_t TCP_FLAG_ACK = 0x10;
+
+static constexpr uint8_t TCP_OPT_END = 0;
+static constexpr uint8_t TCP_OPT_NOP = 1;
+static constexpr uint8_t TCP_OPT_SACK = 5;
+
+static uint16_t load_u16(const uint8_t *p) {
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+static uint32_t load_u32(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+/**
+ * Get the IP header length of a pure ACK
+ * @return 0 if the packet is not a pure ACK or carries SACK blocks
+ */
+static size_t pure_ack_ip_hdr_len(const uint8_t *packet, size_t length) {
+    size_t ip_hdr_len = 0;
+    if (length >= IPV6_HDR_LEN && (packet[0] >> 4) == 6) {
+        if (packet[6] != IP_PROTO_TCP || IPV6_HDR_LEN + load_u16(packet + 4) != length) {
+            return 0;
+        }
+        ip_hdr_len = IPV6_HDR_LEN;
+    } else if (length >= IPV4_MIN_HDR_LEN && (packet[0] >> 4) == 4) {
+        ip_hdr_len = (packet[0] & 0x0f) * 4;
+        if (ip_hdr_len < IPV4_MIN_HDR_LEN || packet[9] != IP_PROTO_TCP || load_u16(packet + 2) != length
+                || (load_u16(packet + 6) & 0x3fff) != 0) {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+
+    if (length < ip_hdr_len + TCP_MIN_HDR_LEN) {
+        return 0;
+    }
+    const uint8_t *tcp_hdr = packet + ip_hdr_len;
+    size_t tcp_hdr_len = (tcp_hdr[12] >> 4) * 4;
+    if (tcp_hdr_len < TCP_MIN_HDR_LEN || ip_hdr_len + tcp_hdr_len != length
+            || tcp_hdr[TCP_FLAGS_OFFSET] != TCP_FLAG_ACK) {
+        return 0;
+    }
+
+    // SACK blocks describe the holes in the received data, so each of them must reach the peer
+    for (size_t i = TCP_MIN_HDR_LEN; i < tcp_hdr_len;) {
+        uint8_t kind = tcp_hdr[i];
+        if (kind == TCP_OPT_END) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            i += 1;
+            continue;
+        }
+        if (kind == TCP_OPT_SACK || i + 1 >= tcp_hdr_len || tcp_hdr[i + 1] < 2) {
+            return 0;
+        }
+        i += tcp_hdr[i + 1];
+    }
+
+    return ip_hdr_len;
+}
+
+static bool same_flow(const uint8_t *a, const uint8_t *b, size_t ip_hdr_len) {
+    bool v6 = (a[0] >> 4) == 6;
+    if (v6 != ((b[0] >> 4) == 6)) {
+        return false;
+    }
+    size_t b_ip_hdr_len = v6 ? IPV6_HDR_LEN : (b[0] & 0x0f) * 4;
+    // The addresses and then the ports
+    return (v6 ? 0 == std::memcmp(a + 8, b + 8, 32) : 0 == std::memcmp(a + 12, b + 12, 8))
+            && 0 == std::memcmp(a + ip_hdr_len, b + b_ip_hdr_len, 4);
+}
+
+bool TunAckCoalescer::hold(std::span<const evbuffer_iovec> chunks, int family) {
+    size_t length = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        length += chunk.iov_len;
+    }
+    if (length > MAX_ACK_SIZE) {
+        return false;
+    }
+
+    uint8_t packet[MAX_ACK_SIZE];
+    uint8_t *out = packet;
+    for (const evbuffer_iovec &chunk : chunks) {
+        std::memcpy(out, chunk.iov_base, chunk.iov_len);
+        out += chunk.iov_len;
+    }
+
+    size_t ip_hdr_len = pure_ack_ip_hdr_len(packet, length);
+    if (ip_hdr_len == 0) {
+        return false;
+    }
+
+    Ack *ack = nullptr;
+    for (size_t i = 0; i < m_count; ++i) {
+        if (same_flow(packet, m_acks[i].data, ip_hdr_len)) {
+            ack = &m_acks[i];
+            break;
+        }
+    }
+    if (ack != nullptr) {
+        size_t held_ip_hdr_len = ((ack->data[0] >> 4) == 6) ? IPV6_HDR_LEN : (ack->data[0] & 0x0f) * 4;
+        uint32_t held_ack = load_u32(ack->data + held_ip_hdr_len + TCP_ACK_OFFSET);
+        uint32_t new_ack = load_u32(packet + ip_hdr_len + TCP_ACK_OFFSET);
+        if (int32_t(new_ack - held_ack) <= 0) {
+            return false;
+        }
+    } else if (m_count < MAX_FLOWS) {
+        ack = &m_acks[m_count++];
+    } else {
+        return false;
+    }
+
+    std::memcpy(ack->data, packet, length);
+    ack->length = length;
+    ack->family = family;
+    return true;
+}
+
+} // namespace ag
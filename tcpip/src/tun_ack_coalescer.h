@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <event2/buffer.h>
+
+namespace ag {
+
+/**
+ * Holds the pure TCP ACKs the stack produces while it processes a batch of incoming packets,
+ * so that a flow receiving many segments in one batch gets a single cumulative ACK written
+ * to the TUN device instead of one per couple of segments.
+ *
+ * An ACK replaces the held one of the same flow only if it acknowledges more data, so
+ * duplicate ACKs and window updates reach the peer as they are. The held ACKs must be written
+ * before any other outgoing packet, and at the end of the batch.
+ */
+class TunAckCoalescer {
+public:
+    /** Largest pure ACK: an IPv6 header and a TCP header with the maximum options */
+    static constexpr size_t MAX_ACK_SIZE = 40 + 60;
+    /** Number of the flows whose ACKs may be held at once */
+    static constexpr size_t MAX_FLOWS = 16;
+
+    struct Ack {
+        uint8_t data[MAX_ACK_SIZE];
+        size_t length;
+        int family;
+    };
+
+    /**
+     * Try to hold an outgoing IP packet
+     * @param chunks the packet data
+     * @param family the address family of the packet
+     * @return true if the packet is held, false if it must be written after the held ones
+     */
+    bool hold(std::span<const evbuffer_iovec> chunks, int family);
+
+    /**
+     * Get the held ACKs in the order they were first held
+     */
+    [[nodiscard]] std::span<const Ack> held() const {
+        return {m_acks, m_count};
+    }
+
+    /**
+     * Drop the held ACKs
+     */
+    void reset() {
+        m_count = 0;
+    }
+
+private:
+    Ack m_acks[MAX_FLOWS];
+    size_t m_count = 0;
+};
+
+} // namespace ag
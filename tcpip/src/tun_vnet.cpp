@@ -0,0 +1,216 @@
+#include "tun_vnet.h"
+
+#include <cstring>
+
+namespace ag {
+
+static constexpr uint8_t IP_PROTO_TCP = 6;
+
+static constexpr size_t IPV4_MIN_HDR_LEN = 20;
+static constexpr size_t IPV6_HDR_LEN = 40;
+static constexpr size_t TCP_MIN_HDR_LEN = 20;
+static constexpr size_t TCP_SEQ_OFFSET = 4;
+static constexpr size_t TCP_ACK_OFFSET = 8;
+static constexpr size_t TCP_FLAGS_OFFSET = 13;
+static constexpr size_t TCP_CHECKSUM_OFFSET = 16;
+
+static constexpr uint8_t TCP_FLAG_PSH = 0x08;
+static constexpr uint8_t TCP_FLAG_ACK = 0x10;
+
+static uint16_t load_u16(const uint8_t *p) {
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+static uint32_t load_u32(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+static void store_u16(uint8_t *p, uint16_t v) {
+    p[0] = uint8_t(v >> 8);
+    p[1] = uint8_t(v);
+}
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t length) {
+    for (; length > 1; data += 2, length -= 2) {
+        sum += load_u16(data);
+    }
+    if (length > 0) {
+        sum += uint32_t(data[0]) << 8;
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return uint16_t(sum);
+}
+
+static uint32_t pseudo_header_sum(const uint8_t *ip_hdr, bool v6, size_t tcp_length) {
+    uint32_t sum = 0;
+    if (v6) {
+        // Source and destination addresses lie next to each other
+        sum = checksum_add(sum, ip_hdr + 8, 32);
+        sum += uint32_t(tcp_length >> 16) + uint32_t(tcp_length & 0xffff);
+    } else {
+        sum = checksum_add(sum, ip_hdr + 12, 8);
+        sum += uint32_t(tcp_length);
+    }
+    return sum + IP_PROTO_TCP;
+}
+
+bool tun_vnet_complete_checksum(const TunVnetHdr &hdr, uint8_t *packet, size_t length) {
+    if (!(hdr.flags & TUN_VNET_HDR_F_NEEDS_CSUM)) {
+        return true;
+    }
+
+    size_t start = hdr.csum_start;
+    size_t field = start + hdr.csum_offset;
+    if (start >= length || field + 2 > length) {
+        return false;
+    }
+
+    // The field contains the pseudo-header sum already
+    store_u16(packet + field, uint16_t(~checksum_fold(checksum_add(0, packet + start, length - start))));
+    return true;
+}
+
+TunGsoCoalescer::TunGsoCoalescer()
+        : m_buffer(new uint8_t[TUN_VNET_MAX_PACKET_SIZE]) {
+}
+
+TunGsoCoalescer::AppendResult TunGsoCoalescer::append(std::span<const evbuffer_iovec> chunks) {
+    if (chunks.empty()) {
+        return GSO_NOT_CANDIDATE;
+    }
+
+    size_t length = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        length += chunk.iov_len;
+    }
+
+    // lwIP puts all the headers in the first buffer of a chain
+    const auto *ip_hdr = (const uint8_t *) chunks[0].iov_base;
+    size_t first_len = chunks[0].iov_len;
+    if (first_len < IPV4_MIN_HDR_LEN) {
+        return GSO_NOT_CANDIDATE;
+    }
+
+    size_t ip_hdr_len = 0;
+    bool v6 = (ip_hdr[0] >> 4) == 6;
+    if (v6) {
+        if (first_len < IPV6_HDR_LEN || ip_hdr[6] != IP_PROTO_TCP) {
+            return GSO_NOT_CANDIDATE;
+        }
+        ip_hdr_len = IPV6_HDR_LEN;
+    } else {
+        ip_hdr_len = (ip_hdr[0] & 0x0f) * 4;
+        // Fragmented packets can't be segmented
+        if (ip_hdr_len < IPV4_MIN_HDR_LEN || ip_hdr[9] != IP_PROTO_TCP || (load_u16(ip_hdr + 6) & 0x3fff) != 0) {
+            return GSO_NOT_CANDIDATE;
+        }
+    }
+
+    if (first_len < ip_hdr_len + TCP_MIN_HDR_LEN) {
+        return GSO_NOT_CANDIDATE;
+    }
+    const uint8_t *tcp_hdr = ip_hdr + ip_hdr_len;
+    size_t hdr_len = ip_hdr_len + (tcp_hdr[12] >> 4) * 4;
+    uint8_t flags = tcp_hdr[TCP_FLAGS_OFFSET];
+    if (first_len < hdr_len || length <= hdr_len || (flags & ~(TCP_FLAG_ACK | TCP_FLAG_PSH)) != 0) {
+        return GSO_NOT_CANDIDATE;
+    }
+
+    size_t payload_len = length - hdr_len;
+    uint32_t seq = load_u32(tcp_hdr + TCP_SEQ_OFFSET);
+    if (m_segments == 0) {
+        // `length` fits by definition as the packet went through the stack
+        uint8_t *out = m_buffer.get();
+        for (const evbuffer_iovec &chunk : chunks) {
+            std::memcpy(out, chunk.iov_base, chunk.iov_len);
+            out += chunk.iov_len;
+        }
+        m_length = length;
+        m_segments = 1;
+        m_ip_hdr_len = ip_hdr_len;
+        m_hdr_len = hdr_len;
+        m_gso_size = uint16_t(payload_len);
+        m_next_seq = seq + uint32_t(payload_len);
+        m_tcp_flags = flags;
+        m_closed = false;
+        return GSO_APPENDED;
+    }
+
+    const uint8_t *head = m_buffer.get();
+    const uint8_t *head_tcp = head + m_ip_hdr_len;
+    size_t options_len = hdr_len - ip_hdr_len - TCP_MIN_HDR_LEN;
+    bool same_flow = hdr_len == m_hdr_len && ip_hdr_len == m_ip_hdr_len && (head[0] >> 4) == (ip_hdr[0] >> 4)
+            && (v6 ? 0 == std::memcmp(head + 8, ip_hdr + 8, 32) : 0 == std::memcmp(head + 12, ip_hdr + 12, 8))
+            && 0 == std::memcmp(head_tcp, tcp_hdr, TCP_SEQ_OFFSET)
+            // The kernel copies the options of the first segment to all the others
+            && 0 == std::memcmp(head_tcp + TCP_MIN_HDR_LEN, tcp_hdr + TCP_MIN_HDR_LEN, options_len);
+    if (!same_flow || m_closed || seq != m_next_seq || payload_len > m_gso_size
+            || m_length + payload_len > TUN_VNET_MAX_PACKET_SIZE
+            || 0 != std::memcmp(head_tcp + TCP_ACK_OFFSET, tcp_hdr + TCP_ACK_OFFSET, 4)) {
+        return GSO_MISMATCH;
+    }
+
+    uint8_t *out = m_buffer.get() + m_length;
+    size_t skip = hdr_len;
+    for (const evbuffer_iovec &chunk : chunks) {
+        if (skip >= chunk.iov_len) {
+            skip -= chunk.iov_len;
+            continue;
+        }
+        std::memcpy(out, (const uint8_t *) chunk.iov_base + skip, chunk.iov_len - skip);
+        out += chunk.iov_len - skip;
+        skip = 0;
+    }
+    m_length += payload_len;
+    m_segments += 1;
+    m_next_seq += uint32_t(payload_len);
+    m_tcp_flags |= flags;
+    m_closed = payload_len < m_gso_size;
+    return GSO_APPENDED;
+}
+
+std::span<const uint8_t> TunGsoCoalescer::finish(TunVnetHdr *hdr) {
+    *hdr = {};
+    uint8_t *packet = m_buffer.get();
+    if (m_segments <= 1) {
+        // Checksums were calculated by the stack already
+        return {packet, m_length};
+    }
+
+    bool v6 = (packet[0] >> 4) == 6;
+    if (v6) {
+        store_u16(packet + 4, uint16_t(m_length - IPV6_HDR_LEN));
+    } else {
+        store_u16(packet + 2, uint16_t(m_length));
+        store_u16(packet + 10, 0);
+        store_u16(packet + 10, uint16_t(~checksum_fold(checksum_add(0, packet, m_ip_hdr_len))));
+    }
+
+    // The kernel clears PSH on all the segments except the last one
+    uint8_t *tcp_hdr = packet + m_ip_hdr_len;
+    tcp_hdr[TCP_FLAGS_OFFSET] = m_tcp_flags;
+    store_u16(tcp_hdr + TCP_CHECKSUM_OFFSET, checksum_fold(pseudo_header_sum(packet, v6, m_length - m_ip_hdr_len)));
+
+    hdr->flags = TUN_VNET_HDR_F_NEEDS_CSUM;
+    hdr->gso_type = v6 ? TUN_VNET_HDR_GSO_TCPV6 : TUN_VNET_HDR_GSO_TCPV4;
+    hdr->hdr_len = uint16_t(m_hdr_len);
+    hdr->gso_size = m_gso_size;
+    hdr->csum_start = uint16_t(m_ip_hdr_len);
+    hdr->csum_offset = uint16_t(TCP_CHECKSUM_OFFSET);
+
+    return {packet, m_length};
+}
+
+void TunGsoCoalescer::reset() {
+    m_length = 0;
+    m_segments = 0;
+    m_closed = false;
+}
+
+} // namespace ag
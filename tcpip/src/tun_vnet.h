@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+#include <event2/buffer.h>
+
+namespace ag {
+
+/**
+ * Mirrors `struct virtio_net_hdr` from `linux/virtio_net.h` which can't be included in C++ code.
+ * Prepended to each packet on a TUN descriptor opened with `IFF_VNET_HDR`.
+ */
+struct TunVnetHdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;     // IP + TCP header length
+    uint16_t gso_size;    // bytes to append to `hdr_len` per frame
+    uint16_t csum_start;  // position to start checksumming from
+    uint16_t csum_offset; // offset after that to place checksum
+};
+
+static constexpr uint8_t TUN_VNET_HDR_F_NEEDS_CSUM = 1;
+static constexpr uint8_t TUN_VNET_HDR_GSO_NONE = 0;
+static constexpr uint8_t TUN_VNET_HDR_GSO_TCPV4 = 1;
+static constexpr uint8_t TUN_VNET_HDR_GSO_TCPV6 = 4;
+
+/**
+ * Maximum size of a packet (without `TunVnetHdr`) which may be passed through
+ * the TUN device with offloads enabled
+ */
+static constexpr size_t TUN_VNET_MAX_PACKET_SIZE = UINT16_MAX;
+
+/**
+ * Complete the partial checksum of a packet read from the TUN device as requested by
+ * `TUN_VNET_HDR_F_NEEDS_CSUM`. Does nothing if the flag is not set.
+ * @param hdr the header read along with the packet
+ * @param packet the packet
+ * @param length the packet length
+ * @return false if the header points outside the packet
+ */
+bool tun_vnet_complete_checksum(const TunVnetHdr &hdr, uint8_t *packet, size_t length);
+
+/**
+ * Coalesces consecutive outgoing TCP segments of a single flow into one GSO super-packet,
+ * which is split back into the segments by the kernel
+ */
+class TunGsoCoalescer {
+public:
+    enum AppendResult {
+        GSO_APPENDED,      // the packet is a part of the super-packet now
+        GSO_MISMATCH,      // the packet does not continue the current super-packet, flush it and try again
+        GSO_NOT_CANDIDATE, // the packet can't be a part of any super-packet, write it as is
+    };
+
+    TunGsoCoalescer();
+
+    /**
+     * Try to append an outgoing IP packet to the current super-packet
+     * @param chunks the packet data
+     */
+    AppendResult append(std::span<const evbuffer_iovec> chunks);
+
+    /**
+     * Check if there are no pending segments
+     */
+    [[nodiscard]] bool empty() const {
+        return m_segments == 0;
+    }
+
+    /**
+     * Get the number of segments in the current super-packet
+     */
+    [[nodiscard]] size_t segments() const {
+        return m_segments;
+    }
+
+    /**
+     * Finalize the current super-packet. The coalescer must be reset before the next use.
+     * @param hdr the header to be written in front of the packet
+     * @return the packet data
+     */
+    std::span<const uint8_t> finish(TunVnetHdr *hdr);
+
+    /**
+     * Drop the current super-packet
+     */
+    void reset();
+
+private:
+    std::unique_ptr<uint8_t[]> m_buffer;
+    size_t m_length = 0;
+    size_t m_segments = 0;
+    size_t m_ip_hdr_len = 0;
+    size_t m_hdr_len = 0;
+    uint16_t m_gso_size = 0;
+    uint32_t m_next_seq = 0;
+    uint8_t m_tcp_flags = 0;
+    bool m_closed = false; // the last segment is shorter than `m_gso_size`, so no more can be appended
+};
+
+} // namespace ag
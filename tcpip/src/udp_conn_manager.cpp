@@ -45,6 +45,7 @@ constexpr auto UDP_HEADER_SIZE = 8;
 
 static void process_rejected_connection(UdpConnDescriptor *);
 static void process_forwarded_connection(UdpConnDescriptor *);
+static void timeout_callback(void *arg);
 
 int udp_cm_send_data(UdpConnDescriptor *connection, const uint8_t *data, size_t length) {
     TcpipConnection *common = &connection->common;
@@ -132,7 +133,7 @@ void udp_cm_receive(TcpipCtx *ctx, const ip_addr_t *src_addr, u16_t src_port, co
 
     TcpipHandler *callbacks = &ctx->parameters.handler;
 
-    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0};
+    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0, nullptr};
     callbacks->handler(callbacks->arg, TCPIP_EVENT_READ, &event);
 
     if (event.result >= 0) {
@@ -268,6 +269,7 @@ UdpConnDescriptor *udp_cm_create_descriptor(TcpipCtx *ctx, struct pbuf *buffer,
 
     common->addr = {*src_addr, src_port, *dst_addr, dst_port};
     common->parent_ctx = ctx;
+    common->timeout_timer = {.callback = timeout_callback, .arg = connection};
 
     tcpip_refresh_connection_timeout_with_interval(ctx, common, TCPIP_UDP_TIMEOUT_S);
     tcpip_put_connection(&ctx->udp.connections, common);
@@ -303,20 +305,12 @@ void udp_cm_request_connection(TcpipCtx *ctx, UdpConnDescriptor *connection) {
     callbacks->handler(callbacks->arg, TCPIP_EVENT_CONNECT_REQUEST, &event);
 }
 
-void udp_cm_timer_tick(TcpipCtx *ctx) {
-    struct timeval now;
-    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &now);
-
-    khash_t(connections_by_id) *table = ctx->udp.connections.by_id;
-    for (khiter_t it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
-            continue;
-        }
-        auto *conn = (UdpConnDescriptor *) kh_value(table, it);
-        if (timercmp(&conn->common.conn_timeout, &now, <)) {
-            log_conn(conn, dbg, "Connection has timed out");
-            udp_cm_close_descriptor(ctx, conn->common.id);
-        }
+static void timeout_callback(void *arg) {
+    auto *conn = (UdpConnDescriptor *) arg;
+    TcpipCtx *ctx = conn->common.parent_ctx;
+    if (tcpip_connection_timed_out(ctx, &conn->common)) {
+        log_conn(conn, dbg, "Connection has timed out");
+        udp_cm_close_descriptor(ctx, conn->common.id);
     }
 }
 
@@ -100,13 +100,6 @@ UdpConnDescriptor *udp_cm_create_descriptor(TcpipCtx *ctx, struct pbuf *buffer,
  */
 void udp_cm_request_connection(TcpipCtx *ctx, UdpConnDescriptor *descriptor);
 
-/**
- * Notifies UDP connection manager of timer tick event
- *
- * @param ctx initialized earlier TCP/IP context instance
- */
-void udp_cm_timer_tick(TcpipCtx *ctx);
-
 /**
  * Sends data to TCP/IP stack
  *
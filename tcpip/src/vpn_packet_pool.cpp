@@ -1,73 +1,188 @@
 #include "vpn_packet_pool.h"
 
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 namespace ag {
 
-struct VpnPacketPool::VpnPacketPoolState {
-    VpnPacketPool *pool;
-    std::atomic_size_t refcounter;
-    std::atomic_bool is_alive;
+static constexpr size_t BLOCK_ALIGNMENT = 64;
+// The arena is aligned to the huge page size once it is large enough to occupy one,
+// so that it may be backed by huge pages
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 
-    void retain() {
-        refcounter.fetch_add(1, std::memory_order_relaxed);
-    }
+static constexpr size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+struct VpnPacketPool::Block {
+    pbuf_custom pbuf; // Must be the first: lwIP passes the pointer to it to `free_pbuf`
+    VpnPacket packet; // The packet wrapped into `pbuf`
+    Block *next;      // Next block in a free list
+    State *state;     // The state of the pool the block belongs to
+};
+
+struct VpnPacketPool::State {
+    static constexpr size_t BLOCK_HEADER_SIZE = align_up(sizeof(Block), BLOCK_ALIGNMENT);
+
+    std::atomic_size_t refcounter; // The pool itself plus the blocks in use
+    uint32_t mtu;
+    size_t block_size;
+    size_t arena_size;
+    size_t arena_alignment;
+    uint8_t *arena;
+    size_t carved_count; // Number of the arena blocks handed out at least once, owner thread only
+    Block *free_list;    // Owner thread only
+    size_t free_count;
+    std::atomic<Block *> returned; // The blocks returned since the last time the owner took them over
 
     void release() {
-        if (refcounter.fetch_sub(1, std::memory_order_relaxed) == 1) {
+        if (refcounter.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            ::operator delete(arena, std::align_val_t{arena_alignment});
             delete this;
         }
     }
+
+    [[nodiscard]] bool owns(const Block *block) const {
+        return (const uint8_t *) block >= arena && (const uint8_t *) block < arena + arena_size;
+    }
+
+    [[nodiscard]] static uint8_t *data_of(Block *block) {
+        return (uint8_t *) block + BLOCK_HEADER_SIZE;
+    }
+
+    [[nodiscard]] static Block *block_of(uint8_t *data) {
+        return (Block *) (data - BLOCK_HEADER_SIZE);
+    }
+
+    void take_returned() {
+        Block *list = returned.exchange(nullptr, std::memory_order_acquire);
+        while (list != nullptr) {
+            Block *block = list;
+            list = block->next;
+            block->next = free_list;
+            free_list = block;
+            ++free_count;
+        }
+    }
+
+    Block *take() {
+        if (free_list == nullptr) {
+            take_returned();
+        }
+
+        Block *block = free_list;
+        if (block != nullptr) {
+            free_list = block->next;
+            --free_count;
+        } else if ((carved_count + 1) * block_size <= arena_size) {
+            // The blocks are carved out of the arena in the address order as they are needed,
+            // so the pages of an arena which is never filled up are not touched
+            block = (Block *) &arena[carved_count * block_size];
+            block->state = this;
+            ++carved_count;
+        } else {
+            block = (Block *) ::operator new(block_size, std::align_val_t{BLOCK_ALIGNMENT});
+            block->state = this;
+        }
+        block->next = nullptr;
+        refcounter.fetch_add(1, std::memory_order_relaxed);
+        return block;
+    }
+
+    // May be called from any thread
+    void put(Block *block) {
+        if (owns(block)) {
+            Block *head = returned.load(std::memory_order_relaxed);
+            do {
+                block->next = head;
+            } while (!returned.compare_exchange_weak(
+                    head, block, std::memory_order_release, std::memory_order_relaxed));
+        } else {
+            ::operator delete(block, std::align_val_t{BLOCK_ALIGNMENT});
+        }
+        release();
+    }
 };
 
 VpnPacketPool::VpnPacketPool(size_t size, uint32_t mtu)
-        : m_capacity(size)
-        , m_mtu(mtu)
-        , m_state(new VpnPacketPoolState{this, 1, true}) {
-    for (size_t i = 0; i < size; ++i) {
-        m_packets.emplace_back(new uint8_t[m_mtu]);
+        : m_state(new State{}) {
+    m_state->refcounter = 1;
+    m_state->mtu = mtu;
+    m_state->block_size = State::BLOCK_HEADER_SIZE + align_up(mtu, BLOCK_ALIGNMENT);
+    m_state->arena_size = size * m_state->block_size;
+    m_state->arena_alignment = (m_state->arena_size >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : BLOCK_ALIGNMENT;
+    m_state->arena = (uint8_t *) ::operator new(m_state->arena_size, std::align_val_t{m_state->arena_alignment});
+#ifdef __linux__
+    if (m_state->arena_alignment == HUGE_PAGE_SIZE) {
+        // Only a hint, the arena works on normal pages as well
+        madvise(m_state->arena, m_state->arena_size / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
     }
+#endif
 }
 
 VpnPacketPool::~VpnPacketPool() {
-    m_state->is_alive.store(false, std::memory_order_release);
     m_state->release();
 }
 
-VpnPacket VpnPacketPool::get_packet() {
-    m_state->retain();
+void VpnPacketPool::destroy_packet(void *arg, uint8_t *) {
+    auto *block = (Block *) arg;
+    block->state->put(block);
+}
 
-    auto destructor = [](void *arg, uint8_t *data) {
-        auto *state = static_cast<VpnPacketPoolState *>(arg);
-        if (state->is_alive.load(std::memory_order_acquire)) {
-            state->pool->return_packet_data(data);
-        } else {
-            delete[] data;
-            state->release();
-        }
+VpnPacket VpnPacketPool::get_packet() {
+    Block *block = m_state->take();
+    return VpnPacket{
+            .data = State::data_of(block),
+            .size = static_cast<size_t>(m_state->mtu),
+            .destructor = destroy_packet,
+            .destructor_arg = block,
     };
+}
 
-    uint8_t *data = nullptr;
-    if (m_packets.empty()) {
-        data = new uint8_t[m_mtu];
-    } else {
-        data = m_packets.front().release();
-        m_packets.pop_front();
-    }
+void VpnPacketPool::return_packet_data(uint8_t *packet) {
+    Block *block = State::block_of(packet);
+    block->state->put(block);
+}
 
-    return VpnPacket{
-            .data = data, .size = static_cast<size_t>(m_mtu), .destructor = destructor, .destructor_arg = m_state};
+size_t VpnPacketPool::get_size() {
+    m_state->take_returned();
+    return m_state->free_count + m_state->arena_size / m_state->block_size - m_state->carved_count;
 }
 
-void VpnPacketPool::return_packet_data(uint8_t *packet) {
-    std::unique_ptr<uint8_t[]> data{packet};
-    if (m_packets.size() < m_capacity) {
-        m_packets.emplace_back(std::move(data));
+pbuf *VpnPacketPool::make_pbuf(VpnPacket *packet) {
+    Block *block = (packet->destructor == destroy_packet) ? (Block *) packet->destructor_arg : m_state->take();
+    block->packet = *packet;
+    block->pbuf.custom_free_function = free_pbuf;
+    pbuf *buffer = pbuf_alloced_custom(
+            PBUF_RAW, u16_t(packet->size), PBUF_REF, &block->pbuf, packet->data, u16_t(packet->size));
+    if (buffer == nullptr && packet->destructor != destroy_packet) {
+        block->state->put(block);
     }
+    return buffer;
+}
 
-    m_state->release();
+size_t VpnPacketPool::held_size(const pbuf *buffer) {
+    if (!(buffer->flags & PBUF_FLAG_IS_CUSTOM)) {
+        return buffer->len;
+    }
+    const auto *block = (const Block *) buffer;
+    if (block->packet.destructor != destroy_packet) {
+        return SIZE_MAX;
+    }
+    return block->state->block_size;
 }
 
-size_t VpnPacketPool::get_size() {
-    return m_packets.size();
+void VpnPacketPool::free_pbuf(pbuf *buffer) {
+    auto *block = (Block *) buffer;
+    const VpnPacket &packet = block->packet;
+    // A packet from a pool shares the block with the header, so returning the block destroys both
+    if (packet.destructor != destroy_packet && packet.destructor != nullptr) {
+        packet.destructor(packet.destructor_arg, packet.data);
+    }
+    block->state->put(block);
 }
 
 } // namespace ag
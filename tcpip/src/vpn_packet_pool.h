@@ -1,48 +1,85 @@
 #pragma once
 
-#include <list>
-#include <memory>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <lwip/pbuf.h>
 
 #include "tcpip/tcpip.h"
 #include "vpn/utils.h"
 
 namespace ag {
 
+/**
+ * Slab of fixed-size packet blocks.
+ *
+ * All the blocks are carved out of one contiguous arena allocated up front, as they are first needed,
+ * so the memory of the blocks which are never used is not touched. Each block has an lwIP buffer header
+ * in front of the data, so a packet got from the pool is passed to the stack without any allocation
+ * (see `make_pbuf`). Free blocks are linked into an intrusive list.
+ *
+ * The blocks are taken on the thread owning the pool, but may be returned from any thread:
+ * the returned blocks are pushed onto a lock-free stack, which the owner takes over as a whole
+ * once its own list runs out. The arena outlives the pool until the last block is returned.
+ */
 class VpnPacketPool {
 public:
     /**
-     * Init list with pointers to data blocks
+     * Allocate the arena
      * @param size number of blocks
-     * @param mtu size of one block
+     * @param mtu size of one block. Zero makes a pool of lwIP buffer headers for the packets
+     *            allocated elsewhere (see `make_pbuf`).
      */
     VpnPacketPool(size_t size, uint32_t mtu);
 
     ~VpnPacketPool();
 
+    VpnPacketPool(const VpnPacketPool &) = delete;
+    VpnPacketPool &operator=(const VpnPacketPool &) = delete;
+    VpnPacketPool(VpnPacketPool &&) = delete;
+    VpnPacketPool &operator=(VpnPacketPool &&) = delete;
+
     /**
      * Return VpnPacket with pointer to data from pool.
-     * If there are no unused data block, create the new one.
+     * If there are no unused data blocks, allocate a new one, which is freed on return.
      */
     VpnPacket get_packet();
 
     /**
-     * Take ownership of allocated data back
+     * Take ownership of allocated data back. May be called from any thread.
      * @param packet pointer to data block
      */
     void return_packet_data(uint8_t *packet);
 
     /**
-     * Return number of unused allocated blocks
+     * Return number of unused blocks of the arena
      */
     size_t get_size();
 
+    /**
+     * Wrap a packet into an lwIP buffer without copying the data. The packet is destroyed when
+     * the buffer is freed. The header of a packet got from a pool is embedded in its block,
+     * the packets allocated elsewhere take a block of this pool for the header.
+     * @return null if failed, the packet is left intact in this case
+     */
+    pbuf *make_pbuf(VpnPacket *packet);
+
+    /**
+     * Memory a reference to the buffer keeps alive: a buffer made by `make_pbuf` pins the whole block
+     * of its packet, however small the payload is.
+     * @return SIZE_MAX if the data belongs to someone else (e.g. the Wintun ring), so it must not be held
+     */
+    static size_t held_size(const pbuf *buffer);
+
 private:
-    struct VpnPacketPoolState;
+    struct Block;
+    struct State;
+
+    State *m_state;
 
-    size_t m_capacity;
-    uint32_t m_mtu;
-    std::list<std::unique_ptr<uint8_t[]>> m_packets;
-    VpnPacketPoolState *m_state;
+    static void destroy_packet(void *arg, uint8_t *data);
+    static void free_pbuf(pbuf *buffer);
 };
 
 } // namespace ag
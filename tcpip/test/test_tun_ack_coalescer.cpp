@@ -0,0 +1,136 @@
+#include <cstring>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include "tun_ack_coalescer.h"
+
+using namespace ag;
+
+static constexpr uint8_t TCP_FLAG_ACK = 0x10;
+static constexpr uint8_t TCP_FLAG_FIN = 0x01;
+
+static std::vector<uint8_t> make_ipv4_segment(uint16_t src_port, uint32_t ack, size_t payload_len = 0,
+        uint8_t flags = TCP_FLAG_ACK, const std::vector<uint8_t> &options = {}) {
+    size_t tcp_hdr_len = 20 + options.size();
+    std::vector<uint8_t> packet(20 + tcp_hdr_len + payload_len);
+    uint8_t *ip = packet.data();
+    ip[0] = 0x45;
+    uint16_t tot_len = htons(uint16_t(packet.size()));
+    std::memcpy(ip + 2, &tot_len, 2);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    inet_pton(AF_INET, "10.0.0.1", ip + 12);
+    inet_pton(AF_INET, "10.0.0.2", ip + 16);
+    uint8_t *tcp = ip + 20;
+    uint16_t port = htons(src_port);
+    std::memcpy(tcp, &port, 2);
+    tcp[3] = 81;
+    uint32_t ack_n = htonl(ack);
+    std::memcpy(tcp + 8, &ack_n, 4);
+    tcp[12] = uint8_t((tcp_hdr_len / 4) << 4);
+    tcp[13] = flags;
+    std::memcpy(tcp + 20, options.data(), options.size());
+    return packet;
+}
+
+static std::vector<uint8_t> make_ipv6_ack(uint32_t ack) {
+    std::vector<uint8_t> packet(40 + 20);
+    uint8_t *ip = packet.data();
+    ip[0] = 0x60;
+    ip[5] = 20;
+    ip[6] = IPPROTO_TCP;
+    inet_pton(AF_INET6, "fd00::1", ip + 8);
+    inet_pton(AF_INET6, "fd00::2", ip + 24);
+    uint8_t *tcp = ip + 40;
+    tcp[1] = 80;
+    tcp[3] = 81;
+    uint32_t ack_n = htonl(ack);
+    std::memcpy(tcp + 8, &ack_n, 4);
+    tcp[12] = 5 << 4;
+    tcp[13] = TCP_FLAG_ACK;
+    return packet;
+}
+
+static bool hold(TunAckCoalescer &acks, std::vector<uint8_t> &packet, int family = AF_INET) {
+    // Split headers like lwIP does with the options
+    evbuffer_iovec chunks[] = {{packet.data(), 20}, {packet.data() + 20, packet.size() - 20}};
+    return acks.hold(chunks, family);
+}
+
+static uint32_t held_ack(const TunAckCoalescer::Ack &ack) {
+    size_t ip_hdr_len = ((ack.data[0] >> 4) == 6) ? 40 : 20;
+    uint32_t value = 0;
+    std::memcpy(&value, ack.data + ip_hdr_len + 8, 4);
+    return ntohl(value);
+}
+
+TEST(TunAckCoalescer, LatestAckOfFlowIsKept) {
+    TunAckCoalescer acks;
+    for (uint32_t ack = 1000; ack <= 5000; ack += 1000) {
+        std::vector<uint8_t> packet = make_ipv4_segment(80, ack);
+        ASSERT_TRUE(hold(acks, packet));
+    }
+    std::vector<uint8_t> other = make_ipv4_segment(8080, 100);
+    ASSERT_TRUE(hold(acks, other));
+    std::vector<uint8_t> v6 = make_ipv6_ack(200);
+    ASSERT_TRUE(hold(acks, v6, AF_INET6));
+
+    ASSERT_EQ(acks.held().size(), 3);
+    ASSERT_EQ(held_ack(acks.held()[0]), 5000);
+    ASSERT_EQ(acks.held()[0].length, 40);
+    ASSERT_EQ(acks.held()[0].family, AF_INET);
+    ASSERT_EQ(held_ack(acks.held()[1]), 100);
+    ASSERT_EQ(held_ack(acks.held()[2]), 200);
+    ASSERT_EQ(acks.held()[2].family, AF_INET6);
+
+    acks.reset();
+    ASSERT_TRUE(acks.held().empty());
+}
+
+TEST(TunAckCoalescer, DuplicateAckIsNotHeld) {
+    TunAckCoalescer acks;
+    std::vector<uint8_t> packet = make_ipv4_segment(80, 1000);
+    ASSERT_TRUE(hold(acks, packet));
+    // A duplicate ACK or a window update must reach the peer
+    ASSERT_FALSE(hold(acks, packet));
+    std::vector<uint8_t> older = make_ipv4_segment(80, 900);
+    ASSERT_FALSE(hold(acks, older));
+    ASSERT_EQ(held_ack(acks.held()[0]), 1000);
+
+    // Sequence numbers wrap around
+    acks.reset();
+    std::vector<uint8_t> before_wrap = make_ipv4_segment(80, UINT32_MAX - 10);
+    std::vector<uint8_t> after_wrap = make_ipv4_segment(80, 10);
+    ASSERT_TRUE(hold(acks, before_wrap));
+    ASSERT_TRUE(hold(acks, after_wrap));
+    ASSERT_EQ(held_ack(acks.held()[0]), 10);
+}
+
+TEST(TunAckCoalescer, OtherPacketsAreNotHeld) {
+    TunAckCoalescer acks;
+    std::vector<uint8_t> data = make_ipv4_segment(80, 1000, 10);
+    ASSERT_FALSE(hold(acks, data));
+    std::vector<uint8_t> fin = make_ipv4_segment(80, 1000, 0, TCP_FLAG_ACK | TCP_FLAG_FIN);
+    ASSERT_FALSE(hold(acks, fin));
+    // NOP, NOP, SACK with one block
+    std::vector<uint8_t> sack = make_ipv4_segment(80, 1000, 0, TCP_FLAG_ACK, {1, 1, 5, 10, 0, 0, 0, 1, 0, 0, 0, 2});
+    ASSERT_FALSE(hold(acks, sack));
+    // NOP, NOP, timestamps
+    std::vector<uint8_t> timestamps =
+            make_ipv4_segment(80, 1000, 0, TCP_FLAG_ACK, {1, 1, 8, 10, 0, 0, 0, 1, 0, 0, 0, 2});
+    ASSERT_TRUE(hold(acks, timestamps));
+    ASSERT_EQ(acks.held().size(), 1);
+}
+
+TEST(TunAckCoalescer, FlowsAreLimited) {
+    TunAckCoalescer acks;
+    for (size_t i = 0; i < TunAckCoalescer::MAX_FLOWS; ++i) {
+        std::vector<uint8_t> packet = make_ipv4_segment(uint16_t(1000 + i), 1000);
+        ASSERT_TRUE(hold(acks, packet));
+    }
+    std::vector<uint8_t> packet = make_ipv4_segment(80, 1000);
+    ASSERT_FALSE(hold(acks, packet));
+    ASSERT_EQ(acks.held().size(), TunAckCoalescer::MAX_FLOWS);
+}
@@ -0,0 +1,53 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "tcpip/tcpip.h"
+#include "vpn/event_loop.h"
+
+using namespace ag;
+
+class TunIngressTest : public testing::Test {
+protected:
+    DeclPtr<VpnEventLoop, &vpn_event_loop_destroy> m_ev_loop{vpn_event_loop_create()};
+    TcpipCtx *m_tcpip = nullptr;
+    int m_peer_fd = -1;
+
+    void SetUp() override {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+        m_peer_fd = fds[1];
+
+        TcpipParameters params = {
+                .tun_fd = fds[0],
+                .event_loop = m_ev_loop.get(),
+                .mtu_size = DEFAULT_MTU_SIZE,
+                .handler = {[](void *, TcpipEvent, void *) {}, nullptr},
+        };
+        m_tcpip = tcpip_open(&params);
+        ASSERT_NE(m_tcpip, nullptr);
+    }
+
+    void TearDown() override {
+        tcpip_close(m_tcpip);
+        close(m_peer_fd);
+    }
+};
+
+TEST_F(TunIngressTest, PacketsReadOnOneWakeupAreCounted) {
+    constexpr size_t PACKETS_NUM = 10;
+    // Not a valid IP packet, so the stack just drops it
+    uint8_t packet[20] = {};
+    for (size_t i = 0; i < PACKETS_NUM; ++i) {
+        ASSERT_EQ(ssize_t(sizeof(packet)), send(m_peer_fd, packet, sizeof(packet), 0));
+    }
+
+    event_base_loop(vpn_event_loop_get_base(m_ev_loop.get()), EVLOOP_ONCE | EVLOOP_NONBLOCK);
+
+    TcpipTunIngressStats stats = tcpip_get_tun_ingress_stats(m_tcpip);
+    ASSERT_EQ(stats.wakeups, 1);
+    ASSERT_EQ(stats.packets, PACKETS_NUM);
+    ASSERT_EQ(stats.last_batch, PACKETS_NUM);
+    ASSERT_EQ(stats.max_batch, PACKETS_NUM);
+}
@@ -0,0 +1,126 @@
+#include <cstring>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include "tun_vnet.h"
+
+using namespace ag;
+
+static uint16_t checksum(const uint8_t *data, size_t length, uint32_t sum = 0) {
+    for (; length > 1; data += 2, length -= 2) {
+        sum += (data[0] << 8) | data[1];
+    }
+    if (length > 0) {
+        sum += data[0] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return uint16_t(sum);
+}
+
+static uint32_t ipv4_pseudo_header_sum(const uint8_t *packet, size_t tcp_length) {
+    uint32_t sum = checksum(packet + 12, 8);
+    return sum + IPPROTO_TCP + uint32_t(tcp_length);
+}
+
+static std::vector<uint8_t> make_ipv4_segment(uint32_t seq, size_t payload_len, uint8_t flags = 0x10) {
+    std::vector<uint8_t> packet(20 + 20 + payload_len);
+    uint8_t *ip = packet.data();
+    ip[0] = 0x45;
+    uint16_t tot_len = htons(uint16_t(packet.size()));
+    std::memcpy(ip + 2, &tot_len, 2);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    inet_pton(AF_INET, "10.0.0.1", ip + 12);
+    inet_pton(AF_INET, "10.0.0.2", ip + 16);
+    uint8_t *tcp = ip + 20;
+    tcp[1] = 80;
+    tcp[3] = 81;
+    uint32_t seq_n = htonl(seq);
+    std::memcpy(tcp + 4, &seq_n, 4);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    for (size_t i = 0; i < payload_len; ++i) {
+        tcp[20 + i] = uint8_t(seq + i);
+    }
+    return packet;
+}
+
+static TunGsoCoalescer::AppendResult append(TunGsoCoalescer &gso, std::vector<uint8_t> &packet) {
+    // Split headers and payload like lwIP does
+    evbuffer_iovec chunks[] = {{packet.data(), 40}, {packet.data() + 40, packet.size() - 40}};
+    return gso.append({chunks, packet.size() > 40 ? 2u : 1u});
+}
+
+TEST(TunVnet, CompleteChecksum) {
+    std::vector<uint8_t> packet = make_ipv4_segment(1000, 101);
+    size_t tcp_length = packet.size() - 20;
+    uint16_t partial = htons(checksum(nullptr, 0, ipv4_pseudo_header_sum(packet.data(), tcp_length)));
+    std::memcpy(packet.data() + 20 + 16, &partial, 2);
+
+    TunVnetHdr hdr{};
+    hdr.flags = TUN_VNET_HDR_F_NEEDS_CSUM;
+    hdr.csum_start = 20;
+    hdr.csum_offset = 16;
+    ASSERT_TRUE(tun_vnet_complete_checksum(hdr, packet.data(), packet.size()));
+
+    // A valid checksum sums up to all ones
+    ASSERT_EQ(0xffff,
+            checksum(packet.data() + 20, tcp_length, ipv4_pseudo_header_sum(packet.data(), tcp_length)));
+
+    hdr.csum_start = uint16_t(packet.size());
+    ASSERT_FALSE(tun_vnet_complete_checksum(hdr, packet.data(), packet.size()));
+}
+
+TEST(TunVnet, CoalesceSegments) {
+    TunGsoCoalescer gso;
+    std::vector<uint8_t> first = make_ipv4_segment(1000, 1000);
+    std::vector<uint8_t> second = make_ipv4_segment(2000, 1000);
+    std::vector<uint8_t> last = make_ipv4_segment(3000, 500, 0x18);
+    ASSERT_EQ(TunGsoCoalescer::GSO_APPENDED, append(gso, first));
+    ASSERT_EQ(TunGsoCoalescer::GSO_APPENDED, append(gso, second));
+    ASSERT_EQ(TunGsoCoalescer::GSO_APPENDED, append(gso, last));
+    ASSERT_EQ(3, gso.segments());
+
+    // The shorter segment closes the super-packet
+    std::vector<uint8_t> next = make_ipv4_segment(3500, 1000);
+    ASSERT_EQ(TunGsoCoalescer::GSO_MISMATCH, append(gso, next));
+
+    TunVnetHdr hdr{};
+    std::span<const uint8_t> packet = gso.finish(&hdr);
+    ASSERT_EQ(packet.size(), 40 + 2500);
+    ASSERT_EQ(hdr.gso_type, TUN_VNET_HDR_GSO_TCPV4);
+    ASSERT_EQ(hdr.gso_size, 1000);
+    ASSERT_EQ(hdr.hdr_len, 40);
+    ASSERT_EQ(hdr.csum_start, 20);
+    ASSERT_EQ(hdr.csum_offset, 16);
+    ASSERT_EQ((packet[2] << 8) | packet[3], packet.size());
+    ASSERT_EQ(0xffff, checksum(packet.data(), 20));
+    ASSERT_EQ(packet[20 + 13], 0x18);
+    for (size_t i = 0; i < 2500; ++i) {
+        ASSERT_EQ(packet[40 + i], uint8_t(1000 + i)) << i;
+    }
+
+    gso.reset();
+    ASSERT_TRUE(gso.empty());
+    ASSERT_EQ(TunGsoCoalescer::GSO_APPENDED, append(gso, next));
+    packet = gso.finish(&hdr);
+    ASSERT_EQ(hdr.gso_type, TUN_VNET_HDR_GSO_NONE);
+    ASSERT_EQ(packet.size(), next.size());
+}
+
+TEST(TunVnet, NotCandidates) {
+    TunGsoCoalescer gso;
+    std::vector<uint8_t> syn = make_ipv4_segment(1000, 0, 0x02);
+    ASSERT_EQ(TunGsoCoalescer::GSO_NOT_CANDIDATE, append(gso, syn));
+    std::vector<uint8_t> pure_ack = make_ipv4_segment(1000, 0);
+    ASSERT_EQ(TunGsoCoalescer::GSO_NOT_CANDIDATE, append(gso, pure_ack));
+
+    std::vector<uint8_t> first = make_ipv4_segment(1000, 1000);
+    ASSERT_EQ(TunGsoCoalescer::GSO_APPENDED, append(gso, first));
+    std::vector<uint8_t> gap = make_ipv4_segment(3000, 1000);
+    ASSERT_EQ(TunGsoCoalescer::GSO_MISMATCH, append(gso, gap));
+}
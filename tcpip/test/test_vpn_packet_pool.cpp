@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "vpn_packet_pool.h"
@@ -28,3 +33,121 @@ TEST(VpnPacketPool, Functional) {
     }
     ASSERT_EQ(pool->get_size(), pool_capacity);
 }
+
+TEST(VpnPacketPool, BlocksAreCarvedInOrder) {
+    VpnPacketPool pool(3, DEFAULT_MTU_SIZE);
+    VpnPacket first = pool.get_packet();
+    VpnPacket second = pool.get_packet();
+    ASSERT_GT(second.data, first.data);
+    ASSERT_EQ(pool.get_size(), 1);
+
+    // A returned block is reused before the next one is carved out
+    pool.return_packet_data(first.data);
+    ASSERT_EQ(pool.get_size(), 2);
+    VpnPacket reused = pool.get_packet();
+    ASSERT_EQ(reused.data, first.data);
+    VpnPacket third = pool.get_packet();
+    ASSERT_GT(third.data, second.data);
+    ASSERT_EQ(pool.get_size(), 0);
+
+    pool.return_packet_data(reused.data);
+    pool.return_packet_data(second.data);
+    pool.return_packet_data(third.data);
+    ASSERT_EQ(pool.get_size(), 3);
+}
+
+TEST(VpnPacketPool, PbufHeaderIsEmbedded) {
+    VpnPacketPool pool(2, DEFAULT_MTU_SIZE);
+    VpnPacket packet = pool.get_packet();
+    packet.size = 100;
+
+    pbuf *buffer = pool.make_pbuf(&packet);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(buffer->payload, packet.data);
+    ASSERT_EQ(buffer->tot_len, 100);
+    ASSERT_EQ(pool.get_size(), 1);
+
+    pbuf_free(buffer);
+    ASSERT_EQ(pool.get_size(), 2);
+}
+
+TEST(VpnPacketPool, PbufHeaderForForeignPacket) {
+    VpnPacketPool pool(2, 0);
+    uint8_t data[64]{};
+    bool destroyed = false;
+    VpnPacket packet{
+            .data = data,
+            .size = sizeof(data),
+            .destructor = [](void *arg, uint8_t *) {
+                *(bool *) arg = true;
+            },
+            .destructor_arg = &destroyed,
+    };
+
+    pbuf *buffer = pool.make_pbuf(&packet);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(buffer->payload, data);
+    ASSERT_EQ(pool.get_size(), 1);
+
+    pbuf_free(buffer);
+    ASSERT_TRUE(destroyed);
+    ASSERT_EQ(pool.get_size(), 2);
+}
+
+TEST(VpnPacketPool, HeldSize) {
+    VpnPacketPool pool(2, DEFAULT_MTU_SIZE);
+    VpnPacket packet = pool.get_packet();
+    packet.size = 100;
+    pbuf *buffer = pool.make_pbuf(&packet);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_GE(VpnPacketPool::held_size(buffer), DEFAULT_MTU_SIZE);
+    pbuf_free(buffer);
+
+    uint8_t data[64]{};
+    VpnPacket foreign{
+            .data = data,
+            .size = sizeof(data),
+            .destructor = [](void *, uint8_t *) {},
+    };
+    buffer = pool.make_pbuf(&foreign);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(VpnPacketPool::held_size(buffer), SIZE_MAX);
+    pbuf_free(buffer);
+
+    buffer = pbuf_alloc(PBUF_RAW, 100, PBUF_RAM);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(VpnPacketPool::held_size(buffer), 100);
+    pbuf_free(buffer);
+}
+
+TEST(VpnPacketPool, ReturnFromOtherThreads) {
+    constexpr size_t pool_capacity = 32;
+    constexpr size_t threads_num = 4;
+    VpnPacketPool pool(pool_capacity, DEFAULT_MTU_SIZE);
+    for (size_t round = 0; round < 100; ++round) {
+        std::vector<VpnPacket> packets;
+        for (size_t i = 0; i < pool_capacity + threads_num; ++i) {
+            packets.push_back(pool.get_packet());
+        }
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threads_num; ++t) {
+            threads.emplace_back([&packets, t] {
+                for (size_t i = t; i < packets.size(); i += threads_num) {
+                    packets[i].destructor(packets[i].destructor_arg, packets[i].data);
+                }
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        ASSERT_EQ(pool.get_size(), pool_capacity);
+    }
+}
+
+TEST(VpnPacketPool, PacketOutlivesPool) {
+    auto pool = std::make_unique<VpnPacketPool>(1, DEFAULT_MTU_SIZE);
+    VpnPacket packet = pool->get_packet();
+    pool.reset();
+    std::fill_n(packet.data, packet.size, 0xff);
+    packet.destructor(packet.destructor_arg, packet.data);
+}
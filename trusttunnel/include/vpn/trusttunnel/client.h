@@ -2,7 +2,9 @@
 
 #include <atomic>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include "common/autofd.h"
 #include "common/logger.h"
@@ -21,6 +23,11 @@ static constexpr std::string_view WINTUN_DLL_NAME = "wintun";
 
 namespace ag {
 
+/**
+ * If the traffic is spread between several sessions, `protect_handler` may be invoked concurrently from
+ * the threads of the sessions, so it must be thread-safe. `client_output_handler` is invoked by the main
+ * session only. The rest are never invoked concurrently.
+ */
 struct VpnCallbacks {
     std::function<void(SocketProtectEvent *)> protect_handler;
     std::function<void(VpnVerifyCertificateEvent *)> verify_handler;
@@ -92,19 +99,39 @@ public:
     ~TrustTunnelClient();
 
 private:
+    /**
+     * An extra VPN session serving one of the TUN device queues. Each one runs on its own event loop
+     * with its own endpoint connections and connection table, the kernel spreads the flows between
+     * the queues by flow hash.
+     */
+    struct Shard {
+        TrustTunnelClient *client = nullptr;
+        std::atomic<Vpn *> vpn = nullptr;
+        size_t index = 0;
+    };
+
     Error<ConnectResultError> connect_impl(ListenerSettings listener_settings);
     Error<ConnectResultError> vpn_runner(ListenerSettings listener_settings);
-    Error<ConnectResultError> connect_to_server();
+    Error<ConnectResultError> connect_to_server(Vpn *vpn);
+    Error<ConnectResultError> start_shards(std::vector<AutoFd> queue_fds);
+    void stop_shards();
 
     VpnListener *make_tun_listener(ListenerSettings listener_settings);
     VpnListener *make_socks_listener(ListenerSettings listener_settings);
 
+    VpnSettings make_vpn_settings(VpnHandler handler) const;
+    VpnListenerConfig make_listener_config(std::vector<const char *> &dns_upstreams) const;
+
     static void static_vpn_handler(void *arg, VpnEvent what, void *data);
-    void vpn_handler(void *, VpnEvent what, void *data);
+    static void static_shard_vpn_handler(void *arg, VpnEvent what, void *data);
+    void vpn_handler(Shard *shard, VpnEvent what, void *data);
 
     VpnSessionState m_connect_result = VPN_SS_DISCONNECTED;
     const ag::Logger m_logger{"TRUSTTUNNEL_CLIENT"};
     std::atomic<Vpn *> m_vpn = nullptr;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    // Guards `m_shards`, as the notifications may come from other threads while the shards are started or stopped
+    std::mutex m_shards_guard;
     TrustTunnelConfig m_config;
     std::thread m_loop_thread;
     DeclPtr<VpnEventLoop, &vpn_event_loop_destroy> m_extra_loop = nullptr;
@@ -112,6 +139,9 @@ private:
     std::optional<FileHandler> m_logfile_handler;
     std::optional<Logger::LogToFile> m_logtofile;
     VpnCallbacks m_callbacks;
+    // Serializes the callbacks which are not required to be thread-safe. Recursive, as a callback
+    // may make a session raise another event on the same thread.
+    std::recursive_mutex m_callbacks_guard;
 #ifdef _WIN32
     HMODULE m_wintun;
 #endif
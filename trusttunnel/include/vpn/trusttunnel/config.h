@@ -33,6 +33,7 @@ struct TrustTunnelConfig {
         bool has_ipv6 = false;
         uint32_t health_check_timeout_ms = 0;
         uint32_t timeout_ms = 0;
+        ag::VpnQuicTransportConfig quic_transport{}; ///< Applied to HTTP/3 connections, zero means the defaults
     };
 
     struct SocksListener {
@@ -48,6 +49,8 @@ struct TrustTunnelConfig {
         std::string bound_if;
         bool change_system_dns = true;
         std::optional<std::string> netns;
+        bool offload = false;
+        uint32_t shards = 1; ///< Number of independent sessions the traffic is spread between (Linux only)
     };
 
     using Listener = std::variant<SocksListener, TunListener>;
@@ -59,6 +62,7 @@ struct TrustTunnelConfig {
     bool post_quantum_group_enabled = true;
     std::string log_file_path;
     std::string exclusions;
+    std::optional<std::string> exclusions_file;
     std::optional<std::string> ssl_session_storage_path;
     std::vector<std::string> dns_upstreams;
     Location location;
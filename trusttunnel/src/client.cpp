@@ -1,4 +1,5 @@
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -44,6 +45,7 @@ Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect(Listener
 }
 
 int TrustTunnelClient::disconnect() {
+    stop_shards();
     if (Vpn *vpn = m_vpn.exchange(nullptr)) {
         vpn_stop(vpn);
         vpn_close(vpn);
@@ -56,18 +58,36 @@ void TrustTunnelClient::notify_network_change(VpnNetworkState state) {
     if (m_vpn) {
         vpn_notify_network_change(m_vpn, state);
     }
+    std::scoped_lock shards_lock(m_shards_guard);
+    for (auto &shard : m_shards) {
+        if (Vpn *vpn = shard->vpn) {
+            vpn_notify_network_change(vpn, state);
+        }
+    }
 }
 
 void TrustTunnelClient::notify_sleep() {
     if (m_vpn) {
         vpn_notify_sleep(m_vpn, [](void *) {}, nullptr);
     }
+    std::scoped_lock shards_lock(m_shards_guard);
+    for (auto &shard : m_shards) {
+        if (Vpn *vpn = shard->vpn) {
+            vpn_notify_sleep(vpn, [](void *) {}, nullptr);
+        }
+    }
 }
 
 void TrustTunnelClient::notify_wake() {
     if (m_vpn) {
         vpn_notify_wake(m_vpn);
     }
+    std::scoped_lock shards_lock(m_shards_guard);
+    for (auto &shard : m_shards) {
+        if (Vpn *vpn = shard->vpn) {
+            vpn_notify_wake(vpn);
+        }
+    }
 }
 
 bool TrustTunnelClient::process_client_packets(VpnPackets packets) {
@@ -106,14 +126,33 @@ Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::set_system_dns()
     return {};
 }
 
-Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect_impl(ListenerSettings listener_settings) {
+VpnSettings TrustTunnelClient::make_vpn_settings(VpnHandler handler) const {
     VpnSettings settings = {
-            .handler = {static_vpn_handler, this},
+            .handler = handler,
             .mode = m_config.mode,
             .exclusions = {m_config.exclusions.data(), (uint32_t) m_config.exclusions.size()},
             .killswitch_enabled = m_config.killswitch_enabled,
     };
+    if (m_config.exclusions_file.has_value()) {
+        settings.exclusions_file = m_config.exclusions_file->c_str();
+    }
+    return settings;
+}
+
+VpnListenerConfig TrustTunnelClient::make_listener_config(std::vector<const char *> &dns_upstreams) const {
+    dns_upstreams.clear();
+    dns_upstreams.reserve(m_config.dns_upstreams.size());
+    for (const std::string &upstream : m_config.dns_upstreams) {
+        dns_upstreams.emplace_back(upstream.c_str());
+    }
+
+    return {
+            .dns_upstreams = {.data = dns_upstreams.data(), .size = uint32_t(dns_upstreams.size())},
+    };
+}
 
+Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect_impl(ListenerSettings listener_settings) {
+    VpnSettings settings = make_vpn_settings({static_vpn_handler, this});
     if (m_config.ssl_session_storage_path.has_value()) {
         settings.ssl_sessions_storage_path = m_config.ssl_session_storage_path->c_str();
     }
@@ -132,7 +171,7 @@ Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect_impl(Lis
 }
 
 Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::vpn_runner(ListenerSettings listener_settings) {
-    if (auto r = connect_to_server(); r) {
+    if (auto r = connect_to_server(m_vpn); r) {
         return r;
     }
     VpnListener *listener = std::holds_alternative<TrustTunnelConfig::TunListener>(m_config.listener)
@@ -144,24 +183,94 @@ Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::vpn_runner(Liste
     }
 
     std::vector<const char *> dns_upstreams;
-    dns_upstreams.reserve(m_config.dns_upstreams.size());
-    for (const std::string &upstream : m_config.dns_upstreams) {
-        dns_upstreams.emplace_back(upstream.c_str());
-    }
-
-    VpnListenerConfig listener_config = {
-            .dns_upstreams = {.data = dns_upstreams.data(), .size = uint32_t(dns_upstreams.size())},
-    };
+    VpnListenerConfig listener_config = make_listener_config(dns_upstreams);
     VpnError error = vpn_listen(m_vpn, listener, &listener_config);
     if (error.code != 0) {
         return make_error(ConnectResultError{},
                 AG_FMT("Failed to start listening: {} ({})", safe_to_string_view(error.text),
                         magic_enum::enum_name((VpnErrorCode) error.code)));
     }
+
+#ifdef __linux__
+    if (m_tunnel != nullptr) {
+        std::vector<AutoFd> queue_fds;
+        for (evutil_socket_t fd : m_tunnel->take_extra_queue_fds()) {
+            queue_fds.emplace_back(AutoFd::adopt_fd(fd));
+        }
+        if (auto r = start_shards(std::move(queue_fds)); r) {
+            return r;
+        }
+    }
+#endif // __linux__
+
     return {};
 }
 
-Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect_to_server() {
+Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::start_shards(std::vector<AutoFd> queue_fds) {
+    const auto &config = std::get<TrustTunnelConfig::TunListener>(m_config.listener);
+    std::vector<const char *> dns_upstreams;
+    VpnListenerConfig listener_config = make_listener_config(dns_upstreams);
+
+    for (AutoFd &fd : queue_fds) {
+        Shard *shard = nullptr;
+        {
+            std::scoped_lock shards_lock(m_shards_guard);
+            shard = m_shards.emplace_back(std::make_unique<Shard>()).get();
+            shard->client = this;
+            shard->index = m_shards.size();
+        }
+
+        // Session storage is left to the main session, so that the instances don't race over the file
+        VpnSettings settings = make_vpn_settings({static_shard_vpn_handler, shard});
+        shard->vpn = vpn_open(&settings);
+        if (shard->vpn == nullptr) {
+            return make_error(ConnectResultError{}, AG_FMT("Failed on create VPN instance for shard {}", shard->index));
+        }
+        if (auto r = connect_to_server(shard->vpn); r) {
+            return r;
+        }
+
+        VpnTunListenerConfig tun_config = {
+                .fd = fd.release(),
+                .mtu_size = config.mtu_size,
+#ifdef __linux__
+                .vnet_hdr = m_tunnel->is_vnet_hdr_enabled(),
+#endif
+        };
+        VpnListener *listener = vpn_create_tun_listener(shard->vpn, &tun_config);
+        if (listener == nullptr) {
+            return make_error(ConnectResultError{}, AG_FMT("Failed to create listener for shard {}", shard->index));
+        }
+        VpnError error = vpn_listen(shard->vpn, listener, &listener_config);
+        if (error.code != 0) {
+            return make_error(ConnectResultError{},
+                    AG_FMT("Failed to start listening on shard {}: {} ({})", shard->index,
+                            safe_to_string_view(error.text), magic_enum::enum_name((VpnErrorCode) error.code)));
+        }
+    }
+
+    if (!queue_fds.empty()) {
+        infolog(m_logger, "Traffic is spread between {} sessions", queue_fds.size() + 1);
+    }
+    return {};
+}
+
+void TrustTunnelClient::stop_shards() {
+    // The sessions are stopped out of the lock, so that a notification is not held up by a stopping session
+    std::vector<std::unique_ptr<Shard>> shards;
+    {
+        std::scoped_lock shards_lock(m_shards_guard);
+        shards.swap(m_shards);
+    }
+    for (auto &shard : shards) {
+        if (Vpn *vpn = shard->vpn.exchange(nullptr)) {
+            vpn_stop(vpn);
+            vpn_close(vpn);
+        }
+    }
+}
+
+Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect_to_server(Vpn *vpn) {
     std::vector<VpnEndpoint> endpoints;
     std::vector<VpnRelay> relays;
     std::vector<std::string> hostnames;
@@ -255,11 +364,12 @@ Error<TrustTunnelClient::ConnectResultError> TrustTunnelClient::connect_to_serve
                             .username = m_config.location.username.c_str(),
                             .password = m_config.location.password.c_str(),
                             .anti_dpi = m_config.location.anti_dpi,
+                            .quic_transport = m_config.location.quic_transport,
                     },
     };
 
     {
-        VpnError err = vpn_connect(m_vpn, &parameters);
+        VpnError err = vpn_connect(vpn, &parameters);
         if (err.code != 0) {
             return make_error(ConnectResultError{},
                     AG_FMT("Failed to initiate endpoint connection: {} ({})", safe_to_string_view(err.text),
@@ -351,7 +461,7 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
     VpnError res = m_tunnel->init(&tunnel_settings, &win_settings);
 #else
 #ifdef __linux__
-    VpnError res = m_tunnel->init(&tunnel_settings, config.netns);
+    VpnError res = m_tunnel->init(&tunnel_settings, config.netns, config.offload, config.shards);
 #else
     VpnError res = m_tunnel->init(&tunnel_settings);
 #endif
@@ -368,6 +478,9 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
             .tunnel = m_tunnel.get(),
 #endif
             .mtu_size = config.mtu_size,
+#ifdef __linux__
+            .vnet_hdr = m_tunnel->is_vnet_hdr_enabled(),
+#endif
     };
 
     return vpn_create_tun_listener(m_vpn, &listener_config);
@@ -395,7 +508,14 @@ void TrustTunnelClient::static_vpn_handler(void *arg, VpnEvent what, void *data)
     }
 }
 
-void TrustTunnelClient::vpn_handler(void *, VpnEvent what, void *data) {
+void TrustTunnelClient::static_shard_vpn_handler(void *arg, VpnEvent what, void *data) {
+    auto *shard = (Shard *) (arg);
+    shard->client->vpn_handler(shard, what, data);
+}
+
+void TrustTunnelClient::vpn_handler(Shard *shard, VpnEvent what, void *data) {
+    // With the shards, the sessions run on their own threads. Socket protection is thread-safe and is
+    // on the path of every new connection, so only the rest of the callbacks are serialized.
     switch (what) {
     case VPN_EVENT_PROTECT_SOCKET: {
         // protect socket to avoid route loop
@@ -431,12 +551,25 @@ void TrustTunnelClient::vpn_handler(void *, VpnEvent what, void *data) {
                 event->result = 0;
             }
         } else {
+            std::scoped_lock callbacks_lock(m_callbacks_guard);
             m_callbacks.verify_handler(event);
         }
         break;
     }
     case VPN_EVENT_STATE_CHANGED: {
         auto *event = (VpnStateChangedEvent *) data;
+        if (shard != nullptr) {
+            // The reported state follows the main session, the shards recover on their own.
+            // But a shard which has given up leaves its share of the flows with no way out,
+            // so it fails the whole connection, unless it is being stopped.
+            dbglog(m_logger, "Shard {} state: {}", shard->index, magic_enum::enum_name(event->state));
+            if (event->state != VPN_SS_DISCONNECTED || shard->vpn.load() == nullptr) {
+                break;
+            }
+            errlog(m_logger, "Shard {} disconnected: {} ({})", shard->index, safe_to_string_view(event->error.text),
+                    event->error.code);
+        }
+        std::scoped_lock callbacks_lock(m_callbacks_guard);
         m_callbacks.state_changed_handler(event);
         break;
     }
@@ -451,7 +584,7 @@ void TrustTunnelClient::vpn_handler(void *, VpnEvent what, void *data) {
         info->action = VPN_CA_DEFAULT;
         info->appname = safe_to_string_view(event->app_name).empty() ? "trusttunnel_client" : event->app_name;
         task_context->info = info;
-        task_context->vpn = m_vpn;
+        task_context->vpn = (shard != nullptr) ? shard->vpn.load() : m_vpn.load();
         vpn_event_loop_submit(m_extra_loop.get(),
                 {
                         .arg = (void *) task_context,
@@ -475,6 +608,7 @@ void TrustTunnelClient::vpn_handler(void *, VpnEvent what, void *data) {
     case VPN_EVENT_CONNECTION_INFO:
         auto *info = (VpnConnectionInfoEvent *) data;
         if (m_callbacks.connection_info_handler) {
+            std::scoped_lock callbacks_lock(m_callbacks_guard);
             m_callbacks.connection_info_handler(info);
         }
         break;
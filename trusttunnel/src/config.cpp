@@ -31,6 +31,13 @@ static const std::unordered_map<std::string_view, VpnUpstreamProtocol> UPSTREAM_
         {"http3", VPN_UP_HTTP3},
 };
 
+static const std::unordered_map<std::string_view, VpnQuicCongestionControl> QUIC_CC_MAP = {
+        {"cubic", VPN_QUIC_CC_CUBIC},
+        {"reno", VPN_QUIC_CC_RENO},
+        {"bbr", VPN_QUIC_CC_BBR},
+        {"bbr2", VPN_QUIC_CC_BBR2},
+};
+
 static const std::unordered_map<std::string_view, VpnMode> VPN_MODE_MAP = {
         {"general", VPN_MODE_GENERAL},
         {"selective", VPN_MODE_SELECTIVE},
@@ -63,6 +70,29 @@ static UniquePtr<X509_STORE, &X509_STORE_free> load_certificate(std::string_view
     return store;
 }
 
+static std::optional<VpnQuicTransportConfig> parse_quic_transport_config(const toml::table &config) {
+    VpnQuicTransportConfig transport{};
+    if (const toml::node *node = config.get("congestion_control"); node != nullptr) {
+        auto cc = node->value<std::string_view>();
+        if (!cc.has_value() || !QUIC_CC_MAP.contains(*cc)) {
+            errlog(g_logger, "Unexpected QUIC congestion control value: {}", streamable_to_string(*node));
+            return std::nullopt;
+        }
+        transport.congestion_control = QUIC_CC_MAP.at(*cc);
+    }
+    transport.disable_hystart = !config["hystart"].value_or(true);
+    transport.initial_max_data = config["initial_max_data"].value_or<uint64_t>(0);
+    transport.initial_max_stream_data = config["initial_max_stream_data"].value_or<uint64_t>(0);
+    transport.max_connection_window = config["max_connection_window"].value_or<uint64_t>(0);
+    transport.max_stream_window = config["max_stream_window"].value_or<uint64_t>(0);
+    transport.max_recv_udp_payload_size = config["max_recv_udp_payload_size"].value_or<uint32_t>(0);
+    if (transport.max_recv_udp_payload_size != 0 && transport.max_recv_udp_payload_size < QUIC_MIN_UDP_PAYLOAD_SIZE) {
+        errlog(g_logger, "QUIC max_recv_udp_payload_size must be at least {}", QUIC_MIN_UDP_PAYLOAD_SIZE);
+        return std::nullopt;
+    }
+    return transport;
+}
+
 static std::optional<TrustTunnelConfig::Location> build_endpoint(const toml::table &config) {
     TrustTunnelConfig::Location location;
     std::vector<TrustTunnelConfig::Endpoint> endpoint;
@@ -119,6 +149,14 @@ static std::optional<TrustTunnelConfig::Location> build_endpoint(const toml::tab
         return std::nullopt;
     }
 
+    if (const toml::table *quic = config["quic"].as_table(); quic != nullptr) {
+        if (auto transport = parse_quic_transport_config(*quic)) {
+            location.quic_transport = *transport;
+        } else {
+            return std::nullopt;
+        }
+    }
+
     // Parse client random (format: "prefix[/mask]")
     if (auto client_random = config["client_random"].value<std::string>()) {
         if (auto slash_pos = client_random->find('/'); slash_pos != std::string::npos) {
@@ -172,7 +210,13 @@ static std::optional<TrustTunnelConfig::TunListener> parse_tun_listener_config(c
             .bound_if = std::move(bound_if),
             .change_system_dns = (*tun_config)["change_system_dns"].value_or<bool>(true),
             .netns = (*tun_config)["netns"].value<std::string>(),
+            .offload = (*tun_config)["offload"].value_or<bool>(false),
+            .shards = (*tun_config)["shards"].value<uint32_t>().value_or(1),
     };
+    if (tun.shards == 0) {
+        errlog(g_logger, "Number of shards must be positive");
+        return std::nullopt;
+    }
 
     if (const auto *x = (*tun_config)["included_routes"].as_array(); x != nullptr) {
         tun.included_routes.reserve(x->size());
@@ -262,6 +306,8 @@ std::optional<TrustTunnelConfig> TrustTunnelConfig::build_config(const toml::tab
         }
     }
 
+    result.exclusions_file = config["exclusions_file"].value<std::string_view>();
+
     if (const auto *x = config["dns_upstreams"].as_array(); x != nullptr) {
         result.dns_upstreams.reserve(x->size());
         for (const auto &a : *x) {
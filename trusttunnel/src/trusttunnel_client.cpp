@@ -103,6 +103,7 @@ int main(int argc, char **argv) {
             ("s", "Skip verify certificate", cxxopts::value<bool>()->default_value("false"))
             ("c,config", "Config file name.", cxxopts::value<std::string>()->default_value(std::string(DEFAULT_CONFIG_FILE)))
             ("l,loglevel", "Logging level. Possible values: error, warn, info, debug, trace.", cxxopts::value<std::string>()->default_value("info"))
+            ("compile-exclusions", "Compile the exclusions from the config file into a file for `exclusions_file` and exit.", cxxopts::value<std::string>())
             ("h,help", "Print usage");
     // clang-format on
 
@@ -134,6 +135,16 @@ int main(int argc, char **argv) {
     }
     ag::Logger::set_log_level(config.loglevel);
 
+    if (result.count("compile-exclusions")) {
+        const auto &path = result["compile-exclusions"].as<std::string>();
+        if (!vpn_compile_exclusions({config.exclusions.data(), uint32_t(config.exclusions.size())}, path.c_str())) {
+            errlog(g_logger, "Failed to compile exclusions into {}", path);
+            return 1;
+        }
+        infolog(g_logger, "Compiled exclusions into {}", path);
+        return 0;
+    }
+
     vpn_post_quantum_group_set_enabled(config.post_quantum_group_enabled);
 
     VpnCallbacks callbacks = {